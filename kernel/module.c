@@ -5,15 +5,28 @@
 #include <asm/uaccess.h>
 #include <linux/tty.h>
 #include <linux/sched.h>
+#include <linux/uio.h>
+#include <linux/mutex.h>
 #include "ramdisk_kernel.h"
+#include "ramdisk_stats.h"
 
 
 MODULE_LICENSE("GPL");
 
-void ramdisk_init(void);
+module_param_named(block_count, ramdisk_block_count, int, 0444);
+MODULE_PARM_DESC(block_count, "Size of the ramdisk in 256 byte blocks, memory is only allocated for blocks in use");
+module_param_named(buddy_allocator, ramdisk_buddy_allocator, int, 0444);
+MODULE_PARM_DESC(buddy_allocator, "Allocate through the buddy allocator and map regular files with extents");
+module_param_named(tail_packing, ramdisk_tail_packing, int, 0444);
+MODULE_PARM_DESC(tail_packing, "Pack small files and partial last blocks into shared blocks on last close");
+module_param_named(huge_chunks, ramdisk_huge_chunks, int, 0444);
+MODULE_PARM_DESC(huge_chunks, "Back file blocks with 2MB physically contiguous chunks, falling back to vmalloc");
+
+int ramdisk_init(void);
 void ramdisk_uninit(void);
 int ramdisk_get_dir_entry_length(void);
 static int rd_ioctl(struct inode *inode, struct file *file,unsigned int cmd, unsigned long arg);
+static long rd_unlocked_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
 static int rd_creat(struct inode *inode, struct file *file,unsigned int cmd, unsigned long arg);
 static int rd_unlink(struct inode *inode, struct file *file,unsigned int cmd, unsigned long arg);
 static int rd_open(struct inode *inode, struct file *file,unsigned int cmd, unsigned long arg);
@@ -23,14 +36,33 @@ static int rd_write(struct inode *inode, struct file *file,unsigned int cmd, uns
 static int rd_lseek(struct inode *inode, struct file *file,unsigned int cmd, unsigned long arg);
 static int rd_mkdir(struct inode *inode, struct file *file,unsigned int cmd, unsigned long arg);
 static int rd_readdir(struct inode *inode, struct file *file,unsigned int cmd, unsigned long arg);
+static int rd_readdir_range(struct inode *inode, struct file *file,unsigned int cmd, unsigned long arg);
+static int rd_defrag(struct inode *inode, struct file *file,unsigned int cmd, unsigned long arg);
+static int rd_export(struct inode *inode, struct file *file,unsigned int cmd, unsigned long arg);
+static int rd_import(struct inode *inode, struct file *file,unsigned int cmd, unsigned long arg);
+static int rd_rmtree(struct inode *inode, struct file *file,unsigned int cmd, unsigned long arg);
+static int rd_walk(struct inode *inode, struct file *file,unsigned int cmd, unsigned long arg);
+static int rd_rename(struct inode *inode, struct file *file,unsigned int cmd, unsigned long arg);
+static int rd_copy_range(struct inode *inode, struct file *file,unsigned int cmd, unsigned long arg);
+static int rd_snapshot(struct inode *inode, struct file *file,unsigned int cmd, unsigned long arg);
+static int rd_dedup(struct inode *inode, struct file *file,unsigned int cmd, unsigned long arg);
+static int rd_compress(struct inode *inode, struct file *file,unsigned int cmd, unsigned long arg);
+static int rd_readv(struct inode *inode, struct file *file,unsigned int cmd, unsigned long arg);
+static int rd_writev(struct inode *inode, struct file *file,unsigned int cmd, unsigned long arg);
+static int rd_append(struct inode *inode, struct file *file,unsigned int cmd, unsigned long arg);
+static int rd_range_lock(struct inode *inode, struct file *file,unsigned int cmd, unsigned long arg);
 char *strdup_ramdisk(pathname_t *pathname);
 
 static struct file_operations pseudo_dev_proc_operations;
 static struct proc_dir_entry *proc_entry;
+// ioctls run without the big kernel lock: reads and writes lock the file
+// and byte range they use, every other command changes the directory tree
+// or open counts, or goes over all files, and is serialized here
+DEFINE_MUTEX(rd_namespace_lock);
 
 
 static int __init initialization_routine(void) {
-  pseudo_dev_proc_operations.ioctl = rd_ioctl;
+  pseudo_dev_proc_operations.unlocked_ioctl = rd_unlocked_ioctl;
 
   proc_entry = create_proc_entry("ramdisk", 0444, NULL);
   if(!proc_entry)
@@ -39,7 +71,19 @@ static int __init initialization_routine(void) {
     return 1;
   }
   proc_entry->proc_fops = &pseudo_dev_proc_operations;
-  ramdisk_init();
+  if (0 != ramdisk_stats_init())
+  {
+    printk("<1> Error creating /proc/ramdisk_stats entry.\n");
+    remove_proc_entry("ramdisk", NULL);
+    return 1;
+  }
+  if (0 != ramdisk_init())
+  {
+    printk("<1> Error allocating ramdisk memory.\n");
+    ramdisk_stats_uninit();
+    remove_proc_entry("ramdisk", NULL);
+    return 1;
+  }
 
   return 0;
 }
@@ -58,48 +102,127 @@ void my_printk(char *string)
 static void __exit cleanup_routine(void) {
 
   ramdisk_uninit();
+  ramdisk_stats_uninit();
   remove_proc_entry("ramdisk", NULL);
 
   return;
 }
 
 
+// commands that run outside rd_namespace_lock; a range lock may wait for
+// another process and must not hold up everyone else meanwhile
+static int rd_is_file_io(unsigned int cmd)
+{
+  return (IOCTL_READ == cmd) || (IOCTL_WRITE == cmd) || (IOCTL_READV == cmd) || (IOCTL_WRITEV == cmd)
+    || (IOCTL_APPEND == cmd) || (IOCTL_LSEEK == cmd) || (IOCTL_RANGE_LOCK == cmd);
+}
+
+static long rd_unlocked_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+  int result = 0;
+
+  if (rd_is_file_io(cmd))
+  {
+    return rd_ioctl(file->f_path.dentry->d_inode, file, cmd, arg);
+  }
+  mutex_lock(&rd_namespace_lock);
+  result = rd_ioctl(file->f_path.dentry->d_inode, file, cmd, arg);
+  mutex_unlock(&rd_namespace_lock);
+
+  return result;
+}
+
 /* This is the main entry point of the kernel module's ioctl function. */
 static int rd_ioctl(struct inode *inode, struct file *file,unsigned int cmd, unsigned long arg)
 {
+  u64 start = 0;
+  int result = 0;
+
+  start = ramdisk_stats_clock();
   switch (cmd)
   {
   case IOCTL_CREAT:
-    rd_creat(inode, file, cmd, arg);
+    result = rd_creat(inode, file, cmd, arg);
     break;
   case IOCTL_UNLINK:
-    rd_unlink(inode, file, cmd, arg);
+    result = rd_unlink(inode, file, cmd, arg);
     break;
   case IOCTL_OPEN:
-    rd_open(inode, file, cmd, arg);
+    result = rd_open(inode, file, cmd, arg);
     break;
   case IOCTL_CLOSE:
-    rd_close(inode, file, cmd, arg);
+    result = rd_close(inode, file, cmd, arg);
     break;
   case IOCTL_READ:
-    rd_read(inode, file, cmd, arg);
+    result = rd_read(inode, file, cmd, arg);
     break;
   case IOCTL_WRITE:
-    rd_write(inode, file, cmd, arg);
+    result = rd_write(inode, file, cmd, arg);
     break;
   case IOCTL_LSEEK:
-    rd_lseek(inode, file, cmd, arg);
+    result = rd_lseek(inode, file, cmd, arg);
     break;
   case IOCTL_MKDIR:
-    rd_mkdir(inode, file, cmd, arg);
+    result = rd_mkdir(inode, file, cmd, arg);
     break;
   case IOCTL_READDIR:
-    rd_readdir(inode, file, cmd, arg);
+    result = rd_readdir(inode, file, cmd, arg);
+    break;
+  case IOCTL_READDIR_RANGE:
+    result = rd_readdir_range(inode, file, cmd, arg);
+    break;
+  case IOCTL_DEFRAG:
+    result = rd_defrag(inode, file, cmd, arg);
+    break;
+  case IOCTL_EXPORT:
+    result = rd_export(inode, file, cmd, arg);
     break;
+  case IOCTL_IMPORT:
+    result = rd_import(inode, file, cmd, arg);
+    break;
+  case IOCTL_RMTREE:
+    result = rd_rmtree(inode, file, cmd, arg);
+    break;
+  case IOCTL_WALK:
+    result = rd_walk(inode, file, cmd, arg);
+    break;
+  case IOCTL_RENAME:
+    result = rd_rename(inode, file, cmd, arg);
+    break;
+  case IOCTL_COPY_RANGE:
+    result = rd_copy_range(inode, file, cmd, arg);
+    break;
+  case IOCTL_SNAPSHOT:
+    result = rd_snapshot(inode, file, cmd, arg);
+    break;
+  case IOCTL_DEDUP:
+    result = rd_dedup(inode, file, cmd, arg);
+    break;
+  case IOCTL_COMPRESS:
+    result = rd_compress(inode, file, cmd, arg);
+    break;
+  case IOCTL_READV:
+    result = rd_readv(inode, file, cmd, arg);
+    break;
+  case IOCTL_WRITEV:
+    result = rd_writev(inode, file, cmd, arg);
+    break;
+  case IOCTL_APPEND:
+    result = rd_append(inode, file, cmd, arg);
+    break;
+  case IOCTL_RANGE_LOCK:
+    result = rd_range_lock(inode, file, cmd, arg);
+    break;
+  case IOCTL_STATS_RESET:
+    ramdisk_stats_reset();
+    return 0;
   default:
     return -EINVAL;
     break;
   }
+  // handlers return the file system's result, which for reads and writes is the byte count
+  ramdisk_stats_record(_IOC_NR(cmd), start, result,
+    ((IOCTL_READ == cmd) || (IOCTL_WRITE == cmd) || (IOCTL_READV == cmd) || (IOCTL_WRITEV == cmd) || (IOCTL_APPEND == cmd)) && (result > 0) ? result : 0);
   return 0;
 }
 static int rd_creat(struct inode *inode, struct file *file,
@@ -116,7 +239,7 @@ static int rd_creat(struct inode *inode, struct file *file,
 
   kfree(pathname);
 
-  return 0;
+  return creat_param.return_value;
 }
 
 static int rd_unlink(struct inode *inode, struct file *file,
@@ -131,7 +254,7 @@ static int rd_unlink(struct inode *inode, struct file *file,
   copy_to_user((int *)arg, &unlink_param.return_value, sizeof(int));
   kfree(pathname);
 
-  return 0;
+  return unlink_param.return_value;
 }
 
 static int rd_open(struct inode *inode, struct file *file,
@@ -147,7 +270,7 @@ static int rd_open(struct inode *inode, struct file *file,
   copy_to_user((open_param_t *)arg, &open_param, sizeof(open_param_t));
   kfree(pathname);
 
-  return 0;
+  return open_param.return_value;
 }
 
 static int rd_close(struct inode *inode, struct file *file,
@@ -157,10 +280,12 @@ static int rd_close(struct inode *inode, struct file *file,
 
   copy_from_user(&close_param, (close_param_t *)arg,sizeof(close_param_t));
 
+  // like POSIX record locks, closing the file drops the caller's locks on it
+  ramdisk_range_lock(close_param.index_node_number, 0, 0, RAMDISK_RANGE_UNLOCK, current->tgid, 0);
   close_param.return_value = ramdisk_close(close_param.index_node_number);
   copy_to_user((int *)arg, &close_param.return_value, sizeof(int));
 
-  return 0;
+  return close_param.return_value;
 }
 
 static int rd_read(struct inode *inode, struct file *file,
@@ -173,7 +298,7 @@ static int rd_read(struct inode *inode, struct file *file,
   read_param.return_value = ramdisk_read(read_param.index_node_number,read_param.file_position,read_param.address,read_param.num_bytes);
   copy_to_user((read_write_param_t *)arg, &read_param, sizeof(read_write_param_t));
 
-  return 0;
+  return read_param.return_value;
 }
 
 static int rd_write(struct inode *inode, struct file *file,
@@ -186,7 +311,44 @@ static int rd_write(struct inode *inode, struct file *file,
   write_param.return_value = ramdisk_write(write_param.index_node_number,write_param.file_position,write_param.address,write_param.num_bytes);
   copy_to_user((read_write_param_t *)arg, &write_param, sizeof(read_write_param_t));
 
-  return 0;
+  return write_param.return_value;
+}
+
+static int rd_append(struct inode *inode, struct file *file,
+  unsigned int cmd, unsigned long arg)
+{
+  int file_position = 0;
+  read_write_param_t append_param;
+
+  copy_from_user(&append_param, (read_write_param_t *)arg,sizeof(read_write_param_t));
+
+  append_param.return_value = ramdisk_append(append_param.index_node_number,append_param.address,append_param.num_bytes,&file_position);
+  if (append_param.return_value >= 0)
+  {
+    append_param.file_position = file_position;
+  }
+  copy_to_user((read_write_param_t *)arg, &append_param, sizeof(read_write_param_t));
+
+  return append_param.return_value;
+}
+
+static int rd_range_lock(struct inode *inode, struct file *file,
+  unsigned int cmd, unsigned long arg)
+{
+  range_lock_param_t range_lock_param;
+
+  copy_from_user(&range_lock_param, (range_lock_param_t *)arg, sizeof(range_lock_param_t));
+
+  // locks belong to the process, as with fcntl, so its threads share them
+  range_lock_param.return_value = ramdisk_range_lock(range_lock_param.index_node_number,
+    range_lock_param.start,
+    range_lock_param.length,
+    range_lock_param.type,
+    current->tgid,
+    range_lock_param.is_wait);
+  copy_to_user((int *)arg, &range_lock_param.return_value, sizeof(int));
+
+  return range_lock_param.return_value;
 }
 
 static int rd_lseek(struct inode *inode, struct file *file,
@@ -204,7 +366,7 @@ static int rd_lseek(struct inode *inode, struct file *file,
   }
   copy_to_user((lseek_param_t *)arg, &lseek_param, sizeof(lseek_param_t));
 
-  return 0;
+  return lseek_param.return_value;
 }
 
 static int rd_mkdir(struct inode *inode, struct file *file,
@@ -221,7 +383,7 @@ static int rd_mkdir(struct inode *inode, struct file *file,
 
   kfree(pathname);
 
-  return 0;
+  return mkdir_param.return_value;
 }
 
 static int rd_readdir(struct inode *inode, struct file *file,
@@ -238,7 +400,240 @@ static int rd_readdir(struct inode *inode, struct file *file,
   }
   copy_to_user((readdir_param_t *)arg, &readdir_param, sizeof(readdir_param_t));
 
-  return 0;
+  return readdir_param.return_value;
+}
+
+static int rd_readdir_range(struct inode *inode, struct file *file,
+  unsigned int cmd, unsigned long arg)
+{
+  readdir_range_param_t range_param;
+
+  copy_from_user(&range_param, (readdir_range_param_t *)arg,sizeof(readdir_range_param_t));
+  range_param.after[sizeof(range_param.after) - 1] = '\0';
+  range_param.before[sizeof(range_param.before) - 1] = '\0';
+  range_param.prefix[sizeof(range_param.prefix) - 1] = '\0';
+
+  range_param.return_value = ramdisk_readdir_range(range_param.index_node_number,range_param.after,range_param.before,range_param.prefix,range_param.address,range_param.max_entry_count);
+  copy_to_user((int *)arg, &range_param.return_value, sizeof(int));
+
+  return range_param.return_value;
+}
+
+static int rd_defrag(struct inode *inode, struct file *file,
+  unsigned int cmd, unsigned long arg)
+{
+  defrag_param_t defrag_param;
+
+  copy_from_user(&defrag_param, (defrag_param_t *)arg, sizeof(defrag_param_t));
+
+  defrag_param.return_value = ramdisk_defrag(&defrag_param);
+  copy_to_user((defrag_param_t *)arg, &defrag_param, sizeof(defrag_param_t));
+
+  return defrag_param.return_value;
+}
+
+static int rd_export(struct inode *inode, struct file *file,
+  unsigned int cmd, unsigned long arg)
+{
+  image_param_t export_param;
+
+  copy_from_user(&export_param, (image_param_t *)arg, sizeof(image_param_t));
+
+  export_param.image_size = 0;
+  export_param.return_value = ramdisk_export(export_param.address, export_param.length, &export_param.image_size);
+  copy_to_user((image_param_t *)arg, &export_param, sizeof(image_param_t));
+
+  return export_param.return_value;
+}
+
+static int rd_import(struct inode *inode, struct file *file,
+  unsigned int cmd, unsigned long arg)
+{
+  image_param_t import_param;
+
+  copy_from_user(&import_param, (image_param_t *)arg, sizeof(image_param_t));
+
+  import_param.return_value = ramdisk_import(import_param.address, import_param.length);
+  copy_to_user((int *)arg, &import_param.return_value, sizeof(int));
+
+  return import_param.return_value;
+}
+
+static int rd_rmtree(struct inode *inode, struct file *file,
+  unsigned int cmd, unsigned long arg)
+{
+  creat_param_t rmtree_param;
+  char *pathname = NULL;
+
+  copy_from_user(&rmtree_param, (creat_param_t *)arg, sizeof(creat_param_t));
+  pathname = strdup_ramdisk(&rmtree_param.pathname);
+  rmtree_param.return_value = ramdisk_rmtree(pathname);
+  copy_to_user((int *)arg, &rmtree_param.return_value, sizeof(int));
+  kfree(pathname);
+
+  return rmtree_param.return_value;
+}
+
+static int rd_walk(struct inode *inode, struct file *file,
+  unsigned int cmd, unsigned long arg)
+{
+  walk_param_t walk_param;
+  char *pathname = NULL;
+
+  copy_from_user(&walk_param, (walk_param_t *)arg, sizeof(walk_param_t));
+  pathname = strdup_ramdisk(&walk_param.pathname);
+  walk_param.return_value = ramdisk_walk(pathname, walk_param.start_index, walk_param.address, walk_param.max_record_count);
+  copy_to_user((int *)arg, &walk_param.return_value, sizeof(int));
+  kfree(pathname);
+
+  return walk_param.return_value;
+}
+
+static int rd_rename(struct inode *inode, struct file *file,
+  unsigned int cmd, unsigned long arg)
+{
+  rename_param_t rename_param;
+  char *old_pathname = NULL;
+  char *new_pathname = NULL;
+
+  copy_from_user(&rename_param, (rename_param_t *)arg, sizeof(rename_param_t));
+  old_pathname = strdup_ramdisk(&rename_param.old_pathname);
+  new_pathname = strdup_ramdisk(&rename_param.new_pathname);
+  rename_param.return_value = ramdisk_rename(old_pathname, new_pathname);
+  copy_to_user((int *)arg, &rename_param.return_value, sizeof(int));
+  kfree(new_pathname);
+  kfree(old_pathname);
+
+  return rename_param.return_value;
+}
+
+static int rd_copy_range(struct inode *inode, struct file *file,
+  unsigned int cmd, unsigned long arg)
+{
+  copy_range_param_t copy_range_param;
+
+  copy_from_user(&copy_range_param, (copy_range_param_t *)arg, sizeof(copy_range_param_t));
+
+  copy_range_param.return_value = ramdisk_copy_range(copy_range_param.src_index_node_number,
+    copy_range_param.src_file_position,
+    copy_range_param.dst_index_node_number,
+    copy_range_param.dst_file_position,
+    copy_range_param.num_bytes,
+    copy_range_param.flags);
+  copy_to_user((int *)arg, &copy_range_param.return_value, sizeof(int));
+
+  return copy_range_param.return_value;
+}
+
+static int rd_snapshot(struct inode *inode, struct file *file,
+  unsigned int cmd, unsigned long arg)
+{
+  creat_param_t snapshot_param;
+  char *name = NULL;
+
+  copy_from_user(&snapshot_param, (creat_param_t *)arg, sizeof(creat_param_t));
+  name = strdup_ramdisk(&snapshot_param.pathname);
+  snapshot_param.return_value = ramdisk_snapshot(name);
+  copy_to_user((int *)arg, &snapshot_param.return_value, sizeof(int));
+  kfree(name);
+
+  return snapshot_param.return_value;
+}
+
+static int rd_dedup(struct inode *inode, struct file *file,
+  unsigned int cmd, unsigned long arg)
+{
+  dedup_param_t dedup_param;
+
+  copy_from_user(&dedup_param, (dedup_param_t *)arg, sizeof(dedup_param_t));
+
+  dedup_param.return_value = ramdisk_dedup(&dedup_param);
+  copy_to_user((dedup_param_t *)arg, &dedup_param, sizeof(dedup_param_t));
+
+  return dedup_param.return_value;
+}
+
+static int rd_compress(struct inode *inode, struct file *file,
+  unsigned int cmd, unsigned long arg)
+{
+  compress_param_t compress_param;
+
+  copy_from_user(&compress_param, (compress_param_t *)arg, sizeof(compress_param_t));
+
+  compress_param.return_value = ramdisk_compress(&compress_param);
+  copy_to_user((compress_param_t *)arg, &compress_param, sizeof(compress_param_t));
+
+  return compress_param.return_value;
+}
+
+// the iovec array is copied in once, the buffers it points at are copied
+// a piece at a time by the read or write itself
+static struct iovec *rd_iovec_dup(readv_writev_param_t *param)
+{
+  struct iovec *iov = NULL;
+
+  if ((param->iov_count <= 0) || (param->iov_count > RAMDISK_IOV_MAX))
+  {
+    return NULL;
+  }
+  iov = (struct iovec *)kmalloc(param->iov_count * sizeof(struct iovec), GFP_KERNEL);
+  if (NULL == iov)
+  {
+    return NULL;
+  }
+  if (0 != copy_from_user(iov, param->iov, param->iov_count * sizeof(struct iovec)))
+  {
+    kfree(iov);
+    return NULL;
+  }
+
+  return iov;
+}
+
+static int rd_readv(struct inode *inode, struct file *file,
+  unsigned int cmd, unsigned long arg)
+{
+  readv_writev_param_t readv_param;
+  struct iovec *iov = NULL;
+
+  copy_from_user(&readv_param, (readv_writev_param_t *)arg, sizeof(readv_writev_param_t));
+  iov = rd_iovec_dup(&readv_param);
+
+  if ((NULL == iov) && (0 != readv_param.iov_count))
+  {
+    readv_param.return_value = -1;
+  }
+  else
+  {
+    readv_param.return_value = ramdisk_readv(readv_param.index_node_number, readv_param.file_position, iov, readv_param.iov_count);
+  }
+  copy_to_user((int *)arg, &readv_param.return_value, sizeof(int));
+  kfree(iov);
+
+  return readv_param.return_value;
+}
+
+static int rd_writev(struct inode *inode, struct file *file,
+  unsigned int cmd, unsigned long arg)
+{
+  readv_writev_param_t writev_param;
+  struct iovec *iov = NULL;
+
+  copy_from_user(&writev_param, (readv_writev_param_t *)arg, sizeof(readv_writev_param_t));
+  iov = rd_iovec_dup(&writev_param);
+
+  if ((NULL == iov) && (0 != writev_param.iov_count))
+  {
+    writev_param.return_value = -1;
+  }
+  else
+  {
+    writev_param.return_value = ramdisk_writev(writev_param.index_node_number, writev_param.file_position, iov, writev_param.iov_count);
+  }
+  copy_to_user((int *)arg, &writev_param.return_value, sizeof(int));
+  kfree(iov);
+
+  return writev_param.return_value;
 }
 
 char *strdup_ramdisk(pathname_t *pathname)
@@ -0,0 +1,527 @@
+// Benchmark driver for the userspace build of the ramdisk engine. Calls the
+// ramdisk_* entry points directly, without the ioctl path, so the engine
+// can be profiled with perf or run under the sanitizers without loading
+// the module. Build with "make bench" in this directory.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "ramdisk_kernel.h"
+
+// shim/ramdisk_shim.c, the per-CPU slot the calling thread uses
+void ramdisk_shim_set_cpu(int cpu);
+
+typedef struct bench_config_struct
+{
+  int iteration_count;
+  int file_count;
+  int file_size;
+  int io_size;
+  // files laid out by bench_random_read_setup
+  int read_file_count;
+  // most threads a threaded workload runs with
+  int thread_count;
+  // the thread running a threaded workload, which names its files apart
+  int thread_index;
+  // bytes each thread of a threaded workload writes, so all of them fit
+  int thread_file_size;
+} bench_config_t;
+
+typedef struct bench_workload_struct
+{
+  const char *name;
+  // run once before timing starts when not NULL, 0 on success
+  int (*setup)(bench_config_t *config, char *buffer);
+  // returns the number of operations performed, or -1 on error
+  long (*run)(bench_config_t *config, char *buffer);
+  // run by 1, 2, 4... up to thread_count threads at once, each on its own
+  // shim CPU, rather than once by the main thread
+  int is_threaded;
+} bench_workload_t;
+
+typedef struct bench_thread_struct
+{
+  bench_config_t config;
+  bench_workload_t *workload;
+  char *buffer;
+  pthread_t thread;
+  // operations over all iterations, or -1 on error
+  long op_count;
+} bench_thread_t;
+
+static double bench_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// create and unlink file_count empty files in the root directory
+static long bench_create_unlink(bench_config_t *config, char *buffer)
+{
+  char pathname[32];
+  int i = 0;
+  for (i = 0; i < config->file_count; i++)
+  {
+    sprintf(pathname, "/f%d", i);
+    if (0 != ramdisk_create(pathname, "reg"))
+    {
+      return -1;
+    }
+  }
+  for (i = 0; i < config->file_count; i++)
+  {
+    sprintf(pathname, "/f%d", i);
+    if (0 != ramdisk_unlink(pathname))
+    {
+      return -1;
+    }
+  }
+  return 2L * config->file_count;
+}
+
+// create, fill, read back, and unlink one file of file_size bytes in io_size steps
+static long bench_sequential(bench_config_t *config, char *buffer)
+{
+  int index_node_number = 0;
+  int pos = 0;
+  int length = 0;
+  long op_count = 0;
+  if (0 != ramdisk_create("/seq", "reg") || 0 != ramdisk_open("/seq", &index_node_number))
+  {
+    return -1;
+  }
+  for (pos = 0; pos < config->file_size; pos += length)
+  {
+    length = config->file_size - pos < config->io_size ? config->file_size - pos : config->io_size;
+    if (length != ramdisk_write(index_node_number, pos, buffer, length))
+    {
+      return -1;
+    }
+    op_count++;
+  }
+  for (pos = 0; pos < config->file_size; pos += length)
+  {
+    length = config->file_size - pos < config->io_size ? config->file_size - pos : config->io_size;
+    if (length != ramdisk_read(index_node_number, pos, buffer, length))
+    {
+      return -1;
+    }
+    op_count++;
+  }
+  ramdisk_close(index_node_number);
+  if (0 != ramdisk_unlink("/seq"))
+  {
+    return -1;
+  }
+  return op_count;
+}
+
+// write then read io_size bytes at pseudo-random offsets of a file_size file
+static long bench_random(bench_config_t *config, char *buffer)
+{
+  int index_node_number = 0;
+  int block_count = 0;
+  int pos = 0;
+  int i = 0;
+  unsigned int seed = 1;
+  if (0 != ramdisk_create("/rand", "reg") || 0 != ramdisk_open("/rand", &index_node_number))
+  {
+    return -1;
+  }
+  if (config->file_size != ramdisk_write(index_node_number, 0, buffer, config->file_size))
+  {
+    return -1;
+  }
+  block_count = (config->file_size - config->io_size) / BLK_SZ + 1;
+  for (i = 0; i < config->file_count; i++)
+  {
+    seed = seed * 1103515245 + 12345;
+    pos = (seed >> 8) % block_count * BLK_SZ;
+    if (config->io_size != ramdisk_write(index_node_number, pos, buffer, config->io_size)
+        || config->io_size != ramdisk_read(index_node_number, pos, buffer, config->io_size))
+    {
+      return -1;
+    }
+  }
+  ramdisk_close(index_node_number);
+  if (0 != ramdisk_unlink("/rand"))
+  {
+    return -1;
+  }
+  return 2L * config->file_count;
+}
+
+// fill most of the disk with files of file_size bytes, up to one per index node
+static int bench_random_read_setup(bench_config_t *config, char *buffer)
+{
+  char pathname[32];
+  int index_node_number = 0;
+  int block_count = 0;
+
+  block_count = (config->file_size + BLK_SZ - 1) / BLK_SZ;
+  block_count = block_count + block_count / PTRS_PB + 2;
+  config->read_file_count = 0;
+  while ((config->read_file_count < MAX_INDEX_NODES_COUNT - 1)
+         && (ramdisk_get_free_block_count() - block_count > ramdisk_block_count / 16))
+  {
+    sprintf(pathname, "/r%d", config->read_file_count);
+    if (0 != ramdisk_create(pathname, "reg") || 0 != ramdisk_open(pathname, &index_node_number)
+        || config->file_size != ramdisk_write(index_node_number, 0, buffer, config->file_size))
+    {
+      return -1;
+    }
+    ramdisk_close(index_node_number);
+    config->read_file_count++;
+  }
+  return (0 == config->read_file_count) ? -1 : 0;
+}
+
+// read io_size bytes file_count times at pseudo-random offsets of pseudo-random
+// files across the disk, so the working set is the whole disk
+static long bench_random_read(bench_config_t *config, char *buffer)
+{
+  static int index_node_numbers[MAX_INDEX_NODES_COUNT];
+  char pathname[32];
+  int block_count = 0;
+  int pos = 0;
+  int i = 0;
+  unsigned int seed = 1;
+  for (i = 0; i < config->read_file_count; i++)
+  {
+    sprintf(pathname, "/r%d", i);
+    if (0 != ramdisk_open(pathname, &index_node_numbers[i]))
+    {
+      return -1;
+    }
+  }
+  block_count = (config->file_size - config->io_size) / BLK_SZ + 1;
+  for (i = 0; i < config->file_count; i++)
+  {
+    seed = seed * 1103515245 + 12345;
+    pos = (seed >> 8) % block_count * BLK_SZ;
+    seed = seed * 1103515245 + 12345;
+    if (config->io_size != ramdisk_read(index_node_numbers[(seed >> 8) % config->read_file_count], pos, buffer, config->io_size))
+    {
+      return -1;
+    }
+  }
+  for (i = 0; i < config->read_file_count; i++)
+  {
+    ramdisk_close(index_node_numbers[i]);
+  }
+  return config->file_count;
+}
+
+// create, write, close, reopen, read, and unlink file_count small files
+static long bench_small_files(bench_config_t *config, char *buffer)
+{
+  char pathname[32];
+  int index_node_number = 0;
+  int length = 0;
+  int i = 0;
+  for (i = 0; i < config->file_count; i++)
+  {
+    sprintf(pathname, "/s%d", i);
+    length = 1 + i * 37 % config->io_size;
+    if (0 != ramdisk_create(pathname, "reg") || 0 != ramdisk_open(pathname, &index_node_number)
+        || length != ramdisk_write(index_node_number, 0, buffer, length))
+    {
+      return -1;
+    }
+    ramdisk_close(index_node_number);
+  }
+  for (i = 0; i < config->file_count; i++)
+  {
+    sprintf(pathname, "/s%d", i);
+    length = 1 + i * 37 % config->io_size;
+    if (0 != ramdisk_open(pathname, &index_node_number)
+        || length != ramdisk_read(index_node_number, 0, buffer, config->io_size))
+    {
+      return -1;
+    }
+    ramdisk_close(index_node_number);
+    if (0 != ramdisk_unlink(pathname))
+    {
+      return -1;
+    }
+  }
+  return 2L * config->file_count;
+}
+
+// create a file of the thread's own, fill it in io_size steps, and unlink
+// it, so every step allocates blocks and the unlink hands them back
+static long bench_alloc(bench_config_t *config, char *buffer)
+{
+  char pathname[32];
+  int index_node_number = 0;
+  int pos = 0;
+  int length = 0;
+  long op_count = 0;
+  sprintf(pathname, "/a%d", config->thread_index);
+  if (0 != ramdisk_create(pathname, "reg") || 0 != ramdisk_open(pathname, &index_node_number))
+  {
+    return -1;
+  }
+  for (pos = 0; pos < config->thread_file_size; pos += length)
+  {
+    length = config->thread_file_size - pos < config->io_size ? config->thread_file_size - pos : config->io_size;
+    if (length != ramdisk_write(index_node_number, pos, buffer, length))
+    {
+      return -1;
+    }
+    op_count++;
+  }
+  ramdisk_close(index_node_number);
+  if (0 != ramdisk_unlink(pathname))
+  {
+    return -1;
+  }
+  return op_count + 2;
+}
+
+static bench_workload_t bench_workloads[] =
+{
+  {"create", NULL, bench_create_unlink, 0},
+  {"seq", NULL, bench_sequential, 0},
+  {"random", NULL, bench_random, 0},
+  {"randread", bench_random_read_setup, bench_random_read, 0},
+  {"small", NULL, bench_small_files, 0},
+  {"alloc", NULL, bench_alloc, 1},
+};
+
+#define BENCH_WORKLOAD_COUNT (sizeof(bench_workloads) / sizeof(bench_workloads[0]))
+
+static void *bench_thread_run(void *arg)
+{
+  bench_thread_t *thread = (bench_thread_t *)arg;
+  long op_count = 0;
+  int i = 0;
+
+  ramdisk_shim_set_cpu(thread->config.thread_index);
+  thread->op_count = 0;
+  for (i = 0; i < thread->config.iteration_count; i++)
+  {
+    op_count = thread->workload->run(&thread->config, thread->buffer);
+    if (-1 == op_count)
+    {
+      thread->op_count = -1;
+      break;
+    }
+    thread->op_count += op_count;
+  }
+  return NULL;
+}
+
+// run a threaded workload with thread_count threads for iteration_count
+// iterations each; returns the operations of all of them, or -1 on error
+static long bench_threads_run(bench_config_t *config, bench_workload_t *workload, char *buffer, int thread_count)
+{
+  bench_thread_t *threads = NULL;
+  long op_count = 0;
+  int i = 0;
+
+  threads = calloc(thread_count, sizeof(bench_thread_t));
+  config->thread_file_size = ramdisk_block_count / 2 / thread_count * BLK_SZ;
+  if (config->thread_file_size > config->file_size)
+  {
+    config->thread_file_size = config->file_size;
+  }
+  for (i = 0; i < thread_count; i++)
+  {
+    threads[i].config = *config;
+    threads[i].config.thread_index = i;
+    threads[i].workload = workload;
+    threads[i].buffer = buffer;
+    pthread_create(&threads[i].thread, NULL, bench_thread_run, &threads[i]);
+  }
+  for (i = 0; i < thread_count; i++)
+  {
+    pthread_join(threads[i].thread, NULL);
+    if (-1 == threads[i].op_count)
+    {
+      op_count = -1;
+    }
+    else if (-1 != op_count)
+    {
+      op_count += threads[i].op_count;
+    }
+  }
+  free(threads);
+  return op_count;
+}
+
+// print the throughput of a run and any blocks it did not give back
+static void bench_report(const char *name, long op_count, double elapsed, int free_block_count)
+{
+  printf("%-8s %10ld ops %9.3f s %12.0f ops/s %9.1f ns/op\n", name,
+         op_count, elapsed, op_count / elapsed, elapsed * 1e9 / op_count);
+  ramdisk_drain_block_magazines();
+  if (free_block_count != ramdisk_get_free_block_count())
+  {
+    fprintf(stderr, "%s: leaked %d blocks\n", name, free_block_count - ramdisk_get_free_block_count());
+  }
+}
+
+// run a threaded workload with 1, 2, 4... threads up to thread_count, on a
+// fresh ramdisk each, and report the throughput of every thread count
+static int bench_threaded(bench_config_t *config, bench_workload_t *workload, char *buffer)
+{
+  bench_config_t warm_config;
+  char name[32];
+  double start = 0;
+  long op_count = 0;
+  int free_block_count = 0;
+  int thread_count = 1;
+
+  while (1)
+  {
+    if (0 != ramdisk_init())
+    {
+      fprintf(stderr, "%s: can not initialize the ramdisk\n", workload->name);
+      return -1;
+    }
+    // one untimed pass grows the root directory to an entry per thread,
+    // blocks it keeps, and fills the magazines of every shim CPU
+    warm_config = *config;
+    warm_config.iteration_count = 1;
+    if (-1 == bench_threads_run(&warm_config, workload, buffer, thread_count))
+    {
+      fprintf(stderr, "%s: failed with %d threads\n", workload->name, thread_count);
+      return -1;
+    }
+    ramdisk_drain_block_magazines();
+    free_block_count = ramdisk_get_free_block_count();
+    start = bench_now();
+    op_count = bench_threads_run(config, workload, buffer, thread_count);
+    if (-1 == op_count)
+    {
+      fprintf(stderr, "%s: failed with %d threads\n", workload->name, thread_count);
+      return -1;
+    }
+    sprintf(name, "%s/%d", workload->name, thread_count);
+    bench_report(name, op_count, bench_now() - start, free_block_count);
+    ramdisk_uninit();
+    if (thread_count == config->thread_count)
+    {
+      break;
+    }
+    thread_count = (2 * thread_count < config->thread_count) ? 2 * thread_count : config->thread_count;
+  }
+  return 0;
+}
+
+static void bench_usage(const char *program)
+{
+  fprintf(stderr,
+          "usage: %s [-w workload] [-i iterations] [-n files] [-s file size] [-b io size] [-t threads] [-C blocks] [-B] [-P] [-H]\n"
+          "  -w  create, seq, random, randread, small, alloc or all (default all)\n"
+          "  -t  most threads alloc runs with, doubling from 1 (default 4)\n"
+          "  -C  ramdisk size in blocks, randread fills most of it\n"
+          "  -B  use the buddy allocator and extent-mapped files\n"
+          "  -P  pack small files and partial last blocks\n"
+          "  -H  back file blocks with 2MB chunks\n",
+          program);
+}
+
+int main(int argc, char **argv)
+{
+  bench_config_t config;
+  const char *workload_name = "all";
+  char *buffer = NULL;
+  double start = 0;
+  long op_count = 0;
+  long total_op_count = 0;
+  int option = 0;
+  int free_block_count = 0;
+  int i = 0;
+  int j = 0;
+
+  config.iteration_count = 10;
+  config.file_count = 1000;
+  config.file_size = 1 << 20;
+  config.io_size = BLK_SZ;
+  config.thread_count = 4;
+  while (-1 != (option = getopt(argc, argv, "w:i:n:s:b:t:C:BPHh")))
+  {
+    switch (option)
+    {
+    case 'w': workload_name = optarg; break;
+    case 'i': config.iteration_count = atoi(optarg); break;
+    case 'n': config.file_count = atoi(optarg); break;
+    case 's': config.file_size = atoi(optarg); break;
+    case 'b': config.io_size = atoi(optarg); break;
+    case 't': config.thread_count = atoi(optarg); break;
+    case 'C': ramdisk_block_count = atoi(optarg); break;
+    case 'B': ramdisk_buddy_allocator = 1; break;
+    case 'P': ramdisk_tail_packing = 1; break;
+    case 'H': ramdisk_huge_chunks = 1; break;
+    default: bench_usage(argv[0]); return 1;
+    }
+  }
+  if (config.file_count <= 0 || config.file_count >= MAX_INDEX_NODES_COUNT
+      || config.file_size <= 0 || config.file_size > MAX_FILE_SIZE
+      || config.io_size <= 0 || config.io_size > config.file_size || config.iteration_count <= 0
+      || config.thread_count <= 0 || config.thread_count > ramdisk_block_count / 64)
+  {
+    bench_usage(argv[0]);
+    return 1;
+  }
+  buffer = malloc(config.file_size);
+  for (i = 0; i < config.file_size; i++)
+  {
+    buffer[i] = (char)(i * 7 + 3);
+  }
+
+  for (i = 0; i < (int)BENCH_WORKLOAD_COUNT; i++)
+  {
+    if (0 != strcmp(workload_name, "all") && 0 != strcmp(workload_name, bench_workloads[i].name))
+    {
+      continue;
+    }
+    if (bench_workloads[i].is_threaded)
+    {
+      if (0 != bench_threaded(&config, &bench_workloads[i], buffer))
+      {
+        return 1;
+      }
+      continue;
+    }
+    if (0 != ramdisk_init())
+    {
+      fprintf(stderr, "%s: can not initialize the ramdisk\n", bench_workloads[i].name);
+      return 1;
+    }
+    if (NULL != bench_workloads[i].setup && 0 != bench_workloads[i].setup(&config, buffer))
+    {
+      fprintf(stderr, "%s: setup failed\n", bench_workloads[i].name);
+      return 1;
+    }
+    total_op_count = 0;
+    start = bench_now();
+    for (j = 0; j < config.iteration_count; j++)
+    {
+      op_count = bench_workloads[i].run(&config, buffer);
+      if (-1 == op_count)
+      {
+        fprintf(stderr, "%s: failed in iteration %d\n", bench_workloads[i].name, j);
+        return 1;
+      }
+      total_op_count += op_count;
+      // directories keep their blocks once grown, so compare against the first
+      // pass once freed blocks have been cleared
+      if (0 == j)
+      {
+        ramdisk_drain_block_magazines();
+        free_block_count = ramdisk_get_free_block_count();
+      }
+    }
+    bench_report(bench_workloads[i].name, total_op_count, bench_now() - start, free_block_count);
+    ramdisk_uninit();
+  }
+  free(buffer);
+  return 0;
+}
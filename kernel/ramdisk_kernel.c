@@ -3,11 +3,211 @@
 #include <linux/vmalloc.h>
 #include <linux/string.h>
 #include <linux/kernel.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/sched.h>
+#include <linux/rwsem.h>
+#include <linux/gfp.h>
+#include <linux/mm.h>
+#include <linux/workqueue.h>
+#include <linux/sort.h>
+#include <linux/jhash.h>
+#include <linux/mutex.h>
+#include <linux/uio.h>
+#include <linux/wait.h>
+#include <linux/lzo.h>
 
+#define CREATE_TRACE_POINTS
+#include "ramdisk_trace.h"
 
+
+// superblock, index node array and bitmap
 static unsigned char *ramdisk_memory;
+int ramdisk_block_count = RAMDISK_MEMORY_SIZE / BLK_SZ;
+// file blocks live in chunks allocated when the first of their blocks is
+// allocated and freed with the last, so memory use follows the data stored
+// rather than the configured size
+int ramdisk_huge_chunks = 0;
+// chunks are single pages, or 2MB high-order allocations with huge_chunks
+// so the kernel maps them with large pages and random access across the
+// disk takes fewer TLB misses
+#define RAMDISK_HUGE_CHUNK_SIZE  (2 << 20)
+#define RAMDISK_CHUNK_BLOCK_COUNT  (1 << ramdisk_chunk_block_shift)
+static int ramdisk_chunk_order;
+static int ramdisk_chunk_block_shift;
+static char **ramdisk_chunks;
+static unsigned short *ramdisk_chunk_used_count;
+static int ramdisk_chunk_count;
+// protects ramdisk_chunks and ramdisk_chunk_used_count
+static DEFINE_SPINLOCK(ramdisk_chunk_lock);
+// taken shared by reads, writes and appends, and exclusively by passes
+// that need every file to hold still: dedup, snapshots, export, import and
+// the space report. Commands other than file I/O are serialized by the
+// caller, so this is all that keeps I/O out of such a pass
+static DECLARE_RWSEM(ramdisk_io_lock);
+// taken shared by reads and writes, which keep out of each other's way with
+// byte range locks, and exclusively by whatever rebuilds a file's block map
+// as a whole: tail packing, compression, defragmentation, reflinks and
+// appends; index 0 is the root directory
+static struct rw_semaphore ramdisk_index_node_lock[MAX_INDEX_NODES_COUNT + 1];
+// protects a file's block map and size while reads and writes share the
+// index node lock: they hold it shared while they copy, and a write takes
+// it exclusively only for a block it has to allocate or copy and to grow
+// the file
+static struct rw_semaphore ramdisk_map_lock[MAX_INDEX_NODES_COUNT + 1];
+
+// a byte range [start, end) of a file a read or write is copying, or one a
+// process has locked through IOCTL_RANGE_LOCK
+typedef struct range_struct
+{
+  int start;
+  int end;
+  int is_write;
+  // process holding an advisory lock, 0 for the range of a read or write
+  int owner;
+  struct range_struct *next;
+} range_t;
+// ranges reads and writes hold, on their stacks
+static range_t *ramdisk_io_ranges[MAX_INDEX_NODES_COUNT + 1];
+// advisory ranges, kmalloc'ed, and dropped when the last opener closes the file
+static range_t *ramdisk_advisory_ranges[MAX_INDEX_NODES_COUNT + 1];
+// protects both lists of a file
+static spinlock_t ramdisk_range_list_lock[MAX_INDEX_NODES_COUNT + 1];
+// woken whenever a range of the file is released
+static wait_queue_head_t ramdisk_range_wait[MAX_INDEX_NODES_COUNT + 1];
+
+static int ramdisk_create_index_node(char *pathname, char *type);
+static int ramdisk_add_index_node(index_node_t *parent_directory_index_node, const char *filename, char *type);
+static int ramdisk_open_index_node(char *pathname, int *index_node_number);
+static int ramdisk_unlink_index_node(char *pathname);
+static void ramdisk_remove_index_node(index_node_t *parent_directory_index_node, const char *filename, index_node_t *index_node);
+static void ramdisk_chunk_put(int block_pointer, int block_count);
+static void ramdisk_zero_queue_add(int block_pointer, int order);
+static int ramdisk_reclaim_queue_add(index_node_t *index_node);
+static void ramdisk_reclaim_flush(void);
+static int *ramdisk_extent_get_slot(index_node_t *index_node, int index, int is_read_mode);
+static int ramdisk_block_share(int block_pointer);
+static int *ramdisk_block_pointer_get_slot(block_pointer_t *block_pointer);
+static int ramdisk_compressed_read(index_node_t *index_node, int pos, char *address, int num_bytes, int is_user);
+static int ramdisk_compressed_stream_length(index_node_t *index_node);
+static int ramdisk_expand_index_node(index_node_t *index_node);
+static void ramdisk_compress_cache_drop(index_node_t *index_node);
+static int ramdisk_read_vector(int index_node_number, int pos, const struct iovec *iov, int iov_count);
+static range_t *ramdisk_range_drop(range_t **list, int start, int end, int owner, range_t *spare);
+static int ramdisk_block_is_shared(int block_pointer);
+static int ramdisk_write_vector(int index_node_number, int pos, const struct iovec *iov, int iov_count, int *append_position);
 
+#ifndef NULL
 #define NULL 0
+#endif
+
+// free blocks a CPU keeps reserved from the shared bitmap, moved between
+// the magazine and the bitmap a batch at a time
+#define BLOCK_MAGAZINE_SIZE   32
+#define BLOCK_MAGAZINE_BATCH  16
+
+typedef struct block_magazine_struct
+{
+  spinlock_t lock;
+  int count;
+  int blocks[BLOCK_MAGAZINE_SIZE];
+} block_magazine_t;
+
+static DEFINE_PER_CPU(block_magazine_t, ramdisk_block_magazine);
+
+// freed blocks wait here until a worker has cleared them and handed them
+// back to the allocator, so every block allocated reads as zeros without
+// a memset on the allocation path
+#define ZERO_QUEUE_SIZE   1024
+#define ZERO_QUEUE_BATCH  32
+
+typedef struct zero_request_struct
+{
+  int block_pointer;
+  int order;
+} zero_request_t;
+
+static zero_request_t ramdisk_zero_queue[ZERO_QUEUE_SIZE];
+static int ramdisk_zero_queue_count;
+// blocks queued or being cleared, counted as free
+static int ramdisk_zero_block_count;
+// protects the zero queue and ramdisk_zero_block_count
+static DEFINE_SPINLOCK(ramdisk_zero_lock);
+static void ramdisk_zero_worker(struct work_struct *work);
+static DECLARE_WORK(ramdisk_zero_work, ramdisk_zero_worker);
+
+// copies of unlinked files whose blocks a worker has yet to free, so unlink
+// takes the same time however large the file; files that fit in their
+// direct blocks are freed by unlink itself
+#define RECLAIM_QUEUE_SIZE  64
+// most blocks a block-mapped file can hold, pointer blocks included
+#define RECLAIM_MAX_BLOCK_COUNT  (MAX_BLOCK_COUNT_IN_FILE + 2 + PTRS_PB)
+
+typedef struct reclaim_request_struct
+{
+  index_node_t index_node;
+  // blocks freeing the file gives back, taken when it was queued
+  int block_count;
+} reclaim_request_t;
+
+static reclaim_request_t ramdisk_reclaim_queue[RECLAIM_QUEUE_SIZE];
+static int ramdisk_reclaim_queue_count;
+// blocks of queued files or files being freed, counted as free
+static int ramdisk_reclaim_block_count;
+// protects the reclaim queue and ramdisk_reclaim_block_count
+static DEFINE_SPINLOCK(ramdisk_reclaim_lock);
+static void ramdisk_reclaim_worker(struct work_struct *work);
+static DECLARE_WORK(ramdisk_reclaim_work, ramdisk_reclaim_worker);
+// held by callers flushing the queues, so a flush also waits for batches
+// another caller's flush took off them
+static DEFINE_MUTEX(ramdisk_flush_lock);
+
+// protects the block bitmap, num_free_blocks and ramdisk_bitmap_hint
+static DEFINE_SPINLOCK(ramdisk_bitmap_lock);
+// no bitmap byte before this one has a free block
+static int ramdisk_bitmap_hint;
+
+int ramdisk_buddy_allocator;
+// buddy free lists, linked through per-block next/prev arrays; free_order
+// is the order of the free chunk starting at a block, -1 for any other block
+static int ramdisk_buddy_free_head[BUDDY_ORDER_COUNT];
+static int *ramdisk_buddy_next;
+static int *ramdisk_buddy_prev;
+static signed char *ramdisk_buddy_free_order;
+
+int ramdisk_tail_packing;
+// pack blocks that may have room for another tail
+#define PACK_BLOCK_CACHE_SIZE 16
+static int ramdisk_pack_block_cache[PACK_BLOCK_CACHE_SIZE];
+// protects pack block headers and ramdisk_pack_block_cache
+static DEFINE_SPINLOCK(ramdisk_pack_lock);
+
+// owners beyond the first of each file block, allocated by the first
+// reflink; a data block with a nonzero count is mapped by several files,
+// is copied before any of them writes to it and is freed by the last
+#define BLOCK_REFCOUNT_MAX  0xFFFF
+static unsigned short *ramdisk_block_refcount;
+// protects the counts in ramdisk_block_refcount
+static DEFINE_SPINLOCK(ramdisk_refcount_lock);
+
+// a decompressed unit of a compressed file
+typedef struct compress_cache_entry_struct
+{
+  // NULL for an unused entry
+  index_node_t *index_node;
+  int unit;
+  char data[COMPRESS_UNIT_SZ];
+} compress_cache_entry_t;
+// allocated with the compressed bytes of the unit being read by the first
+// read of a compressed file, and replaced round robin
+static compress_cache_entry_t *ramdisk_compress_cache;
+static char *ramdisk_compress_buffer;
+static int ramdisk_compress_cache_hand;
+// protects the cache and the buffer; a mutex since reads copy to user
+// space straight from the cache
+static DEFINE_MUTEX(ramdisk_compress_lock);
+// sched_clock of the last read or write of each file, what finds idle files to compress
+static unsigned long long ramdisk_access_time[MAX_INDEX_NODES_COUNT + 1];
 
 
 // parse to next directory in file path 
@@ -28,840 +228,5995 @@ const char *find_next_directory(const char *str)
   return NULL;
 }
 
-// initialize ramdisk memory
-void ramdisk_init()
+// mark a run of blocks allocated or free in bitmap, callers hold ramdisk_bitmap_lock
+static void ramdisk_bitmap_set_range(int block_pointer, int block_count, int is_free)
 {
-  int x = 0;
   int i = 0;
-  int j = 0;
-  int index = 0;
   superblock_t *superblock = NULL;
-  index_node_t *index_node_array = NULL;
   unsigned char *block_bitmap = NULL;
-  printk(KERN_INFO "Initializing ramdisk\n");
-  // create 2MB of memory for ramdisk
-  ramdisk_memory = (unsigned char *)vmalloc(sizeof(unsigned char) * RAMDISK_MEMORY_SIZE);
-  
-  // initialize superblock
-  superblock = (superblock_t *)ramdisk_memory;
-  memset(superblock, 0, BLK_SZ);
-  superblock->num_free_blocks = RAMDISK_MEMORY_SIZE / BLK_SZ;
-  superblock->num_free_index_nodes = MAX_INDEX_NODES_COUNT;
-  // initialize root directory
-  strcpy(superblock->first_block.type, "dir");
-
-  // initialize index node array
-  index_node_array = ramdisk_get_index_node(1);
-  memset(index_node_array, 0, sizeof(unsigned char) * (BLK_SZ * INDEX_NODE_ARRAY_BLOCK_COUNT));
 
-  // initialize block bitmap
+  superblock = (superblock_t *)ramdisk_memory;
   block_bitmap = (ramdisk_memory + BLK_SZ * (1 + INDEX_NODE_ARRAY_BLOCK_COUNT));
-  for (i = 0; i < BLOCK_BITMAP_BLOCK_COUNT; i++)
+  i = block_pointer;
+  while (i < block_pointer + block_count)
   {
-    for (j = 0; j < BLK_SZ; j++)
+    // a byte at a time where the run covers all eight of its blocks
+    if ((0 == i % 8) && (i + 8 <= block_pointer + block_count))
+    {
+      block_bitmap[i / 8] = is_free ? 0x0FF : 0;
+      i = i + 8;
+      continue;
+    }
+    if (is_free)
+    {
+      block_bitmap[i / 8] = block_bitmap[i / 8] | (1 << (i % 8));
+    }
+    else
     {
-      block_bitmap[index++] = 0x0FF;
+      block_bitmap[i / 8] = block_bitmap[i / 8] & ~(1 << (i % 8));
     }
+    i++;
   }
+  superblock->num_free_blocks = superblock->num_free_blocks + (is_free ? block_count : -block_count);
+}
 
-  // initialize block bitmap for the superblock, index node array, and block bitmap itself to used
-  for (x = 0; x < (1 + INDEX_NODE_ARRAY_BLOCK_COUNT + BLOCK_BITMAP_BLOCK_COUNT); x++)
+static void ramdisk_buddy_push(int block_pointer, int order)
+{
+  int head = 0;
+
+  head = ramdisk_buddy_free_head[order];
+  ramdisk_buddy_next[block_pointer] = head;
+  ramdisk_buddy_prev[block_pointer] = 0;
+  if (0 != head)
   {
-    search_bitmap();
+    ramdisk_buddy_prev[head] = block_pointer;
   }
-  printk(KERN_INFO "Finished initializing ramdisk\n");
+  ramdisk_buddy_free_head[order] = block_pointer;
+  ramdisk_buddy_free_order[block_pointer] = order;
 }
 
-
-void ramdisk_uninit()
+static void ramdisk_buddy_unlink(int block_pointer, int order)
 {
-  if (NULL != ramdisk_memory)
+  int next = 0;
+  int prev = 0;
+
+  next = ramdisk_buddy_next[block_pointer];
+  prev = ramdisk_buddy_prev[block_pointer];
+  if (0 != next)
   {
-    vfree(ramdisk_memory);
-    ramdisk_memory = NULL;
+    ramdisk_buddy_prev[next] = prev;
+  }
+  if (0 != prev)
+  {
+    ramdisk_buddy_next[prev] = next;
+  }
+  else
+  {
+    ramdisk_buddy_free_head[order] = next;
   }
+  ramdisk_buddy_free_order[block_pointer] = -1;
 }
 
-// create file with absolute pathname from root of directory tree
-int ramdisk_create(char *pathname, char *type)
+// take a chunk of BLK_SZ << order, splitting larger chunks as needed,
+// callers hold ramdisk_bitmap_lock
+static int ramdisk_buddy_alloc(int order)
 {
-  printk(KERN_INFO "Creating file %s\n", pathname);
-  int index_node_number = 0, updated_parent = -1;
-  index_node_t *parent_directory_index_node = NULL;
-  index_node_t *index_node = NULL;
-  const char *filename = NULL;
-  dir_entry_t entry;
-  superblock_t *superblock = (superblock_t *)ramdisk_memory;
-  index_node_t *index_node_array = ramdisk_get_index_node(1);
-  char *dst = NULL;
-  file_position_t file_position;
-  dir_entry_t *empty_entry = NULL;
+  int k = 0;
+  int block_pointer = 0;
 
-  // 1. iterate from root until the parent file node to find parent's inode
-  parent_directory_index_node = ramdisk_get_directory_index_node(pathname);
-  if (parent_directory_index_node == NULL)
+  for (k = order; k <= BUDDY_MAX_ORDER; k++)
   {
-    return -1;
+    if (0 != ramdisk_buddy_free_head[k])
+    {
+      break;
+    }
   }
-
-  // 2. use strrchr to find the last split of '/' for child directory
-  filename = strrchr(pathname, '/');
-  if (ramdisk_get_dir_entry(parent_directory_index_node, filename, NULL) != NULL)
+  if (k > BUDDY_MAX_ORDER)
   {
     return -1;
   }
+  block_pointer = ramdisk_buddy_free_head[k];
+  ramdisk_buddy_unlink(block_pointer, k);
+  // hand the upper halves back until the chunk has the wanted size
+  while (k > order)
+  {
+    k--;
+    ramdisk_buddy_push(block_pointer + (1 << k), k);
+  }
+  ramdisk_bitmap_set_range(block_pointer, 1 << order, 0);
 
-  // 3. find unused inode from inode array
-  int i = 0;
-  for (i = 0; i < MAX_INDEX_NODES_COUNT; i++)
+  return block_pointer;
+}
+
+// return a chunk and merge it with its free buddies, callers hold ramdisk_bitmap_lock
+static void ramdisk_buddy_free(int block_pointer, int order)
+{
+  int buddy = 0;
+
+  ramdisk_bitmap_set_range(block_pointer, 1 << order, 1);
+  while (order < BUDDY_MAX_ORDER)
   {
-    if (0 == strcmp(index_node_array[i].type, ""))
+    buddy = block_pointer ^ (1 << order);
+    if ((buddy >= TOTAL_BLOCK_COUNT) || (ramdisk_buddy_free_order[buddy] != order))
     {
-      superblock->num_free_index_nodes--;
-      index_node_number = i + 1;
       break;
     }
-    else if (i == MAX_INDEX_NODES_COUNT - 1)
-    {
-      return -1;
-    }
+    ramdisk_buddy_unlink(buddy, order);
+    block_pointer = min(block_pointer, buddy);
+    order++;
   }
+  ramdisk_buddy_push(block_pointer, order);
+}
 
-  // 4. find correlating block memory address for inode and fill in structures
-  index_node = ramdisk_get_index_node(index_node_number);
-  memset(index_node, 0, sizeof(index_node_t));
-  strcpy(index_node->type, type);
-  strcpy(entry.filename, filename);
-  entry.index_node_number = index_node_number;
-  printk(KERN_INFO "Created file %s, type %s, at index node %d\n", entry.filename, type, entry.index_node_number);
+// put every free block of the bitmap on the buddy free lists in the
+// largest aligned chunks that fit, callers hold ramdisk_bitmap_lock
+static void ramdisk_buddy_rebuild(void)
+{
+  int i = 0;
+  int order = 0;
+  int block_pointer = 0;
+  int run_end = 0;
+  int block_count = TOTAL_BLOCK_COUNT;
+  unsigned char *block_bitmap = NULL;
 
-  // 5. find empty entry in parent directory and add new entry
-  if ((parent_directory_index_node->size + sizeof(dir_entry_t)) > MAX_FILE_SIZE) {
-    return -1; 
+  block_bitmap = ramdisk_memory + BLK_SZ * (1 + INDEX_NODE_ARRAY_BLOCK_COUNT);
+  memset(ramdisk_buddy_free_order, -1, sizeof(signed char) * block_count);
+  for (i = 0; i < BUDDY_ORDER_COUNT; i++)
+  {
+    ramdisk_buddy_free_head[i] = 0;
   }
-  ramdisk_file_position_init(&file_position, parent_directory_index_node, 0, 1);
-  // scan through the directory file until an empty entry is found or the end is reached.
-  while (file_position.file_position < parent_directory_index_node->size) {
-    empty_entry = (dir_entry_t *)ramdisk_get_memory_address(&file_position);
-    if (NULL == empty_entry) {
-      break;
+
+  block_pointer = 1 + INDEX_NODE_ARRAY_BLOCK_COUNT + BLOCK_BITMAP_BLOCK_COUNT;
+  while (block_pointer < block_count)
+  {
+    if (0 == (block_bitmap[block_pointer / 8] & (1 << (block_pointer % 8))))
+    {
+      block_pointer++;
+      continue;
     }
-    ramdisk_file_position_add(&file_position, sizeof(dir_entry_t));
-    
-    // If an empty child directory entry is found, use it for the new entry.
-    if (0 == strcmp(empty_entry->filename, "")) {
-      memcpy(empty_entry, &entry, sizeof(dir_entry_t));
-      parent_directory_index_node->dir_entry_count++;
-      return 0;
+    run_end = block_pointer;
+    while ((run_end < block_count) && (block_bitmap[run_end / 8] & (1 << (run_end % 8))))
+    {
+      run_end++;
+    }
+    while (block_pointer < run_end)
+    {
+      order = BUDDY_MAX_ORDER;
+      while ((0 != (block_pointer & ((1 << order) - 1))) || (block_pointer + (1 << order) > run_end))
+      {
+        order--;
+      }
+      ramdisk_buddy_push(block_pointer, order);
+      block_pointer = block_pointer + (1 << order);
     }
   }
-  // now that we have memory address add it to the end of the parent directory file
-  ramdisk_file_position_init(&file_position, parent_directory_index_node, parent_directory_index_node->size, 0);
-  dst = ramdisk_get_memory_address(&file_position);
-  if (NULL == dst) {
-    return -1; 
+}
+
+// set up the buddy free lists from the bitmap, -1 when they can not be
+// allocated and the bitmap allocator has to stay in use
+static int ramdisk_buddy_init(void)
+{
+  int block_count = TOTAL_BLOCK_COUNT;
+
+  ramdisk_buddy_next = (int *)vmalloc(sizeof(int) * block_count);
+  ramdisk_buddy_prev = (int *)vmalloc(sizeof(int) * block_count);
+  ramdisk_buddy_free_order = (signed char *)vmalloc(sizeof(signed char) * block_count);
+  if ((NULL == ramdisk_buddy_next) || (NULL == ramdisk_buddy_prev) || (NULL == ramdisk_buddy_free_order))
+  {
+    vfree(ramdisk_buddy_free_order);
+    vfree(ramdisk_buddy_prev);
+    vfree(ramdisk_buddy_next);
+    ramdisk_buddy_free_order = NULL;
+    ramdisk_buddy_prev = NULL;
+    ramdisk_buddy_next = NULL;
+    return -1;
   }
-  memcpy(dst, &entry, sizeof(dir_entry_t));
-  parent_directory_index_node->size = parent_directory_index_node->size + sizeof(dir_entry_t);
-  parent_directory_index_node->dir_entry_count++;
+  ramdisk_buddy_rebuild();
 
-  printk(KERN_INFO "Finished creating file %s\n", pathname);
   return 0;
 }
 
-// absolute file path from root of directory tree
-int ramdisk_mkdir(char *pathname)
+// allocate a single block from whichever allocator backs the ramdisk,
+// callers hold ramdisk_bitmap_lock
+static int ramdisk_region_alloc(void)
 {
-  return ramdisk_create(pathname, "dir");
+  if (ramdisk_buddy_allocator)
+  {
+    return ramdisk_buddy_alloc(0);
+  }
+
+  return search_bitmap();
 }
 
-// open file with absolute pathname from root of directory tree
-int ramdisk_open(char *pathname, int *index_node_number)
+// allocate a zeroed chunk, physically contiguous when possible; huge chunks
+// fall back to vmalloc when no free 2MB block is left, may sleep
+static char *ramdisk_chunk_alloc(void)
 {
-  const char *filename = NULL;
-  index_node_t *parent_directory_index_node = NULL;
-  index_node_t *index_node = NULL;
-  dir_entry_t *entry = NULL;
-  superblock_t *superblock = NULL;
-  if ((0 == strcmp("", pathname)) || (0 == strcmp("/", pathname)))
+  char *memory = NULL;
+
+  if (0 == ramdisk_chunk_order)
   {
-    *index_node_number = 0;
-    superblock = (superblock_t *)ramdisk_memory;
-    superblock->first_block.open_counter++;
-    return 0;
+    return (char *)get_zeroed_page(GFP_KERNEL);
+  }
+  memory = (char *)__get_free_pages(GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN | __GFP_NORETRY, ramdisk_chunk_order);
+  if (NULL == memory)
+  {
+    memory = (char *)vzalloc(PAGE_SIZE << ramdisk_chunk_order);
   }
 
-  parent_directory_index_node = ramdisk_get_directory_index_node(pathname);
-  if (NULL == parent_directory_index_node)
+  return memory;
+}
+
+static void ramdisk_chunk_release(char *memory)
+{
+  if (is_vmalloc_addr(memory))
   {
-    return -1;
+    vfree(memory);
   }
-  filename = strrchr(pathname, '/');
-  entry = ramdisk_get_dir_entry(parent_directory_index_node, filename, NULL);
-  if (NULL == entry)
+  else
   {
-    return -1;
+    free_pages((unsigned long)memory, ramdisk_chunk_order);
   }
-  *index_node_number = entry->index_node_number;
-  printk(KERN_INFO "Opened file %s at index node %d\n", pathname, *index_node_number);
+}
 
-  // increase the number of open entries at inode
-  index_node = ramdisk_get_index_node(entry->index_node_number);
-  index_node->open_counter++;
+// count block_count blocks from block_pointer as in use by their chunks,
+// allocating chunks that have no memory yet; may sleep, -1 when a chunk
+// can not be allocated
+static int ramdisk_chunk_get(int block_pointer, int block_count)
+{
+  int chunk = 0;
+  int first = 0;
+  int last = 0;
+  char *memory = NULL;
+
+  for (chunk = block_pointer / RAMDISK_CHUNK_BLOCK_COUNT; chunk * RAMDISK_CHUNK_BLOCK_COUNT < block_pointer + block_count; chunk++)
+  {
+    first = max(block_pointer, chunk * RAMDISK_CHUNK_BLOCK_COUNT);
+    last = min(block_pointer + block_count, (chunk + 1) * RAMDISK_CHUNK_BLOCK_COUNT);
+    memory = NULL;
+    spin_lock(&ramdisk_chunk_lock);
+    if (NULL == ramdisk_chunks[chunk])
+    {
+      spin_unlock(&ramdisk_chunk_lock);
+      memory = ramdisk_chunk_alloc();
+      if (NULL == memory)
+      {
+        ramdisk_chunk_put(block_pointer, first - block_pointer);
+        return -1;
+      }
+      spin_lock(&ramdisk_chunk_lock);
+      // another caller may have filled it meanwhile
+      if (NULL == ramdisk_chunks[chunk])
+      {
+        ramdisk_chunks[chunk] = memory;
+        memory = NULL;
+      }
+    }
+    ramdisk_chunk_used_count[chunk] = ramdisk_chunk_used_count[chunk] + (last - first);
+    spin_unlock(&ramdisk_chunk_lock);
+    if (NULL != memory)
+    {
+      ramdisk_chunk_release(memory);
+    }
+  }
 
   return 0;
 }
 
+// stop counting block_count blocks from block_pointer as in use, freeing
+// chunks that no longer hold any
+static void ramdisk_chunk_put(int block_pointer, int block_count)
+{
+  int chunk = 0;
+  int first = 0;
+  int last = 0;
+  char *memory = NULL;
 
-// free memory and remove the absolute file path 
-int ramdisk_unlink(char *pathname)
+  for (chunk = block_pointer / RAMDISK_CHUNK_BLOCK_COUNT; chunk * RAMDISK_CHUNK_BLOCK_COUNT < block_pointer + block_count; chunk++)
+  {
+    first = max(block_pointer, chunk * RAMDISK_CHUNK_BLOCK_COUNT);
+    last = min(block_pointer + block_count, (chunk + 1) * RAMDISK_CHUNK_BLOCK_COUNT);
+    memory = NULL;
+    spin_lock(&ramdisk_chunk_lock);
+    ramdisk_chunk_used_count[chunk] = ramdisk_chunk_used_count[chunk] - (last - first);
+    if (0 == ramdisk_chunk_used_count[chunk])
+    {
+      memory = ramdisk_chunks[chunk];
+      ramdisk_chunks[chunk] = NULL;
+    }
+    spin_unlock(&ramdisk_chunk_lock);
+    if (NULL != memory)
+    {
+      ramdisk_chunk_release(memory);
+    }
+  }
+}
+
+// free every chunk of a chunk table and the table itself
+static void ramdisk_chunks_free(char **chunks, int chunk_count)
 {
-  const char *filename = NULL;
-  index_node_t *parent_directory_index_node = NULL;
-  index_node_t *index_node = NULL;
-  dir_entry_t *entry = NULL;
-  superblock_t *superblock = NULL;
-  int block_pointer_value = 0;
-  block_pointer_t block_pointer;
-  int loop = 0;
+  int chunk = 0;
 
-  // can not unlink root!
-  if ((0 == strcmp("", pathname)) || (0 == strcmp("/", pathname)))
+  for (chunk = 0; chunk < chunk_count; chunk++)
   {
+    if (NULL != chunks[chunk])
+    {
+      ramdisk_chunk_release(chunks[chunk]);
+    }
+  }
+  vfree(chunks);
+}
 
-    return -1;
+// allocate a chunk of BLK_SZ << order for an extent
+int ramdisk_extent_alloc(int order)
+{
+  int block_pointer = -1;
+
+  spin_lock(&ramdisk_bitmap_lock);
+  block_pointer = ramdisk_buddy_alloc(order);
+  spin_unlock(&ramdisk_bitmap_lock);
+  if (block_pointer <= 0)
+  {
+    // the free space may still be being reclaimed, see ramdisk_block_alloc
+    ramdisk_reclaim_flush();
+    spin_lock(&ramdisk_bitmap_lock);
+    block_pointer = ramdisk_buddy_alloc(order);
+    spin_unlock(&ramdisk_bitmap_lock);
   }
-  
-  // check parent file path
-  parent_directory_index_node = ramdisk_get_directory_index_node(pathname);
-  if (NULL == parent_directory_index_node)
+  if ((block_pointer > 0) && (0 != ramdisk_chunk_get(block_pointer, 1 << order)))
   {
-    return -1;
+    spin_lock(&ramdisk_bitmap_lock);
+    ramdisk_buddy_free(block_pointer, order);
+    spin_unlock(&ramdisk_bitmap_lock);
+    block_pointer = -1;
   }
-  
-  // check to for the child file
-  filename = strrchr(pathname, '/');
-  entry = ramdisk_get_dir_entry(parent_directory_index_node, filename, NULL);
-  if (NULL == entry)
+  trace_ramdisk_block_alloc(block_pointer, order);
+
+  return block_pointer;
+}
+
+// free an extent chunk once it has been cleared
+void ramdisk_extent_free(int block_pointer, int order)
+{
+  trace_ramdisk_block_free(block_pointer, order);
+  ramdisk_zero_queue_add(block_pointer, order);
+}
+
+// initialize ramdisk memory, -1 when the metadata can not be allocated
+int ramdisk_init()
+{
+  int x = 0;
+  int cpu = 0;
+  int i = 0;
+  superblock_t *superblock = NULL;
+  index_node_t *index_node_array = NULL;
+  unsigned char *block_bitmap = NULL;
+  printk(KERN_INFO "Initializing ramdisk\n");
+  if ((ramdisk_block_count <= 0) || (ramdisk_block_count > MAX_TOTAL_BLOCK_COUNT) || (ramdisk_block_count <= METADATA_BLOCK_COUNT))
   {
-    return -1;
+    printk(KERN_ERR "ramdisk: block count %d out of range, using %d\n", ramdisk_block_count, RAMDISK_MEMORY_SIZE / BLK_SZ);
+    ramdisk_block_count = RAMDISK_MEMORY_SIZE / BLK_SZ;
   }
-  
-  // checking if it is directory, it has to be empty
-  index_node = ramdisk_get_index_node(entry->index_node_number);
-  if ((0 == strcmp("dir", index_node->type)) && (index_node->dir_entry_count > 0))
+  // only the metadata is allocated up front, file blocks get their chunk on first use
+  ramdisk_chunk_order = ramdisk_huge_chunks ? get_order(RAMDISK_HUGE_CHUNK_SIZE) : 0;
+  ramdisk_chunk_block_shift = 0;
+  while ((BLK_SZ << ramdisk_chunk_block_shift) < (PAGE_SIZE << ramdisk_chunk_order))
   {
-    return -1;
+    ramdisk_chunk_block_shift++;
   }
-
-  // make sure file is not open
-  if (index_node->open_counter > 0)
+  ramdisk_memory = (unsigned char *)vmalloc(sizeof(unsigned char) * METADATA_BLOCK_COUNT * BLK_SZ);
+  ramdisk_chunk_count = (TOTAL_BLOCK_COUNT + RAMDISK_CHUNK_BLOCK_COUNT - 1) / RAMDISK_CHUNK_BLOCK_COUNT;
+  ramdisk_chunks = (char **)vmalloc(sizeof(char *) * ramdisk_chunk_count);
+  ramdisk_chunk_used_count = (unsigned short *)vmalloc(sizeof(unsigned short) * ramdisk_chunk_count);
+  if ((NULL == ramdisk_memory) || (NULL == ramdisk_chunks) || (NULL == ramdisk_chunk_used_count))
   {
+    printk(KERN_ERR "ramdisk: can not allocate metadata for %d blocks\n", TOTAL_BLOCK_COUNT);
+    vfree(ramdisk_chunk_used_count);
+    vfree(ramdisk_chunks);
+    vfree(ramdisk_memory);
+    ramdisk_chunk_used_count = NULL;
+    ramdisk_chunks = NULL;
+    ramdisk_memory = NULL;
     return -1;
   }
+  memset(ramdisk_chunks, 0, sizeof(char *) * ramdisk_chunk_count);
+  memset(ramdisk_chunk_used_count, 0, sizeof(unsigned short) * ramdisk_chunk_count);
 
-  // free the inode at the block memory
-  ramdisk_block_pointer_init(&block_pointer, index_node, 0, 1);
+  // initialize superblock
+  superblock = (superblock_t *)ramdisk_memory;
+  memset(superblock, 0, BLK_SZ);
+  superblock->num_free_blocks = TOTAL_BLOCK_COUNT;
+  superblock->num_free_index_nodes = MAX_INDEX_NODES_COUNT;
+  // initialize root directory
+  strcpy(superblock->first_block.type, "dir");
 
-  // Free memory block by block in the ramdisk
-  for (loop = 0; loop < MAX_BLOCK_COUNT_IN_FILE; loop++) {
-      block_pointer_value = ramdisk_alloc_and_get_block_pointer(&block_pointer);
-      if (block_pointer_value <= 0) {
-          break;
-      }
-      ramdisk_block_free(block_pointer_value);
-      ramdisk_block_pointer_increase(&block_pointer);
-  }
+  // initialize index node array
+  index_node_array = ramdisk_get_index_node(1);
+  memset(index_node_array, 0, sizeof(unsigned char) * (BLK_SZ * INDEX_NODE_ARRAY_BLOCK_COUNT));
 
-  // Free memory for single-indirect block pointer if it exists
-  if (index_node->location[SINGLE_INDIRECT_BLOCK_POINTER] > 0) {
-      ramdisk_block_free(index_node->location[SINGLE_INDIRECT_BLOCK_POINTER]);
+  // initialize block bitmap, bits past the last block stay allocated
+  block_bitmap = (ramdisk_memory + BLK_SZ * (1 + INDEX_NODE_ARRAY_BLOCK_COUNT));
+  memset(block_bitmap, 0, BLOCK_BITMAP_BLOCK_COUNT * BLK_SZ);
+  memset(block_bitmap, 0x0FF, TOTAL_BLOCK_COUNT / 8);
+  for (i = TOTAL_BLOCK_COUNT / 8 * 8; i < TOTAL_BLOCK_COUNT; i++)
+  {
+    block_bitmap[i / 8] = block_bitmap[i / 8] | (1 << (i % 8));
   }
 
-  // Free memory for double-indirect block pointer if it exists
-  if (index_node->location[DOUBLE_INDIRECT_BLOCK_POINTER] > 0) {
-      int *location = (int *)(ramdisk_memory + (BLK_SZ * (index_node->location[DOUBLE_INDIRECT_BLOCK_POINTER])));
-      for (loop = 0; loop < PTRS_PB; loop++) {
-          if (location[loop] <= 0) {
-              break;
-          }
-          ramdisk_block_free(location[loop]);
-      }
-      ramdisk_block_free(index_node->location[DOUBLE_INDIRECT_BLOCK_POINTER]);
+  // initialize block bitmap for the superblock, index node array, and block bitmap itself to used
+  ramdisk_bitmap_hint = 0;
+  for (x = 0; x < (1 + INDEX_NODE_ARRAY_BLOCK_COUNT + BLOCK_BITMAP_BLOCK_COUNT); x++)
+  {
+    search_bitmap();
+  }
+  for (i = 0; i <= MAX_INDEX_NODES_COUNT; i++)
+  {
+    init_rwsem(&ramdisk_index_node_lock[i]);
+    init_rwsem(&ramdisk_map_lock[i]);
+    spin_lock_init(&ramdisk_range_list_lock[i]);
+    init_waitqueue_head(&ramdisk_range_wait[i]);
+    ramdisk_io_ranges[i] = NULL;
+    ramdisk_advisory_ranges[i] = NULL;
+  }
+  for_each_possible_cpu(cpu)
+  {
+    spin_lock_init(&per_cpu(ramdisk_block_magazine, cpu).lock);
+    per_cpu(ramdisk_block_magazine, cpu).count = 0;
+  }
+  if (ramdisk_buddy_allocator && (0 != ramdisk_buddy_init()))
+  {
+    printk(KERN_WARNING "ramdisk: can not allocate buddy free lists, using the block bitmap\n");
+    ramdisk_buddy_allocator = 0;
+  }
+  memset(ramdisk_pack_block_cache, 0, sizeof(ramdisk_pack_block_cache));
+  ramdisk_zero_queue_count = 0;
+  ramdisk_zero_block_count = 0;
+  ramdisk_reclaim_queue_count = 0;
+  ramdisk_reclaim_block_count = 0;
+  printk(KERN_INFO "Finished initializing ramdisk\n");
+
+  return 0;
+}
+
+
+void ramdisk_uninit()
+{
+  int i = 0;
+
+  // queued blocks and files go away with their chunks
+  cancel_work_sync(&ramdisk_reclaim_work);
+  cancel_work_sync(&ramdisk_zero_work);
+  for (i = 0; i <= MAX_INDEX_NODES_COUNT; i++)
+  {
+    ramdisk_range_drop(&ramdisk_advisory_ranges[i], 0, MAX_FILE_SIZE, 0, NULL);
+  }
+  if (NULL != ramdisk_buddy_next)
+  {
+    vfree(ramdisk_buddy_next);
+    vfree(ramdisk_buddy_prev);
+    vfree(ramdisk_buddy_free_order);
+    ramdisk_buddy_next = NULL;
+    ramdisk_buddy_prev = NULL;
+    ramdisk_buddy_free_order = NULL;
+  }
+  if (NULL != ramdisk_block_refcount)
+  {
+    vfree(ramdisk_block_refcount);
+    ramdisk_block_refcount = NULL;
+  }
+  if (NULL != ramdisk_compress_cache)
+  {
+    vfree(ramdisk_compress_cache);
+    vfree(ramdisk_compress_buffer);
+    ramdisk_compress_cache = NULL;
+    ramdisk_compress_buffer = NULL;
+  }
+  if (NULL != ramdisk_memory)
+  {
+    ramdisk_chunks_free(ramdisk_chunks, ramdisk_chunk_count);
+    vfree(ramdisk_chunk_used_count);
+    vfree(ramdisk_memory);
+    ramdisk_chunks = NULL;
+    ramdisk_chunk_used_count = NULL;
+    ramdisk_memory = NULL;
+  }
+}
+
+// nonzero while an event that reports latency_ns is enabled
+static int ramdisk_trace_timing_count;
+
+void ramdisk_trace_timing_reg(void)
+{
+  ramdisk_trace_timing_count++;
+}
+
+void ramdisk_trace_timing_unreg(void)
+{
+  ramdisk_trace_timing_count--;
+}
+
+// clock for tracepoint latencies, read only while someone is tracing them
+static unsigned long long ramdisk_trace_clock(void)
+{
+  if (0 == ramdisk_trace_timing_count)
+  {
+    return 0;
+  }
+  return sched_clock();
+}
+
+// how far below the root a path into /.snapshot goes: 1 for /.snapshot
+// itself, 2 for a snapshot, more for what is in one, 0 for any other path
+static int ramdisk_snapshot_path_depth(const char *pathname)
+{
+  int depth = 1;
+  int length = 0;
+  const char *filename_start = NULL;
+
+  filename_start = pathname;
+  if ('/' == filename_start[0])
+  {
+    filename_start = filename_start + 1;
+  }
+  length = strlen(SNAPSHOT_DIRECTORY_NAME);
+  if ((0 != strncmp(SNAPSHOT_DIRECTORY_NAME, filename_start, length))
+      || (('\0' != filename_start[length]) && ('/' != filename_start[length])))
+  {
+    return 0;
+  }
+  for (filename_start = filename_start + length; '\0' != *filename_start; filename_start++)
+  {
+    if ('/' == *filename_start)
+    {
+      depth++;
+    }
+  }
+
+  return depth;
+}
+
+// create file with absolute pathname from root of directory tree
+int ramdisk_create(char *pathname, char *type)
+{
+  unsigned long long start = ramdisk_trace_clock();
+  int index_node_number = 0;
+
+  // only ramdisk_snapshot adds to /.snapshot
+  index_node_number = (0 != ramdisk_snapshot_path_depth(pathname)) ? -1 : ramdisk_create_index_node(pathname, type);
+  trace_ramdisk_create(pathname, type, index_node_number, (index_node_number < 0) ? -1 : 0, ramdisk_trace_clock() - start);
+
+  return (index_node_number < 0) ? -1 : 0;
+}
+
+// add a file of the given type to its parent directory and return its index node number
+static int ramdisk_create_index_node(char *pathname, char *type)
+{
+  index_node_t *parent_directory_index_node = NULL;
+  const char *filename = NULL;
+
+  // 1. iterate from root until the parent file node to find parent's inode
+  parent_directory_index_node = ramdisk_get_directory_index_node(pathname);
+  if (parent_directory_index_node == NULL)
+  {
+    return -1;
+  }
+
+  // 2. find the name of the child after the last '/'
+  filename = ramdisk_get_filename(pathname);
+  if ((0 == strlen(filename)) || (strlen(filename) > MAX_FILENAME_LENGTH))
+  {
+    return -1;
+  }
+  if (ramdisk_get_dir_entry(parent_directory_index_node, filename, NULL) != NULL)
+  {
+    return -1;
+  }
+
+  return ramdisk_add_index_node(parent_directory_index_node, filename, type);
+}
+
+// take a free index node for a new file of the given type and name it in
+// a directory that has no entry of that name, return its index node number
+static int ramdisk_add_index_node(index_node_t *parent_directory_index_node, const char *filename, char *type)
+{
+  int i = 0;
+  int index_node_number = 0;
+  index_node_t *index_node = NULL;
+  dir_entry_t entry;
+  superblock_t *superblock = (superblock_t *)ramdisk_memory;
+  index_node_t *index_node_array = ramdisk_get_index_node(1);
+
+  // 3. find unused inode from inode array
+  for (i = 0; i < MAX_INDEX_NODES_COUNT; i++)
+  {
+    if (0 == strcmp(index_node_array[i].type, ""))
+    {
+      superblock->num_free_index_nodes--;
+      index_node_number = i + 1;
+      break;
+    }
+    else if (i == MAX_INDEX_NODES_COUNT - 1)
+    {
+      return -1;
+    }
+  }
+
+  // 4. find correlating block memory address for inode and fill in structures
+  index_node = ramdisk_get_index_node(index_node_number);
+  memset(index_node, 0, sizeof(index_node_t));
+  strcpy(index_node->type, type);
+  if (ramdisk_buddy_allocator && (0 == strcmp("reg", type)))
+  {
+    index_node->flags = INDEX_NODE_FLAG_EXTENTS;
+  }
+  memset(&entry, 0, sizeof(dir_entry_t));
+  strcpy(entry.filename, filename);
+  entry.index_node_number = index_node_number;
+
+  // 5. add the new entry to the parent directory
+  if (0 != ramdisk_dir_add_entry(parent_directory_index_node, &entry))
+  {
+    memset(index_node, 0, sizeof(index_node_t));
+    superblock->num_free_index_nodes++;
+    return -1;
+  }
+
+  return index_node_number;
+}
+
+// absolute file path from root of directory tree
+int ramdisk_mkdir(char *pathname)
+{
+  return ramdisk_create(pathname, "dir");
+}
+
+// open file with absolute pathname from root of directory tree
+int ramdisk_open(char *pathname, int *index_node_number)
+{
+  unsigned long long start = ramdisk_trace_clock();
+  int result = 0;
+
+  result = ramdisk_open_index_node(pathname, index_node_number);
+  trace_ramdisk_open(pathname, (0 == result) ? *index_node_number : -1, result, ramdisk_trace_clock() - start);
+
+  return result;
+}
+
+// index node number of an absolute path, 0 for the root, -1 when it does not exist
+static int ramdisk_lookup_index_node(char *pathname)
+{
+  const char *filename = NULL;
+  index_node_t *parent_directory_index_node = NULL;
+  dir_entry_t *entry = NULL;
+
+  if ((0 == strcmp("", pathname)) || (0 == strcmp("/", pathname)))
+  {
+    return 0;
+  }
+  parent_directory_index_node = ramdisk_get_directory_index_node(pathname);
+  if (NULL == parent_directory_index_node)
+  {
+    return -1;
+  }
+  filename = ramdisk_get_filename(pathname);
+  entry = ramdisk_get_dir_entry(parent_directory_index_node, filename, NULL);
+  if (NULL == entry)
+  {
+    return -1;
+  }
+
+  return entry->index_node_number;
+}
+
+static int ramdisk_open_index_node(char *pathname, int *index_node_number)
+{
+  index_node_t *index_node = NULL;
+
+  *index_node_number = ramdisk_lookup_index_node(pathname);
+  if (*index_node_number < 0)
+  {
+    return -1;
+  }
+
+  // increase the number of open entries at inode
+  index_node = ramdisk_get_index_node(*index_node_number);
+  index_node->open_counter++;
+
+  return 0;
+}
+
+
+// free memory and remove the absolute file path 
+int ramdisk_unlink(char *pathname)
+{
+  unsigned long long start = ramdisk_trace_clock();
+  int index_node_number = 0;
+
+  // snapshots are dropped whole with ramdisk_rmtree
+  index_node_number = (0 != ramdisk_snapshot_path_depth(pathname)) ? -1 : ramdisk_unlink_index_node(pathname);
+  trace_ramdisk_unlink(pathname, index_node_number, (index_node_number < 0) ? -1 : 0, ramdisk_trace_clock() - start);
+
+  return (index_node_number < 0) ? -1 : 0;
+}
+
+// remove the file from its parent directory and return its former index node number
+static int ramdisk_unlink_index_node(char *pathname)
+{
+  int index_node_number = 0;
+  const char *filename = NULL;
+  index_node_t *parent_directory_index_node = NULL;
+  index_node_t *index_node = NULL;
+  dir_entry_t *entry = NULL;
+
+  // can not unlink root!
+  if ((0 == strcmp("", pathname)) || (0 == strcmp("/", pathname)))
+  {
+
+    return -1;
+  }
+  
+  // check parent file path
+  parent_directory_index_node = ramdisk_get_directory_index_node(pathname);
+  if (NULL == parent_directory_index_node)
+  {
+    return -1;
+  }
+  
+  // check to for the child file
+  filename = ramdisk_get_filename(pathname);
+  entry = ramdisk_get_dir_entry(parent_directory_index_node, filename, NULL);
+  if (NULL == entry)
+  {
+    return -1;
+  }
+  
+  // checking if it is directory, it has to be empty
+  index_node = ramdisk_get_index_node(entry->index_node_number);
+  if ((0 == strcmp("dir", index_node->type)) && (index_node->dir_entry_count > 0))
+  {
+    return -1;
+  }
+
+  // make sure file is not open
+  if (index_node->open_counter > 0)
+  {
+    return -1;
+  }
+
+  index_node_number = entry->index_node_number;
+  ramdisk_remove_index_node(parent_directory_index_node, filename, index_node);
+
+  return index_node_number;
+}
+
+// free a file or empty directory and drop its entry from the parent directory
+static void ramdisk_remove_index_node(index_node_t *parent_directory_index_node, const char *filename, index_node_t *index_node)
+{
+  ramdisk_free_index_node_memory(index_node);
+  ramdisk_dir_remove_entry(parent_directory_index_node, filename);
+}
+
+// free the blocks of a file or empty directory no entry names any more
+void ramdisk_free_index_node_memory(index_node_t *index_node)
+{
+  int index_node_number = 0;
+  superblock_t *superblock = NULL;
+
+  // file I/O does not hold the namespace lock, wait for any read or write
+  // still inside the file before its blocks go
+  index_node_number = (int)(index_node - (index_node_t *)(ramdisk_memory + BLK_SZ)) + 1;
+  down_write(&ramdisk_index_node_lock[index_node_number]);
+  if (index_node->flags & INDEX_NODE_FLAG_COMPRESSED)
+  {
+    ramdisk_compress_cache_drop(index_node);
+  }
+  // free every data and pointer block of the file, large files in the background
+  if (0 != ramdisk_reclaim_queue_add(index_node))
+  {
+    ramdisk_truncate_blocks(index_node, 0);
   }
-  printk(KERN_INFO "Unlinked file at index node %d\n", entry->index_node_number);
 
   // clear location attribute and reset file attributes
   memset(index_node->location, 0, sizeof(index_node->location));
   index_node->size = 0;
   index_node->dir_entry_count = 0;
 
-  // adjust data structures
-  memset(index_node, 0, sizeof(index_node_t));
-  superblock = (superblock_t *)ramdisk_memory;
-  superblock->num_free_index_nodes++;
-  memset(entry, 0, sizeof(dir_entry_t));
-  parent_directory_index_node->dir_entry_count--;
+  // adjust data structures
+  memset(index_node, 0, sizeof(index_node_t));
+  up_write(&ramdisk_index_node_lock[index_node_number]);
+  superblock = (superblock_t *)ramdisk_memory;
+  superblock->num_free_index_nodes++;
+}
+
+// whether a directory on the way to the last component of pathname is the given index node
+static int ramdisk_path_crosses_index_node(const char *pathname, int index_node_number)
+{
+  const char *filename_start = NULL;
+  const char *filename_end = NULL;
+  index_node_t *index_node = NULL;
+  dir_entry_t *entry = NULL;
+
+  index_node = &((superblock_t *)ramdisk_memory)->first_block;
+  filename_start = pathname;
+  if ('/' == filename_start[0])
+  {
+    filename_start = filename_start + 1;
+  }
+  filename_end = find_next_directory(filename_start);
+  while (NULL != filename_end)
+  {
+    entry = ramdisk_get_dir_entry(index_node, filename_start, filename_end);
+    if (NULL == entry)
+    {
+      return 0;
+    }
+    if (entry->index_node_number == index_node_number)
+    {
+      return 1;
+    }
+    index_node = ramdisk_get_index_node(entry->index_node_number);
+    filename_start = filename_end + 1;
+    filename_end = find_next_directory(filename_start);
+  }
+
+  return 0;
+}
+
+// move the entry at old_pathname to new_pathname without touching the file's
+// blocks; a file or empty directory of the same type already at new_pathname
+// is replaced, and its name never stops resolving while that happens
+int ramdisk_rename(char *old_pathname, char *new_pathname)
+{
+  int index_node_number = 0;
+  int target_index_node_number = 0;
+  const char *old_filename = NULL;
+  const char *new_filename = NULL;
+  index_node_t *old_parent_directory_index_node = NULL;
+  index_node_t *new_parent_directory_index_node = NULL;
+  index_node_t *index_node = NULL;
+  index_node_t *target_index_node = NULL;
+  dir_entry_t *entry = NULL;
+  dir_entry_t new_entry;
+
+  // nothing moves into, out of or within /.snapshot
+  if ((0 != ramdisk_snapshot_path_depth(old_pathname)) || (0 != ramdisk_snapshot_path_depth(new_pathname)))
+  {
+    return -1;
+  }
+  // the root can not be moved
+  index_node_number = ramdisk_lookup_index_node(old_pathname);
+  if (index_node_number <= 0)
+  {
+    return -1;
+  }
+  old_parent_directory_index_node = ramdisk_get_directory_index_node(old_pathname);
+  old_filename = ramdisk_get_filename(old_pathname);
+  index_node = ramdisk_get_index_node(index_node_number);
+
+  new_parent_directory_index_node = ramdisk_get_directory_index_node(new_pathname);
+  if (NULL == new_parent_directory_index_node)
+  {
+    return -1;
+  }
+  new_filename = ramdisk_get_filename(new_pathname);
+  if ((0 == strlen(new_filename)) || (strlen(new_filename) > MAX_FILENAME_LENGTH))
+  {
+    return -1;
+  }
+  // a directory can not move below itself
+  if ((0 == strcmp("dir", index_node->type)) && ramdisk_path_crosses_index_node(new_pathname, index_node_number))
+  {
+    return -1;
+  }
+
+  entry = ramdisk_get_dir_entry(new_parent_directory_index_node, new_filename, NULL);
+  if (NULL == entry)
+  {
+    // add the new name first, so running out of directory space changes nothing
+    memset(&new_entry, 0, sizeof(dir_entry_t));
+    strcpy(new_entry.filename, new_filename);
+    new_entry.index_node_number = index_node_number;
+    if (0 != ramdisk_dir_add_entry(new_parent_directory_index_node, &new_entry))
+    {
+      return -1;
+    }
+    ramdisk_dir_remove_entry(old_parent_directory_index_node, old_filename);
+    return 0;
+  }
+
+  target_index_node_number = entry->index_node_number;
+  if (target_index_node_number == index_node_number)
+  {
+    return 0;
+  }
+  // same rules as unlink for the file being replaced
+  target_index_node = ramdisk_get_index_node(target_index_node_number);
+  if ((0 != strcmp(index_node->type, target_index_node->type))
+      || (target_index_node->dir_entry_count > 0) || (target_index_node->open_counter > 0))
+  {
+    return -1;
+  }
+  // repoint the existing entry in place, then drop the old name
+  entry->index_node_number = index_node_number;
+  ramdisk_dir_remove_entry(old_parent_directory_index_node, old_filename);
+  ramdisk_free_index_node_memory(target_index_node);
+
+  return 0;
+}
+
+// close fd table
+int ramdisk_close(int index_node_number)
+{
+  index_node_t *index_node = NULL;
+
+  // decrease number of open index nodes
+  index_node = ramdisk_get_index_node(index_node_number);
+  index_node->open_counter--;
+
+  // advisory locks go with the last opener
+  if (0 == index_node->open_counter)
+  {
+    spin_lock(&ramdisk_range_list_lock[index_node_number]);
+    ramdisk_range_drop(&ramdisk_advisory_ranges[index_node_number], 0, MAX_FILE_SIZE, 0, NULL);
+    spin_unlock(&ramdisk_range_list_lock[index_node_number]);
+    wake_up_all(&ramdisk_range_wait[index_node_number]);
+  }
+
+  // move the partial last block of a file nobody has open into a pack block
+  if ((0 == index_node->open_counter) && ramdisk_tail_packing)
+  {
+    down_write(&ramdisk_index_node_lock[index_node_number]);
+    ramdisk_tail_pack(index_node, index_node_number);
+    up_write(&ramdisk_index_node_lock[index_node_number]);
+  }
+
+  // directory maintenance was postponed while the directory was open
+  if ((0 == index_node->open_counter) && (0 == strcmp("dir", index_node->type)))
+  {
+    if (index_node->flags & INDEX_NODE_FLAG_DIR_BTREE)
+    {
+      if (index_node->dir_entry_count < DIR_FLAT_MAX_ENTRY_COUNT)
+      {
+        ramdisk_dir_convert_to_flat(index_node);
+      }
+    }
+    else if (index_node->dir_entry_count >= DIR_BTREE_MIN_ENTRY_COUNT)
+    {
+      ramdisk_dir_convert_to_btree(index_node);
+    }
+    else if (ramdisk_dir_needs_compaction(index_node))
+    {
+      ramdisk_dir_compact(index_node);
+    }
+  }
+
+  return 0;
+}
+
+// whether two ranges overlap and at least one of them writes; the advisory
+// locks of one process never conflict with each other
+static int ramdisk_range_conflicts(range_t *range, range_t *other)
+{
+  return (range->start < other->end) && (other->start < range->end) && (range->is_write || other->is_write)
+    && ((0 == range->owner) || (range->owner != other->owner));
+}
+
+// first range of a list that conflicts with range, NULL when none does
+static range_t *ramdisk_range_find_conflict(range_t *list, range_t *range)
+{
+  for (; NULL != list; list = list->next)
+  {
+    if (ramdisk_range_conflicts(list, range))
+    {
+      return list;
+    }
+  }
+
+  return NULL;
+}
+
+// add a read or write range to its file's list unless it conflicts with one there
+static int ramdisk_range_try_lock_io(int index_node_number, range_t *range)
+{
+  int is_locked = 0;
+
+  spin_lock(&ramdisk_range_list_lock[index_node_number]);
+  if (NULL == ramdisk_range_find_conflict(ramdisk_io_ranges[index_node_number], range))
+  {
+    range->next = ramdisk_io_ranges[index_node_number];
+    ramdisk_io_ranges[index_node_number] = range;
+    is_locked = 1;
+  }
+  spin_unlock(&ramdisk_range_list_lock[index_node_number]);
+
+  return is_locked;
+}
+
+// hold [start, end) of a file for a read or write, once no other read or
+// write of an overlapping range is running, unless both are reads
+static void ramdisk_range_lock_io(int index_node_number, range_t *range, int start, int end, int is_write)
+{
+  range->start = start;
+  range->end = end;
+  range->is_write = is_write;
+  range->owner = 0;
+  range->next = NULL;
+  wait_event(ramdisk_range_wait[index_node_number], ramdisk_range_try_lock_io(index_node_number, range));
+}
+
+static void ramdisk_range_unlock_io(int index_node_number, range_t *range)
+{
+  range_t **link = NULL;
+
+  spin_lock(&ramdisk_range_list_lock[index_node_number]);
+  for (link = &ramdisk_io_ranges[index_node_number]; *link != range; link = &(*link)->next)
+  {
+  }
+  *link = range->next;
+  spin_unlock(&ramdisk_range_list_lock[index_node_number]);
+  wake_up_all(&ramdisk_range_wait[index_node_number]);
+}
+
+// take [start, end) out of the advisory ranges of owner in a list, or of
+// everyone for owner 0; a range reaching past both ends is split in two
+// with spare, which is returned when it was not needed
+static range_t *ramdisk_range_drop(range_t **list, int start, int end, int owner, range_t *spare)
+{
+  range_t **link = NULL;
+  range_t *range = NULL;
+
+  link = list;
+  while (NULL != *link)
+  {
+    range = *link;
+    if (((0 != owner) && (range->owner != owner)) || (range->end <= start) || (end <= range->start))
+    {
+      link = &range->next;
+    }
+    else if ((start <= range->start) && (range->end <= end))
+    {
+      *link = range->next;
+      kfree(range);
+    }
+    else if ((range->start < start) && (end < range->end))
+    {
+      spare->start = end;
+      spare->end = range->end;
+      spare->is_write = range->is_write;
+      spare->owner = range->owner;
+      spare->next = range->next;
+      range->end = start;
+      range->next = spare;
+      link = &spare->next;
+      spare = NULL;
+    }
+    else
+    {
+      if (range->start < start)
+      {
+        range->end = start;
+      }
+      else
+      {
+        range->start = end;
+      }
+      link = &range->next;
+    }
+  }
+
+  return spare;
+}
+
+// whether range could be added to the advisory locks of its file now
+static int ramdisk_range_is_free(int index_node_number, range_t *range)
+{
+  int is_free = 0;
+
+  spin_lock(&ramdisk_range_list_lock[index_node_number]);
+  is_free = (NULL == ramdisk_range_find_conflict(ramdisk_advisory_ranges[index_node_number], range));
+  spin_unlock(&ramdisk_range_list_lock[index_node_number]);
+
+  return is_free;
+}
+
+// lock or unlock a byte range of an open file for owner, a process: a lock
+// replaces whatever owner held in the range, and waits for or fails on
+// locks of other processes it conflicts with. Reads and writes ignore these
+// locks, they only order applications that ask for them
+int ramdisk_range_lock(int index_node_number, int start, int length, int type, int owner, int is_wait)
+{
+  int result = 0;
+  int is_done = 0;
+  index_node_t *index_node = NULL;
+  range_t *range = NULL;
+  range_t *spare = NULL;
+
+  if ((index_node_number <= 0) || (index_node_number > MAX_INDEX_NODES_COUNT) || (0 == owner)
+      || (start < 0) || (start >= MAX_FILE_SIZE) || (length < 0) || (length > MAX_FILE_SIZE - start)
+      || (type < RAMDISK_RANGE_UNLOCK) || (type > RAMDISK_RANGE_WRITE))
+  {
+    return -1;
+  }
+  index_node = ramdisk_get_index_node(index_node_number);
+  if (0 != strcmp("reg", index_node->type))
+  {
+    return -1;
+  }
+  // the lock, and the second half of a range it splits; the list is
+  // changed under a spinlock, where nothing can be allocated
+  range = (range_t *)kmalloc(sizeof(range_t), GFP_KERNEL);
+  spare = (range_t *)kmalloc(sizeof(range_t), GFP_KERNEL);
+  if ((NULL == range) || (NULL == spare))
+  {
+    kfree(range);
+    kfree(spare);
+    return -1;
+  }
+  range->start = start;
+  range->end = (0 == length) ? MAX_FILE_SIZE : start + length;
+  range->is_write = (RAMDISK_RANGE_WRITE == type);
+  range->owner = owner;
+  range->next = NULL;
+
+  while ((0 == result) && !is_done)
+  {
+    spin_lock(&ramdisk_range_list_lock[index_node_number]);
+    // a file nobody has open keeps no locks, ramdisk_close drops them
+    if (0 == index_node->open_counter)
+    {
+      result = -1;
+    }
+    else if ((RAMDISK_RANGE_UNLOCK == type) || (NULL == ramdisk_range_find_conflict(ramdisk_advisory_ranges[index_node_number], range)))
+    {
+      spare = ramdisk_range_drop(&ramdisk_advisory_ranges[index_node_number], range->start, range->end, owner, spare);
+      if (RAMDISK_RANGE_UNLOCK != type)
+      {
+        range->next = ramdisk_advisory_ranges[index_node_number];
+        ramdisk_advisory_ranges[index_node_number] = range;
+        range = NULL;
+      }
+      is_done = 1;
+    }
+    spin_unlock(&ramdisk_range_list_lock[index_node_number]);
+    if ((0 == result) && !is_done)
+    {
+      // there is no deadlock detection, a signal ends the wait
+      if (!is_wait || (0 != wait_event_interruptible(ramdisk_range_wait[index_node_number], ramdisk_range_is_free(index_node_number, range))))
+      {
+        result = -1;
+      }
+    }
+  }
+  // a range given up or turned into a read lock may let a waiter in
+  if (is_done)
+  {
+    wake_up_all(&ramdisk_range_wait[index_node_number]);
+  }
+  kfree(range);
+  kfree(spare);
+
+  return result;
+}
+
+// read number of bytes from a file
+int ramdisk_read(int index_node_number, int pos, char *address, int num_bytes)
+{
+  struct iovec iov;
+
+  iov.iov_base = address;
+  iov.iov_len = max(num_bytes, 0);
+
+  return ramdisk_read_vector(index_node_number, pos, &iov, 1);
+}
+
+int ramdisk_write(int index_node_number, int pos, char *address, int num_bytes)
+{
+  struct iovec iov;
+
+  iov.iov_base = address;
+  iov.iov_len = max(num_bytes, 0);
+
+  return ramdisk_write_vector(index_node_number, pos, &iov, 1, NULL);
+}
+
+// whether an iovec from user space can be read or written in one call
+static int ramdisk_iovec_check(const struct iovec *iov, int iov_count)
+{
+  int i = 0;
+  size_t total_length = 0;
+
+  if ((iov_count < 0) || (iov_count > RAMDISK_IOV_MAX))
+  {
+    return -1;
+  }
+  for (i = 0; i < iov_count; i++)
+  {
+    if (iov[i].iov_len > INT_MAX - total_length)
+    {
+      return -1;
+    }
+    total_length = total_length + iov[i].iov_len;
+  }
+
+  return 0;
+}
+
+// write at the end of the file, whatever its size by the time the write
+// runs; file_position receives the offset the data went to
+int ramdisk_append(int index_node_number, char *address, int num_bytes, int *file_position)
+{
+  struct iovec iov;
+
+  iov.iov_base = address;
+  iov.iov_len = max(num_bytes, 0);
+
+  return ramdisk_write_vector(index_node_number, 0, &iov, 1, file_position);
+}
+
+// read from pos on into the buffers of an iovec in turn, one after the other
+int ramdisk_readv(int index_node_number, int pos, const struct iovec *iov, int iov_count)
+{
+  if (0 != ramdisk_iovec_check(iov, iov_count))
+  {
+    return -1;
+  }
+
+  return ramdisk_read_vector(index_node_number, pos, iov, iov_count);
+}
+
+// write the buffers of an iovec to the file from pos on, one after the other
+int ramdisk_writev(int index_node_number, int pos, const struct iovec *iov, int iov_count)
+{
+  if (0 != ramdisk_iovec_check(iov, iov_count))
+  {
+    return -1;
+  }
+
+  return ramdisk_write_vector(index_node_number, pos, iov, iov_count, NULL);
+}
+
+// read into the buffers of an iovec in one pass over the file's blocks and
+// return the number of bytes read
+static int ramdisk_read_vector(int index_node_number, int pos, const struct iovec *iov, int iov_count)
+{
+  int i = 0;
+  int num_bytes = 0;
+  int range_length = 0;
+  int data_length_read = 0;
+  int data_length_to_read_once = 0;
+  int remainder_data_length_in_block = 0;
+  int remainder_data_length_to_read = 0;
+  char *dst = NULL;
+  char *src = NULL;
+  index_node_t *index_node = NULL;
+  file_position_t file_position;
+  range_t range;
+
+  // can not read directory file
+  if ((index_node_number < 0) || (index_node_number > MAX_INDEX_NODES_COUNT) || (pos < 0))
+  {
+    return -1;
+  }
+  index_node = ramdisk_get_index_node(index_node_number);
+  if (0 != strcmp("reg", index_node->type))
+  {
+    return -1;
+  }
+  for (i = 0; i < iov_count; i++)
+  {
+    num_bytes = num_bytes + iov[i].iov_len;
+  }
+  down_read(&ramdisk_io_lock);
+  down_read(&ramdisk_index_node_lock[index_node_number]);
+  // the file may have been closed and removed before the lock was ours
+  if ((0 != strcmp("reg", index_node->type)) || (0 == index_node->open_counter))
+  {
+    up_read(&ramdisk_index_node_lock[index_node_number]);
+    up_read(&ramdisk_io_lock);
+    return -1;
+  }
+  ramdisk_access_time[index_node_number] = sched_clock();
+  // lock what was asked for before looking at the size, so a write growing
+  // the file into the range finishes first
+  range_length = min(num_bytes, MAX_FILE_SIZE - pos);
+  if (range_length > 0)
+  {
+    ramdisk_range_lock_io(index_node_number, &range, pos, pos + range_length, 0);
+  }
+  // check if we are trying to read too much
+  num_bytes = min(num_bytes, index_node->size - pos);
+  if (index_node->flags & INDEX_NODE_FLAG_COMPRESSED)
+  {
+    for (i = 0; (i < iov_count) && (data_length_read < num_bytes); i++)
+    {
+      data_length_to_read_once = min((int)iov[i].iov_len, num_bytes - data_length_read);
+      if (data_length_to_read_once != ramdisk_compressed_read(index_node, pos + data_length_read, iov[i].iov_base, data_length_to_read_once, 1))
+      {
+        data_length_read = -1;
+        break;
+      }
+      data_length_read = data_length_read + data_length_to_read_once;
+    }
+  }
+  else if (num_bytes > 0)
+  {
+    /* Init the file position data structure. */
+    ramdisk_file_position_init(&file_position, index_node, pos, 1);
+    down_read(&ramdisk_map_lock[index_node_number]);
+    // each buffer picks up where the last one left the block iterator
+    for (i = 0; (i < iov_count) && (data_length_read < num_bytes); i++)
+    {
+      dst = iov[i].iov_base;
+      remainder_data_length_to_read = min((int)iov[i].iov_len, num_bytes - data_length_read);
+      // read block by block
+      while (remainder_data_length_to_read > 0)
+      {
+        src = ramdisk_get_memory_address(&file_position);
+        if (NULL == src)
+        {
+          break;
+        }
+        remainder_data_length_in_block = ramdisk_get_contiguous_length(&file_position);
+        // the data length to read once should not exceed the remainder of the contiguous run.
+        data_length_to_read_once = min(remainder_data_length_in_block, remainder_data_length_to_read);
+        // copy the data from the ramdisk to the user space.
+        copy_to_user(dst, src, data_length_to_read_once);
+        data_length_read = data_length_read + data_length_to_read_once;
+        dst = dst + data_length_to_read_once;
+        remainder_data_length_to_read = remainder_data_length_to_read - data_length_to_read_once;
+        ramdisk_file_position_add(&file_position, data_length_to_read_once);
+      }
+      // a hole ends the read
+      if (remainder_data_length_to_read > 0)
+      {
+        break;
+      }
+    }
+    up_read(&ramdisk_map_lock[index_node_number]);
+  }
+  if (range_length > 0)
+  {
+    ramdisk_range_unlock_io(index_node_number, &range);
+  }
+  up_read(&ramdisk_index_node_lock[index_node_number]);
+  up_read(&ramdisk_io_lock);
+  return data_length_read;
+}
+
+// move a packed tail back to a block of its own and a compressed file back
+// to plain blocks, so a write can change them in place; the caller holds
+// the index node lock for writing
+static int ramdisk_write_prepare(index_node_t *index_node)
+{
+  if ((index_node->flags & INDEX_NODE_FLAG_TAIL) && (0 != ramdisk_tail_unpack(index_node)))
+  {
+    return -1;
+  }
+  if ((index_node->flags & INDEX_NODE_FLAG_COMPRESSED) && (0 != ramdisk_expand_index_node(index_node)))
+  {
+    return -1;
+  }
+
+  return 0;
+}
+
+// address a write at a file position copies to and the length of the run
+// it starts, called with the map lock held for reading; a block that is
+// already mapped and not shared needs no change to the block map, for any
+// other the lock is taken for writing while the block is allocated or
+// copied
+static char *ramdisk_write_get_memory_address(int index_node_number, file_position_t *file_position, int *contiguous_length)
+{
+  int block_pointer = 0;
+  char *dst = NULL;
+
+  file_position->block_pointer.is_read_mode = 1;
+  block_pointer = ramdisk_alloc_and_get_block_pointer(&file_position->block_pointer);
+  file_position->block_pointer.is_read_mode = 0;
+  if ((block_pointer > 0) && !ramdisk_block_is_shared(block_pointer))
+  {
+    *contiguous_length = ramdisk_get_contiguous_length(file_position);
+    return ramdisk_get_block_memory_address(block_pointer) + file_position->data_offset_in_block;
+  }
+
+  up_read(&ramdisk_map_lock[index_node_number]);
+  down_write(&ramdisk_map_lock[index_node_number]);
+  dst = ramdisk_get_memory_address(file_position);
+  if (NULL != dst)
+  {
+    *contiguous_length = ramdisk_get_contiguous_length(file_position);
+  }
+  up_write(&ramdisk_map_lock[index_node_number]);
+  down_read(&ramdisk_map_lock[index_node_number]);
+
+  return dst;
+}
+
+// drop the locks a write took on its way in
+static void ramdisk_write_unlock(int index_node_number, int is_exclusive)
+{
+  if (is_exclusive)
+  {
+    up_write(&ramdisk_index_node_lock[index_node_number]);
+  }
+  else
+  {
+    up_read(&ramdisk_index_node_lock[index_node_number]);
+  }
+  up_read(&ramdisk_io_lock);
+}
+
+// take back an append that ran out of space: clear what it wrote past the
+// old end of the file and free the blocks it added
+static void ramdisk_append_undo(index_node_t *index_node, int pos, int length)
+{
+  int data_length = 0;
+  char *dst = NULL;
+  file_position_t file_position;
+
+  ramdisk_file_position_init(&file_position, index_node, pos, 1);
+  while (length > 0)
+  {
+    dst = ramdisk_get_memory_address(&file_position);
+    if (NULL == dst)
+    {
+      break;
+    }
+    data_length = min(ramdisk_get_contiguous_length(&file_position), length);
+    memset(dst, 0, data_length);
+    length = length - data_length;
+    if (length > 0)
+    {
+      ramdisk_file_position_add(&file_position, data_length);
+    }
+  }
+  ramdisk_truncate_blocks(index_node, (pos + BLK_SZ - 1) / BLK_SZ);
+}
+
+// write the buffers of an iovec in one pass over the file's blocks, growing
+// the file once at the end, and return the number of bytes written; with an
+// append_position the write goes to the end of the file, found under the
+// lock so concurrent appends never overlap, and is refused rather than cut
+// short at MAX_FILE_SIZE or when the ramdisk runs out of space
+static int ramdisk_write_vector(int index_node_number, int pos, const struct iovec *iov, int iov_count, int *append_position)
+{
+  int i = 0;
+  int result = 0;
+  int is_exclusive = 0;
+  int num_bytes = 0;
+  int data_length_written = 0;
+  int data_length_to_write_once = 0;
+  int remainder_space_in_block = 0;
+  int remainder_data_length_to_write = 0;
+  char *dst = NULL;
+  char *src = NULL;
+  index_node_t *index_node = NULL;
+  file_position_t file_position;
+  range_t range;
+
+  // type of index node is directory file
+  if ((index_node_number < 0) || (index_node_number > MAX_INDEX_NODES_COUNT) || (pos < 0))
+  {
+    return -1;
+  }
+  index_node = ramdisk_get_index_node(index_node_number);
+  if ((0 != strcmp("reg", index_node->type)) || (index_node->flags & INDEX_NODE_FLAG_SNAPSHOT))
+  {
+    return -1;
+  }
+  for (i = 0; i < iov_count; i++)
+  {
+    num_bytes = num_bytes + iov[i].iov_len;
+  }
+  // an append has to find the end of the file and fill it before anyone
+  // else can, other writes only lock the range they write
+  is_exclusive = (NULL != append_position);
+  down_read(&ramdisk_io_lock);
+  if (is_exclusive)
+  {
+    down_write(&ramdisk_index_node_lock[index_node_number]);
+  }
+  else
+  {
+    down_read(&ramdisk_index_node_lock[index_node_number]);
+  }
+  // the file may have been closed and removed before the lock was ours
+  if ((0 != strcmp("reg", index_node->type)) || (0 == index_node->open_counter))
+  {
+    ramdisk_write_unlock(index_node_number, is_exclusive);
+    return -1;
+  }
+  ramdisk_access_time[index_node_number] = sched_clock();
+  if (NULL != append_position)
+  {
+    pos = index_node->size;
+    if (num_bytes > MAX_FILE_SIZE - pos)
+    {
+      ramdisk_write_unlock(index_node_number, is_exclusive);
+      return -1;
+    }
+    *append_position = pos;
+  }
+  // check if we are trying to write too much
+  num_bytes = min(num_bytes, MAX_FILE_SIZE - pos);
+  // a packed tail or a compressed file is rebuilt before it can change,
+  // which takes the file to itself for a moment; look again after taking
+  // the shared lock back, another writer may have closed and packed it
+  while ((0 == result) && (num_bytes > 0) && (index_node->flags & (INDEX_NODE_FLAG_TAIL | INDEX_NODE_FLAG_COMPRESSED)))
+  {
+    if (!is_exclusive)
+    {
+      up_read(&ramdisk_index_node_lock[index_node_number]);
+      down_write(&ramdisk_index_node_lock[index_node_number]);
+    }
+    result = ramdisk_write_prepare(index_node);
+    if (!is_exclusive)
+    {
+      up_write(&ramdisk_index_node_lock[index_node_number]);
+      down_read(&ramdisk_index_node_lock[index_node_number]);
+    }
+  }
+  if (0 != result)
+  {
+    ramdisk_write_unlock(index_node_number, is_exclusive);
+    return -1;
+  }
+  if (num_bytes > 0)
+  {
+    ramdisk_range_lock_io(index_node_number, &range, pos, pos + num_bytes, 1);
+    ramdisk_file_position_init(&file_position, index_node, pos, 0);
+  }
+  down_read(&ramdisk_map_lock[index_node_number]);
+
+  // each buffer picks up where the last one left the block iterator
+  for (i = 0; (i < iov_count) && (data_length_written < num_bytes); i++)
+  {
+    src = iov[i].iov_base;
+    remainder_data_length_to_write = min((int)iov[i].iov_len, num_bytes - data_length_written);
+    while (remainder_data_length_to_write > 0)
+    {
+      dst = ramdisk_write_get_memory_address(index_node_number, &file_position, &remainder_space_in_block);
+      if (NULL == dst)
+      {
+        break;
+      }
+
+      data_length_to_write_once = min(remainder_space_in_block, remainder_data_length_to_write);
+
+      copy_from_user(dst, src, data_length_to_write_once);
+      data_length_written = data_length_written + data_length_to_write_once;
+      src = src + data_length_to_write_once;
+      remainder_data_length_to_write = remainder_data_length_to_write - data_length_to_write_once;
+      if (data_length_written < num_bytes)
+      {
+        ramdisk_file_position_add(&file_position, data_length_to_write_once);
+      }
+    }
+    // out of space
+    if (remainder_data_length_to_write > 0)
+    {
+      break;
+    }
+  }
+  up_read(&ramdisk_map_lock[index_node_number]);
+  down_write(&ramdisk_map_lock[index_node_number]);
+  if ((NULL != append_position) && (data_length_written < num_bytes))
+  {
+    ramdisk_append_undo(index_node, pos, data_length_written);
+    data_length_written = -1;
+  }
+  else
+  {
+    index_node->size = (pos + data_length_written > index_node->size) ? (pos + data_length_written) : index_node->size;
+  }
+  up_write(&ramdisk_map_lock[index_node_number]);
+  if (num_bytes > 0)
+  {
+    ramdisk_range_unlock_io(index_node_number, &range);
+  }
+  ramdisk_write_unlock(index_node_number, is_exclusive);
+
+  return data_length_written;
+}
+
+// map the block of a block-mapped file at a file position to the shared
+// data block of another file, 0 when done and -1 when the caller should
+// copy the block instead; a hole stays a hole over a block never written
+static int ramdisk_reflink_block(file_position_t *src_position, file_position_t *dst_position)
+{
+  int *src_slot = NULL;
+  int *dst_slot = NULL;
+  int old_block = 0;
+
+  src_slot = ramdisk_block_pointer_get_slot(&src_position->block_pointer);
+  dst_slot = ramdisk_block_pointer_get_slot(&dst_position->block_pointer);
+  if (NULL == dst_slot)
+  {
+    return -1;
+  }
+  if ((NULL == src_slot) || (*src_slot <= 0))
+  {
+    return (*dst_slot <= 0) ? 0 : -1;
+  }
+  if (*dst_slot == *src_slot)
+  {
+    return 0;
+  }
+  if (0 != ramdisk_block_share(*src_slot))
+  {
+    return -1;
+  }
+  old_block = *dst_slot;
+  *dst_slot = *src_slot;
+  if (old_block > 0)
+  {
+    ramdisk_block_free(old_block);
+  }
+
+  return 0;
+}
+
+// copy num_bytes from one regular file to another without leaving the
+// kernel and return the number of bytes copied; with COPY_RANGE_REFLINK,
+// whole blocks of block-mapped files are shared instead of copied, and
+// whichever file writes to a shared block first gets its own copy. A whole
+// compressed file copied into an empty one stays compressed
+int ramdisk_copy_range(int src_index_node_number, int src_pos, int dst_index_node_number, int dst_pos, int num_bytes, int flags)
+{
+  int data_length_copied = 0;
+  int data_length_to_copy_once = 0;
+  int remainder_data_length_to_copy = 0;
+  int result = 0;
+  int is_clone = 0;
+  int stream_length = 0;
+  char *dst = NULL;
+  char *src = NULL;
+  index_node_t *src_index_node = NULL;
+  index_node_t *dst_index_node = NULL;
+  file_position_t src_position;
+  file_position_t dst_position;
+
+  if ((src_index_node_number < 0) || (src_index_node_number > MAX_INDEX_NODES_COUNT)
+      || (dst_index_node_number < 0) || (dst_index_node_number > MAX_INDEX_NODES_COUNT)
+      || (src_pos < 0) || (dst_pos < 0) || (num_bytes < 0))
+  {
+    return -1;
+  }
+  src_index_node = ramdisk_get_index_node(src_index_node_number);
+  dst_index_node = ramdisk_get_index_node(dst_index_node_number);
+  if ((0 != strcmp("reg", src_index_node->type)) || (0 != strcmp("reg", dst_index_node->type))
+      || (dst_index_node->flags & INDEX_NODE_FLAG_SNAPSHOT))
+  {
+    return -1;
+  }
+  // a range copied onto itself would read bytes it has already overwritten
+  if ((src_index_node_number == dst_index_node_number) && (src_pos < dst_pos + num_bytes) && (dst_pos < src_pos + num_bytes))
+  {
+    return -1;
+  }
+  // the source is held exclusively too: a reflink shares its blocks, and a
+  // write already past its map lookup would land in the copy as well. Lock
+  // in index node order so two copies in opposite directions can not deadlock
+  if (src_index_node_number < dst_index_node_number)
+  {
+    down_write(&ramdisk_index_node_lock[src_index_node_number]);
+    down_write_nested(&ramdisk_index_node_lock[dst_index_node_number], SINGLE_DEPTH_NESTING);
+  }
+  else
+  {
+    down_write(&ramdisk_index_node_lock[dst_index_node_number]);
+    if (src_index_node_number > dst_index_node_number)
+    {
+      down_write_nested(&ramdisk_index_node_lock[src_index_node_number], SINGLE_DEPTH_NESTING);
+    }
+  }
+  num_bytes = max(0, min(num_bytes, src_index_node->size - src_pos));
+  num_bytes = max(0, min(num_bytes, MAX_FILE_SIZE - dst_pos));
+  // a packed tail moves back to a block of its own before it can change
+  if ((num_bytes > 0) && (dst_index_node->flags & INDEX_NODE_FLAG_TAIL) && (0 != ramdisk_tail_unpack(dst_index_node)))
+  {
+    num_bytes = 0;
+    result = -1;
+  }
+  // the stream of a compressed file copied whole is copied as it is,
+  // otherwise the source is read a decompressed unit at a time and a
+  // compressed destination goes back to plain blocks first
+  is_clone = (src_index_node->flags & INDEX_NODE_FLAG_COMPRESSED) && (src_index_node_number != dst_index_node_number)
+    && (0 == src_pos) && (0 == dst_pos) && (num_bytes == src_index_node->size) && (0 == dst_index_node->size);
+  if (is_clone)
+  {
+    stream_length = ramdisk_compressed_stream_length(src_index_node);
+  }
+  else if ((num_bytes > 0) && (dst_index_node->flags & INDEX_NODE_FLAG_COMPRESSED) && (0 != ramdisk_expand_index_node(dst_index_node)))
+  {
+    num_bytes = 0;
+    result = -1;
+  }
+  if (stream_length < 0)
+  {
+    num_bytes = 0;
+    result = -1;
+  }
+  // extent-mapped files own their extents whole, so they are always copied
+  if ((src_index_node->flags | dst_index_node->flags) & INDEX_NODE_FLAG_EXTENTS)
+  {
+    flags = flags & ~COPY_RANGE_REFLINK;
+  }
+  if (num_bytes > 0)
+  {
+    ramdisk_file_position_init(&src_position, src_index_node, src_pos, 1);
+    ramdisk_file_position_init(&dst_position, dst_index_node, dst_pos, 0);
+  }
+  remainder_data_length_to_copy = is_clone ? stream_length : num_bytes;
+
+  while (remainder_data_length_to_copy > 0)
+  {
+    if ((src_index_node->flags & INDEX_NODE_FLAG_COMPRESSED) && !is_clone)
+    {
+      dst = ramdisk_get_memory_address(&dst_position);
+      if (NULL == dst)
+      {
+        break;
+      }
+      data_length_to_copy_once = min(ramdisk_get_contiguous_length(&dst_position), remainder_data_length_to_copy);
+      if (data_length_to_copy_once != ramdisk_compressed_read(src_index_node, src_pos + data_length_copied, dst, data_length_to_copy_once, 0))
+      {
+        result = -1;
+        break;
+      }
+    }
+    // a block the range covers whole, outside a packed tail, can be shared
+    else if ((flags & COPY_RANGE_REFLINK) && (0 == src_position.data_offset_in_block) && (0 == dst_position.data_offset_in_block)
+        && (remainder_data_length_to_copy >= BLK_SZ) && (0 == ramdisk_reflink_block(&src_position, &dst_position)))
+    {
+      data_length_to_copy_once = BLK_SZ;
+    }
+    else
+    {
+      dst = ramdisk_get_memory_address(&dst_position);
+      if (NULL == dst)
+      {
+        break;
+      }
+      data_length_to_copy_once = min(ramdisk_get_contiguous_length(&dst_position), remainder_data_length_to_copy);
+      src = ramdisk_get_memory_address(&src_position);
+      if (NULL == src)
+      {
+        // a hole reads as zeros
+        data_length_to_copy_once = min(data_length_to_copy_once, BLK_SZ - src_position.data_offset_in_block);
+        memset(dst, 0, data_length_to_copy_once);
+      }
+      else
+      {
+        data_length_to_copy_once = min(data_length_to_copy_once, ramdisk_get_contiguous_length(&src_position));
+        memcpy(dst, src, data_length_to_copy_once);
+      }
+    }
+    data_length_copied = data_length_copied + data_length_to_copy_once;
+    remainder_data_length_to_copy = remainder_data_length_to_copy - data_length_to_copy_once;
+    if (remainder_data_length_to_copy > 0)
+    {
+      ramdisk_file_position_add(&src_position, data_length_to_copy_once);
+      ramdisk_file_position_add(&dst_position, data_length_to_copy_once);
+    }
+  }
+  if (is_clone && (data_length_copied == stream_length))
+  {
+    dst_index_node->flags = dst_index_node->flags | INDEX_NODE_FLAG_COMPRESSED;
+    dst_index_node->size = src_index_node->size;
+    data_length_copied = num_bytes;
+  }
+  // a stream copied in part is no file at all
+  else if (is_clone)
+  {
+    ramdisk_truncate_blocks(dst_index_node, 0);
+    data_length_copied = 0;
+    result = -1;
+  }
+  else if ((data_length_copied > 0) && (dst_pos + data_length_copied > dst_index_node->size))
+  {
+    dst_index_node->size = dst_pos + data_length_copied;
+  }
+  if (src_index_node_number != dst_index_node_number)
+  {
+    up_write(&ramdisk_index_node_lock[src_index_node_number]);
+  }
+  up_write(&ramdisk_index_node_lock[dst_index_node_number]);
+
+  return (0 != result) ? -1 : data_length_copied;
+}
+
+// seek to a position in a file
+int ramdisk_lseek(int index_node_number, int seek_offset, int *seek_result_offset)
+{
+  index_node_t *index_node = NULL;
+
+  // can not seek directory file
+  index_node = ramdisk_get_index_node(index_node_number);
+  if (0 != strcmp("reg", index_node->type))
+  {
+    return -1;
+  }
+  if (seek_offset < 0)
+  {
+    *seek_result_offset = 0;
+  }
+  // check if we are trying to seek too much and return end of file
+  else if (seek_offset > index_node->size)
+  {
+    *seek_result_offset = index_node->size;
+  }
+  // return the seek offset
+  else
+  {
+    *seek_result_offset = seek_offset;
+  }
+
+  return 0;
+}
+
+// read directory file and store in address
+// B-tree directories are read in name order and continue after the name
+// of the entry in address, which has to be the one the previous call
+// returned whenever *pos is not 0, so entries added or removed meanwhile
+// never make a reader skip or repeat the others
+int ramdisk_readdir(int index_node_number, char *address, int *pos)
+{
+  char after[MAX_FILENAME_LENGTH + 1];
+  dir_entry_t *entry = NULL;
+  index_node_t *index_node = NULL;
+  file_position_t file_position;
+
+  index_node = ramdisk_get_index_node(index_node_number);
+  if (0 != strcmp("dir", index_node->type))
+  {
+    return -1;
+  }
+  if (index_node->flags & INDEX_NODE_FLAG_DIR_BTREE)
+  {
+    after[0] = '\0';
+    if (0 != *pos)
+    {
+      strncpy(after, ((dir_entry_t *)address)->filename, MAX_FILENAME_LENGTH);
+      after[MAX_FILENAME_LENGTH] = '\0';
+    }
+    entry = ramdisk_dir_btree_next_entry(index_node, after);
+    if (NULL == entry)
+    {
+      return 0;
+    }
+    memcpy(address, entry, sizeof(dir_entry_t));
+    *pos = *pos + sizeof(dir_entry_t);
+    return 1;
+  }
+  /* Init the file position data structure. */
+  ramdisk_file_position_init(&file_position, index_node, *pos, 1);
+  while (file_position.file_position < index_node->size)
+  {
+    entry = (dir_entry_t *)ramdisk_get_memory_address(&file_position);
+    if (NULL == entry)
+    {
+      break;
+    }
+    ramdisk_file_position_add(&file_position, sizeof(dir_entry_t));
+
+    if (0 != strcmp(entry->filename, ""))
+    {
+      memcpy(address, entry, sizeof(dir_entry_t));
+      *pos = file_position.file_position;
+      return 1;
+    }
+  }
+
+  *pos = file_position.file_position;
+  return 0;
+}
+
+// check if a name falls in the range listed by ramdisk_readdir_range
+static int ramdisk_dir_name_in_range(const char *name, const char *after, const char *before, const char *prefix)
+{
+  if (('\0' == name[0]) || (strcmp(name, after) <= 0))
+  {
+    return 0;
+  }
+  if (('\0' != before[0]) && (strcmp(name, before) >= 0))
+  {
+    return 0;
+  }
+
+  return (0 == strncmp(name, prefix, strlen(prefix)));
+}
+
+// copy the directory entries named after "after", before "before" and
+// starting with "prefix" to address in name order, returns the entry count
+int ramdisk_readdir_range(int index_node_number, const char *after, const char *before, const char *prefix, char *address, int max_entry_count)
+{
+  int i = 0;
+  int slot = 0;
+  int entry_count = 0;
+  char last[14];
+  const char *start = NULL;
+  index_node_t *index_node = NULL;
+  dir_entry_t *entry = NULL;
+  dir_entry_t *best_entry = NULL;
+  dir_btree_leaf_t *leaf = NULL;
+
+  index_node = ramdisk_get_index_node(index_node_number);
+  if ((0 != strcmp("dir", index_node->type)) || (max_entry_count < 0))
+  {
+    return -1;
+  }
+
+  // walk the leaf chain from the first leaf that can hold a match
+  if (index_node->flags & INDEX_NODE_FLAG_DIR_BTREE)
+  {
+    start = (strcmp(prefix, after) > 0) ? prefix : after;
+    leaf = ramdisk_dir_btree_find_leaf(index_node, start, NULL);
+    while (entry_count < max_entry_count)
+    {
+      for (i = 0; (i < leaf->header.count) && (entry_count < max_entry_count); i++)
+      {
+        entry = &leaf->entries[i];
+        if (ramdisk_dir_name_in_range(entry->filename, after, before, prefix))
+        {
+          copy_to_user(address + entry_count * sizeof(dir_entry_t), entry, sizeof(dir_entry_t));
+          entry_count++;
+        }
+        // names are sorted, nothing further can match
+        else if ((strcmp(entry->filename, start) > 0) &&
+                 ((0 < strncmp(entry->filename, prefix, strlen(prefix))) ||
+                  (('\0' != before[0]) && (strcmp(entry->filename, before) >= 0))))
+        {
+          return entry_count;
+        }
+      }
+      if (0 == leaf->header.link)
+      {
+        break;
+      }
+      leaf = (dir_btree_leaf_t *)ramdisk_get_block_memory_address(leaf->header.link);
+    }
+    return entry_count;
+  }
+
+  // flat directories are small, pick the next name in order on each pass
+  strncpy(last, after, sizeof(last));
+  last[sizeof(last) - 1] = '\0';
+  while (entry_count < max_entry_count)
+  {
+    best_entry = NULL;
+    for (slot = 0; slot < index_node->size / (int)sizeof(dir_entry_t); slot++)
+    {
+      entry = ramdisk_get_dir_slot(index_node, slot);
+      if (!ramdisk_dir_name_in_range(entry->filename, last, before, prefix))
+      {
+        continue;
+      }
+      if ((NULL == best_entry) || (strcmp(entry->filename, best_entry->filename) < 0))
+      {
+        best_entry = entry;
+      }
+    }
+    if (NULL == best_entry)
+    {
+      break;
+    }
+    copy_to_user(address + entry_count * sizeof(dir_entry_t), best_entry, sizeof(dir_entry_t));
+    strcpy(last, best_entry->filename);
+    entry_count++;
+  }
+
+  return entry_count;
+}
+
+// a directory being listed by a tree walk
+typedef struct tree_walk_frame_struct
+{
+  int index_node_number;
+  // readdir position of the next entry
+  int position;
+  // the entry the directory's last readdir returned, where the next continues
+  dir_entry_t entry;
+  // length of the directory's path relative to the walked directory
+  int path_length;
+} tree_walk_frame_t;
+
+// pre-order walk of the tree below a directory, one readdir position per level
+typedef struct tree_walk_struct
+{
+  int depth;
+  // path of the last entry returned relative to the walked directory, only
+  // valid when path_length is below WALK_PATH_LENGTH
+  char path[WALK_PATH_LENGTH];
+  int path_length;
+  int parent_index_node_number;
+  tree_walk_frame_t frames[MAX_INDEX_NODES_COUNT + 1];
+} tree_walk_t;
+
+// a file or directory listed for removal by ramdisk_rmtree
+typedef struct rmtree_entry_struct
+{
+  int parent_index_node_number;
+  int index_node_number;
+  char filename[14];
+} rmtree_entry_t;
+
+static void ramdisk_tree_walk_init(tree_walk_t *walk, int index_node_number)
+{
+  walk->depth = 1;
+  walk->path[0] = '\0';
+  walk->path_length = 0;
+  walk->parent_index_node_number = 0;
+  walk->frames[0].index_node_number = index_node_number;
+  walk->frames[0].position = 0;
+  walk->frames[0].path_length = 0;
+}
+
+// step a tree walk to the next entry and descend into it when it is a
+// directory, 1 with the entry copied to entry, 0 once the tree is done;
+// the tree must not change during the walk
+static int ramdisk_tree_walk_next(tree_walk_t *walk, dir_entry_t *entry)
+{
+  tree_walk_frame_t *frame = NULL;
+  index_node_t *index_node = NULL;
+
+  while (walk->depth > 0)
+  {
+    frame = &walk->frames[walk->depth - 1];
+    if (1 != ramdisk_readdir(frame->index_node_number, (char *)&frame->entry, &frame->position))
+    {
+      walk->depth--;
+      continue;
+    }
+    memcpy(entry, &frame->entry, sizeof(dir_entry_t));
+    walk->parent_index_node_number = frame->index_node_number;
+    walk->path_length = frame->path_length + 1 + strlen(entry->filename);
+    if (walk->path_length < WALK_PATH_LENGTH)
+    {
+      walk->path[frame->path_length] = '/';
+      strcpy(&walk->path[frame->path_length + 1], entry->filename);
+    }
+    index_node = ramdisk_get_index_node(entry->index_node_number);
+    if ((0 == strcmp("dir", index_node->type)) && (walk->depth <= MAX_INDEX_NODES_COUNT))
+    {
+      walk->frames[walk->depth].index_node_number = entry->index_node_number;
+      walk->frames[walk->depth].position = 0;
+      walk->frames[walk->depth].path_length = walk->path_length;
+      walk->depth++;
+    }
+    return 1;
+  }
+
+  return 0;
+}
+
+// remove a directory and everything below it, or everything below the
+// root, in one pass over the index nodes; nothing is removed when a file
+// in the tree is open. Returns the number of files and directories removed
+int ramdisk_rmtree(char *pathname)
+{
+  int i = 0;
+  int count = 0;
+  int result = 0;
+  int index_node_number = 0;
+  index_node_t *index_node = NULL;
+  dir_entry_t entry;
+  tree_walk_t *walk = NULL;
+  rmtree_entry_t *entries = NULL;
+
+  // a snapshot goes as a whole or not at all
+  if (ramdisk_snapshot_path_depth(pathname) > 2)
+  {
+    return -1;
+  }
+  index_node_number = ramdisk_lookup_index_node(pathname);
+  if (index_node_number < 0)
+  {
+    return -1;
+  }
+  index_node = ramdisk_get_index_node(index_node_number);
+  if (0 != strcmp("dir", index_node->type))
+  {
+    return (0 == ramdisk_unlink(pathname)) ? 1 : -1;
+  }
+  if ((index_node_number > 0) && (index_node->open_counter > 0))
+  {
+    return -1;
+  }
+
+  walk = (tree_walk_t *)vmalloc(sizeof(tree_walk_t));
+  entries = (rmtree_entry_t *)vmalloc(sizeof(rmtree_entry_t) * MAX_INDEX_NODES_COUNT);
+  if ((NULL == walk) || (NULL == entries))
+  {
+    result = -1;
+  }
+  else
+  {
+    // list the whole tree first so an open file stops the removal before anything is gone
+    ramdisk_tree_walk_init(walk, index_node_number);
+    while (1 == ramdisk_tree_walk_next(walk, &entry))
+    {
+      if ((MAX_INDEX_NODES_COUNT == count) || (ramdisk_get_index_node(entry.index_node_number)->open_counter > 0))
+      {
+        result = -1;
+        break;
+      }
+      entries[count].parent_index_node_number = walk->parent_index_node_number;
+      entries[count].index_node_number = entry.index_node_number;
+      strcpy(entries[count].filename, entry.filename);
+      count++;
+    }
+  }
+
+  if (0 == result)
+  {
+    // a directory comes before everything below it in the walk, so going
+    // backwards empties each directory before it is removed
+    for (i = count - 1; i >= 0; i--)
+    {
+      ramdisk_remove_index_node(ramdisk_get_index_node(entries[i].parent_index_node_number),
+        entries[i].filename,
+        ramdisk_get_index_node(entries[i].index_node_number));
+    }
+    result = count;
+    if ((index_node_number > 0) && (ramdisk_unlink_index_node(pathname) > 0))
+    {
+      result++;
+    }
+  }
+  if (NULL != walk)
+  {
+    vfree(walk);
+  }
+  if (NULL != entries)
+  {
+    vfree(entries);
+  }
+
+  return result;
+}
+
+// copy a (path, index node, type, size) record for everything below a
+// directory to address in pre-order, skipping the first start_index, so a
+// caller with a small buffer can continue where the last call stopped;
+// returns the number of records copied, -1 when pathname is not a
+// directory, a path is too long for a record or address is not writable
+int ramdisk_walk(char *pathname, int start_index, char *address, int max_record_count)
+{
+  int index = 0;
+  int record_count = 0;
+  int index_node_number = 0;
+  index_node_t *index_node = NULL;
+  dir_entry_t entry;
+  walk_record_t record;
+  tree_walk_t *walk = NULL;
+
+  index_node_number = ramdisk_lookup_index_node(pathname);
+  if ((index_node_number < 0) || (start_index < 0) || (max_record_count < 0))
+  {
+    return -1;
+  }
+  if (0 != strcmp("dir", ramdisk_get_index_node(index_node_number)->type))
+  {
+    return -1;
+  }
+  walk = (tree_walk_t *)vmalloc(sizeof(tree_walk_t));
+  if (NULL == walk)
+  {
+    return -1;
+  }
+
+  ramdisk_tree_walk_init(walk, index_node_number);
+  while ((record_count < max_record_count) && (1 == ramdisk_tree_walk_next(walk, &entry)))
+  {
+    index++;
+    if (index <= start_index)
+    {
+      continue;
+    }
+    if (walk->path_length >= WALK_PATH_LENGTH)
+    {
+      record_count = -1;
+      break;
+    }
+    index_node = ramdisk_get_index_node(entry.index_node_number);
+    memset(&record, 0, sizeof(walk_record_t));
+    strcpy(record.path, walk->path);
+    record.index_node_number = entry.index_node_number;
+    memcpy(record.type, index_node->type, sizeof(record.type));
+    record.size = index_node->size;
+    if (0 != copy_to_user(address + record_count * sizeof(walk_record_t), &record, sizeof(walk_record_t)))
+    {
+      record_count = -1;
+      break;
+    }
+    record_count++;
+  }
+  vfree(walk);
+
+  return record_count;
+}
+
+// freeze everything below the root as /.snapshot/<name>: each directory
+// and file gets a copy of its own, and the copies of regular files share
+// every whole block with the originals, so the work follows the number of
+// files and block pointers rather than the data; whichever side writes to
+// a shared block later gets its own copy. Earlier snapshots are left out.
+// A snapshot can only be read; drop it with ramdisk_rmtree, which frees
+// large files in the background. Returns the number of files and
+// directories in the snapshot
+static int ramdisk_snapshot_tree(char *name)
+{
+  int count = 0;
+  int result = 0;
+  int size = 0;
+  int snapshot_directory_index_node_number = 0;
+  int snapshot_index_node_number = -1;
+  int copy_index_node_number = 0;
+  char pathname[1 + sizeof(SNAPSHOT_DIRECTORY_NAME) + MAX_FILENAME_LENGTH + 1];
+  index_node_t *index_node = NULL;
+  index_node_t *snapshot_directory_index_node = NULL;
+  index_node_t *copy_index_node = NULL;
+  dir_entry_t entry;
+  tree_walk_t *walk = NULL;
+  // index node number of the copy of each index node in the tree
+  short *copies = NULL;
+
+  if ((0 == strlen(name)) || (strlen(name) > MAX_FILENAME_LENGTH) || (NULL != strchr(name, '/')))
+  {
+    return -1;
+  }
+  snapshot_directory_index_node_number = ramdisk_lookup_index_node("/" SNAPSHOT_DIRECTORY_NAME);
+  if (snapshot_directory_index_node_number < 0)
+  {
+    snapshot_directory_index_node_number = ramdisk_create_index_node("/" SNAPSHOT_DIRECTORY_NAME, "dir");
+    if (snapshot_directory_index_node_number < 0)
+    {
+      return -1;
+    }
+  }
+  snapshot_directory_index_node = ramdisk_get_index_node(snapshot_directory_index_node_number);
+  if ((0 != strcmp("dir", snapshot_directory_index_node->type))
+      || (NULL != ramdisk_get_dir_entry(snapshot_directory_index_node, name, NULL)))
+  {
+    return -1;
+  }
+
+  walk = (tree_walk_t *)vmalloc(sizeof(tree_walk_t));
+  copies = (short *)vmalloc(sizeof(short) * (MAX_INDEX_NODES_COUNT + 1));
+  if ((NULL == walk) || (NULL == copies))
+  {
+    result = -1;
+  }
+  else
+  {
+    snapshot_index_node_number = ramdisk_add_index_node(snapshot_directory_index_node, name, "dir");
+    copies[0] = snapshot_index_node_number;
+    result = (snapshot_index_node_number < 0) ? -1 : 0;
+  }
+
+  if (0 == result)
+  {
+    // the copies only go below the snapshot directory, which the walk skips
+    ramdisk_tree_walk_init(walk, 0);
+    while (1 == ramdisk_tree_walk_next(walk, &entry))
+    {
+      if (entry.index_node_number == snapshot_directory_index_node_number)
+      {
+        walk->depth--;
+        continue;
+      }
+      index_node = ramdisk_get_index_node(entry.index_node_number);
+      copy_index_node_number = ramdisk_add_index_node(ramdisk_get_index_node(copies[walk->parent_index_node_number]), entry.filename, index_node->type);
+      if (copy_index_node_number < 0)
+      {
+        result = -1;
+        break;
+      }
+      copies[entry.index_node_number] = copy_index_node_number;
+      copy_index_node = ramdisk_get_index_node(copy_index_node_number);
+      count++;
+      if (0 == strcmp("reg", index_node->type))
+      {
+        size = index_node->size;
+        if (size != ramdisk_copy_range(entry.index_node_number, 0, copy_index_node_number, 0, size, COPY_RANGE_REFLINK))
+        {
+          result = -1;
+          break;
+        }
+        // nobody writes the copy, so its tail is packed now rather than on a close
+        if (ramdisk_tail_packing)
+        {
+          ramdisk_tail_pack(copy_index_node, copy_index_node_number);
+        }
+      }
+      // from here on the copy can not be written, renamed or removed on its own
+      copy_index_node->flags = copy_index_node->flags | INDEX_NODE_FLAG_SNAPSHOT;
+    }
+  }
+
+  // a snapshot is complete or not there at all
+  if ((0 != result) && (snapshot_index_node_number > 0))
+  {
+    sprintf(pathname, "/%s/%s", SNAPSHOT_DIRECTORY_NAME, name);
+    ramdisk_rmtree(pathname);
+  }
+  if (NULL != walk)
+  {
+    vfree(walk);
+  }
+  if (NULL != copies)
+  {
+    vfree(copies);
+  }
+
+  return (0 != result) ? -1 : count;
+}
+
+int ramdisk_snapshot(char *name)
+{
+  int result = 0;
+
+  // files are copied one after another, keep writes out so the snapshot
+  // shows every file as of the same moment
+  down_write(&ramdisk_io_lock);
+  result = ramdisk_snapshot_tree(name);
+  up_write(&ramdisk_io_lock);
+
+  return result;
+}
+
+// length of directory entry in bytes
+int ramdisk_get_dir_entry_length()
+{
+  return ((int)sizeof(dir_entry_t));
+}
+
+// return memory address of inode array
+index_node_t *ramdisk_get_index_node(int index_node_number)
+{
+  superblock_t *superblock = NULL;
+  index_node_t *index_node_array = NULL;
+
+  // if the inode is 0 then we are just at root directory
+  if (index_node_number <= 0)
+  {
+    superblock = (superblock_t *)ramdisk_memory;
+    return &superblock->first_block;
+  }
+
+  // if not then return the memory address of the inode
+  index_node_array = (index_node_t *)(ramdisk_memory + BLK_SZ);
+  return index_node_array + (index_node_number - 1);
+}
+
+// return memory address of a block, whose chunk is present while the
+// block is allocated
+char *ramdisk_get_block_memory_address(int block_pointer)
+{
+  if (block_pointer < METADATA_BLOCK_COUNT)
+  {
+    return (char *)(ramdisk_memory + (BLK_SZ * block_pointer));
+  }
+
+  return ramdisk_chunks[block_pointer >> ramdisk_chunk_block_shift] + BLK_SZ * (block_pointer & (RAMDISK_CHUNK_BLOCK_COUNT - 1));
+}
+
+// find free block and allocate it in bitmap, callers other than
+// ramdisk_init hold ramdisk_bitmap_lock
+int search_bitmap() {
+  int blockPointer = 0;
+  int byteIndex = 0;
+  int bitIndex = 0;
+  unsigned char bitMask = 0;
+  superblock_t *superblock = NULL;
+  unsigned char *blockBitmap = NULL;
+
+  // Pointers to superblock and block bitmap
+  superblock = (superblock_t *)ramdisk_memory;
+  blockBitmap = (ramdisk_memory + BLK_SZ * (1 + INDEX_NODE_ARRAY_BLOCK_COUNT));
+  // Loop through the block bitmap to find a free block, no byte before the hint has one
+  for (byteIndex = ramdisk_bitmap_hint; byteIndex < BLOCK_BITMAP_BLOCK_COUNT * BLK_SZ; byteIndex++) {
+    // skip bytes whose eight blocks are all allocated
+    if (0 == blockBitmap[byteIndex]) {
+      continue;
+    }
+    bitMask = 1;
+    for (bitIndex = 0; bitIndex < 8; bitIndex++) {
+      // Check if the bit indicates a free block
+      if ((blockBitmap[byteIndex] & bitMask) != 0) {
+        // Mark the block as allocated and update free block count
+        blockBitmap[byteIndex] = blockBitmap[byteIndex] - bitMask;
+        superblock->num_free_blocks--;
+        blockPointer = byteIndex * 8 + bitIndex;
+        ramdisk_bitmap_hint = byteIndex;
+        return blockPointer;
+      }
+      bitMask = bitMask << 1; // Shift the bit mask to check the next bit
+    }
+  }
+  ramdisk_bitmap_hint = byteIndex;
+  return -1;
+}
+
+// mark a block free in bitmap, callers hold ramdisk_bitmap_lock
+static void ramdisk_bitmap_free(int block_pointer)
+{
+  int index = 0;
+  int k = 0;
+  int mask = 0;
+  superblock_t *superblock = NULL;
+  unsigned char *block_bitmap = NULL;
+
+  superblock = (superblock_t *)ramdisk_memory;
+  block_bitmap = (ramdisk_memory + BLK_SZ * (1 + INDEX_NODE_ARRAY_BLOCK_COUNT));
+
+  k = block_pointer % 8;
+  index = block_pointer / 8;
+  mask = (1 << k);
+  // check bitmap
+  if (0 == (block_bitmap[index] & mask))
+  {
+    block_bitmap[index] = block_bitmap[index] | mask;
+    superblock->num_free_blocks++;
+    if (index < ramdisk_bitmap_hint)
+    {
+      ramdisk_bitmap_hint = index;
+    }
+  }
+}
+
+// move up to a batch of free blocks from the bitmap into a magazine, in
+// ascending order so consecutive allocations stay contiguous
+static void ramdisk_block_magazine_refill(block_magazine_t *magazine)
+{
+  int i = 0;
+  int block_pointer = 0;
+
+  spin_lock(&ramdisk_bitmap_lock);
+  for (i = 0; i < BLOCK_MAGAZINE_BATCH; i++)
+  {
+    block_pointer = ramdisk_region_alloc();
+    if (block_pointer <= 0)
+    {
+      break;
+    }
+    magazine->blocks[BLOCK_MAGAZINE_BATCH - 1 - i] = block_pointer;
+  }
+  spin_unlock(&ramdisk_bitmap_lock);
+
+  // close the gap left by a short batch
+  if (i < BLOCK_MAGAZINE_BATCH)
+  {
+    memmove(magazine->blocks, &magazine->blocks[BLOCK_MAGAZINE_BATCH - i], i * sizeof(int));
+  }
+  magazine->count = i;
+}
+
+// give the oldest batch of a full magazine back to the bitmap
+static void ramdisk_block_magazine_drain(block_magazine_t *magazine, int count)
+{
+  int i = 0;
+
+  spin_lock(&ramdisk_bitmap_lock);
+  for (i = 0; i < count; i++)
+  {
+    if (ramdisk_buddy_allocator)
+    {
+      ramdisk_buddy_free(magazine->blocks[i], 0);
+    }
+    else
+    {
+      ramdisk_bitmap_free(magazine->blocks[i]);
+    }
+  }
+  spin_unlock(&ramdisk_bitmap_lock);
+  memmove(magazine->blocks, &magazine->blocks[count], (magazine->count - count) * sizeof(int));
+  magazine->count = magazine->count - count;
+}
+
+// take a block from another CPU's magazine once the bitmap is exhausted
+static int ramdisk_block_steal(void)
+{
+  int cpu = 0;
+  int block_pointer = -1;
+  block_magazine_t *magazine = NULL;
+
+  for_each_possible_cpu(cpu)
+  {
+    magazine = &per_cpu(ramdisk_block_magazine, cpu);
+    spin_lock(&magazine->lock);
+    if (magazine->count > 0)
+    {
+      magazine->count--;
+      block_pointer = magazine->blocks[magazine->count];
+    }
+    spin_unlock(&magazine->lock);
+    if (block_pointer > 0)
+    {
+      break;
+    }
+  }
+
+  return block_pointer;
+}
+
+// put a free block in this CPU's magazine, it stays there until the
+// magazine overflows
+static void ramdisk_block_magazine_put(int block_pointer)
+{
+  block_magazine_t *magazine = NULL;
+
+  magazine = &get_cpu_var(ramdisk_block_magazine);
+  spin_lock(&magazine->lock);
+  if (BLOCK_MAGAZINE_SIZE == magazine->count)
+  {
+    ramdisk_block_magazine_drain(magazine, BLOCK_MAGAZINE_BATCH);
+  }
+  magazine->blocks[magazine->count] = block_pointer;
+  magazine->count++;
+  spin_unlock(&magazine->lock);
+  put_cpu_var(ramdisk_block_magazine);
+}
+
+// take a block from this CPU's magazine, refilling it from the bitmap, or
+// from another CPU's magazine when the bitmap is empty
+static int ramdisk_block_take(void)
+{
+  int block_pointer = -1;
+  block_magazine_t *magazine = NULL;
+
+  magazine = &get_cpu_var(ramdisk_block_magazine);
+  spin_lock(&magazine->lock);
+  if (0 == magazine->count)
+  {
+    ramdisk_block_magazine_refill(magazine);
+  }
+  if (magazine->count > 0)
+  {
+    magazine->count--;
+    block_pointer = magazine->blocks[magazine->count];
+  }
+  spin_unlock(&magazine->lock);
+  put_cpu_var(ramdisk_block_magazine);
+
+  if (block_pointer <= 0)
+  {
+    block_pointer = ramdisk_block_steal();
+  }
+
+  return block_pointer;
+}
+
+// allocate a free block
+int ramdisk_block_alloc()
+{
+  int block_pointer = -1;
+
+  block_pointer = ramdisk_block_take();
+  if (block_pointer <= 0)
+  {
+    // the last free blocks may still be being reclaimed or cleared; the
+    // workers can finish them between the failed try and the flush, so
+    // try again whatever the flush found
+    ramdisk_reclaim_flush();
+    block_pointer = ramdisk_block_take();
+  }
+  if ((block_pointer > 0) && (0 != ramdisk_chunk_get(block_pointer, 1)))
+  {
+    ramdisk_block_magazine_put(block_pointer);
+    block_pointer = -1;
+  }
+  trace_ramdisk_block_alloc(block_pointer, 0);
+
+  return block_pointer;
+}
+
+// allocate_free_block, blocks are cleared before they return to the
+// allocator so there is nothing left to zero here
+int ramdisk_block_calloc()
+{
+  return ramdisk_block_alloc();
+}
+
+// clear block_count blocks from block_pointer, a chunk at a time
+static void ramdisk_blocks_zero(int block_pointer, int block_count)
+{
+  int length = 0;
+
+  while (block_count > 0)
+  {
+    length = min(block_count, RAMDISK_CHUNK_BLOCK_COUNT - (block_pointer & (RAMDISK_CHUNK_BLOCK_COUNT - 1)));
+    memset(ramdisk_get_block_memory_address(block_pointer), 0, BLK_SZ * length);
+    block_pointer = block_pointer + length;
+    block_count = block_count - length;
+  }
+}
+
+// clear freed blocks and give them back to the allocator
+static void ramdisk_zero_release(int block_pointer, int order)
+{
+  ramdisk_blocks_zero(block_pointer, 1 << order);
+  ramdisk_chunk_put(block_pointer, 1 << order);
+  if (0 == order)
+  {
+    ramdisk_block_magazine_put(block_pointer);
+  }
+  else
+  {
+    spin_lock(&ramdisk_bitmap_lock);
+    ramdisk_buddy_free(block_pointer, order);
+    spin_unlock(&ramdisk_bitmap_lock);
+  }
+}
+
+// queue freed blocks for the worker, or clear them here when the queue is full
+static void ramdisk_zero_queue_add(int block_pointer, int order)
+{
+  spin_lock(&ramdisk_zero_lock);
+  if (ZERO_QUEUE_SIZE == ramdisk_zero_queue_count)
+  {
+    spin_unlock(&ramdisk_zero_lock);
+    ramdisk_zero_release(block_pointer, order);
+    return;
+  }
+  ramdisk_zero_queue[ramdisk_zero_queue_count].block_pointer = block_pointer;
+  ramdisk_zero_queue[ramdisk_zero_queue_count].order = order;
+  ramdisk_zero_queue_count++;
+  ramdisk_zero_block_count = ramdisk_zero_block_count + (1 << order);
+  // wake the worker once per batch, a short tail is cleared by the next
+  // batch or when the allocator runs dry
+  if (0 == ramdisk_zero_queue_count % ZERO_QUEUE_BATCH)
+  {
+    spin_unlock(&ramdisk_zero_lock);
+    schedule_work(&ramdisk_zero_work);
+    return;
+  }
+  spin_unlock(&ramdisk_zero_lock);
+}
+
+// clear and release up to a batch of queued blocks, returns the number of
+// requests taken from the queue
+static int ramdisk_zero_queue_run(void)
+{
+  zero_request_t batch[ZERO_QUEUE_BATCH];
+  int count = 0;
+  int block_count = 0;
+  int i = 0;
+
+  spin_lock(&ramdisk_zero_lock);
+  count = min(ramdisk_zero_queue_count, ZERO_QUEUE_BATCH);
+  ramdisk_zero_queue_count = ramdisk_zero_queue_count - count;
+  memcpy(batch, &ramdisk_zero_queue[ramdisk_zero_queue_count], count * sizeof(zero_request_t));
+  spin_unlock(&ramdisk_zero_lock);
+
+  for (i = 0; i < count; i++)
+  {
+    ramdisk_zero_release(batch[i].block_pointer, batch[i].order);
+    block_count = block_count + (1 << batch[i].order);
+  }
+  spin_lock(&ramdisk_zero_lock);
+  ramdisk_zero_block_count = ramdisk_zero_block_count - block_count;
+  spin_unlock(&ramdisk_zero_lock);
+
+  return count;
+}
+
+static void ramdisk_zero_worker(struct work_struct *work)
+{
+  while (ramdisk_zero_queue_run() > 0)
+  {
+  }
+}
+
+// clear everything still queued and wait for the worker's batch in flight,
+// so every block freed before the call is back with the allocator; may sleep
+static void ramdisk_zero_flush(void)
+{
+  while (ramdisk_zero_queue_run() > 0)
+  {
+  }
+  flush_work(&ramdisk_zero_work);
+}
+
+// whether another file also maps a block; read without the lock since a
+// count only rises from zero while the block's one owner is locked
+static int ramdisk_block_is_shared(int block_pointer)
+{
+  return (NULL != ramdisk_block_refcount) && (0 != ramdisk_block_refcount[block_pointer]);
+}
+
+// add an owner to a data block for a reflink, -1 when the count table can
+// not be allocated or the count is saturated and the block must be copied
+static int ramdisk_block_share(int block_pointer)
+{
+  int result = 0;
+  unsigned short *refcount = NULL;
+
+  if (NULL == ramdisk_block_refcount)
+  {
+    refcount = (unsigned short *)vzalloc(sizeof(unsigned short) * TOTAL_BLOCK_COUNT);
+    if (NULL == refcount)
+    {
+      return -1;
+    }
+  }
+  spin_lock(&ramdisk_refcount_lock);
+  if (NULL == ramdisk_block_refcount)
+  {
+    ramdisk_block_refcount = refcount;
+    refcount = NULL;
+  }
+  if (BLOCK_REFCOUNT_MAX == ramdisk_block_refcount[block_pointer])
+  {
+    result = -1;
+  }
+  else
+  {
+    ramdisk_block_refcount[block_pointer]++;
+  }
+  spin_unlock(&ramdisk_refcount_lock);
+  // another reflink installed its table first
+  if (NULL != refcount)
+  {
+    vfree(refcount);
+  }
+
+  return result;
+}
+
+// drop one owner of a block, 1 while other files still map it and it must
+// not be freed
+static int ramdisk_block_unshare(int block_pointer)
+{
+  int shared = 0;
+
+  if (NULL == ramdisk_block_refcount)
+  {
+    return 0;
+  }
+  spin_lock(&ramdisk_refcount_lock);
+  if (0 != ramdisk_block_refcount[block_pointer])
+  {
+    ramdisk_block_refcount[block_pointer]--;
+    shared = 1;
+  }
+  spin_unlock(&ramdisk_refcount_lock);
+
+  return shared;
+}
+
+// allocate block to free status, it is cleared in the background and then
+// stays in a CPU's magazine until the magazine overflows; a block other
+// files still map only loses an owner
+void ramdisk_block_free(int block_pointer)
+{
+  if (ramdisk_block_unshare(block_pointer))
+  {
+    return;
+  }
+  trace_ramdisk_block_free(block_pointer, 0);
+  ramdisk_zero_queue_add(block_pointer, 0);
+}
+
+// return every block held in magazines or waiting to be reclaimed to the
+// bitmap so num_free_blocks and the bitmap describe all free space
+void ramdisk_drain_block_magazines()
+{
+  int cpu = 0;
+  block_magazine_t *magazine = NULL;
+
+  ramdisk_reclaim_flush();
+  for_each_possible_cpu(cpu)
+  {
+    magazine = &per_cpu(ramdisk_block_magazine, cpu);
+    spin_lock(&magazine->lock);
+    ramdisk_block_magazine_drain(magazine, magazine->count);
+    spin_unlock(&magazine->lock);
+  }
+}
+
+// approximate number of free blocks, read without locks
+int ramdisk_get_free_block_count()
+{
+  int cpu = 0;
+  int free_block_count = 0;
+  superblock_t *superblock = NULL;
+
+  superblock = (superblock_t *)ramdisk_memory;
+  free_block_count = superblock->num_free_blocks + ramdisk_zero_block_count + ramdisk_reclaim_block_count;
+  for_each_possible_cpu(cpu)
+  {
+    free_block_count = free_block_count + per_cpu(ramdisk_block_magazine, cpu).count;
+  }
+
+  return free_block_count;
+}
+
+// find directory index node
+index_node_t *ramdisk_get_directory_index_node(const char *pathname)
+{
+  index_node_t *index_node = NULL;
+  const char *filename_start = NULL;
+  const char *filename_end = NULL;
+  dir_entry_t *entry = NULL;
+
+  index_node = &((superblock_t *)ramdisk_memory)->first_block;
+  filename_start = pathname;
+  // omit first '/'
+  if ('/' == filename_start[0])
+  {
+    filename_start = filename_start + 1;
+  }
+  while (1)
+  {
+    // cycle through path name to make sure each directory exists in specified
+    filename_end = find_next_directory(filename_start);
+    if (NULL == filename_end)
+    {
+      break;
+    }
+    // find the parent path checking each directory down file path
+    entry = ramdisk_get_dir_entry(index_node, filename_start, filename_end);
+    if (NULL == entry)
+    {
+      return NULL;
+    }
+    
+    // keep traversing down path of directory
+    index_node = ramdisk_get_index_node(entry->index_node_number);
+    if (strcmp(index_node->type, "dir"))
+    {
+      return NULL;
+    }
+
+    filename_start = filename_end + 1;
+  }
+
+  return index_node;
+}
+
+// find child entry from parent directory
+dir_entry_t *ramdisk_get_dir_entry(index_node_t *index_node, const char *filename_start, const char *filename_end)
+{
+  int slot = 0;
+
+  if (index_node->flags & INDEX_NODE_FLAG_DIR_BTREE)
+  {
+    return ramdisk_dir_btree_lookup(index_node, filename_start, filename_end);
+  }
+  slot = ramdisk_find_dir_slot(index_node, filename_start, filename_end);
+  if (slot < 0)
+  {
+    return NULL;
+  }
+
+  return ramdisk_get_dir_slot(index_node, slot);
+}
+
+// find the slot index of a child entry in its parent directory, -1 if absent
+int ramdisk_find_dir_slot(index_node_t *index_node, const char *filename_start, const char *filename_end)
+{
+  dir_entry_t *entry = NULL;
+  file_position_t file_position;
+
+  ramdisk_file_position_init(&file_position, index_node, 0, 1);
+  
+  // scan through until we reach end
+  while (file_position.file_position < index_node->size)
+  {
+    // find memory block after we allocate it in the right file position
+    entry = (dir_entry_t *)ramdisk_get_memory_address(&file_position);
+    if (NULL == entry)
+    {
+      break;
+    }
+    ramdisk_file_position_add(&file_position, sizeof(dir_entry_t));
+    // tombstones never match
+    if ('\0' == entry->filename[0])
+    {
+      continue;
+    }
+    /* If we find a child directory entry whose name is the same as the specified name,
+       then return the found directory entry. */
+    if (0 == ramdisk_dir_name_compare(entry->filename, filename_start, filename_end))
+    {
+      return (file_position.file_position / sizeof(dir_entry_t)) - 1;
+    }
+  }
+
+  return -1;
+}
+
+// memory address of a directory slot
+dir_entry_t *ramdisk_get_dir_slot(index_node_t *index_node, int slot)
+{
+  file_position_t file_position;
+
+  if ((slot < 0) || ((slot * (int)sizeof(dir_entry_t)) >= index_node->size))
+  {
+    return NULL;
+  }
+  ramdisk_file_position_init(&file_position, index_node, slot * sizeof(dir_entry_t), 1);
+
+  return (dir_entry_t *)ramdisk_get_memory_address(&file_position);
+}
+
+// turn a directory slot into a tombstone and push it on the free slot list
+void ramdisk_release_dir_slot(index_node_t *index_node, int slot)
+{
+  dir_entry_t *entry = NULL;
+
+  entry = ramdisk_get_dir_slot(index_node, slot);
+  if (NULL == entry)
+  {
+    return;
+  }
+  memset(entry, 0, sizeof(dir_entry_t));
+  entry->index_node_number = index_node->free_dir_slot;
+  index_node->free_dir_slot = slot + 1;
+}
+
+// check if tombstones make up more than half of a large directory
+int ramdisk_dir_needs_compaction(index_node_t *index_node)
+{
+  int slot_count = 0;
+
+  if (0 != strcmp("dir", index_node->type))
+  {
+    return 0;
+  }
+  slot_count = index_node->size / sizeof(dir_entry_t);
+  if (slot_count < DIR_COMPACT_MIN_SLOT_COUNT)
+  {
+    return 0;
+  }
+
+  return (2 * (slot_count - index_node->dir_entry_count)) > slot_count;
+}
+
+// move live entries from the end of a directory into its tombstones, then
+// shrink the directory file and free the blocks past its new end
+void ramdisk_dir_compact(index_node_t *index_node)
+{
+  int front = 0;
+  int back = 0;
+  dir_entry_t *front_entry = NULL;
+  dir_entry_t *back_entry = NULL;
+
+  back = (index_node->size / sizeof(dir_entry_t)) - 1;
+  while (front < back)
+  {
+    front_entry = ramdisk_get_dir_slot(index_node, front);
+    if ('\0' != front_entry->filename[0])
+    {
+      front++;
+      continue;
+    }
+    back_entry = ramdisk_get_dir_slot(index_node, back);
+    if ('\0' != back_entry->filename[0])
+    {
+      memcpy(front_entry, back_entry, sizeof(dir_entry_t));
+      front++;
+    }
+    back--;
+  }
+
+  // every tombstone is now past the live entries
+  index_node->size = index_node->dir_entry_count * sizeof(dir_entry_t);
+  index_node->free_dir_slot = 0;
+  ramdisk_truncate_blocks(index_node, (index_node->size + BLK_SZ - 1) / BLK_SZ);
+}
+
+// free every block of a file from block_count onwards, including pointer
+// blocks that no longer map any data
+void ramdisk_truncate_blocks(index_node_t *index_node, int block_count)
+{
+  int i = 0;
+  int j = 0;
+  int first = 0;
+  int *location = NULL;
+  int *row = NULL;
+
+  if ((index_node->flags & INDEX_NODE_FLAG_TAIL) && (block_count <= index_node->size / BLK_SZ))
+  {
+    ramdisk_tail_release(index_node);
+  }
+  if (index_node->flags & INDEX_NODE_FLAG_EXTENTS)
+  {
+    ramdisk_extent_truncate(index_node, block_count);
+    return;
+  }
+
+  // direct blocks
+  for (i = block_count; i < DIRECT_BLOCK_POINTER_COUNT; i++)
+  {
+    if (index_node->location[i] > 0)
+    {
+      ramdisk_block_free(index_node->location[i]);
+      index_node->location[i] = 0;
+    }
+  }
+
+  // single-indirect blocks
+  if (index_node->location[SINGLE_INDIRECT_BLOCK_POINTER] > 0)
+  {
+    location = (int *)ramdisk_get_block_memory_address(index_node->location[SINGLE_INDIRECT_BLOCK_POINTER]);
+    first = max(0, block_count - DIRECT_BLOCK_POINTER_COUNT);
+    for (i = first; i < PTRS_PB; i++)
+    {
+      if (location[i] > 0)
+      {
+        ramdisk_block_free(location[i]);
+        location[i] = 0;
+      }
+    }
+    if (0 == first)
+    {
+      ramdisk_block_free(index_node->location[SINGLE_INDIRECT_BLOCK_POINTER]);
+      index_node->location[SINGLE_INDIRECT_BLOCK_POINTER] = 0;
+    }
+  }
+
+  // double-indirect blocks, one row of pointers at a time
+  if (index_node->location[DOUBLE_INDIRECT_BLOCK_POINTER] > 0)
+  {
+    location = (int *)ramdisk_get_block_memory_address(index_node->location[DOUBLE_INDIRECT_BLOCK_POINTER]);
+    for (i = 0; i < PTRS_PB; i++)
+    {
+      if (location[i] <= 0)
+      {
+        continue;
+      }
+      row = (int *)ramdisk_get_block_memory_address(location[i]);
+      first = max(0, block_count - (DIRECT_BLOCK_POINTER_COUNT + PTRS_PB + i * PTRS_PB));
+      for (j = first; j < PTRS_PB; j++)
+      {
+        if (row[j] > 0)
+        {
+          ramdisk_block_free(row[j]);
+          row[j] = 0;
+        }
+      }
+      if (0 == first)
+      {
+        ramdisk_block_free(location[i]);
+        location[i] = 0;
+      }
+    }
+    if (block_count <= (DIRECT_BLOCK_POINTER_COUNT + PTRS_PB))
+    {
+      ramdisk_block_free(index_node->location[DOUBLE_INDIRECT_BLOCK_POINTER]);
+      index_node->location[DOUBLE_INDIRECT_BLOCK_POINTER] = 0;
+    }
+  }
+}
+
+static int ramdisk_reclaim_compare(const void *a, const void *b)
+{
+  return *(const int *)a - *(const int *)b;
+}
+
+// add a block to the list being collected, or count it when there is no
+// list and the block goes back to the allocator with the file, which a
+// data block a reflinked file still maps does not
+static int ramdisk_reclaim_collect_block(int *blocks, int count, int block_pointer)
+{
+  if (NULL == blocks)
+  {
+    return ramdisk_block_is_shared(block_pointer) ? count : count + 1;
+  }
+  blocks[count] = block_pointer;
+
+  return count + 1;
+}
+
+// list every data and pointer block of a block-mapped file, returns the
+// count; with no list, count the blocks freeing the file gives back
+static int ramdisk_reclaim_collect(index_node_t *index_node, int *blocks)
+{
+  int i = 0;
+  int j = 0;
+  int count = 0;
+  int *location = NULL;
+  int *row = NULL;
+
+  for (i = 0; i < DIRECT_BLOCK_POINTER_COUNT; i++)
+  {
+    if (index_node->location[i] > 0)
+    {
+      count = ramdisk_reclaim_collect_block(blocks, count, index_node->location[i]);
+    }
+  }
+  if (index_node->location[SINGLE_INDIRECT_BLOCK_POINTER] > 0)
+  {
+    location = (int *)ramdisk_get_block_memory_address(index_node->location[SINGLE_INDIRECT_BLOCK_POINTER]);
+    for (i = 0; i < PTRS_PB; i++)
+    {
+      if (location[i] > 0)
+      {
+        count = ramdisk_reclaim_collect_block(blocks, count, location[i]);
+      }
+    }
+    count = ramdisk_reclaim_collect_block(blocks, count, index_node->location[SINGLE_INDIRECT_BLOCK_POINTER]);
+  }
+  if (index_node->location[DOUBLE_INDIRECT_BLOCK_POINTER] > 0)
+  {
+    location = (int *)ramdisk_get_block_memory_address(index_node->location[DOUBLE_INDIRECT_BLOCK_POINTER]);
+    for (i = 0; i < PTRS_PB; i++)
+    {
+      if (location[i] <= 0)
+      {
+        continue;
+      }
+      row = (int *)ramdisk_get_block_memory_address(location[i]);
+      for (j = 0; j < PTRS_PB; j++)
+      {
+        if (row[j] > 0)
+        {
+          count = ramdisk_reclaim_collect_block(blocks, count, row[j]);
+        }
+      }
+      count = ramdisk_reclaim_collect_block(blocks, count, location[i]);
+    }
+    count = ramdisk_reclaim_collect_block(blocks, count, index_node->location[DOUBLE_INDIRECT_BLOCK_POINTER]);
+  }
+
+  return count;
+}
+
+// number of blocks freeing a file gives back to the allocator
+static int ramdisk_reclaim_count(index_node_t *index_node)
+{
+  int index = 0;
+  int count = 0;
+  int *slot = NULL;
+
+  if (!(index_node->flags & INDEX_NODE_FLAG_EXTENTS))
+  {
+    return ramdisk_reclaim_collect(index_node, NULL);
+  }
+  for (index = 0; index < MAX_EXTENT_COUNT_IN_FILE; index++)
+  {
+    slot = ramdisk_extent_get_slot(index_node, index, 1);
+    if ((NULL == slot) || (0 == *slot))
+    {
+      break;
+    }
+    count = count + (1 << EXTENT_ORDER(*slot));
+  }
+  if (0 != index_node->location[EXTENT_INDIRECT_POINTER])
+  {
+    count++;
+  }
+
+  return count;
+}
+
+// free the blocks of an unlinked file; block-mapped files are freed in
+// sorted runs straight to the bitmap, a byte of it at a time where a run
+// allows, instead of block by block through the magazines
+static void ramdisk_reclaim_file(index_node_t *index_node)
+{
+  int i = 0;
+  int j = 0;
+  int k = 0;
+  int count = 0;
+  int *blocks = NULL;
+
+  if (!(index_node->flags & INDEX_NODE_FLAG_EXTENTS))
+  {
+    blocks = (int *)vmalloc(sizeof(int) * RECLAIM_MAX_BLOCK_COUNT);
+  }
+  if (NULL == blocks)
+  {
+    ramdisk_truncate_blocks(index_node, 0);
+    return;
+  }
+  count = ramdisk_reclaim_collect(index_node, blocks);
+  // blocks a reflinked file still maps stay with it
+  for (i = 0; i < count; i++)
+  {
+    if (!ramdisk_block_unshare(blocks[i]))
+    {
+      blocks[k++] = blocks[i];
+    }
+  }
+  count = k;
+  sort(blocks, count, sizeof(int), ramdisk_reclaim_compare, NULL);
+
+  // free blocks must read as zeros, see ramdisk_zero_release
+  for (i = 0; i < count; i = j)
+  {
+    for (j = i + 1; (j < count) && (blocks[j] == blocks[j - 1] + 1); j++)
+    {
+    }
+    ramdisk_blocks_zero(blocks[i], j - i);
+    ramdisk_chunk_put(blocks[i], j - i);
+  }
+  spin_lock(&ramdisk_bitmap_lock);
+  for (i = 0; i < count; i = j)
+  {
+    for (j = i + 1; (j < count) && (blocks[j] == blocks[j - 1] + 1); j++)
+    {
+    }
+    if (ramdisk_buddy_allocator)
+    {
+      for (k = i; k < j; k++)
+      {
+        ramdisk_buddy_free(blocks[k], 0);
+      }
+    }
+    else
+    {
+      ramdisk_bitmap_set_range(blocks[i], j - i, 1);
+    }
+  }
+  if ((count > 0) && (blocks[0] / 8 < ramdisk_bitmap_hint))
+  {
+    ramdisk_bitmap_hint = blocks[0] / 8;
+  }
+  spin_unlock(&ramdisk_bitmap_lock);
+  for (i = 0; i < count; i++)
+  {
+    trace_ramdisk_block_free(blocks[i], 0);
+  }
+  vfree(blocks);
+}
+
+// hand the blocks of a regular file being unlinked to the reclaim worker,
+// -1 when the caller should free them itself
+static int ramdisk_reclaim_queue_add(index_node_t *index_node)
+{
+  int block_count = 0;
+
+  if ((0 != strcmp("reg", index_node->type)) || (index_node->size <= DIRECT_BLOCK_POINTER_COUNT * BLK_SZ))
+  {
+    return -1;
+  }
+
+  // a packed tail belongs to the pack block, not to the copy
+  if (index_node->flags & INDEX_NODE_FLAG_TAIL)
+  {
+    ramdisk_tail_release(index_node);
+  }
+  block_count = ramdisk_reclaim_count(index_node);
+  spin_lock(&ramdisk_reclaim_lock);
+  if (RECLAIM_QUEUE_SIZE == ramdisk_reclaim_queue_count)
+  {
+    spin_unlock(&ramdisk_reclaim_lock);
+    return -1;
+  }
+  memcpy(&ramdisk_reclaim_queue[ramdisk_reclaim_queue_count].index_node, index_node, sizeof(index_node_t));
+  ramdisk_reclaim_queue[ramdisk_reclaim_queue_count].block_count = block_count;
+  ramdisk_reclaim_queue_count++;
+  ramdisk_reclaim_block_count = ramdisk_reclaim_block_count + block_count;
+  spin_unlock(&ramdisk_reclaim_lock);
+  schedule_work(&ramdisk_reclaim_work);
+
+  return 0;
+}
+
+// free one queued file, returns 0 when the queue was empty
+static int ramdisk_reclaim_queue_run(void)
+{
+  reclaim_request_t request;
+
+  spin_lock(&ramdisk_reclaim_lock);
+  if (0 == ramdisk_reclaim_queue_count)
+  {
+    spin_unlock(&ramdisk_reclaim_lock);
+    return 0;
+  }
+  ramdisk_reclaim_queue_count--;
+  memcpy(&request, &ramdisk_reclaim_queue[ramdisk_reclaim_queue_count], sizeof(reclaim_request_t));
+  spin_unlock(&ramdisk_reclaim_lock);
+
+  ramdisk_reclaim_file(&request.index_node);
+  spin_lock(&ramdisk_reclaim_lock);
+  ramdisk_reclaim_block_count = ramdisk_reclaim_block_count - request.block_count;
+  spin_unlock(&ramdisk_reclaim_lock);
+
+  return 1;
+}
+
+static void ramdisk_reclaim_worker(struct work_struct *work)
+{
+  while (ramdisk_reclaim_queue_run() > 0)
+  {
+  }
+}
+
+// free every queued file and clear every freed block, waiting for the
+// workers' batches in flight; may sleep
+static void ramdisk_reclaim_flush(void)
+{
+  mutex_lock(&ramdisk_flush_lock);
+  while (ramdisk_reclaim_queue_run() > 0)
+  {
+  }
+  flush_work(&ramdisk_reclaim_work);
+  ramdisk_zero_flush();
+  mutex_unlock(&ramdisk_flush_lock);
+}
+
+// address of the slot holding the descriptor of an extent-mapped file's
+// index-th extent, NULL past the last slot or when it is not allocated
+static int *ramdisk_extent_get_slot(index_node_t *index_node, int index, int is_read_mode)
+{
+  int *location = NULL;
+
+  if (index < DIRECT_EXTENT_COUNT)
+  {
+    return &index_node->location[index];
+  }
+  if (index >= MAX_EXTENT_COUNT_IN_FILE)
+  {
+    return NULL;
+  }
+  if (0 == index_node->location[EXTENT_INDIRECT_POINTER])
+  {
+    if (is_read_mode)
+    {
+      return NULL;
+    }
+    index_node->location[EXTENT_INDIRECT_POINTER] = ramdisk_block_calloc();
+    if (index_node->location[EXTENT_INDIRECT_POINTER] <= 0)
+    {
+      index_node->location[EXTENT_INDIRECT_POINTER] = 0;
+      return NULL;
+    }
+  }
+  location = (int *)ramdisk_get_block_memory_address(index_node->location[EXTENT_INDIRECT_POINTER]);
+
+  return &location[index - DIRECT_EXTENT_COUNT];
+}
+
+// map a block of an extent-mapped file, appending extents that grow with
+// the file when writing past its last extent; run_block_count receives the
+// number of contiguous blocks from this one to the end of its extent
+int ramdisk_extent_get_block(index_node_t *index_node, int block_number, int is_read_mode, int *run_block_count)
+{
+  int index = 0;
+  int order = 0;
+  int start = 0;
+  int block_pointer = 0;
+  int *slot = NULL;
+
+  for (index = 0; index < MAX_EXTENT_COUNT_IN_FILE; index++)
+  {
+    slot = ramdisk_extent_get_slot(index_node, index, is_read_mode);
+    if (NULL == slot)
+    {
+      return -1;
+    }
+    if (0 == *slot)
+    {
+      if (is_read_mode)
+      {
+        return -1;
+      }
+      // the next extent is as large as everything mapped so far, so the
+      // extent count grows with the log of the file size
+      order = 0;
+      while ((order < BUDDY_MAX_ORDER) && ((2 << order) <= start) && (start + (2 << order) <= MAX_BLOCK_COUNT_IN_FILE))
+      {
+        order++;
+      }
+      // settle for smaller chunks when the region is fragmented
+      block_pointer = -1;
+      while ((order >= 0) && (block_pointer <= 0))
+      {
+        block_pointer = ramdisk_extent_alloc(order);
+        order--;
+      }
+      if (block_pointer <= 0)
+      {
+        return -1;
+      }
+      *slot = EXTENT_MAKE(block_pointer, order + 1);
+    }
+    if (block_number < start + (1 << EXTENT_ORDER(*slot)))
+    {
+      if (NULL != run_block_count)
+      {
+        *run_block_count = start + (1 << EXTENT_ORDER(*slot)) - block_number;
+      }
+      return EXTENT_BLOCK(*slot) + (block_number - start);
+    }
+    start = start + (1 << EXTENT_ORDER(*slot));
+  }
+
+  return -1;
+}
+
+// free the extents of a file that lie entirely past block_count
+void ramdisk_extent_truncate(index_node_t *index_node, int block_count)
+{
+  int index = 0;
+  int start = 0;
+  int is_indirect_used = 0;
+  int *slot = NULL;
+
+  for (index = 0; index < MAX_EXTENT_COUNT_IN_FILE; index++)
+  {
+    slot = ramdisk_extent_get_slot(index_node, index, 1);
+    if ((NULL == slot) || (0 == *slot))
+    {
+      break;
+    }
+    if (start >= block_count)
+    {
+      start = start + (1 << EXTENT_ORDER(*slot));
+      ramdisk_extent_free(EXTENT_BLOCK(*slot), EXTENT_ORDER(*slot));
+      *slot = 0;
+      continue;
+    }
+    start = start + (1 << EXTENT_ORDER(*slot));
+    if (index >= DIRECT_EXTENT_COUNT)
+    {
+      is_indirect_used = 1;
+    }
+  }
+  if ((0 != index_node->location[EXTENT_INDIRECT_POINTER]) && !is_indirect_used)
+  {
+    ramdisk_block_free(index_node->location[EXTENT_INDIRECT_POINTER]);
+    index_node->location[EXTENT_INDIRECT_POINTER] = 0;
+  }
+}
+
+// find a pack block with a free slot and a free run of unit_count units,
+// starting a new pack block in the zeroed spare_block when none of the
+// cached ones has room, 0 when that is needed and there is no spare;
+// callers hold ramdisk_pack_lock
+static int ramdisk_pack_block_find(int unit_count, int *first_unit, int spare_block)
+{
+  int i = 0;
+  int unit = 0;
+  int run = 0;
+  int block_pointer = 0;
+  pack_block_header_t *header = NULL;
+
+  for (i = 0; i < PACK_BLOCK_CACHE_SIZE; i++)
+  {
+    if (0 == ramdisk_pack_block_cache[i])
+    {
+      continue;
+    }
+    header = (pack_block_header_t *)ramdisk_get_block_memory_address(ramdisk_pack_block_cache[i]);
+    if (PACK_SLOT_COUNT == header->slot_count)
+    {
+      continue;
+    }
+    run = 0;
+    for (unit = PACK_HEADER_UNIT_COUNT; unit < PACK_UNIT_COUNT; unit++)
+    {
+      run = (header->used_units & (1 << unit)) ? 0 : run + 1;
+      if (run == unit_count)
+      {
+        *first_unit = unit - unit_count + 1;
+        return ramdisk_pack_block_cache[i];
+      }
+    }
+  }
+
+  if (spare_block <= 0)
+  {
+    return 0;
+  }
+  block_pointer = spare_block;
+  header = (pack_block_header_t *)ramdisk_get_block_memory_address(block_pointer);
+  header->used_units = (1 << PACK_HEADER_UNIT_COUNT) - 1;
+  // replace an empty or full cache entry, or the first one
+  for (i = 0; i < PACK_BLOCK_CACHE_SIZE - 1; i++)
+  {
+    if (0 == ramdisk_pack_block_cache[i])
+    {
+      break;
+    }
+    if (PACK_SLOT_COUNT == ((pack_block_header_t *)ramdisk_get_block_memory_address(ramdisk_pack_block_cache[i]))->slot_count)
+    {
+      break;
+    }
+  }
+  ramdisk_pack_block_cache[i] = block_pointer;
+  *first_unit = PACK_HEADER_UNIT_COUNT;
+
+  return block_pointer;
+}
+
+// move the partial last block of a regular file into a pack block slot
+int ramdisk_tail_pack(index_node_t *index_node, int index_node_number)
+{
+  int i = 0;
+  int slot = 0;
+  int first_unit = 0;
+  int unit_count = 0;
+  int tail_length = 0;
+  int block_pointer = 0;
+  int spare_block = 0;
+  char *src = NULL;
+  pack_block_header_t *header = NULL;
+  file_position_t file_position;
+
+  // a compressed file's blocks hold a stream whose length is not the size
+  if ((0 != strcmp("reg", index_node->type)) || (index_node->flags & (INDEX_NODE_FLAG_EXTENTS | INDEX_NODE_FLAG_TAIL | INDEX_NODE_FLAG_COMPRESSED)))
+  {
+    return 0;
+  }
+  tail_length = index_node->size % BLK_SZ;
+  if ((0 == tail_length) || (tail_length > MAX_TAIL_SIZE))
+  {
+    return 0;
+  }
+  ramdisk_file_position_init(&file_position, index_node, index_node->size - tail_length, 1);
+  src = ramdisk_get_memory_address(&file_position);
+  if (NULL == src)
+  {
+    return -1;
+  }
+
+  unit_count = (tail_length + PACK_UNIT_SZ - 1) / PACK_UNIT_SZ;
+  spin_lock(&ramdisk_pack_lock);
+  block_pointer = ramdisk_pack_block_find(unit_count, &first_unit, 0);
+  if (0 == block_pointer)
+  {
+    // backing a new block may sleep, so take it outside the lock and look
+    // again in case another file started a pack block meanwhile
+    spin_unlock(&ramdisk_pack_lock);
+    spare_block = ramdisk_block_calloc();
+    if (spare_block <= 0)
+    {
+      return -1;
+    }
+    spin_lock(&ramdisk_pack_lock);
+    block_pointer = ramdisk_pack_block_find(unit_count, &first_unit, spare_block);
+  }
+  header = (pack_block_header_t *)ramdisk_get_block_memory_address(block_pointer);
+  for (slot = 0; slot < PACK_SLOT_COUNT; slot++)
+  {
+    if (0 == header->slots[slot].unit_count)
+    {
+      break;
+    }
+  }
+  for (i = first_unit; i < first_unit + unit_count; i++)
+  {
+    header->used_units = header->used_units | (1 << i);
+  }
+  header->slots[slot].first_unit = first_unit;
+  header->slots[slot].unit_count = unit_count;
+  header->slots[slot].index_node_number = index_node_number;
+  header->slot_count++;
+  memcpy((char *)header + first_unit * PACK_UNIT_SZ, src, tail_length);
+  spin_unlock(&ramdisk_pack_lock);
+  if ((spare_block > 0) && (spare_block != block_pointer))
+  {
+    ramdisk_block_free(spare_block);
+  }
+
+  // the last block and any pointer block it emptied go back to the allocator
+  ramdisk_truncate_blocks(index_node, index_node->size / BLK_SZ);
+  index_node->tail = TAIL_MAKE(block_pointer, slot);
+  index_node->flags = index_node->flags | INDEX_NODE_FLAG_TAIL;
+
+  return 0;
+}
+
+// memory address of a file's packed tail
+char *ramdisk_tail_get_memory_address(index_node_t *index_node)
+{
+  pack_block_header_t *header = NULL;
+
+  header = (pack_block_header_t *)ramdisk_get_block_memory_address(TAIL_BLOCK(index_node->tail));
+
+  return (char *)header + header->slots[TAIL_SLOT(index_node->tail)].first_unit * PACK_UNIT_SZ;
+}
+
+// give a packed tail's units back to its pack block, freeing the block
+// with its last slot
+void ramdisk_tail_release(index_node_t *index_node)
+{
+  int i = 0;
+  int block_pointer = 0;
+  pack_slot_t *slot = NULL;
+  pack_block_header_t *header = NULL;
+
+  block_pointer = TAIL_BLOCK(index_node->tail);
+  spin_lock(&ramdisk_pack_lock);
+  header = (pack_block_header_t *)ramdisk_get_block_memory_address(block_pointer);
+  slot = &header->slots[TAIL_SLOT(index_node->tail)];
+  for (i = slot->first_unit; i < slot->first_unit + slot->unit_count; i++)
+  {
+    header->used_units = header->used_units & ~(1 << i);
+  }
+  memset(slot, 0, sizeof(pack_slot_t));
+  header->slot_count--;
+  for (i = 0; i < PACK_BLOCK_CACHE_SIZE; i++)
+  {
+    if (ramdisk_pack_block_cache[i] == block_pointer)
+    {
+      break;
+    }
+  }
+  if (0 == header->slot_count)
+  {
+    if (i < PACK_BLOCK_CACHE_SIZE)
+    {
+      ramdisk_pack_block_cache[i] = 0;
+    }
+    ramdisk_block_free(block_pointer);
+  }
+  // the block has room again, remember it if there is a free cache entry
+  else if (i == PACK_BLOCK_CACHE_SIZE)
+  {
+    for (i = 0; i < PACK_BLOCK_CACHE_SIZE; i++)
+    {
+      if (0 == ramdisk_pack_block_cache[i])
+      {
+        ramdisk_pack_block_cache[i] = block_pointer;
+        break;
+      }
+    }
+  }
+  spin_unlock(&ramdisk_pack_lock);
+
+  index_node->tail = 0;
+  index_node->flags = index_node->flags & ~INDEX_NODE_FLAG_TAIL;
+}
+
+// move a packed tail back into a block of its own before the file grows
+// or is overwritten; the slot is only given up once the tail has been
+// copied, so a file that is out of space keeps its packed tail
+int ramdisk_tail_unpack(index_node_t *index_node)
+{
+  int tail_length = 0;
+  int block_pointer = 0;
+  file_position_t file_position;
+
+  tail_length = index_node->size % BLK_SZ;
+  // the position still resolves to the packed tail, so ask for the block
+  ramdisk_file_position_init(&file_position, index_node, index_node->size - tail_length, 0);
+  block_pointer = ramdisk_alloc_and_get_block_pointer(&file_position.block_pointer);
+  if (block_pointer <= 0)
+  {
+    return -1;
+  }
+  memcpy(ramdisk_get_block_memory_address(block_pointer), ramdisk_tail_get_memory_address(index_node), tail_length);
+  ramdisk_tail_release(index_node);
+
+  return 0;
+}
+
+// name of the last component of a path
+const char *ramdisk_get_filename(const char *pathname)
+{
+  const char *filename = NULL;
+
+  filename = strrchr(pathname, '/');
+  if (NULL == filename)
+  {
+    return pathname;
+  }
+
+  return filename + 1;
+}
+
+// compare an entry name with a path component ending at filename_end,
+// or at the end of the string when filename_end is NULL
+int ramdisk_dir_name_compare(const char *name, const char *filename_start, const char *filename_end)
+{
+  int length = 0;
+  int result = 0;
+
+  if (NULL == filename_end)
+  {
+    return strcmp(name, filename_start);
+  }
+  length = filename_end - filename_start;
+  result = strncmp(name, filename_start, length);
+  if (0 != result)
+  {
+    return result;
+  }
+
+  return ('\0' == name[length]) ? 0 : 1;
+}
+
+// add an entry to a flat directory, reusing a free slot when there is one
+static int ramdisk_dir_flat_add_entry(index_node_t *index_node, dir_entry_t *entry)
+{
+  int slot = 0;
+  char *dst = NULL;
+  dir_entry_t *empty_entry = NULL;
+  file_position_t file_position;
+
+  if (0 != index_node->free_dir_slot)
+  {
+    slot = index_node->free_dir_slot - 1;
+    empty_entry = ramdisk_get_dir_slot(index_node, slot);
+    if (NULL == empty_entry)
+    {
+      return -1;
+    }
+    index_node->free_dir_slot = empty_entry->index_node_number;
+    memcpy(empty_entry, entry, sizeof(dir_entry_t));
+    index_node->dir_entry_count++;
+    return 0;
+  }
+  if ((index_node->size + sizeof(dir_entry_t)) > MAX_FILE_SIZE)
+  {
+    return -1;
+  }
+  // now that we have memory address add it to the end of the directory file
+  ramdisk_file_position_init(&file_position, index_node, index_node->size, 0);
+  dst = ramdisk_get_memory_address(&file_position);
+  if (NULL == dst)
+  {
+    return -1;
+  }
+  memcpy(dst, entry, sizeof(dir_entry_t));
+  index_node->size = index_node->size + sizeof(dir_entry_t);
+  index_node->dir_entry_count++;
+
+  return 0;
+}
+
+// add an entry to a directory in whichever format it uses
+int ramdisk_dir_add_entry(index_node_t *index_node, dir_entry_t *entry)
+{
+  if (index_node->flags & INDEX_NODE_FLAG_DIR_BTREE)
+  {
+    return ramdisk_dir_btree_insert(index_node, entry);
+  }
+  if (0 != ramdisk_dir_flat_add_entry(index_node, entry))
+  {
+    return -1;
+  }
+  // large directories move to the B-tree format, unless a reader is walking them
+  if ((0 == index_node->open_counter) && (index_node->dir_entry_count >= DIR_BTREE_MIN_ENTRY_COUNT))
+  {
+    ramdisk_dir_convert_to_btree(index_node);
+  }
+
+  return 0;
+}
+
+// remove an entry from a directory in whichever format it uses
+int ramdisk_dir_remove_entry(index_node_t *index_node, const char *filename)
+{
+  int slot = 0;
+
+  if (index_node->flags & INDEX_NODE_FLAG_DIR_BTREE)
+  {
+    if (0 != ramdisk_dir_btree_remove(index_node, filename))
+    {
+      return -1;
+    }
+    if ((0 == index_node->open_counter) && (index_node->dir_entry_count < DIR_FLAT_MAX_ENTRY_COUNT))
+    {
+      ramdisk_dir_convert_to_flat(index_node);
+    }
+    return 0;
+  }
+
+  slot = ramdisk_find_dir_slot(index_node, filename, NULL);
+  if (slot < 0)
+  {
+    return -1;
+  }
+  ramdisk_release_dir_slot(index_node, slot);
+  index_node->dir_entry_count--;
+
+  // shrink the directory once tombstones dominate, unless a reader is walking it
+  if ((0 == index_node->open_counter) && ramdisk_dir_needs_compaction(index_node))
+  {
+    ramdisk_dir_compact(index_node);
+  }
+
+  return 0;
+}
+
+// descend from the root of a B-tree directory to the leaf that would hold a name
+dir_btree_leaf_t *ramdisk_dir_btree_find_leaf(index_node_t *index_node, const char *filename_start, const char *filename_end)
+{
+  int i = 0;
+  int block_pointer = 0;
+  dir_btree_index_t *node = NULL;
+
+  block_pointer = index_node->location[0];
+  node = (dir_btree_index_t *)ramdisk_get_block_memory_address(block_pointer);
+  while (!node->header.is_leaf)
+  {
+    block_pointer = node->header.link;
+    for (i = 0; i < node->header.count; i++)
+    {
+      if (ramdisk_dir_name_compare(node->keys[i].filename, filename_start, filename_end) > 0)
+      {
+        break;
+      }
+      block_pointer = node->keys[i].child;
+    }
+    node = (dir_btree_index_t *)ramdisk_get_block_memory_address(block_pointer);
+  }
+
+  return (dir_btree_leaf_t *)node;
+}
+
+// find child entry in a B-tree directory
+dir_entry_t *ramdisk_dir_btree_lookup(index_node_t *index_node, const char *filename_start, const char *filename_end)
+{
+  int i = 0;
+  dir_btree_leaf_t *leaf = NULL;
+
+  leaf = ramdisk_dir_btree_find_leaf(index_node, filename_start, filename_end);
+  for (i = 0; i < leaf->header.count; i++)
+  {
+    if (0 == ramdisk_dir_name_compare(leaf->entries[i].filename, filename_start, filename_end))
+    {
+      return &leaf->entries[i];
+    }
+  }
+
+  return NULL;
+}
+
+// insert into the subtree rooted at block_pointer, returns the block of the
+// new right sibling when the node splits (its first name in split_key) and
+// 0 when it did not split; splits take their blocks from spare_blocks,
+// which the caller filled with one per level
+static int ramdisk_dir_btree_insert_node(int block_pointer, dir_entry_t *entry, char *split_key, int *spare_blocks, int *spare_block_count)
+{
+  int position = 0;
+  int half = 0;
+  int right_block = 0;
+  int child_block = 0;
+  char child_split_key[14];
+  dir_btree_leaf_t *leaf = NULL;
+  dir_btree_leaf_t *right_leaf = NULL;
+  dir_btree_index_t *node = NULL;
+  dir_btree_index_t *right_node = NULL;
+  dir_entry_t merged_entries[DIR_BTREE_LEAF_ENTRY_COUNT + 1];
+  dir_btree_key_t merged_keys[DIR_BTREE_INDEX_KEY_COUNT + 1];
+
+  leaf = (dir_btree_leaf_t *)ramdisk_get_block_memory_address(block_pointer);
+  if (leaf->header.is_leaf)
+  {
+    while ((position < leaf->header.count) && (strcmp(leaf->entries[position].filename, entry->filename) < 0))
+    {
+      position++;
+    }
+    if (leaf->header.count < DIR_BTREE_LEAF_ENTRY_COUNT)
+    {
+      memmove(&leaf->entries[position + 1], &leaf->entries[position], (leaf->header.count - position) * sizeof(dir_entry_t));
+      memcpy(&leaf->entries[position], entry, sizeof(dir_entry_t));
+      leaf->header.count++;
+      return 0;
+    }
+
+    // split the full leaf, the upper half moves to a new right sibling
+    *spare_block_count = *spare_block_count - 1;
+    right_block = spare_blocks[*spare_block_count];
+    memcpy(merged_entries, leaf->entries, position * sizeof(dir_entry_t));
+    memcpy(&merged_entries[position], entry, sizeof(dir_entry_t));
+    memcpy(&merged_entries[position + 1], &leaf->entries[position], (leaf->header.count - position) * sizeof(dir_entry_t));
+    half = (DIR_BTREE_LEAF_ENTRY_COUNT + 1) / 2;
+    right_leaf = (dir_btree_leaf_t *)ramdisk_get_block_memory_address(right_block);
+    right_leaf->header.is_leaf = 1;
+    right_leaf->header.count = DIR_BTREE_LEAF_ENTRY_COUNT + 1 - half;
+    right_leaf->header.link = leaf->header.link;
+    memcpy(right_leaf->entries, &merged_entries[half], right_leaf->header.count * sizeof(dir_entry_t));
+    memcpy(leaf->entries, merged_entries, half * sizeof(dir_entry_t));
+    leaf->header.count = half;
+    leaf->header.link = right_block;
+    strcpy(split_key, right_leaf->entries[0].filename);
+    return right_block;
+  }
+
+  // pick the child whose range holds the name
+  node = (dir_btree_index_t *)leaf;
+  child_block = node->header.link;
+  while ((position < node->header.count) && (strcmp(node->keys[position].filename, entry->filename) <= 0))
+  {
+    child_block = node->keys[position].child;
+    position++;
+  }
+  child_block = ramdisk_dir_btree_insert_node(child_block, entry, child_split_key, spare_blocks, spare_block_count);
+  if (0 == child_block)
+  {
+    return 0;
+  }
+
+  // the child split, add a key for its new sibling after the child's own key
+  if (node->header.count < DIR_BTREE_INDEX_KEY_COUNT)
+  {
+    memmove(&node->keys[position + 1], &node->keys[position], (node->header.count - position) * sizeof(dir_btree_key_t));
+    memset(&node->keys[position], 0, sizeof(dir_btree_key_t));
+    strcpy(node->keys[position].filename, child_split_key);
+    node->keys[position].child = child_block;
+    node->header.count++;
+    return 0;
+  }
+
+  // split the full index node, the middle key moves up to the parent
+  *spare_block_count = *spare_block_count - 1;
+  right_block = spare_blocks[*spare_block_count];
+  memcpy(merged_keys, node->keys, position * sizeof(dir_btree_key_t));
+  memset(&merged_keys[position], 0, sizeof(dir_btree_key_t));
+  strcpy(merged_keys[position].filename, child_split_key);
+  merged_keys[position].child = child_block;
+  memcpy(&merged_keys[position + 1], &node->keys[position], (node->header.count - position) * sizeof(dir_btree_key_t));
+  half = (DIR_BTREE_INDEX_KEY_COUNT + 1) / 2;
+  right_node = (dir_btree_index_t *)ramdisk_get_block_memory_address(right_block);
+  right_node->header.is_leaf = 0;
+  right_node->header.link = merged_keys[half].child;
+  right_node->header.count = DIR_BTREE_INDEX_KEY_COUNT - half;
+  memcpy(right_node->keys, &merged_keys[half + 1], right_node->header.count * sizeof(dir_btree_key_t));
+  memcpy(node->keys, merged_keys, half * sizeof(dir_btree_key_t));
+  memset(&node->keys[half], 0, (DIR_BTREE_INDEX_KEY_COUNT - half) * sizeof(dir_btree_key_t));
+  node->header.count = half;
+  strcpy(split_key, merged_keys[half].filename);
+
+  return right_block;
+}
+
+// insert an entry into a B-tree directory
+int ramdisk_dir_btree_insert(index_node_t *index_node, dir_entry_t *entry)
+{
+  int height = 1;
+  int block_pointer = 0;
+  int root_block = 0;
+  int spare_block_count = 0;
+  int spare_blocks[DIR_BTREE_MAX_HEIGHT + 1];
+  char split_key[14];
+  dir_btree_index_t *node = NULL;
+
+  // every level may split and the root may grow, so take a block for each
+  // first and never run out of blocks halfway
+  node = (dir_btree_index_t *)ramdisk_get_block_memory_address(index_node->location[0]);
+  while (!node->header.is_leaf)
+  {
+    node = (dir_btree_index_t *)ramdisk_get_block_memory_address(node->header.link);
+    height++;
+  }
+  if (height > DIR_BTREE_MAX_HEIGHT)
+  {
+    return -1;
+  }
+  for (spare_block_count = 0; spare_block_count <= height; spare_block_count++)
+  {
+    spare_blocks[spare_block_count] = ramdisk_block_calloc();
+    if (spare_blocks[spare_block_count] <= 0)
+    {
+      break;
+    }
+  }
+  if (spare_block_count <= height)
+  {
+    while (spare_block_count > 0)
+    {
+      spare_block_count--;
+      ramdisk_block_free(spare_blocks[spare_block_count]);
+    }
+    return -1;
+  }
+
+  block_pointer = ramdisk_dir_btree_insert_node(index_node->location[0], entry, split_key, spare_blocks, &spare_block_count);
+  if (block_pointer > 0)
+  {
+    spare_block_count--;
+    root_block = spare_blocks[spare_block_count];
+    node = (dir_btree_index_t *)ramdisk_get_block_memory_address(root_block);
+    node->header.is_leaf = 0;
+    node->header.count = 1;
+    node->header.link = index_node->location[0];
+    strcpy(node->keys[0].filename, split_key);
+    node->keys[0].child = block_pointer;
+    index_node->location[0] = root_block;
+  }
+  while (spare_block_count > 0)
+  {
+    spare_block_count--;
+    ramdisk_block_free(spare_blocks[spare_block_count]);
+  }
+  index_node->dir_entry_count++;
+  index_node->size = index_node->dir_entry_count * sizeof(dir_entry_t);
+
+  return 0;
+}
+
+// remove an entry from a B-tree directory, nodes are left underfull and
+// small directories go back to the flat format instead of rebalancing
+int ramdisk_dir_btree_remove(index_node_t *index_node, const char *filename)
+{
+  int i = 0;
+  dir_btree_leaf_t *leaf = NULL;
+
+  leaf = ramdisk_dir_btree_find_leaf(index_node, filename, NULL);
+  for (i = 0; i < leaf->header.count; i++)
+  {
+    if (0 == strcmp(leaf->entries[i].filename, filename))
+    {
+      memmove(&leaf->entries[i], &leaf->entries[i + 1], (leaf->header.count - i - 1) * sizeof(dir_entry_t));
+      leaf->header.count--;
+      memset(&leaf->entries[leaf->header.count], 0, sizeof(dir_entry_t));
+      index_node->dir_entry_count--;
+      index_node->size = index_node->dir_entry_count * sizeof(dir_entry_t);
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+// find the first entry of a B-tree directory named after "after", the
+// first entry of all when "after" is ""
+dir_entry_t *ramdisk_dir_btree_next_entry(index_node_t *index_node, const char *after)
+{
+  int i = 0;
+  dir_btree_leaf_t *leaf = NULL;
+
+  // removals leave leaves underfull or empty, so the entry may be a few leaves on
+  leaf = ramdisk_dir_btree_find_leaf(index_node, after, NULL);
+  while (1)
+  {
+    for (i = 0; i < leaf->header.count; i++)
+    {
+      if (strcmp(leaf->entries[i].filename, after) > 0)
+      {
+        return &leaf->entries[i];
+      }
+    }
+    if (0 == leaf->header.link)
+    {
+      return NULL;
+    }
+    leaf = (dir_btree_leaf_t *)ramdisk_get_block_memory_address(leaf->header.link);
+  }
+}
+
+// free every node of a B-tree directory
+void ramdisk_dir_btree_free(int block_pointer)
+{
+  int i = 0;
+  dir_btree_index_t *node = NULL;
+
+  node = (dir_btree_index_t *)ramdisk_get_block_memory_address(block_pointer);
+  if (!node->header.is_leaf)
+  {
+    ramdisk_dir_btree_free(node->header.link);
+    for (i = 0; i < node->header.count; i++)
+    {
+      ramdisk_dir_btree_free(node->keys[i].child);
+    }
+  }
+  ramdisk_block_free(block_pointer);
+}
+
+// rebuild a flat directory as a B-tree
+int ramdisk_dir_convert_to_btree(index_node_t *index_node)
+{
+  int slot = 0;
+  int root_block = 0;
+  index_node_t flat_index_node;
+  dir_entry_t *entry = NULL;
+  dir_btree_leaf_t *leaf = NULL;
+
+  root_block = ramdisk_block_calloc();
+  if (root_block <= 0)
+  {
+    return -1;
+  }
+  leaf = (dir_btree_leaf_t *)ramdisk_get_block_memory_address(root_block);
+  leaf->header.is_leaf = 1;
+
+  memcpy(&flat_index_node, index_node, sizeof(index_node_t));
+  memset(index_node->location, 0, sizeof(index_node->location));
+  index_node->location[0] = root_block;
+  index_node->flags = index_node->flags | INDEX_NODE_FLAG_DIR_BTREE;
+  index_node->size = 0;
+  index_node->dir_entry_count = 0;
+  index_node->free_dir_slot = 0;
+  for (slot = 0; slot < flat_index_node.size / (int)sizeof(dir_entry_t); slot++)
+  {
+    entry = ramdisk_get_dir_slot(&flat_index_node, slot);
+    if ('\0' == entry->filename[0])
+    {
+      continue;
+    }
+    // out of blocks, keep the flat directory
+    if (0 != ramdisk_dir_btree_insert(index_node, entry))
+    {
+      ramdisk_dir_btree_free(index_node->location[0]);
+      memcpy(index_node, &flat_index_node, sizeof(index_node_t));
+      return -1;
+    }
+  }
+  ramdisk_truncate_blocks(&flat_index_node, 0);
+
+  return 0;
+}
+
+// rebuild a B-tree directory as a flat directory in name order
+int ramdisk_dir_convert_to_flat(index_node_t *index_node)
+{
+  index_node_t btree_index_node;
+  dir_entry_t *entry = NULL;
+
+  memcpy(&btree_index_node, index_node, sizeof(index_node_t));
+  memset(index_node->location, 0, sizeof(index_node->location));
+  index_node->flags = index_node->flags & ~INDEX_NODE_FLAG_DIR_BTREE;
+  index_node->size = 0;
+  index_node->dir_entry_count = 0;
+  index_node->free_dir_slot = 0;
+  for (entry = ramdisk_dir_btree_next_entry(&btree_index_node, ""); NULL != entry;
+       entry = ramdisk_dir_btree_next_entry(&btree_index_node, entry->filename))
+  {
+    // out of blocks, keep the B-tree
+    if (0 != ramdisk_dir_flat_add_entry(index_node, entry))
+    {
+      ramdisk_truncate_blocks(index_node, 0);
+      memcpy(index_node, &btree_index_node, sizeof(index_node_t));
+      return -1;
+    }
+  }
+  ramdisk_dir_btree_free(btree_index_node.location[0]);
+
+  return 0;
+}
+
+void ramdisk_file_position_init(file_position_t *file_position,index_node_t *index_node,int pos,int is_read_mode)
+{
+  int block_number = 0;
+
+  /* get the correspond current block number of the file position */
+  block_number = pos / BLK_SZ;
+  /* Set the file position */
+  file_position->file_position = pos;
+  ramdisk_block_pointer_init(&file_position->block_pointer,index_node,block_number,is_read_mode);
+  file_position->data_offset_in_block = pos % BLK_SZ;
+}
+
+// add offset to file position
+void ramdisk_file_position_add(file_position_t *file_position, int offset)
+{
+  file_position->file_position = file_position->file_position + offset;
+  file_position->data_offset_in_block = file_position->data_offset_in_block + offset;
+  // if we reach end of block then increase block pointer
+  while (file_position->data_offset_in_block >= BLK_SZ)
+  {
+    ramdisk_block_pointer_increase(&file_position->block_pointer);
+    file_position->data_offset_in_block = file_position->data_offset_in_block - BLK_SZ;
+  }
+}
+
+// find memory address of the block pointer
+char *ramdisk_get_memory_address(file_position_t *file_position)
+{
+  int block_pointer = 0;
+  index_node_t *index_node = NULL;
+
+  // the block after the last full one is packed with other files' tails
+  index_node = file_position->block_pointer.index_node;
+  if ((index_node->flags & INDEX_NODE_FLAG_TAIL) &&
+      (ramdisk_block_pointer_get_block_number(&file_position->block_pointer) == index_node->size / BLK_SZ))
+  {
+    return ramdisk_tail_get_memory_address(index_node) + file_position->data_offset_in_block;
+  }
+  block_pointer = ramdisk_alloc_and_get_block_pointer(&file_position->block_pointer);
+  if (block_pointer <= 0)
+  {
+    return NULL;
+  }
+  return ramdisk_get_block_memory_address(block_pointer) + file_position->data_offset_in_block;
+}
+  
+void ramdisk_block_pointer_init(block_pointer_t *block_pointer,index_node_t *index_node,int block_number,int is_read_mode)
+{
+  memset(block_pointer, 0, sizeof(block_pointer_t));
+  block_pointer->is_read_mode = is_read_mode;
+  block_pointer->index_node = index_node;
+
+  if (block_number < DIRECT_BLOCK_POINTER_COUNT)
+  {
+    block_pointer->block_pointer_type = direct_block_pointer_type;
+    block_pointer->direct_block_pointer = block_number;
+  }
+  else if (block_number < (DIRECT_BLOCK_POINTER_COUNT + PTRS_PB))
+  {
+    block_pointer->block_pointer_type = single_indirect_block_pointer_type;
+    block_pointer->single_indirect_block_pointer = block_number - DIRECT_BLOCK_POINTER_COUNT;
+  }
+  /* Initialize the double-indirect block pointer. */
+  else
+  {
+    block_pointer->block_pointer_type = double_indirect_block_pointer_type;
+    block_pointer->double_indirect_block_pointer_row = (block_number - (DIRECT_BLOCK_POINTER_COUNT + PTRS_PB)) / PTRS_PB;
+    block_pointer->double_indirect_block_pointer_column = (block_number - (DIRECT_BLOCK_POINTER_COUNT + PTRS_PB)) % PTRS_PB;
+  }
+}
+
+
+/* This function increate the block pointer. */
+void ramdisk_block_pointer_increase(block_pointer_t *block_pointer)
+{
+  /* Increase the direct block pointer. */
+  if (direct_block_pointer_type == block_pointer->block_pointer_type)
+  {
+    block_pointer->direct_block_pointer++;
+    /* If we reach the end of the direct block pointer,
+       then we move to the beginning of the single-indirect block pointer*/
+    if (DIRECT_BLOCK_POINTER_COUNT == block_pointer->direct_block_pointer)
+    {
+      block_pointer->block_pointer_type = single_indirect_block_pointer_type;
+      block_pointer->single_indirect_block_pointer = 0;
+    }
+  }
+  /* Increase the single-direct block pointer. */
+  else if (single_indirect_block_pointer_type == block_pointer->block_pointer_type)
+  {
+    block_pointer->single_indirect_block_pointer++;
+    /* If we reach the end of the single-indirect block pointer,
+       then we move to the beginning of the double-indirect block pointer*/
+    if (PTRS_PB == block_pointer->single_indirect_block_pointer)
+    {
+      block_pointer->block_pointer_type = double_indirect_block_pointer_type;
+      block_pointer->double_indirect_block_pointer_row = 0;
+      block_pointer->double_indirect_block_pointer_column = 0;
+    }
+  }
+  /* Increase the double-direct block pointer. */
+  else if (double_indirect_block_pointer_type == block_pointer->block_pointer_type)
+  {
+    block_pointer->double_indirect_block_pointer_column++;
+    /* If we reach the end of the current column of the two dimension double-indirect
+       block pointer, then we move to the beginning of the next column
+       of the two dimension double-indirec block pointer. */
+    if (PTRS_PB == block_pointer->double_indirect_block_pointer_column)
+    {
+      block_pointer->double_indirect_block_pointer_row++;
+      block_pointer->double_indirect_block_pointer_column = 0;
+    }
+  }
+}
+
+// logical block number of the file a block pointer refers to
+int ramdisk_block_pointer_get_block_number(block_pointer_t *block_pointer)
+{
+  if (direct_block_pointer_type == block_pointer->block_pointer_type)
+  {
+    return block_pointer->direct_block_pointer;
+  }
+  if (single_indirect_block_pointer_type == block_pointer->block_pointer_type)
+  {
+    return DIRECT_BLOCK_POINTER_COUNT + block_pointer->single_indirect_block_pointer;
+  }
+
+  return DIRECT_BLOCK_POINTER_COUNT + PTRS_PB +
+    block_pointer->double_indirect_block_pointer_row * PTRS_PB +
+    block_pointer->double_indirect_block_pointer_column;
+}
+
+// bytes from a mapped file position to the end of its physically
+// contiguous run, a whole extent for extent-mapped files
+int ramdisk_get_contiguous_length(file_position_t *file_position)
+{
+  int run_block_count = 1;
+  int physical_block = 0;
+  block_pointer_t *block_pointer = NULL;
+
+  block_pointer = &file_position->block_pointer;
+  if (block_pointer->index_node->flags & INDEX_NODE_FLAG_EXTENTS)
+  {
+    physical_block = ramdisk_extent_get_block(block_pointer->index_node,
+      ramdisk_block_pointer_get_block_number(block_pointer),
+      1,
+      &run_block_count);
+    // a run is only contiguous in memory up to the end of its chunk
+    if (physical_block > 0)
+    {
+      run_block_count = min(run_block_count, RAMDISK_CHUNK_BLOCK_COUNT - physical_block % RAMDISK_CHUNK_BLOCK_COUNT);
+    }
+  }
+
+  return run_block_count * BLK_SZ - file_position->data_offset_in_block;
+}
+
+// address of the location slot a block pointer maps to, allocating the
+// pointer blocks on the way unless in read mode; NULL when one is missing
+static int *ramdisk_block_pointer_get_slot(block_pointer_t *block_pointer)
+{
+  int new_block = 0;
+  int *location = NULL;
+
+  location = block_pointer->index_node->location;
+  // check single indirect
+  if (single_indirect_block_pointer_type == block_pointer->block_pointer_type)
+  {
+    if (0 == location[SINGLE_INDIRECT_BLOCK_POINTER])
+    {
+        if (block_pointer->is_read_mode)
+        {
+          return NULL;
+        }
+        new_block = ramdisk_block_calloc();
+        if (new_block <= 0)
+        {
+          return NULL;
+        }
+        location[SINGLE_INDIRECT_BLOCK_POINTER] = new_block;
+    }
+    location = (int *)ramdisk_get_block_memory_address(location[SINGLE_INDIRECT_BLOCK_POINTER]);
+    return &location[block_pointer->single_indirect_block_pointer];
+  }
+  // check double indirect
+  else if (double_indirect_block_pointer_type == block_pointer->block_pointer_type)
+  {
+
+    if (0 == location[DOUBLE_INDIRECT_BLOCK_POINTER])
+    {
+      if (block_pointer->is_read_mode)
+      {
+        return NULL;
+      }
+      else
+      {
+        new_block = ramdisk_block_calloc();
+        if (new_block <= 0)
+        {
+          return NULL;
+        }
+        location[DOUBLE_INDIRECT_BLOCK_POINTER] = new_block;
+      }
+    }
+    location = (int *)ramdisk_get_block_memory_address(location[DOUBLE_INDIRECT_BLOCK_POINTER]);
+    if (0 == location[block_pointer->double_indirect_block_pointer_row])
+    {
+      if (block_pointer->is_read_mode)
+      {
+        return NULL;
+      }
+      else
+      {
+        /* If we fail in allocate the neccesary block memory,
+           then this function will return NULL. */
+        new_block = ramdisk_block_calloc();
+        if (new_block <= 0)
+        {
+          return NULL;
+        }
+        location[block_pointer->double_indirect_block_pointer_row] = new_block;
+      }
+    }
+    location = (int *)ramdisk_get_block_memory_address(location[block_pointer->double_indirect_block_pointer_row]);
+    return &location[block_pointer->double_indirect_block_pointer_column];
+  }
+
+  return &location[block_pointer->direct_block_pointer];
+}
+
+// allocate block and return address
+int ramdisk_alloc_and_get_block_pointer(block_pointer_t *block_pointer)
+{
+  int new_block = 0;
+  int *slot = NULL;
+
+  if (block_pointer->index_node->flags & INDEX_NODE_FLAG_EXTENTS)
+  {
+    return ramdisk_extent_get_block(block_pointer->index_node,
+      ramdisk_block_pointer_get_block_number(block_pointer),
+      block_pointer->is_read_mode,
+      NULL);
+  }
+  slot = ramdisk_block_pointer_get_slot(block_pointer);
+  if (NULL == slot)
+  {
+    return -1;
+  }
+  /* When we use the block pointer for writing data,
+     this function will allocate the neccesary block memory
+     for storing the file's data. */
+  if (0 == *slot)
+  {
+    if (block_pointer->is_read_mode)
+    {
+      return -1;
+    }
+    else
+    {
+      /* If we fail in allocate the neccesary block memory,
+         then this function will return -1. */
+      new_block = ramdisk_block_alloc();
+      if (new_block <= 0)
+      {
+        return -1;
+      }
+      *slot = new_block;
+    }
+  }
+  // a block a reflinked file still maps gets a copy of its own before it changes
+  else if (!block_pointer->is_read_mode && ramdisk_block_is_shared(*slot))
+  {
+    new_block = ramdisk_block_alloc();
+    if (new_block <= 0)
+    {
+      return -1;
+    }
+    memcpy(ramdisk_get_block_memory_address(new_block), ramdisk_get_block_memory_address(*slot), BLK_SZ);
+    ramdisk_block_free(*slot);
+    *slot = new_block;
+  }
+  /* Return the block pointer value of the correspond block we want to read data from or write data to. */
+  return *slot;
+}
+unsigned char *ramdisk_get_block_bitmap()
+{
+  return ramdisk_memory + BLK_SZ * (1 + INDEX_NODE_ARRAY_BLOCK_COUNT);
+}
+
+// whether a block pointer lies in the file block area after the metadata
+static int ramdisk_is_file_block(int block_pointer)
+{
+  return (block_pointer >= METADATA_BLOCK_COUNT) && (block_pointer < TOTAL_BLOCK_COUNT);
+}
+
+// address of the location slot that maps block_number of a block-mapped
+// file, NULL when the pointer block on the way is not allocated; unlike
+// ramdisk_alloc_and_get_block_pointer this never allocates
+int *ramdisk_get_block_slot(index_node_t *index_node, int block_number)
+{
+  int *location = NULL;
+
+  if (block_number < DIRECT_BLOCK_POINTER_COUNT)
+  {
+    return &index_node->location[block_number];
+  }
+  block_number = block_number - DIRECT_BLOCK_POINTER_COUNT;
+  if (block_number < PTRS_PB)
+  {
+    if (!ramdisk_is_file_block(index_node->location[SINGLE_INDIRECT_BLOCK_POINTER]))
+    {
+      return NULL;
+    }
+    location = (int *)ramdisk_get_block_memory_address(index_node->location[SINGLE_INDIRECT_BLOCK_POINTER]);
+    return &location[block_number];
+  }
+  block_number = block_number - PTRS_PB;
+  if ((block_number >= PTRS_PB * PTRS_PB) || !ramdisk_is_file_block(index_node->location[DOUBLE_INDIRECT_BLOCK_POINTER]))
+  {
+    return NULL;
+  }
+  location = (int *)ramdisk_get_block_memory_address(index_node->location[DOUBLE_INDIRECT_BLOCK_POINTER]);
+  if (!ramdisk_is_file_block(location[block_number / PTRS_PB]))
+  {
+    return NULL;
+  }
+  location = (int *)ramdisk_get_block_memory_address(location[block_number / PTRS_PB]);
+
+  return &location[block_number % PTRS_PB];
+}
+
+// record what a block holds, -1 for a pointer outside the file block area
+// or a block that is already claimed
+static int ramdisk_space_claim(space_report_t *report, unsigned char *block_class, int block_pointer, block_class_t class)
+{
+  if (!ramdisk_is_file_block(block_pointer))
+  {
+    report->invalid_pointer_count++;
+    return -1;
+  }
+  if (block_class_unaccounted != block_class[block_pointer])
+  {
+    // each file a reflinked data block belongs to claims it
+    if ((block_class_data == class) && (block_class_data == block_class[block_pointer]) && ramdisk_block_is_shared(block_pointer))
+    {
+      return 0;
+    }
+    report->shared_block_count++;
+    return -1;
+  }
+  block_class[block_pointer] = class;
+
+  return 0;
+}
+
+// count a directory entry naming an index node that is out of range or free
+static void ramdisk_space_check_entry(space_report_t *report, dir_entry_t *entry)
+{
+  if ((NULL == entry) || ('\0' == entry->filename[0]))
+  {
+    return;
+  }
+  if ((entry->index_node_number <= 0) || (entry->index_node_number > MAX_INDEX_NODES_COUNT)
+      || (0 == strcmp("", ramdisk_get_index_node(entry->index_node_number)->type)))
+  {
+    report->invalid_pointer_count++;
+  }
+}
+
+static void ramdisk_space_claim_btree(space_report_t *report, unsigned char *block_class, int block_pointer)
+{
+  int i = 0;
+  dir_btree_index_t *node = NULL;
+
+  // never follow a bad or already visited pointer, so a corrupt tree cannot loop
+  if (0 != ramdisk_space_claim(report, block_class, block_pointer, block_class_directory))
+  {
+    return;
+  }
+  node = (dir_btree_index_t *)ramdisk_get_block_memory_address(block_pointer);
+  if ((node->header.count < 0) || (node->header.count > (node->header.is_leaf ? DIR_BTREE_LEAF_ENTRY_COUNT : DIR_BTREE_INDEX_KEY_COUNT)))
+  {
+    report->invalid_pointer_count++;
+    return;
+  }
+  if (node->header.is_leaf)
+  {
+    report->btree_leaf_slot_count += DIR_BTREE_LEAF_ENTRY_COUNT;
+    report->btree_leaf_entry_count += node->header.count;
+    if ((0 != node->header.link) && !ramdisk_is_file_block(node->header.link))
+    {
+      report->invalid_pointer_count++;
+    }
+    for (i = 0; i < node->header.count; i++)
+    {
+      ramdisk_space_check_entry(report, &((dir_btree_leaf_t *)node)->entries[i]);
+    }
+    return;
+  }
+  ramdisk_space_claim_btree(report, block_class, node->header.link);
+  for (i = 0; i < node->header.count; i++)
+  {
+    ramdisk_space_claim_btree(report, block_class, node->keys[i].child);
+  }
+}
+
+// claim the blocks of an extent-mapped file and count its fragments
+static void ramdisk_space_claim_extents(space_report_t *report, unsigned char *block_class, index_node_t *index_node, file_space_t *file_space)
+{
+  int index = 0;
+  int block = 0;
+  int next_block = -1;
+  int extent_count = DIRECT_EXTENT_COUNT;
+  int *slot = NULL;
+
+  if (0 != index_node->location[EXTENT_INDIRECT_POINTER])
+  {
+    if (0 == ramdisk_space_claim(report, block_class, index_node->location[EXTENT_INDIRECT_POINTER], block_class_indirect))
+    {
+      extent_count = MAX_EXTENT_COUNT_IN_FILE;
+    }
+    file_space->indirect_block_count++;
+  }
+  for (index = 0; index < extent_count; index++)
+  {
+    slot = ramdisk_extent_get_slot(index_node, index, 1);
+    if ((NULL == slot) || (0 == *slot))
+    {
+      break;
+    }
+    for (block = 0; block < (1 << EXTENT_ORDER(*slot)); block++)
+    {
+      ramdisk_space_claim(report, block_class, EXTENT_BLOCK(*slot) + block, block_class_data);
+    }
+    if (EXTENT_BLOCK(*slot) != next_block)
+    {
+      file_space->fragment_count++;
+    }
+    file_space->block_count += 1 << EXTENT_ORDER(*slot);
+    next_block = EXTENT_BLOCK(*slot) + (1 << EXTENT_ORDER(*slot));
+  }
+}
+
+// claim the blocks of a block-mapped file or flat directory and count its fragments
+static void ramdisk_space_claim_blocks(space_report_t *report, unsigned char *block_class, index_node_t *index_node, block_class_t class, file_space_t *file_space)
+{
+  int i = 0;
+  int block_count = 0;
+  int next_block = -1;
+  int error_count = 0;
+  int *slot = NULL;
+  int *location = NULL;
+
+  error_count = report->invalid_pointer_count + report->shared_block_count;
+  if (0 != index_node->location[SINGLE_INDIRECT_BLOCK_POINTER])
+  {
+    ramdisk_space_claim(report, block_class, index_node->location[SINGLE_INDIRECT_BLOCK_POINTER], block_class_indirect);
+    file_space->indirect_block_count++;
+  }
+  if ((0 != index_node->location[DOUBLE_INDIRECT_BLOCK_POINTER])
+      && (0 == ramdisk_space_claim(report, block_class, index_node->location[DOUBLE_INDIRECT_BLOCK_POINTER], block_class_indirect)))
+  {
+    file_space->indirect_block_count++;
+    location = (int *)ramdisk_get_block_memory_address(index_node->location[DOUBLE_INDIRECT_BLOCK_POINTER]);
+    for (i = 0; i < PTRS_PB; i++)
+    {
+      if (0 != location[i])
+      {
+        ramdisk_space_claim(report, block_class, location[i], block_class_indirect);
+        file_space->indirect_block_count++;
+      }
+    }
+  }
+
+  // every mapped slot, not just those below size, since truncation frees
+  // whatever the map holds
+  block_count = DIRECT_BLOCK_POINTER_COUNT;
+  if (0 != index_node->location[DOUBLE_INDIRECT_BLOCK_POINTER])
+  {
+    block_count = MAX_BLOCK_COUNT_IN_FILE;
+  }
+  else if (0 != index_node->location[SINGLE_INDIRECT_BLOCK_POINTER])
+  {
+    block_count = DIRECT_BLOCK_POINTER_COUNT + PTRS_PB;
+  }
+  // a pointer block this walk could not claim may be free and unbacked
+  if (error_count != report->invalid_pointer_count + report->shared_block_count)
+  {
+    block_count = DIRECT_BLOCK_POINTER_COUNT;
+  }
+  for (i = 0; i < block_count; i++)
+  {
+    slot = ramdisk_get_block_slot(index_node, i);
+    if ((NULL == slot) || (0 == *slot))
+    {
+      continue;
+    }
+    ramdisk_space_claim(report, block_class, *slot, class);
+    if (*slot != next_block)
+    {
+      file_space->fragment_count++;
+    }
+    file_space->block_count++;
+    next_block = *slot + 1;
+  }
+}
+
+// walk the bitmap and every index node and describe how space is used
+static int ramdisk_space_walk(space_report_t *report)
+{
+  int i = 0;
+  int cpu = 0;
+  int run = 0;
+  int bucket = 0;
+  int block_pointer = 0;
+  int total_block_count = TOTAL_BLOCK_COUNT;
+  unsigned char *block_class = NULL;
+  unsigned char *block_bitmap = NULL;
+  index_node_t *index_node = NULL;
+  int slot = 0;
+  int error_count = 0;
+  file_space_t file_space;
+  block_magazine_t *magazine = NULL;
+  pack_slot_t *pack_slot = NULL;
+
+  block_class = (unsigned char *)vmalloc(total_block_count);
+  if (NULL == block_class)
+  {
+    return -1;
+  }
+  memset(report, 0, sizeof(space_report_t));
+  // blocks waiting to be reclaimed are in neither the bitmap nor a magazine
+  ramdisk_reclaim_flush();
+  report->chunk_count = ramdisk_chunk_count;
+  report->chunk_size = RAMDISK_CHUNK_BLOCK_COUNT * BLK_SZ;
+  spin_lock(&ramdisk_chunk_lock);
+  for (i = 0; i < ramdisk_chunk_count; i++)
+  {
+    if (NULL != ramdisk_chunks[i])
+    {
+      report->backed_chunk_count++;
+      if ((ramdisk_chunk_order > 0) && !is_vmalloc_addr(ramdisk_chunks[i]))
+      {
+        report->huge_chunk_count++;
+      }
+    }
+  }
+  spin_unlock(&ramdisk_chunk_lock);
+
+  // free blocks are those free in the bitmap plus those held in magazines
+  block_bitmap = ramdisk_get_block_bitmap();
+  spin_lock(&ramdisk_bitmap_lock);
+  for (block_pointer = 0; block_pointer < total_block_count; block_pointer++)
+  {
+    block_class[block_pointer] = (block_bitmap[block_pointer / 8] & (1 << (block_pointer % 8))) ? block_class_free : block_class_unaccounted;
+  }
+  spin_unlock(&ramdisk_bitmap_lock);
+  for_each_possible_cpu(cpu)
+  {
+    magazine = &per_cpu(ramdisk_block_magazine, cpu);
+    spin_lock(&magazine->lock);
+    for (i = 0; i < magazine->count; i++)
+    {
+      block_class[magazine->blocks[i]] = block_class_free;
+    }
+    spin_unlock(&magazine->lock);
+  }
+  for (block_pointer = 0; block_pointer < 1 + INDEX_NODE_ARRAY_BLOCK_COUNT + BLOCK_BITMAP_BLOCK_COUNT; block_pointer++)
+  {
+    block_class[block_pointer] = block_class_metadata;
+  }
+
+  // index node 0 is the root directory held in the superblock
+  for (i = 0; i <= MAX_INDEX_NODES_COUNT; i++)
+  {
+    index_node = ramdisk_get_index_node(i);
+    if (0 == strcmp("", index_node->type))
+    {
+      continue;
+    }
+    memset(&file_space, 0, sizeof(file_space_t));
+    file_space.index_node_number = i;
+    if (0 == strcmp("dir", index_node->type))
+    {
+      if (index_node->flags & INDEX_NODE_FLAG_DIR_BTREE)
+      {
+        report->btree_directory_count++;
+        ramdisk_space_claim_btree(report, block_class, index_node->location[0]);
+      }
+      else
+      {
+        report->flat_directory_count++;
+        report->flat_directory_slot_count += index_node->size / sizeof(dir_entry_t);
+        report->flat_directory_tombstone_count += index_node->size / sizeof(dir_entry_t) - index_node->dir_entry_count;
+        error_count = report->invalid_pointer_count + report->shared_block_count;
+        ramdisk_space_claim_blocks(report, block_class, index_node, block_class_directory, &file_space);
+        // entries can only be read through blocks the walk could claim
+        for (slot = 0; (error_count == report->invalid_pointer_count + report->shared_block_count) && (slot < index_node->size / (int)sizeof(dir_entry_t)); slot++)
+        {
+          // every slot below the size is mapped, or the size is corrupt
+          if (NULL == ramdisk_get_dir_slot(index_node, slot))
+          {
+            report->invalid_pointer_count++;
+            break;
+          }
+          ramdisk_space_check_entry(report, ramdisk_get_dir_slot(index_node, slot));
+        }
+      }
+      continue;
+    }
+    if (index_node->flags & INDEX_NODE_FLAG_EXTENTS)
+    {
+      report->extent_file_count++;
+      ramdisk_space_claim_extents(report, block_class, index_node, &file_space);
+    }
+    else
+    {
+      ramdisk_space_claim_blocks(report, block_class, index_node, block_class_data, &file_space);
+    }
+    if (index_node->flags & INDEX_NODE_FLAG_TAIL)
+    {
+      report->packed_tail_count++;
+      // a pack block is shared by design, claim it once; only read it if
+      // it is not free or another file's block
+      pack_slot = NULL;
+      if (ramdisk_is_file_block(TAIL_BLOCK(index_node->tail)) && (TAIL_SLOT(index_node->tail) < PACK_SLOT_COUNT)
+          && ((block_class_unaccounted == block_class[TAIL_BLOCK(index_node->tail)]) || (block_class_pack == block_class[TAIL_BLOCK(index_node->tail)])))
+      {
+        pack_slot = &((pack_block_header_t *)ramdisk_get_block_memory_address(TAIL_BLOCK(index_node->tail)))->slots[TAIL_SLOT(index_node->tail)];
+      }
+      if ((NULL == pack_slot) || (i != pack_slot->index_node_number) || (pack_slot->first_unit < PACK_HEADER_UNIT_COUNT)
+          || (pack_slot->first_unit + pack_slot->unit_count > PACK_UNIT_COUNT))
+      {
+        report->invalid_pointer_count++;
+      }
+      else
+      {
+        block_class[TAIL_BLOCK(index_node->tail)] = block_class_pack;
+      }
+    }
+    if (file_space.fragment_count > 1)
+    {
+      report->fragmented_file_count++;
+    }
+    report->files[report->file_count] = file_space;
+    report->file_count++;
+  }
+
+  // class totals and the free run length distribution
+  for (block_pointer = 0; block_pointer <= total_block_count; block_pointer++)
+  {
+    if ((block_pointer < total_block_count) && (block_class_free == block_class[block_pointer]))
+    {
+      run++;
+    }
+    else if (run > 0)
+    {
+      report->free_run_count++;
+      report->largest_free_run = max(report->largest_free_run, run);
+      for (bucket = 0; (1 << (bucket + 1)) <= run; bucket++)
+      {
+      }
+      report->free_run_histogram[min(bucket, SPACE_RUN_BUCKET_COUNT - 1)]++;
+      run = 0;
+    }
+    if (block_pointer < total_block_count)
+    {
+      report->block_class_count[block_class[block_pointer]]++;
+    }
+  }
+  vfree(block_class);
+
+  return 0;
+}
+
+// the space report; the caller keeps other commands out, reads and writes
+// are kept out here since copy-on-write frees blocks
+int ramdisk_space_analyze(space_report_t *report)
+{
+  int result = 0;
+
+  down_write(&ramdisk_io_lock);
+  result = ramdisk_space_walk(report);
+  up_write(&ramdisk_io_lock);
+
+  return result;
+}
+
+// claim the smallest free run of at least block_count blocks from the
+// bitmap, -1 when there is none; magazines should be drained first so the
+// bitmap shows all free space
+static int ramdisk_bitmap_alloc_run(int block_count)
+{
+  int block_pointer = 0;
+  int run_start = 0;
+  int run = 0;
+  int best_start = -1;
+  int best_run = 0;
+  int total_block_count = TOTAL_BLOCK_COUNT;
+  unsigned char *block_bitmap = NULL;
+
+  block_bitmap = ramdisk_get_block_bitmap();
+  spin_lock(&ramdisk_bitmap_lock);
+  for (block_pointer = 0; block_pointer <= total_block_count; block_pointer++)
+  {
+    if ((block_pointer < total_block_count) && (block_bitmap[block_pointer / 8] & (1 << (block_pointer % 8))))
+    {
+      if (0 == run)
+      {
+        run_start = block_pointer;
+      }
+      run++;
+      continue;
+    }
+    if ((run >= block_count) && ((best_start < 0) || (run < best_run)))
+    {
+      best_start = run_start;
+      best_run = run;
+    }
+    run = 0;
+  }
+  if (best_start >= 0)
+  {
+    ramdisk_bitmap_set_range(best_start, block_count, 0);
+  }
+  spin_unlock(&ramdisk_bitmap_lock);
+  if ((best_start >= 0) && (0 != ramdisk_chunk_get(best_start, block_count)))
+  {
+    spin_lock(&ramdisk_bitmap_lock);
+    ramdisk_bitmap_set_range(best_start, block_count, 1);
+    spin_unlock(&ramdisk_bitmap_lock);
+    best_start = -1;
+  }
+
+  return best_start;
+}
+
+// number of physically contiguous runs the first block_count blocks of a
+// block-mapped file fall into
+static int ramdisk_get_fragment_count(index_node_t *index_node, int block_count)
+{
+  int i = 0;
+  int fragment_count = 0;
+  int next_block = -1;
+  int *slot = NULL;
+
+  for (i = 0; i < block_count; i++)
+  {
+    slot = ramdisk_get_block_slot(index_node, i);
+    if ((NULL == slot) || (*slot <= 0))
+    {
+      continue;
+    }
+    if (*slot != next_block)
+    {
+      fragment_count++;
+    }
+    next_block = *slot + 1;
+  }
+
+  return fragment_count;
+}
+
+// whether any of the first block_count blocks of a block-mapped file is reflinked
+static int ramdisk_has_shared_blocks(index_node_t *index_node, int block_count)
+{
+  int i = 0;
+  int *slot = NULL;
+
+  if (NULL == ramdisk_block_refcount)
+  {
+    return 0;
+  }
+  for (i = 0; i < block_count; i++)
+  {
+    slot = ramdisk_get_block_slot(index_node, i);
+    if ((NULL != slot) && (*slot > 0) && ramdisk_block_is_shared(*slot))
+    {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// move the data blocks of a block-mapped regular file into one free run,
+// rewriting location[] and the indirect pointer blocks in place
+static void ramdisk_defrag_file(int index_node_number, defrag_param_t *defrag_param)
+{
+  int i = 0;
+  int block_count = 0;
+  int fragment_count = 0;
+  int run_start = 0;
+  int old_block = 0;
+  int *slot = NULL;
+  index_node_t *index_node = NULL;
+
+  index_node = ramdisk_get_index_node(index_node_number);
+  // compressed files are cold, and reads decompress them into the cache anyway
+  if ((0 != strcmp("reg", index_node->type)) || (index_node->flags & (INDEX_NODE_FLAG_EXTENTS | INDEX_NODE_FLAG_COMPRESSED)))
+  {
+    return;
+  }
+  down_write(&ramdisk_index_node_lock[index_node_number]);
+  block_count = (index_node->size + BLK_SZ - 1) / BLK_SZ;
+  // a packed tail is not part of the block map
+  if (index_node->flags & INDEX_NODE_FLAG_TAIL)
+  {
+    block_count--;
+  }
+  fragment_count = ramdisk_get_fragment_count(index_node, block_count);
+  defrag_param->file_count++;
+  defrag_param->fragment_count_before += fragment_count;
+  run_start = -1;
+  // moving a reflinked block would give this file a copy of its own
+  if ((fragment_count > 1) && !ramdisk_has_shared_blocks(index_node, block_count))
+  {
+    // blocks freed by earlier files sit in magazines until drained
+    ramdisk_drain_block_magazines();
+    run_start = ramdisk_bitmap_alloc_run(block_count);
+  }
+  if (run_start < 0)
+  {
+    // already contiguous, or no free run is long enough
+    defrag_param->fragment_count_after += fragment_count;
+    up_write(&ramdisk_index_node_lock[index_node_number]);
+    return;
+  }
+  for (i = 0; i < block_count; i++)
+  {
+    slot = ramdisk_get_block_slot(index_node, i);
+    if ((NULL == slot) || (*slot <= 0))
+    {
+      ramdisk_block_free(run_start + i);
+      continue;
+    }
+    old_block = *slot;
+    memcpy(ramdisk_get_block_memory_address(run_start + i), ramdisk_get_block_memory_address(old_block), BLK_SZ);
+    *slot = run_start + i;
+    ramdisk_block_free(old_block);
+    defrag_param->bytes_moved += BLK_SZ;
+  }
+  defrag_param->fragment_count_after += ramdisk_get_fragment_count(index_node, block_count);
+  up_write(&ramdisk_index_node_lock[index_node_number]);
+}
+
+// defragment one regular file, or all of them when index_node_number is -1;
+// extent-mapped files are already laid out in contiguous chunks and are left alone
+int ramdisk_defrag(defrag_param_t *defrag_param)
+{
+  int i = 0;
+
+  defrag_param->file_count = 0;
+  defrag_param->bytes_moved = 0;
+  defrag_param->fragment_count_before = 0;
+  defrag_param->fragment_count_after = 0;
+  if ((defrag_param->index_node_number < -1) || (defrag_param->index_node_number > MAX_INDEX_NODES_COUNT))
+  {
+    return -1;
+  }
+  // free runs can only be found in the bitmap, and the buddy allocator owns it
+  if (ramdisk_buddy_allocator)
+  {
+    return 0;
+  }
+  if (-1 != defrag_param->index_node_number)
+  {
+    ramdisk_defrag_file(defrag_param->index_node_number, defrag_param);
+    return 0;
+  }
+  for (i = 1; i <= MAX_INDEX_NODES_COUNT; i++)
+  {
+    ramdisk_defrag_file(i, defrag_param);
+  }
+
+  return 0;
+}
+
+// a data block in the index a dedup pass builds, keyed by a hash of its bytes
+typedef struct dedup_entry_struct
+{
+  u32 hash;
+  // 0 marks an empty entry
+  int block_pointer;
+} dedup_entry_t;
+
+// look up the bytes of every data block of a block-mapped regular file in
+// the index, add blocks not seen before, and point the file at the indexed
+// block in place of each duplicate
+static void ramdisk_dedup_file(int index_node_number, dedup_entry_t *index, int index_mask, dedup_param_t *dedup_param)
+{
+  int i = 0;
+  int block_count = 0;
+  int old_block = 0;
+  int *slot = NULL;
+  u32 hash = 0;
+  u32 probe = 0;
+  char *data = NULL;
+  index_node_t *index_node = NULL;
+
+  index_node = ramdisk_get_index_node(index_node_number);
+  if ((0 != strcmp("reg", index_node->type)) || (index_node->flags & INDEX_NODE_FLAG_EXTENTS))
+  {
+    return;
+  }
+  block_count = (index_node->size + BLK_SZ - 1) / BLK_SZ;
+  // a packed tail is not part of the block map
+  if (index_node->flags & INDEX_NODE_FLAG_TAIL)
+  {
+    block_count--;
+  }
+  dedup_param->file_count++;
+  // every block hashed may take an entry, and a probe needs one left empty
+  for (i = 0; (i < block_count) && (dedup_param->block_count < index_mask); i++)
+  {
+    slot = ramdisk_get_block_slot(index_node, i);
+    if ((NULL == slot) || (*slot <= 0))
+    {
+      continue;
+    }
+    data = ramdisk_get_block_memory_address(*slot);
+    hash = jhash2((u32 *)data, BLK_SZ / sizeof(u32), 0);
+    dedup_param->block_count++;
+    for (probe = hash & index_mask; 0 != index[probe].block_pointer; probe = (probe + 1) & index_mask)
+    {
+      if ((index[probe].hash == hash) && ((index[probe].block_pointer == *slot)
+          || (0 == memcmp(ramdisk_get_block_memory_address(index[probe].block_pointer), data, BLK_SZ))))
+      {
+        break;
+      }
+    }
+    if (0 == index[probe].block_pointer)
+    {
+      index[probe].hash = hash;
+      index[probe].block_pointer = *slot;
+      continue;
+    }
+    // already shared, or too many owners to take another one
+    if ((index[probe].block_pointer == *slot) || (0 != ramdisk_block_share(index[probe].block_pointer)))
+    {
+      continue;
+    }
+    old_block = *slot;
+    *slot = index[probe].block_pointer;
+    dedup_param->duplicate_block_count++;
+    if (!ramdisk_block_is_shared(old_block))
+    {
+      dedup_param->blocks_freed++;
+    }
+    ramdisk_block_free(old_block);
+  }
+}
+
+// point every data block of a block-mapped regular file that holds the same
+// bytes as another at a single copy they share, so redundant data takes the
+// space once; the first write to a shared block gives the writer its own copy
+// again. The index lives for one pass: keeping it across writes would put a
+// hash on every write and every free. Extent-mapped files own their extents
+// whole and are left alone
+int ramdisk_dedup(dedup_param_t *dedup_param)
+{
+  int i = 0;
+  int index_size = 1;
+  int used_block_count = 0;
+  dedup_entry_t *index = NULL;
+
+  dedup_param->file_count = 0;
+  dedup_param->block_count = 0;
+  dedup_param->duplicate_block_count = 0;
+  dedup_param->blocks_freed = 0;
+  if (ramdisk_buddy_allocator)
+  {
+    return 0;
+  }
+  // at most half full, so probe chains stay short
+  used_block_count = TOTAL_BLOCK_COUNT - ramdisk_get_free_block_count();
+  while (index_size < 2 * used_block_count)
+  {
+    index_size = index_size * 2;
+  }
+  index = (dedup_entry_t *)vzalloc(index_size * sizeof(dedup_entry_t));
+  if (NULL == index)
+  {
+    return -1;
+  }
+  // a block indexed from one file is shared with another later on, so no
+  // file may be written until the pass is over
+  down_write(&ramdisk_io_lock);
+  for (i = 1; i <= MAX_INDEX_NODES_COUNT; i++)
+  {
+    ramdisk_dedup_file(i, index, index_size - 1, dedup_param);
+  }
+  up_write(&ramdisk_io_lock);
+  vfree(index);
+
+  return 0;
+}
+
+// copy length bytes between address and a file's blocks from pos on,
+// allocating blocks unless in read mode, where a hole reads as zeros;
+// returns the bytes copied, short when out of space
+static int ramdisk_stream_copy(index_node_t *index_node, int pos, char *address, int length, int is_read_mode)
+{
+  int data_length_copied = 0;
+  int data_length_to_copy_once = 0;
+  char *data = NULL;
+  file_position_t file_position;
+
+  if (length <= 0)
+  {
+    return 0;
+  }
+  ramdisk_file_position_init(&file_position, index_node, pos, is_read_mode);
+  while (data_length_copied < length)
+  {
+    data = ramdisk_get_memory_address(&file_position);
+    if ((NULL == data) && !is_read_mode)
+    {
+      break;
+    }
+    if (NULL == data)
+    {
+      data_length_to_copy_once = min(BLK_SZ - file_position.data_offset_in_block, length - data_length_copied);
+      memset(address + data_length_copied, 0, data_length_to_copy_once);
+    }
+    else
+    {
+      data_length_to_copy_once = min(ramdisk_get_contiguous_length(&file_position), length - data_length_copied);
+      if (is_read_mode)
+      {
+        memcpy(address + data_length_copied, data, data_length_to_copy_once);
+      }
+      else
+      {
+        memcpy(data, address + data_length_copied, data_length_to_copy_once);
+      }
+    }
+    data_length_copied = data_length_copied + data_length_to_copy_once;
+    if (data_length_copied < length)
+    {
+      ramdisk_file_position_add(&file_position, data_length_to_copy_once);
+    }
+  }
+
+  return data_length_copied;
+}
+
+// forget the decompressed units of a file, or of every file when NULL
+static void ramdisk_compress_cache_drop(index_node_t *index_node)
+{
+  int i = 0;
+
+  mutex_lock(&ramdisk_compress_lock);
+  for (i = 0; (NULL != ramdisk_compress_cache) && (i < COMPRESS_CACHE_SIZE); i++)
+  {
+    if ((NULL == index_node) || (ramdisk_compress_cache[i].index_node == index_node))
+    {
+      ramdisk_compress_cache[i].index_node = NULL;
+    }
+  }
+  mutex_unlock(&ramdisk_compress_lock);
+}
+
+// the cache entry holding a unit of a compressed file, decompressing it
+// into the oldest entry when it is not cached, NULL when the stream is
+// corrupt or out of memory; callers hold ramdisk_compress_lock
+static compress_cache_entry_t *ramdisk_compress_cache_get(index_node_t *index_node, int unit)
+{
+  int i = 0;
+  int unit_length = 0;
+  int stream_length = 0;
+  int offsets[2];
+  size_t decompressed_length = 0;
+  compress_cache_entry_t *entry = NULL;
+
+  for (i = 0; (NULL != ramdisk_compress_cache) && (i < COMPRESS_CACHE_SIZE); i++)
+  {
+    if ((ramdisk_compress_cache[i].index_node == index_node) && (ramdisk_compress_cache[i].unit == unit))
+    {
+      return &ramdisk_compress_cache[i];
+    }
+  }
+  if (NULL == ramdisk_compress_cache)
+  {
+    ramdisk_compress_cache = (compress_cache_entry_t *)vzalloc(COMPRESS_CACHE_SIZE * sizeof(compress_cache_entry_t));
+    ramdisk_compress_buffer = (char *)vmalloc(COMPRESS_UNIT_SZ);
+    if ((NULL == ramdisk_compress_cache) || (NULL == ramdisk_compress_buffer))
+    {
+      vfree(ramdisk_compress_cache);
+      vfree(ramdisk_compress_buffer);
+      ramdisk_compress_cache = NULL;
+      ramdisk_compress_buffer = NULL;
+      return NULL;
+    }
+  }
+
+  // an imported image may hold anything, so check the offsets before using them
+  unit_length = min(COMPRESS_UNIT_SZ, index_node->size - unit * COMPRESS_UNIT_SZ);
+  stream_length = ramdisk_compressed_stream_length(index_node);
+  if ((stream_length < 0) || (sizeof(offsets) != ramdisk_stream_copy(index_node, unit * sizeof(int), (char *)offsets, sizeof(offsets), 1))
+      || (offsets[0] < (COMPRESS_UNIT_COUNT(index_node->size) + 1) * (int)sizeof(int)) || (offsets[1] > stream_length)
+      || (offsets[1] <= offsets[0]) || (offsets[1] - offsets[0] > unit_length))
+  {
+    return NULL;
+  }
+  entry = &ramdisk_compress_cache[ramdisk_compress_cache_hand];
+  ramdisk_compress_cache_hand = (ramdisk_compress_cache_hand + 1) % COMPRESS_CACHE_SIZE;
+  entry->index_node = NULL;
+  decompressed_length = unit_length;
+  if (offsets[1] - offsets[0] == unit_length)
+  {
+    ramdisk_stream_copy(index_node, offsets[0], entry->data, unit_length, 1);
+  }
+  else
+  {
+    ramdisk_stream_copy(index_node, offsets[0], ramdisk_compress_buffer, offsets[1] - offsets[0], 1);
+    if ((LZO_E_OK != lzo1x_decompress_safe((unsigned char *)ramdisk_compress_buffer, offsets[1] - offsets[0], (unsigned char *)entry->data, &decompressed_length))
+        || (decompressed_length != unit_length))
+    {
+      return NULL;
+    }
+  }
+  entry->index_node = index_node;
+  entry->unit = unit;
 
-  return 0;
+  return entry;
 }
 
-// close fd table
-int ramdisk_close(int index_node_number)
+// length of a compressed file's stream, the last entry of its offset table
+static int ramdisk_compressed_stream_length(index_node_t *index_node)
 {
-  index_node_t *index_node = NULL;
+  int stream_length = 0;
 
-  // decrease number of open index nodes
-  index_node = ramdisk_get_index_node(index_node_number);
-  index_node->open_counter--;
+  if (sizeof(int) != ramdisk_stream_copy(index_node, COMPRESS_UNIT_COUNT(index_node->size) * sizeof(int), (char *)&stream_length, sizeof(int), 1))
+  {
+    return -1;
+  }
 
-  return 0;
+  return (stream_length <= MAX_FILE_SIZE) ? stream_length : -1;
 }
 
-// read number of bytes from a file
-int ramdisk_read(int index_node_number, int pos, char *address, int num_bytes)
+// read from a compressed file a unit at a time through the cache, to user
+// space or to the kernel address of another file's block; returns the
+// bytes read, -1 when the stream is corrupt
+static int ramdisk_compressed_read(index_node_t *index_node, int pos, char *address, int num_bytes, int is_user)
 {
   int data_length_read = 0;
   int data_length_to_read_once = 0;
-  int remainder_data_length_in_block = 0;
-  int remainder_data_length_to_read = 0;
-  char *dst = NULL;
-  char *src = NULL;
-  index_node_t *index_node = NULL;
-  file_position_t file_position;
+  int offset_in_unit = 0;
+  compress_cache_entry_t *entry = NULL;
 
-  // can not read directory file
-  index_node = ramdisk_get_index_node(index_node_number);
-  if (0 != strcmp("reg", index_node->type))
-  {
-    return -1;
-  }
-  // check if we are trying to read too much
-  num_bytes = min(num_bytes, index_node->size - pos);
-  /* Init the file position data structure. */
-  ramdisk_file_position_init(&file_position, index_node, pos, 1);
-  dst = address;
-  remainder_data_length_to_read = num_bytes;
-  // read block by block
-  while (remainder_data_length_to_read > 0)
+  mutex_lock(&ramdisk_compress_lock);
+  while (data_length_read < num_bytes)
   {
-    remainder_data_length_in_block = BLK_SZ - file_position.data_offset_in_block;
-    // the data length to read once should not exceed the remainder space in one block.
-    data_length_to_read_once = min(remainder_data_length_in_block, remainder_data_length_to_read);
-    src = ramdisk_get_memory_address(&file_position);
-    if (NULL == src)
+    entry = ramdisk_compress_cache_get(index_node, (pos + data_length_read) / COMPRESS_UNIT_SZ);
+    if (NULL == entry)
     {
+      data_length_read = -1;
       break;
     }
-    // copy the data from the ramdisk to the user space.
-    copy_to_user(dst, src, data_length_to_read_once);
+    offset_in_unit = (pos + data_length_read) % COMPRESS_UNIT_SZ;
+    data_length_to_read_once = min(COMPRESS_UNIT_SZ - offset_in_unit, num_bytes - data_length_read);
+    if (is_user)
+    {
+      copy_to_user(address + data_length_read, entry->data + offset_in_unit, data_length_to_read_once);
+    }
+    else
+    {
+      memcpy(address + data_length_read, entry->data + offset_in_unit, data_length_to_read_once);
+    }
     data_length_read = data_length_read + data_length_to_read_once;
-    dst = dst + data_length_to_read_once;
-    remainder_data_length_to_read = remainder_data_length_to_read - data_length_to_read_once;
-    ramdisk_file_position_add(&file_position, data_length_to_read_once);
   }
+  mutex_unlock(&ramdisk_compress_lock);
+
   return data_length_read;
 }
 
-int ramdisk_write(int index_node_number, int pos, char *address, int num_bytes)
+// move the blocks of a file to those of new_index_node, which holds the
+// same bytes in another form, and free the old ones
+static void ramdisk_replace_blocks(index_node_t *index_node, index_node_t *new_index_node)
 {
-  int data_length_written = 0;
-  int data_length_to_write_once = 0;
-  int remainder_space_in_block = 0;
-  int remainder_data_length_to_write = 0;
-  char *dst = NULL;
-  char *src = NULL;
-  index_node_t *index_node = NULL;
-  file_position_t file_position;
+  ramdisk_truncate_blocks(index_node, 0);
+  memcpy(index_node->location, new_index_node->location, sizeof(index_node->location));
+  index_node->flags = (index_node->flags & ~INDEX_NODE_FLAG_COMPRESSED) | (new_index_node->flags & INDEX_NODE_FLAG_COMPRESSED);
+}
 
-  // type of index node is directory file
-  index_node = ramdisk_get_index_node(index_node_number);
-  if (0 != strcmp("reg", index_node->type))
+// turn a compressed file back into plain blocks before it changes; callers
+// hold the file's lock exclusively
+static int ramdisk_expand_index_node(index_node_t *index_node)
+{
+  int result = 0;
+  char *data = NULL;
+  index_node_t plain_index_node;
+
+  data = (char *)vmalloc(max(index_node->size, 1));
+  if (NULL == data)
   {
     return -1;
   }
-  // check if we are trying to write too much
-  num_bytes = min(num_bytes, MAX_FILE_SIZE - pos);
-  if (num_bytes > 0)
+  memset(&plain_index_node, 0, sizeof(index_node_t));
+  strcpy(plain_index_node.type, "reg");
+  plain_index_node.flags = index_node->flags & INDEX_NODE_FLAG_EXTENTS;
+  // the compressed blocks stay until the plain ones are all written
+  if ((index_node->size != ramdisk_compressed_read(index_node, 0, data, index_node->size, 0))
+      || (index_node->size != ramdisk_stream_copy(&plain_index_node, 0, data, index_node->size, 0)))
   {
-    ramdisk_file_position_init(&file_position, index_node, pos, 0);
+    ramdisk_truncate_blocks(&plain_index_node, 0);
+    result = -1;
   }
-  src = address;
-  remainder_data_length_to_write = num_bytes;
-  
-  while (remainder_data_length_to_write > 0)
+  else
   {
-    remainder_space_in_block = BLK_SZ - file_position.data_offset_in_block;
-
-    data_length_to_write_once = min(remainder_space_in_block, remainder_data_length_to_write);
-    dst = ramdisk_get_memory_address(&file_position);
-    if (NULL == dst)
-    {
-      break;
-    }
-  
-    copy_from_user(dst, src, data_length_to_write_once);
-    data_length_written = data_length_written + data_length_to_write_once;
-    src = src + data_length_to_write_once;
-    remainder_data_length_to_write = remainder_data_length_to_write - data_length_to_write_once;
-    if (remainder_data_length_to_write > 0)
-    {
-      ramdisk_file_position_add(&file_position, data_length_to_write_once);
-    }
+    ramdisk_compress_cache_drop(index_node);
+    ramdisk_replace_blocks(index_node, &plain_index_node);
   }
-  index_node->size = (pos + data_length_written > index_node->size) ? (pos + data_length_written) : index_node->size;
+  vfree(data);
 
-  return data_length_written;
+  return result;
 }
 
-// seek to a position in a file
-int ramdisk_lseek(int index_node_number, int seek_offset, int *seek_result_offset)
+// replace the blocks of a regular file with a compressed stream of its
+// data when that takes fewer blocks; callers hold the file's lock exclusively
+static int ramdisk_compress_index_node(index_node_t *index_node, compress_param_t *compress_param)
 {
-  index_node_t *index_node = NULL;
+  int i = 0;
+  int result = 0;
+  int unit_count = 0;
+  int unit_length = 0;
+  int stream_length = 0;
+  size_t compressed_length = 0;
+  int *offsets = NULL;
+  char *data = NULL;
+  char *stream = NULL;
+  char *unit = NULL;
+  void *workspace = NULL;
+  index_node_t stream_index_node;
 
-  // can not seek directory file
-  index_node = ramdisk_get_index_node(index_node_number);
-  if (0 != strcmp("reg", index_node->type))
+  if ((0 != strcmp("reg", index_node->type)) || (index_node->flags & INDEX_NODE_FLAG_COMPRESSED) || (index_node->size <= BLK_SZ))
   {
-    return -1;
+    return 0;
   }
-  if (seek_offset < 0)
+  unit_count = COMPRESS_UNIT_COUNT(index_node->size);
+  data = (char *)vmalloc(index_node->size);
+  // a stream as long as the data saves nothing, so that is all the room it gets
+  stream = (char *)vmalloc(index_node->size);
+  unit = (char *)vmalloc(lzo1x_worst_compress(COMPRESS_UNIT_SZ));
+  workspace = vmalloc(LZO1X_1_MEM_COMPRESS);
+  if ((NULL == data) || (NULL == stream) || (NULL == unit) || (NULL == workspace))
   {
-    *seek_result_offset = 0;
+    result = -1;
   }
-  // check if we are trying to seek too much and return end of file
-  else if (seek_offset > index_node->size)
+  else
   {
-    *seek_result_offset = index_node->size;
+    ramdisk_stream_copy(index_node, 0, data, index_node->size, 1);
+    offsets = (int *)stream;
+    stream_length = (unit_count + 1) * sizeof(int);
+    for (i = 0; (i < unit_count) && (stream_length < index_node->size); i++)
+    {
+      offsets[i] = stream_length;
+      unit_length = min(COMPRESS_UNIT_SZ, index_node->size - i * COMPRESS_UNIT_SZ);
+      // a unit that does not get shorter is stored as it is, which is how
+      // a read tells the two apart
+      compressed_length = lzo1x_worst_compress(COMPRESS_UNIT_SZ);
+      if ((LZO_E_OK != lzo1x_1_compress((unsigned char *)data + i * COMPRESS_UNIT_SZ, unit_length, (unsigned char *)unit, &compressed_length, workspace))
+          || (compressed_length >= unit_length))
+      {
+        compressed_length = unit_length;
+        memcpy(unit, data + i * COMPRESS_UNIT_SZ, unit_length);
+      }
+      // the stream stops growing once it is as long as the data, and is dropped below
+      compressed_length = min((int)compressed_length, index_node->size - stream_length);
+      memcpy(stream + stream_length, unit, compressed_length);
+      stream_length = stream_length + compressed_length;
+    }
   }
-  // return the seek offset
-  else
+
+  // only keep a stream that takes fewer blocks than the data
+  if ((0 == result) && ((stream_length + BLK_SZ - 1) / BLK_SZ < (index_node->size + BLK_SZ - 1) / BLK_SZ))
   {
-    *seek_result_offset = seek_offset;
+    offsets[unit_count] = stream_length;
+    memset(&stream_index_node, 0, sizeof(index_node_t));
+    strcpy(stream_index_node.type, "reg");
+    stream_index_node.flags = (index_node->flags & INDEX_NODE_FLAG_EXTENTS) | INDEX_NODE_FLAG_COMPRESSED;
+    if (stream_length != ramdisk_stream_copy(&stream_index_node, 0, stream, stream_length, 0))
+    {
+      ramdisk_truncate_blocks(&stream_index_node, 0);
+      result = -1;
+    }
+    else
+    {
+      ramdisk_replace_blocks(index_node, &stream_index_node);
+      compress_param->file_count++;
+      compress_param->bytes_before += index_node->size;
+      compress_param->bytes_after += stream_length;
+    }
   }
+  vfree(data);
+  vfree(stream);
+  vfree(unit);
+  vfree(workspace);
 
-  return 0;
+  return result;
 }
 
-// read directory file and store in address
-int ramdisk_readdir(int index_node_number, char *address, int *pos)
+// compress one regular file, or every regular file nobody has read or
+// written for idle_seconds when index_node_number is -1; a compressed file
+// is decompressed a unit at a time by reads, through a small cache, and
+// back to plain blocks by the first write
+int ramdisk_compress(compress_param_t *compress_param)
 {
-  dir_entry_t *entry = NULL;
-  index_node_t *index_node = NULL;
-  file_position_t file_position;
+  int i = 0;
+  int result = 0;
+  unsigned long long now = 0;
 
-  index_node = ramdisk_get_index_node(index_node_number);
-  if (0 != strcmp("dir", index_node->type))
+  compress_param->file_count = 0;
+  compress_param->bytes_before = 0;
+  compress_param->bytes_after = 0;
+  if ((compress_param->index_node_number < -1) || (compress_param->index_node_number > MAX_INDEX_NODES_COUNT)
+      || (compress_param->idle_seconds < 0))
   {
     return -1;
   }
-  /* Init the file position data structure. */
-  ramdisk_file_position_init(&file_position, index_node, *pos, 1);
-  while (file_position.file_position < index_node->size)
+  now = sched_clock();
+  for (i = 1; i <= MAX_INDEX_NODES_COUNT; i++)
   {
-    entry = (dir_entry_t *)ramdisk_get_memory_address(&file_position);
-    if (NULL == entry)
+    if ((-1 == compress_param->index_node_number)
+        ? (now - ramdisk_access_time[i] < (unsigned long long)compress_param->idle_seconds * 1000000000ULL)
+        : (i != compress_param->index_node_number))
     {
-      break;
+      continue;
     }
-    ramdisk_file_position_add(&file_position, sizeof(dir_entry_t));
-
-    if (0 != strcmp(entry->filename, ""))
+    down_write(&ramdisk_index_node_lock[i]);
+    if (0 != ramdisk_compress_index_node(ramdisk_get_index_node(i), compress_param))
     {
-      memcpy(address, entry, sizeof(dir_entry_t));
-      *pos = file_position.file_position;
-      return 1;
+      result = -1;
     }
+    up_write(&ramdisk_index_node_lock[i]);
   }
 
-  *pos = file_position.file_position;
-  return 0;
+  return result;
 }
 
-// length of directory entry in bytes
-int ramdisk_get_dir_entry_length()
+// whether a block is allocated in a block bitmap
+static int ramdisk_image_block_used(unsigned char *block_bitmap, int block_pointer)
 {
-  return ((int)sizeof(dir_entry_t));
+  return 0 == (block_bitmap[block_pointer / 8] & (1 << (block_pointer % 8)));
 }
 
-// return memory address of inode array
-index_node_t *ramdisk_get_index_node(int index_node_number)
+// number of blocks a reflink count table gives owners beyond the first
+static int ramdisk_image_count_reflinks(unsigned short *refcount)
 {
-  superblock_t *superblock = NULL;
-  index_node_t *index_node_array = NULL;
+  int block_pointer = 0;
+  int reflink_count = 0;
 
-  // if the inode is 0 then we are just at root directory
-  if (index_node_number <= 0)
+  for (block_pointer = 0; (NULL != refcount) && (block_pointer < TOTAL_BLOCK_COUNT); block_pointer++)
   {
-    superblock = (superblock_t *)ramdisk_memory;
-    return &superblock->first_block;
+    if (0 != refcount[block_pointer])
+    {
+      reflink_count++;
+    }
   }
 
-  // if not then return the memory address of the inode
-  index_node_array = (index_node_t *)(ramdisk_memory + BLK_SZ);
-  return index_node_array + (index_node_number - 1);
+  return reflink_count;
 }
 
-// find free block and allocate it in bitmap
-int search_bitmap() {
-  int blockPointer = 0;
-  int blockIndex = 0;
-  int byteIndex = 0;
-  int bitIndex = 0;
-  unsigned char bitMask = 0;
+// write an image of the ramdisk to a user buffer of length bytes: the
+// header, the metadata blocks, then every allocated file block in block
+// order; image_size is set to the bytes the image needs and -1 is returned
+// when the buffer is smaller than that
+static int ramdisk_export_image(char *address, int length, int *image_size)
+{
+  int block_pointer = 0;
+  int used_block_count = 0;
+  int reflink_count = 0;
+  long image_length = 0;
+  long offset = 0;
+  char *chunk = NULL;
+  image_header_t *header = NULL;
+  image_reflink_t *reflink = NULL;
+  unsigned char *image = NULL;
+  unsigned char *block_bitmap = NULL;
   superblock_t *superblock = NULL;
-  unsigned char *blockBitmap = NULL;
 
-  // Pointers to superblock and block bitmap
+  // build the whole image before copying anything out, copy_to_user may
+  // sleep and let other callers change the file system part way through;
+  // so may vmalloc, so check the buffer still fits once it is allocated
   superblock = (superblock_t *)ramdisk_memory;
-  blockBitmap = (ramdisk_memory + BLK_SZ * (1 + INDEX_NODE_ARRAY_BLOCK_COUNT));
-  // Loop through the block bitmap to find a free block
-  for (byteIndex = 0; byteIndex < BLOCK_BITMAP_BLOCK_COUNT; byteIndex++) {
-    for (blockIndex = 0; blockIndex < BLK_SZ; blockIndex++) {
-      bitMask = 1;
-      for (bitIndex = 0; bitIndex < 8; bitIndex++) {
-        // Check if the bit indicates a free block
-        if ((blockBitmap[blockPointer] & bitMask) != 0) {
-          // Mark the block as allocated and update free block count
-          blockBitmap[blockPointer] = blockBitmap[blockPointer] - bitMask;
-          superblock->num_free_blocks--;
-          return blockPointer;
-        }
-        blockPointer++;
-        bitMask = bitMask << 1; // Shift the bit mask to check the next bit
+  do
+  {
+    if (NULL != image)
+    {
+      vfree(image);
+    }
+    ramdisk_drain_block_magazines();
+    used_block_count = TOTAL_BLOCK_COUNT - METADATA_BLOCK_COUNT - superblock->num_free_blocks;
+    reflink_count = ramdisk_image_count_reflinks(ramdisk_block_refcount);
+    image_length = sizeof(image_header_t) + (long)(METADATA_BLOCK_COUNT + used_block_count) * BLK_SZ
+      + (long)reflink_count * sizeof(image_reflink_t);
+    if (image_length > INT_MAX)
+    {
+      return -1;
+    }
+    *image_size = image_length;
+    if (length < image_length)
+    {
+      return -1;
+    }
+    image = (unsigned char *)vmalloc(image_length);
+    if (NULL == image)
+    {
+      return -1;
+    }
+    ramdisk_drain_block_magazines();
+  } while (TOTAL_BLOCK_COUNT - METADATA_BLOCK_COUNT - superblock->num_free_blocks > used_block_count);
+
+  header = (image_header_t *)image;
+  memset(header, 0, sizeof(image_header_t));
+  header->magic = RAMDISK_IMAGE_MAGIC;
+  header->version = RAMDISK_IMAGE_VERSION;
+  header->block_size = BLK_SZ;
+  header->block_count = TOTAL_BLOCK_COUNT;
+  header->metadata_block_count = METADATA_BLOCK_COUNT;
+  header->flags = ramdisk_buddy_allocator ? RAMDISK_IMAGE_FLAG_BUDDY : 0;
+  offset = sizeof(image_header_t);
+  memcpy(image + offset, ramdisk_memory, METADATA_BLOCK_COUNT * BLK_SZ);
+  offset = offset + METADATA_BLOCK_COUNT * BLK_SZ;
+
+  // free blocks are left out, the bitmap in the image says where the rest go
+  block_bitmap = ramdisk_get_block_bitmap();
+  for (block_pointer = METADATA_BLOCK_COUNT; block_pointer < TOTAL_BLOCK_COUNT; block_pointer++)
+  {
+    if (ramdisk_image_block_used(block_bitmap, block_pointer))
+    {
+      // a block taken by a caller still waiting for its chunk holds nothing yet
+      chunk = ramdisk_chunks[block_pointer / RAMDISK_CHUNK_BLOCK_COUNT];
+      if (NULL == chunk)
+      {
+        memset(image + offset, 0, BLK_SZ);
+      }
+      else
+      {
+        memcpy(image + offset, chunk + BLK_SZ * (block_pointer % RAMDISK_CHUNK_BLOCK_COUNT), BLK_SZ);
       }
+      offset = offset + BLK_SZ;
+      header->used_block_count++;
     }
   }
-  return -1;
+
+  // blocks shared since the size was taken are left out and the image is
+  // rejected on import, as with any file changed during the export
+  reflink = (image_reflink_t *)(image + offset);
+  spin_lock(&ramdisk_refcount_lock);
+  for (block_pointer = METADATA_BLOCK_COUNT; (NULL != ramdisk_block_refcount) && (block_pointer < TOTAL_BLOCK_COUNT); block_pointer++)
+  {
+    if ((0 != ramdisk_block_refcount[block_pointer]) && (header->reflink_count < reflink_count))
+    {
+      reflink[header->reflink_count].block_pointer = block_pointer;
+      reflink[header->reflink_count].owner_count = ramdisk_block_refcount[block_pointer];
+      header->reflink_count++;
+    }
+  }
+  spin_unlock(&ramdisk_refcount_lock);
+  offset = offset + header->reflink_count * sizeof(image_reflink_t);
+
+  *image_size = offset;
+  if (0 != copy_to_user(address, image, offset))
+  {
+    vfree(image);
+    return -1;
+  }
+  vfree(image);
+
+  return 0;
 }
 
+int ramdisk_export(char *address, int length, int *image_size)
+{
+  int result = 0;
 
-// allocate_free_block
-int ramdisk_block_calloc()
+  // keep reads and writes out while blocks are counted and copied
+  down_write(&ramdisk_io_lock);
+  result = ramdisk_export_image(address, length, image_size);
+  up_write(&ramdisk_io_lock);
+
+  return result;
+}
+
+// read the used blocks of an image into chunks allocated for them, the
+// metadata blocks are already loaded; -1 when the image length does not
+// match the blocks its bitmap marks used or memory runs out
+static int ramdisk_image_load_blocks(unsigned char *metadata, char **chunks, unsigned short *chunk_used_count, const char *address, int length, int offset)
+{
+  int block_pointer = 0;
+  int run_end = 0;
+  int chunk = 0;
+  unsigned char *block_bitmap = NULL;
+
+  block_bitmap = metadata + BLK_SZ * (1 + INDEX_NODE_ARRAY_BLOCK_COUNT);
+  block_pointer = METADATA_BLOCK_COUNT;
+  while (block_pointer < TOTAL_BLOCK_COUNT)
+  {
+    if (!ramdisk_image_block_used(block_bitmap, block_pointer))
+    {
+      block_pointer++;
+      continue;
+    }
+    // consecutive used blocks are consecutive in the image too, copy each
+    // run in one go up to the end of its chunk
+    chunk = block_pointer / RAMDISK_CHUNK_BLOCK_COUNT;
+    run_end = block_pointer;
+    while ((run_end < min(TOTAL_BLOCK_COUNT, (chunk + 1) * RAMDISK_CHUNK_BLOCK_COUNT)) && ramdisk_image_block_used(block_bitmap, run_end))
+    {
+      run_end++;
+    }
+    if ((run_end - block_pointer) * BLK_SZ > length - offset)
+    {
+      return -1;
+    }
+    if (NULL == chunks[chunk])
+    {
+      chunks[chunk] = ramdisk_chunk_alloc();
+      if (NULL == chunks[chunk])
+      {
+        return -1;
+      }
+    }
+    chunk_used_count[chunk] = chunk_used_count[chunk] + (run_end - block_pointer);
+    if (0 != copy_from_user(chunks[chunk] + BLK_SZ * (block_pointer % RAMDISK_CHUNK_BLOCK_COUNT), address + offset, (run_end - block_pointer) * BLK_SZ))
+    {
+      return -1;
+    }
+    offset = offset + (run_end - block_pointer) * BLK_SZ;
+    block_pointer = run_end;
+  }
+
+  return (offset == length) ? 0 : -1;
+}
+
+// check the counters and index nodes of a loaded image, clearing the open
+// counts it was exported with; block pointers are checked later by the
+// space analysis
+static int ramdisk_image_check(unsigned char *metadata)
 {
-  int block_index = 0;
+  int i = 0;
+  int block_pointer = 0;
+  int free_block_count = 0;
+  int free_index_node_count = 0;
+  superblock_t *superblock = NULL;
+  index_node_t *index_node = NULL;
+  unsigned char *block_bitmap = NULL;
+
+  superblock = (superblock_t *)metadata;
+  block_bitmap = metadata + BLK_SZ * (1 + INDEX_NODE_ARRAY_BLOCK_COUNT);
+  for (block_pointer = 0; block_pointer < TOTAL_BLOCK_COUNT; block_pointer++)
+  {
+    if (!ramdisk_image_block_used(block_bitmap, block_pointer))
+    {
+      if (block_pointer < METADATA_BLOCK_COUNT)
+      {
+        return -1;
+      }
+      free_block_count++;
+    }
+  }
+  if (free_block_count != superblock->num_free_blocks)
+  {
+    return -1;
+  }
 
-  block_index = search_bitmap();
-  if (block_index > 0)
+  for (i = 0; i <= MAX_INDEX_NODES_COUNT; i++)
+  {
+    if (0 == i)
+    {
+      index_node = &superblock->first_block;
+    }
+    else
+    {
+      index_node = (index_node_t *)(metadata + BLK_SZ) + (i - 1);
+    }
+    index_node->open_counter = 0;
+    if (NULL == memchr(index_node->type, '\0', sizeof(index_node->type)))
+    {
+      return -1;
+    }
+    if (0 == strcmp("", index_node->type))
+    {
+      free_index_node_count++;
+      continue;
+    }
+    if ((0 != strcmp("reg", index_node->type)) && (0 != strcmp("dir", index_node->type)))
+    {
+      return -1;
+    }
+    if ((index_node->size < 0) || (index_node->size > MAX_FILE_SIZE))
+    {
+      return -1;
+    }
+  }
+  if ((0 != strcmp("dir", superblock->first_block.type)) || (free_index_node_count != superblock->num_free_index_nodes))
   {
-    /* clear its all memory to zero. */
-    memset((ramdisk_memory + (BLK_SZ * block_index)), 0, BLK_SZ);
+    return -1;
   }
 
-  return block_index;
+  return 0;
 }
 
-// allocate block to free status
-void ramdisk_block_free(int block_pointer)
+// count one owner for each block-mapped data slot of a row that points into the file block area
+static void ramdisk_image_count_owners(unsigned short *refcount, int *row, int slot_count)
 {
-  int index = 0;
-  int k = 0;
-  int mask = 0;
-  superblock_t *superblock = NULL;
-  unsigned char *block_bitmap = NULL;
-
-  superblock = (superblock_t *)ramdisk_memory;
-  block_bitmap = (ramdisk_memory + BLK_SZ * (1 + INDEX_NODE_ARRAY_BLOCK_COUNT));
+  int i = 0;
 
-  k = block_pointer % 8;
-  index = block_pointer / 8;
-  mask = (1 << k);
-  // check bitmap
-  if (0 == (block_bitmap[index] & mask))
+  for (i = 0; i < slot_count; i++)
   {
-    block_bitmap[index] = block_bitmap[index] | mask;
-    superblock->num_free_blocks++;
+    if (ramdisk_is_file_block(row[i]) && (refcount[row[i]] < BLOCK_REFCOUNT_MAX))
+    {
+      refcount[row[i]]++;
+    }
   }
 }
 
-// find directory index node
-index_node_t *ramdisk_get_directory_index_node(const char *pathname)
+// rebuild the reflink counts of the ramdisk just swapped in from the block
+// maps of its regular files, NULL when no block has a second owner; only
+// pointer blocks the bitmap marks used are followed since only those were
+// loaded, and ramdisk_space_walk checks everything else afterwards
+static int ramdisk_image_build_refcount(unsigned short **refcount)
 {
+  int i = 0;
+  int j = 0;
+  int shared = 0;
+  int block_pointer = 0;
+  int *location = NULL;
   index_node_t *index_node = NULL;
-  const char *filename_start = NULL;
-  const char *filename_end = NULL;
-  dir_entry_t *entry = NULL;
+  unsigned char *block_bitmap = NULL;
 
-  index_node = &((superblock_t *)ramdisk_memory)->first_block;
-  filename_start = pathname;
-  // omit first '/'
-  if ('/' == filename_start[0])
+  *refcount = (unsigned short *)vzalloc(sizeof(unsigned short) * TOTAL_BLOCK_COUNT);
+  if (NULL == *refcount)
   {
-    filename_start = filename_start + 1;
+    return -1;
   }
-  while (1)
+  block_bitmap = ramdisk_get_block_bitmap();
+  for (i = 1; i <= MAX_INDEX_NODES_COUNT; i++)
   {
-    // cycle through path name to make sure each directory exists in specified
-    filename_end = find_next_directory(filename_start);
-    if (NULL == filename_end)
-    {
-      break;
-    }
-    // find the parent path checking each directory down file path
-    entry = ramdisk_get_dir_entry(index_node, filename_start, filename_end);
-    if (NULL == entry)
+    index_node = ramdisk_get_index_node(i);
+    if ((0 != strcmp("reg", index_node->type)) || (index_node->flags & INDEX_NODE_FLAG_EXTENTS))
     {
-      return NULL;
+      continue;
     }
-    
-    // keep traversing down path of directory
-    index_node = ramdisk_get_index_node(entry->index_node_number);
-    if (strcmp(index_node->type, "dir"))
+    ramdisk_image_count_owners(*refcount, index_node->location, DIRECT_BLOCK_POINTER_COUNT);
+    block_pointer = index_node->location[SINGLE_INDIRECT_BLOCK_POINTER];
+    if (ramdisk_is_file_block(block_pointer) && ramdisk_image_block_used(block_bitmap, block_pointer))
     {
-      return NULL;
+      ramdisk_image_count_owners(*refcount, (int *)ramdisk_get_block_memory_address(block_pointer), PTRS_PB);
     }
-
-    filename_start = filename_end + 1;
-  }
-
-  return index_node;
-}
-
-// find child entry from parent directory
-dir_entry_t *ramdisk_get_dir_entry(index_node_t *index_node, const char *filename_start, const char *filename_end)
-{
-  dir_entry_t *entry = NULL;
-  file_position_t file_position;
-
-  ramdisk_file_position_init(&file_position, index_node, 0, 1);
-  
-  // scan through until we reach end
-  while (file_position.file_position < index_node->size)
-  {
-    // find memory block after we allocate it in the right file position
-    entry = (dir_entry_t *)ramdisk_get_memory_address(&file_position);
-    if (NULL == entry)
+    block_pointer = index_node->location[DOUBLE_INDIRECT_BLOCK_POINTER];
+    if (!ramdisk_is_file_block(block_pointer) || !ramdisk_image_block_used(block_bitmap, block_pointer))
     {
-      break;
+      continue;
     }
-    ramdisk_file_position_add(&file_position, sizeof(dir_entry_t));
-    /* If we find a child directory entry whose name is the same as the specified name,
-       then return the found directory entry. */
-    if (NULL == filename_end)
+    location = (int *)ramdisk_get_block_memory_address(block_pointer);
+    for (j = 0; j < PTRS_PB; j++)
     {
-      if (0 == strcmp(filename_start, entry->filename))
+      if (ramdisk_is_file_block(location[j]) && ramdisk_image_block_used(block_bitmap, location[j]))
       {
-        return entry;
+        ramdisk_image_count_owners(*refcount, (int *)ramdisk_get_block_memory_address(location[j]), PTRS_PB);
       }
     }
-    else
+  }
+  // keep only the owners beyond the first
+  for (block_pointer = 0; block_pointer < TOTAL_BLOCK_COUNT; block_pointer++)
+  {
+    if ((*refcount)[block_pointer] > 1)
     {
-      if (0 == strncmp(entry->filename, filename_start, filename_end))
-      {
-        return entry;
-      }
+      shared = 1;
+    }
+    if ((*refcount)[block_pointer] > 0)
+    {
+      (*refcount)[block_pointer]--;
     }
   }
+  if (!shared)
+  {
+    vfree(*refcount);
+    *refcount = NULL;
+  }
 
-  return NULL;
+  return 0;
 }
 
-
-void ramdisk_file_position_init(file_position_t *file_position,index_node_t *index_node,int pos,int is_read_mode)
+// whether the reflink records of an image list exactly the shared blocks
+// its block maps describe
+static int ramdisk_image_check_reflinks(unsigned short *refcount, image_reflink_t *reflink, int reflink_count)
 {
-  int block_number = 0;
-
-  /* get the correspond current block number of the file position */
-  block_number = pos / BLK_SZ;
-  /* Set the file position */
-  file_position->file_position = pos;
-  ramdisk_block_pointer_init(&file_position->block_pointer,index_node,block_number,is_read_mode);
-  file_position->data_offset_in_block = pos % BLK_SZ;
-}
+  int i = 0;
 
-// add offset to file position
-void ramdisk_file_position_add(file_position_t *file_position, int offset)
-{
-  file_position->file_position = file_position->file_position + offset;
-  file_position->data_offset_in_block = file_position->data_offset_in_block + offset;
-  // if we reach end of block then increase block pointer
-  if (file_position->data_offset_in_block >= BLK_SZ)
+  if (reflink_count != ramdisk_image_count_reflinks(refcount))
   {
-    ramdisk_block_pointer_increase(&file_position->block_pointer);
-    file_position->data_offset_in_block = file_position->data_offset_in_block - BLK_SZ;
+    return -1;
   }
-}
-
-// find memory address of the block pointer
-char *ramdisk_get_memory_address(file_position_t *file_position)
-{
-  int block_pointer = 0;
-
-  block_pointer = ramdisk_alloc_and_get_block_pointer(&file_position->block_pointer);
-  if (block_pointer <= 0)
+  for (i = 0; i < reflink_count; i++)
   {
-    return NULL;
+    if (!ramdisk_is_file_block(reflink[i].block_pointer) || (refcount[reflink[i].block_pointer] != reflink[i].owner_count))
+    {
+      return -1;
+    }
   }
-  return (ramdisk_memory + (BLK_SZ * block_pointer))+ file_position->data_offset_in_block;
+
+  return 0;
 }
-  
-void ramdisk_block_pointer_init(block_pointer_t *block_pointer,index_node_t *index_node,int block_number,int is_read_mode)
+
+// replace the ramdisk with an image written by ramdisk_export; the image is
+// checked before it is used and the current contents stay in place if it
+// is rejected or a file is open
+static int ramdisk_import_image(const char *address, int length)
 {
-  memset(block_pointer, 0, sizeof(block_pointer_t));
-  block_pointer->is_read_mode = is_read_mode;
-  block_pointer->index_node = index_node;
+  int i = 0;
+  int result = 0;
+  image_header_t header;
+  unsigned char *metadata = NULL;
+  int reflink_length = 0;
+  char **chunks = NULL;
+  unsigned short *chunk_used_count = NULL;
+  unsigned short *refcount = NULL;
+  image_reflink_t *reflink = NULL;
+  space_report_t *report = NULL;
 
-  if (block_number < DIRECT_BLOCK_POINTER_COUNT)
+  if (length < (int)sizeof(image_header_t))
   {
-    block_pointer->block_pointer_type = direct_block_pointer_type;
-    block_pointer->direct_block_pointer = block_number;
+    return -1;
   }
-  else if (block_number < (DIRECT_BLOCK_POINTER_COUNT + PTRS_PB))
+  if (0 != copy_from_user(&header, address, sizeof(image_header_t)))
   {
-    block_pointer->block_pointer_type = single_indirect_block_pointer_type;
-    block_pointer->single_indirect_block_pointer = block_number - DIRECT_BLOCK_POINTER_COUNT;
+    return -1;
   }
-  /* Initialize the double-indirect block pointer. */
-  else
+  // extent-mapped files can only be freed through the buddy allocator
+  if ((RAMDISK_IMAGE_MAGIC != header.magic) || (RAMDISK_IMAGE_VERSION != header.version)
+      || (BLK_SZ != header.block_size) || (TOTAL_BLOCK_COUNT != header.block_count)
+      || (METADATA_BLOCK_COUNT != header.metadata_block_count)
+      || ((0 != (header.flags & RAMDISK_IMAGE_FLAG_BUDDY)) != (0 != ramdisk_buddy_allocator))
+      || (length < (int)sizeof(image_header_t) + METADATA_BLOCK_COUNT * BLK_SZ)
+      || (header.reflink_count < 0) || (header.reflink_count > TOTAL_BLOCK_COUNT)
+      || (length - (int)sizeof(image_header_t) - METADATA_BLOCK_COUNT * BLK_SZ < header.reflink_count * (int)sizeof(image_reflink_t)))
   {
-    block_pointer->block_pointer_type = double_indirect_block_pointer_type;
-    block_pointer->double_indirect_block_pointer_row = (block_number - (DIRECT_BLOCK_POINTER_COUNT + PTRS_PB)) / PTRS_PB;
-    block_pointer->double_indirect_block_pointer_column = (block_number - (DIRECT_BLOCK_POINTER_COUNT + PTRS_PB)) % PTRS_PB;
+    return -1;
   }
-}
-
-
-/* This function increate the block pointer. */
-void ramdisk_block_pointer_increase(block_pointer_t *block_pointer)
-{
-  /* Increase the direct block pointer. */
-  if (direct_block_pointer_type == block_pointer->block_pointer_type)
+  reflink_length = header.reflink_count * sizeof(image_reflink_t);
+  for (i = 0; i <= MAX_INDEX_NODES_COUNT; i++)
   {
-    block_pointer->direct_block_pointer++;
-    /* If we reach the end of the direct block pointer,
-       then we move to the beginning of the single-indirect block pointer*/
-    if (DIRECT_BLOCK_POINTER_COUNT == block_pointer->direct_block_pointer)
+    if (ramdisk_get_index_node(i)->open_counter > 0)
     {
-      block_pointer->block_pointer_type = single_indirect_block_pointer_type;
-      block_pointer->single_indirect_block_pointer = 0;
+      return -1;
     }
   }
-  /* Increase the single-direct block pointer. */
-  else if (single_indirect_block_pointer_type == block_pointer->block_pointer_type)
+
+  report = (space_report_t *)vmalloc(sizeof(space_report_t));
+  metadata = (unsigned char *)vmalloc(METADATA_BLOCK_COUNT * BLK_SZ);
+  chunks = (char **)vmalloc(sizeof(char *) * ramdisk_chunk_count);
+  chunk_used_count = (unsigned short *)vmalloc(sizeof(unsigned short) * ramdisk_chunk_count);
+  reflink = (image_reflink_t *)vmalloc(max(reflink_length, 1));
+  if ((NULL == report) || (NULL == metadata) || (NULL == chunks) || (NULL == chunk_used_count) || (NULL == reflink))
   {
-    block_pointer->single_indirect_block_pointer++;
-    /* If we reach the end of the single-indirect block pointer,
-       then we move to the beginning of the double-indirect block pointer*/
-    if (PTRS_PB == block_pointer->single_indirect_block_pointer)
-    {
-      block_pointer->block_pointer_type = double_indirect_block_pointer_type;
-      block_pointer->double_indirect_block_pointer_row = 0;
-      block_pointer->double_indirect_block_pointer_column = 0;
-    }
+    result = -1;
   }
-  /* Increase the double-direct block pointer. */
-  else if (double_indirect_block_pointer_type == block_pointer->block_pointer_type)
+  else
   {
-    block_pointer->double_indirect_block_pointer_column++;
-    /* If we reach the end of the current column of the two dimension double-indirect
-       block pointer, then we move to the beginning of the next column
-       of the two dimension double-indirec block pointer. */
-    if (PTRS_PB == block_pointer->double_indirect_block_pointer_column)
+    memset(chunks, 0, sizeof(char *) * ramdisk_chunk_count);
+    memset(chunk_used_count, 0, sizeof(unsigned short) * ramdisk_chunk_count);
+    if ((0 != copy_from_user(metadata, address + sizeof(image_header_t), METADATA_BLOCK_COUNT * BLK_SZ))
+        || (0 != ramdisk_image_load_blocks(metadata, chunks, chunk_used_count, address, length - reflink_length, sizeof(image_header_t) + METADATA_BLOCK_COUNT * BLK_SZ))
+        || (0 != copy_from_user(reflink, address + length - reflink_length, reflink_length))
+        || (0 != ramdisk_image_check(metadata)))
     {
-      block_pointer->double_indirect_block_pointer_row++;
-      block_pointer->double_indirect_block_pointer_column = 0;
+      result = -1;
     }
   }
-}
-
-// allocate block and return address
-int ramdisk_alloc_and_get_block_pointer(block_pointer_t *block_pointer)
-{
-  int block_pointer_index = 0;
-  int *location = NULL;
 
-  location = block_pointer->index_node->location;
-  // check single indirect
-  if (single_indirect_block_pointer_type == block_pointer->block_pointer_type)
+  if (0 == result)
   {
-    if (0 == location[SINGLE_INDIRECT_BLOCK_POINTER])
+    // swap the image in and walk it; every block must be free or owned by
+    // exactly one file, or be a data block its reflink records say is
+    // shared, otherwise put the old contents back
+    ramdisk_drain_block_magazines();
+    swap(ramdisk_memory, metadata);
+    swap(ramdisk_chunks, chunks);
+    swap(ramdisk_chunk_used_count, chunk_used_count);
+    result = ramdisk_image_build_refcount(&refcount);
+    if (0 == result)
     {
-        location[SINGLE_INDIRECT_BLOCK_POINTER] = ramdisk_block_calloc();
-        if (location[SINGLE_INDIRECT_BLOCK_POINTER] <= 0)
-        {
-          return -1;
-        }
+      result = ramdisk_image_check_reflinks(refcount, reflink, header.reflink_count);
     }
-    location = (int *)(ramdisk_memory + (BLK_SZ * location[SINGLE_INDIRECT_BLOCK_POINTER]));
-  }
-  // check double indirect
-  else if (double_indirect_block_pointer_type == block_pointer->block_pointer_type)
-  {
-
-    if (0 == location[DOUBLE_INDIRECT_BLOCK_POINTER])
+    swap(ramdisk_block_refcount, refcount);
+    if ((0 != result) || (0 != ramdisk_space_walk(report)) || (0 != report->invalid_pointer_count)
+        || (0 != report->shared_block_count) || (0 != report->block_class_count[block_class_unaccounted]))
     {
-      if (block_pointer->is_read_mode)
-      {
-        return -1;
-      }
-      else
-      {
-        int block_index = 0;
-        block_index = search_bitmap();
-        if (block_index > 0)
-        {
-          memset((ramdisk_memory + (BLK_SZ * block_index)), 0, BLK_SZ);
-        }
-        location[DOUBLE_INDIRECT_BLOCK_POINTER] = block_index;
-        if (location[DOUBLE_INDIRECT_BLOCK_POINTER] <= 0)
-        {
-          return -1;
-        }
-      }
+      swap(ramdisk_memory, metadata);
+      swap(ramdisk_chunks, chunks);
+      swap(ramdisk_chunk_used_count, chunk_used_count);
+      swap(ramdisk_block_refcount, refcount);
+      result = -1;
     }
-    location = (int *)(ramdisk_memory + (BLK_SZ * location[DOUBLE_INDIRECT_BLOCK_POINTER]));
-    if (0 == location[block_pointer->double_indirect_block_pointer_row])
+    else
     {
-      if (block_pointer->is_read_mode)
-      {
-        return -1;
-      }
-      else
+      spin_lock(&ramdisk_bitmap_lock);
+      ramdisk_bitmap_hint = 0;
+      if (ramdisk_buddy_allocator)
       {
-        /* If we fail in allocate the neccesary block memory,
-           then this function will return -1. */
-        location[block_pointer->double_indirect_block_pointer_row] = ramdisk_block_calloc();
-        if (location[block_pointer->double_indirect_block_pointer_row] <= 0)
-        {
-          return -1;
-        }
+        ramdisk_buddy_rebuild();
       }
+      spin_unlock(&ramdisk_bitmap_lock);
+      spin_lock(&ramdisk_pack_lock);
+      memset(ramdisk_pack_block_cache, 0, sizeof(ramdisk_pack_block_cache));
+      spin_unlock(&ramdisk_pack_lock);
+      ramdisk_compress_cache_drop(NULL);
     }
-    location = (int *) (ramdisk_memory + (location[block_pointer->double_indirect_block_pointer_row]));
   }
 
-  if (direct_block_pointer_type == block_pointer->block_pointer_type)
+  // whichever contents lost are freed
+  if (NULL != chunks)
   {
-    block_pointer_index = block_pointer->direct_block_pointer;
+    ramdisk_chunks_free(chunks, ramdisk_chunk_count);
   }
-  else if (single_indirect_block_pointer_type == block_pointer->block_pointer_type)
+  if (NULL != chunk_used_count)
   {
-    block_pointer_index = block_pointer->single_indirect_block_pointer;
+    vfree(chunk_used_count);
   }
-  else if (double_indirect_block_pointer_type == block_pointer->block_pointer_type)
+  if (NULL != refcount)
   {
-    block_pointer_index = block_pointer->double_indirect_block_pointer_column;
+    vfree(refcount);
   }
-  /* When we use the block pointer for writing data,
-     this function will allocate the neccesary block memory
-     for storing the file's data. */
-  if (0 == location[block_pointer_index])
+  if (NULL != reflink)
   {
-    if (block_pointer->is_read_mode)
-    {
-      return -1;
-    }
-    else
-    {
-      /* If we fail in allocate the neccesary block memory,
-         then this function will return -1. */
-      location[block_pointer_index] = search_bitmap();
-      if (location[block_pointer_index] <= 0)
-      {
-        return -1;
-      }
-    }
+    vfree(reflink);
   }
-  /* Return the block pointer value of the correspond block we want to read data from or write data to. */
-  return location[block_pointer_index];
-}
\ No newline at end of file
+  if (NULL != metadata)
+  {
+    vfree(metadata);
+  }
+  if (NULL != report)
+  {
+    vfree(report);
+  }
+
+  return result;
+}
+
+int ramdisk_import(const char *address, int length)
+{
+  int result = 0;
+
+  // nothing is open, but reads and writes name files by index node number
+  // and must not run while the blocks are replaced
+  down_write(&ramdisk_io_lock);
+  result = ramdisk_import_image(address, length);
+  up_write(&ramdisk_io_lock);
+
+  return result;
+}
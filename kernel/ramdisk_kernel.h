@@ -7,7 +7,14 @@
 #define PTR_SZ 4		
 #define PTRS_PB  (BLK_SZ / PTR_SZ) 
 #define INDEX_NODE_ARRAY_BLOCK_COUNT    256
-#define BLOCK_BITMAP_BLOCK_COUNT        4
+// the block count is set when the ramdisk is loaded, RAMDISK_MEMORY_SIZE
+// worth by default; extent and tail pointers keep a block number in the
+// upper bits of an int, which bounds it
+#define TOTAL_BLOCK_COUNT               (ramdisk_block_count)
+#define MAX_TOTAL_BLOCK_COUNT           (1 << 26)
+#define BLOCK_BITMAP_BLOCK_COUNT        ((TOTAL_BLOCK_COUNT + BLK_SZ * 8 - 1) / (BLK_SZ * 8))
+// superblock, index node array and bitmap come first, file blocks follow
+#define METADATA_BLOCK_COUNT            (1 + INDEX_NODE_ARRAY_BLOCK_COUNT + BLOCK_BITMAP_BLOCK_COUNT)
 
 #define DIRECT_BLOCK_POINTER_COUNT               8
 #define SINGLE_INDIRECT_BLOCK_POINTER_COUNT      1
@@ -20,6 +27,63 @@
 #define MAX_BLOCK_COUNT_IN_FILE   (DIRECT_BLOCK_POINTER_COUNT + PTRS_PB + PTRS_PB * PTRS_PB)
 #define MAX_FILE_SIZE   (MAX_BLOCK_COUNT_IN_FILE * BLK_SZ)
 
+// longest name a directory entry can hold
+#define MAX_FILENAME_LENGTH  13
+
+// a flat directory switches to the B-tree format once it holds this many
+// entries and switches back when it drops below the lower mark
+#define DIR_BTREE_MIN_ENTRY_COUNT   64
+#define DIR_FLAT_MAX_ENTRY_COUNT    32
+
+// index node flags
+#define INDEX_NODE_FLAG_DIR_BTREE   0x0001
+#define INDEX_NODE_FLAG_EXTENTS     0x0002
+#define INDEX_NODE_FLAG_TAIL        0x0004
+#define INDEX_NODE_FLAG_COMPRESSED  0x0008
+// a copy ramdisk_snapshot made, which nothing writes to
+#define INDEX_NODE_FLAG_SNAPSHOT    0x0010
+
+// tail packing splits a pack block into PACK_UNIT_SZ units, the first
+// PACK_HEADER_UNIT_COUNT of them hold the slot table
+#define PACK_UNIT_SZ                16
+#define PACK_UNIT_COUNT             (BLK_SZ / PACK_UNIT_SZ)
+#define PACK_HEADER_UNIT_COUNT      2
+#define PACK_SLOT_COUNT             7
+#define MAX_TAIL_SIZE               ((PACK_UNIT_COUNT - PACK_HEADER_UNIT_COUNT) * PACK_UNIT_SZ)
+
+// packed tail location, the pack block and the slot in its table
+#define TAIL_MAKE(block, slot)      (((block) << 3) | (slot))
+#define TAIL_BLOCK(tail)            ((tail) >> 3)
+#define TAIL_SLOT(tail)             ((tail) & 0x07)
+
+// the buddy allocator hands out chunks of BLK_SZ << order, 256 B to 64 KB
+#define BUDDY_MAX_ORDER             8
+#define BUDDY_ORDER_COUNT           (BUDDY_MAX_ORDER + 1)
+
+// an extent-mapped file keeps its first extents in location[] and the
+// rest in the block pointed to by location[EXTENT_INDIRECT_POINTER]
+#define DIRECT_EXTENT_COUNT         9
+#define EXTENT_INDIRECT_POINTER     (DIRECT_EXTENT_COUNT)
+#define MAX_EXTENT_COUNT_IN_FILE    (DIRECT_EXTENT_COUNT + PTRS_PB)
+
+// extent descriptor, the first block of a chunk and its buddy order
+#define EXTENT_MAKE(block, order)   (((block) << 4) | (order))
+#define EXTENT_BLOCK(extent)        ((extent) >> 4)
+#define EXTENT_ORDER(extent)        ((extent) & 0x0F)
+
+// a compressed file's blocks hold a stream rather than its data: the
+// stream offset of each COMPRESS_UNIT_SZ unit of the file and the stream
+// length, then every unit compressed on its own with LZO1X, or as it is
+// when that is no shorter, so a read only decompresses the units it covers
+#define COMPRESS_UNIT_SZ            4096
+#define COMPRESS_UNIT_COUNT(size)   (((size) + COMPRESS_UNIT_SZ - 1) / COMPRESS_UNIT_SZ)
+// decompressed units kept for the next read
+#define COMPRESS_CACHE_SIZE         8
+
+// a directory is compacted once it has at least this many slots and
+// more than half of them are tombstones left behind by unlink
+#define DIR_COMPACT_MIN_SLOT_COUNT  ((int)(2 * BLK_SZ / sizeof(dir_entry_t)))
+
 // index node structure
 typedef struct index_node_struct
 {
@@ -28,7 +92,11 @@ typedef struct index_node_struct
   int location[10];
   int dir_entry_count;
   int open_counter;
-  char padding[8];
+  // head of the directory's free slot list (slot index + 1, 0 when empty)
+  short free_dir_slot;
+  unsigned short flags;
+  // packed last partial block when INDEX_NODE_FLAG_TAIL is set
+  int tail;
 } index_node_t;
 
 typedef struct superblock_struct
@@ -41,12 +109,68 @@ typedef struct superblock_struct
 
 
 // directory entry for superblock
+// an unlinked entry keeps an empty filename and reuses index_node_number
+// as the link to the next free slot (slot index + 1, 0 ends the list)
 typedef struct dir_entry_struct
 {
   char filename[14];
   short index_node_number;
 } dir_entry_t;
 
+// B-tree directory node header, link is the next leaf of a leaf node and
+// the leftmost child of an index node
+typedef struct dir_btree_header_struct
+{
+  short is_leaf;
+  short count;
+  int link;
+} dir_btree_header_t;
+
+#define DIR_BTREE_LEAF_ENTRY_COUNT  ((int)((BLK_SZ - sizeof(dir_btree_header_t)) / sizeof(dir_entry_t)))
+
+// separator key of a B-tree index node, child holds names >= filename
+typedef struct dir_btree_key_struct
+{
+  char filename[14];
+  short padding;
+  int child;
+} dir_btree_key_t;
+
+#define DIR_BTREE_INDEX_KEY_COUNT   ((int)((BLK_SZ - sizeof(dir_btree_header_t)) / sizeof(dir_btree_key_t)))
+// deepest a B-tree directory grows, far more than MAX_INDEX_NODES_COUNT
+// entries need; an insert takes a spare block per level before it starts
+#define DIR_BTREE_MAX_HEIGHT        8
+
+// B-tree directory leaf, entries are kept sorted by name
+typedef struct dir_btree_leaf_struct
+{
+  dir_btree_header_t header;
+  dir_entry_t entries[(BLK_SZ - sizeof(dir_btree_header_t)) / sizeof(dir_entry_t)];
+} dir_btree_leaf_t;
+
+// B-tree directory index node
+typedef struct dir_btree_index_struct
+{
+  dir_btree_header_t header;
+  dir_btree_key_t keys[(BLK_SZ - sizeof(dir_btree_header_t)) / sizeof(dir_btree_key_t)];
+} dir_btree_index_t;
+
+// slot of a pack block, a run of units owned by one file's tail
+typedef struct pack_slot_struct
+{
+  unsigned char first_unit;
+  unsigned char unit_count;
+  short index_node_number;
+} pack_slot_t;
+
+// header of a pack block, bit n of used_units is set when unit n is taken
+typedef struct pack_block_header_struct
+{
+  unsigned short used_units;
+  short slot_count;
+  pack_slot_t slots[PACK_SLOT_COUNT];
+} pack_block_header_t;
+
 // determining block pointer type
 typedef enum block_pointer_struct
 {
@@ -113,6 +237,20 @@ typedef struct _read_write_param
   int num_bytes;
 } read_write_param_t;
 
+// most buffers one IOCTL_READV or IOCTL_WRITEV takes
+#define RAMDISK_IOV_MAX 1024
+
+typedef struct _readv_writev_param
+{
+  int return_value;
+  int index_node_number;
+  int file_position;
+  // buffers filled or written in turn, as one read or write of their total
+  // length starting at file_position
+  struct iovec *iov;
+  int iov_count;
+} readv_writev_param_t;
+
 typedef struct _lseek_param
 {
   int return_value;
@@ -131,6 +269,224 @@ typedef struct _readdir_param
 } readdir_param_t;
 
 
+typedef struct _readdir_range_param
+{
+  int return_value;
+  int index_node_number;
+  // names strictly after this one, "" starts from the first entry
+  char after[14];
+  // names strictly before this one, "" for no upper bound
+  char before[14];
+  // names starting with this prefix, "" matches every name
+  char prefix[14];
+  int max_entry_count;
+  char *address;
+} readdir_range_param_t;
+
+typedef struct defrag_param_struct
+{
+  int return_value;
+  // -1 to defragment every regular file
+  int index_node_number;
+  int file_count;
+  int bytes_moved;
+  int fragment_count_before;
+  int fragment_count_after;
+
+} defrag_param_t;
+
+typedef struct dedup_param_struct
+{
+  int return_value;
+  int file_count;
+  // data blocks hashed, and those found to hold the same bytes as an
+  // earlier block and pointed at it
+  int block_count;
+  int duplicate_block_count;
+  // blocks no file maps any more once the duplicates point elsewhere
+  int blocks_freed;
+
+} dedup_param_t;
+
+typedef struct compress_param_struct
+{
+  int return_value;
+  // -1 to compress every regular file not read or written for idle_seconds
+  int index_node_number;
+  int idle_seconds;
+  int file_count;
+  // size of the files compressed and of the streams they are now held in
+  int bytes_before;
+  int bytes_after;
+
+} compress_param_t;
+
+// what IOCTL_RANGE_LOCK does with a byte range of a file
+#define RAMDISK_RANGE_UNLOCK        0
+#define RAMDISK_RANGE_READ          1
+#define RAMDISK_RANGE_WRITE         2
+
+// advisory lock on a byte range of an open file, held by the calling
+// process until it unlocks the range or closes the file; only other
+// IOCTL_RANGE_LOCK calls honour it, reads and writes do not
+typedef struct range_lock_param_struct
+{
+  int return_value;
+  int index_node_number;
+  // length 0 covers everything from start on
+  int start;
+  int length;
+  // RAMDISK_RANGE_READ and RAMDISK_RANGE_WRITE replace whatever the process
+  // held in the range, RAMDISK_RANGE_UNLOCK drops it
+  int type;
+  // wait for conflicting locks of other processes to go away rather than fail
+  int is_wait;
+
+} range_lock_param_t;
+
+// image written by IOCTL_EXPORT and read back by IOCTL_IMPORT: this header,
+// the metadata blocks, every allocated file block in block order, then a
+// record for each data block reflinked files share
+#define RAMDISK_IMAGE_MAGIC         0x474d4452
+#define RAMDISK_IMAGE_VERSION       1
+#define RAMDISK_IMAGE_FLAG_BUDDY    0x1
+
+typedef struct image_header_struct
+{
+  int magic;
+  int version;
+  int block_size;
+  int block_count;
+  int metadata_block_count;
+  int used_block_count;
+  int flags;
+  // image_reflink_t records after the blocks
+  int reflink_count;
+} image_header_t;
+
+typedef struct image_reflink_struct
+{
+  int block_pointer;
+  // owners beyond the first
+  int owner_count;
+} image_reflink_t;
+
+typedef struct image_param_struct
+{
+  int return_value;
+  // bytes the image needs, set by export whether or not it fits
+  int image_size;
+  char *address;
+  int length;
+
+} image_param_t;
+
+// longest path, relative to the walked directory, a walk record can hold
+#define WALK_PATH_LENGTH  256
+
+// one file or directory found by IOCTL_WALK
+typedef struct walk_record_struct
+{
+  char path[WALK_PATH_LENGTH];
+  int index_node_number;
+  char type[4];
+  int size;
+} walk_record_t;
+
+typedef struct walk_param_struct
+{
+  int return_value;
+  pathname_t pathname;
+  // records to skip, to continue a walk that filled the buffer
+  int start_index;
+  int max_record_count;
+  char *address;
+
+} walk_param_t;
+
+typedef struct rename_param_struct
+{
+  int return_value;
+  pathname_t old_pathname;
+  pathname_t new_pathname;
+
+} rename_param_t;
+
+// share whole blocks with the source instead of copying them
+#define COPY_RANGE_REFLINK  0x1
+
+typedef struct copy_range_param_struct
+{
+  int return_value;
+  int src_index_node_number;
+  int src_file_position;
+  int dst_index_node_number;
+  int dst_file_position;
+  int num_bytes;
+  int flags;
+
+} copy_range_param_t;
+
+// directory below the root that IOCTL_SNAPSHOT puts snapshots in, each
+// under its own name; IOCTL_RMTREE on a snapshot drops it, and nothing
+// else creates, removes, renames or writes anything below it
+#define SNAPSHOT_DIRECTORY_NAME  ".snapshot"
+
+// free runs of length 1, 2-3, 4-7, ... up to the whole disk
+#define SPACE_RUN_BUCKET_COUNT      14
+
+// what a block holds, as found by walking every index node
+typedef enum block_class_enum
+{
+  block_class_free = 0,
+  block_class_metadata = 1,
+  block_class_data = 2,
+  block_class_indirect = 3,
+  block_class_directory = 4,
+  block_class_pack = 5,
+  block_class_unaccounted = 6,
+  block_class_count = 7
+} block_class_t;
+
+typedef struct file_space_struct
+{
+  int index_node_number;
+  int block_count;
+  int indirect_block_count;
+  // physically contiguous runs the file's blocks fall into, in file order
+  int fragment_count;
+} file_space_t;
+
+typedef struct space_report_struct
+{
+  int block_class_count[block_class_count];
+  // blocks claimed by more than one index node
+  int shared_block_count;
+  // pointers outside the file block area and malformed directory nodes
+  int invalid_pointer_count;
+  int free_run_count;
+  int largest_free_run;
+  int free_run_histogram[SPACE_RUN_BUCKET_COUNT];
+  int flat_directory_count;
+  int flat_directory_slot_count;
+  int flat_directory_tombstone_count;
+  int btree_directory_count;
+  int btree_leaf_slot_count;
+  int btree_leaf_entry_count;
+  int extent_file_count;
+  int packed_tail_count;
+  int fragmented_file_count;
+  // chunks of memory behind the file blocks, allocated and in total, and
+  // how many of the allocated ones are physically contiguous huge chunks
+  int backed_chunk_count;
+  int huge_chunk_count;
+  int chunk_count;
+  int chunk_size;
+  int file_count;
+  file_space_t files[MAX_INDEX_NODES_COUNT];
+} space_report_t;
+
+
 #define IOCTL_CREAT _IOWR(0, 1, creat_param_t)
 #define IOCTL_UNLINK _IOWR(0, 2, creat_param_t)
 #define IOCTL_OPEN _IOWR(0, 3, open_param_t)
@@ -140,9 +496,36 @@ typedef struct _readdir_param
 #define IOCTL_LSEEK _IOWR(0, 7, lseek_param_t)
 #define IOCTL_MKDIR _IOWR(0, 8, creat_param_t)
 #define IOCTL_READDIR _IOWR(0, 9, readdir_param_t)
-
-
-void ramdisk_init(void);
+#define IOCTL_READDIR_RANGE _IOWR(0, 10, readdir_range_param_t)
+// clears the counters and histograms shown in /proc/ramdisk_stats
+#define IOCTL_STATS_RESET _IO(0, 11)
+#define IOCTL_DEFRAG _IOWR(0, 12, defrag_param_t)
+#define IOCTL_EXPORT _IOWR(0, 13, image_param_t)
+#define IOCTL_IMPORT _IOWR(0, 14, image_param_t)
+#define IOCTL_RMTREE _IOWR(0, 15, creat_param_t)
+#define IOCTL_WALK _IOWR(0, 16, walk_param_t)
+#define IOCTL_RENAME _IOWR(0, 17, rename_param_t)
+#define IOCTL_COPY_RANGE _IOWR(0, 18, copy_range_param_t)
+#define IOCTL_SNAPSHOT _IOWR(0, 19, creat_param_t)
+#define IOCTL_DEDUP _IOWR(0, 20, dedup_param_t)
+#define IOCTL_COMPRESS _IOWR(0, 21, compress_param_t)
+#define IOCTL_READV _IOWR(0, 22, readv_writev_param_t)
+#define IOCTL_WRITEV _IOWR(0, 23, readv_writev_param_t)
+// writes at the end of the file and returns the offset it wrote at in
+// file_position
+#define IOCTL_APPEND _IOWR(0, 24, read_write_param_t)
+#define IOCTL_RANGE_LOCK _IOWR(0, 25, range_lock_param_t)
+
+
+// set before ramdisk_init to allocate through the buddy allocator
+extern int ramdisk_block_count;
+extern int ramdisk_buddy_allocator;
+// set to pack small files and partial last blocks into shared blocks
+extern int ramdisk_tail_packing;
+// set before ramdisk_init to back file blocks with 2MB chunks
+extern int ramdisk_huge_chunks;
+
+int ramdisk_init(void);
 void ramdisk_uninit(void);
 int ramdisk_get_dir_entry_length(void);
 void ramdisk_free_index_node_memory(index_node_t *index_node);
@@ -151,12 +534,50 @@ index_node_t *ramdisk_get_index_node(int index_node_number);
 unsigned char *ramdisk_get_block_bitmap(void);
 char *ramdisk_get_block_memory_address(int block_pointer);
 int search_bitmap(void);
+int ramdisk_block_alloc(void);
 int ramdisk_block_calloc(void);
 void ramdisk_block_free(int block_pointer);
+void ramdisk_drain_block_magazines(void);
+int ramdisk_get_free_block_count(void);
+int ramdisk_extent_alloc(int order);
+void ramdisk_extent_free(int block_pointer, int order);
+int ramdisk_extent_get_block(index_node_t *index_node, int block_number, int is_read_mode, int *run_block_count);
+void ramdisk_extent_truncate(index_node_t *index_node, int block_count);
+int ramdisk_block_pointer_get_block_number(block_pointer_t *block_pointer);
+int ramdisk_get_contiguous_length(file_position_t *file_position);
+int *ramdisk_get_block_slot(index_node_t *index_node, int block_number);
+int ramdisk_space_analyze(space_report_t *report);
+int ramdisk_defrag(defrag_param_t *defrag_param);
+int ramdisk_dedup(dedup_param_t *dedup_param);
+int ramdisk_compress(compress_param_t *compress_param);
+int ramdisk_export(char *address, int length, int *image_size);
+int ramdisk_import(const char *address, int length);
+int ramdisk_tail_pack(index_node_t *index_node, int index_node_number);
+int ramdisk_tail_unpack(index_node_t *index_node);
+void ramdisk_tail_release(index_node_t *index_node);
+char *ramdisk_tail_get_memory_address(index_node_t *index_node);
 int ramdisk_update_parent_directory_file(index_node_t *index_node, dir_entry_t *entry);
 index_node_t *ramdisk_get_directory_index_node(const char *pathname);
 dir_entry_t *ramdisk_get_dir_entry(index_node_t *index_node, const char *filename_start, const char *filename_end);
 dir_entry_t *ramdisk_get_empty_entry(index_node_t *index_node);
+int ramdisk_find_dir_slot(index_node_t *index_node, const char *filename_start, const char *filename_end);
+dir_entry_t *ramdisk_get_dir_slot(index_node_t *index_node, int slot);
+void ramdisk_release_dir_slot(index_node_t *index_node, int slot);
+int ramdisk_dir_needs_compaction(index_node_t *index_node);
+void ramdisk_dir_compact(index_node_t *index_node);
+void ramdisk_truncate_blocks(index_node_t *index_node, int block_count);
+const char *ramdisk_get_filename(const char *pathname);
+int ramdisk_dir_name_compare(const char *name, const char *filename_start, const char *filename_end);
+int ramdisk_dir_add_entry(index_node_t *index_node, dir_entry_t *entry);
+int ramdisk_dir_remove_entry(index_node_t *index_node, const char *filename);
+dir_btree_leaf_t *ramdisk_dir_btree_find_leaf(index_node_t *index_node, const char *filename_start, const char *filename_end);
+dir_entry_t *ramdisk_dir_btree_lookup(index_node_t *index_node, const char *filename_start, const char *filename_end);
+int ramdisk_dir_btree_insert(index_node_t *index_node, dir_entry_t *entry);
+int ramdisk_dir_btree_remove(index_node_t *index_node, const char *filename);
+dir_entry_t *ramdisk_dir_btree_next_entry(index_node_t *index_node, const char *after);
+int ramdisk_dir_convert_to_btree(index_node_t *index_node);
+int ramdisk_dir_convert_to_flat(index_node_t *index_node);
+void ramdisk_dir_btree_free(int block_pointer);
 
 void ramdisk_file_position_init(file_position_t *file_position,index_node_t *index_node,int pos,int is_read_mode);
 void ramdisk_file_position_add(file_position_t *file_position, int offset);
@@ -177,11 +598,31 @@ int ramdisk_read(int index_node_number, int file_position, char *address, int nu
 
 int ramdisk_write(int index_node_number, int file_position, char *address, int num_bytes);
 
+int ramdisk_range_lock(int index_node_number, int start, int length, int type, int owner, int is_wait);
+
+int ramdisk_append(int index_node_number, char *address, int num_bytes, int *file_position);
+
+int ramdisk_readv(int index_node_number, int file_position, const struct iovec *iov, int iov_count);
+
+int ramdisk_writev(int index_node_number, int file_position, const struct iovec *iov, int iov_count);
+
 int ramdisk_lseek(int index_node_number, int seek_offset, int *seek_result_offset);
 
 int ramdisk_mkdir(char *pathname);
 
 int ramdisk_readdir(int index_node_number, char *address, int *file_position);
+
+int ramdisk_readdir_range(int index_node_number, const char *after, const char *before, const char *prefix, char *address, int max_entry_count);
+
+int ramdisk_rmtree(char *pathname);
+
+int ramdisk_walk(char *pathname, int start_index, char *address, int max_record_count);
+
+int ramdisk_rename(char *old_pathname, char *new_pathname);
+
+int ramdisk_copy_range(int src_index_node_number, int src_pos, int dst_index_node_number, int dst_pos, int num_bytes, int flags);
+
+int ramdisk_snapshot(char *name);
 #endif
 
 
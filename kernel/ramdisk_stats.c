@@ -0,0 +1,307 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/ioctl.h>
+#include <linux/percpu.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/string.h>
+#include <linux/bitops.h>
+#include <linux/math64.h>
+#include <linux/vmalloc.h>
+#include <linux/errno.h>
+#include "ramdisk_kernel.h"
+#include "ramdisk_stats.h"
+
+// Per-ioctl counters and latency histograms. Each CPU records into its own
+// copy without locking, and readers of /proc/ramdisk_stats sum the copies.
+
+typedef struct ramdisk_command_stats_struct
+{
+  u64 count;
+  u64 error_count;
+  u64 byte_count;
+  u64 total_ns;
+  u64 latency[RAMDISK_STATS_BUCKET_COUNT];
+} ramdisk_command_stats_t;
+
+typedef struct ramdisk_stats_struct
+{
+  ramdisk_command_stats_t command[RAMDISK_STATS_COMMAND_COUNT];
+} ramdisk_stats_t;
+
+static ramdisk_stats_t *ramdisk_stats;
+static struct proc_dir_entry *ramdisk_stats_proc_entry;
+static struct proc_dir_entry *ramdisk_space_proc_entry;
+
+static const char *ramdisk_space_block_class_name[block_class_count] =
+{
+  "free", "metadata", "data", "indirect", "directory", "pack", "unaccounted"
+};
+
+static const char *ramdisk_stats_command_name[RAMDISK_STATS_COMMAND_COUNT] =
+{
+  [_IOC_NR(IOCTL_CREAT)] = "creat",
+  [_IOC_NR(IOCTL_UNLINK)] = "unlink",
+  [_IOC_NR(IOCTL_OPEN)] = "open",
+  [_IOC_NR(IOCTL_CLOSE)] = "close",
+  [_IOC_NR(IOCTL_READ)] = "read",
+  [_IOC_NR(IOCTL_WRITE)] = "write",
+  [_IOC_NR(IOCTL_LSEEK)] = "lseek",
+  [_IOC_NR(IOCTL_MKDIR)] = "mkdir",
+  [_IOC_NR(IOCTL_READDIR)] = "readdir",
+  [_IOC_NR(IOCTL_READDIR_RANGE)] = "readdir_range",
+  [_IOC_NR(IOCTL_DEFRAG)] = "defrag",
+  [_IOC_NR(IOCTL_EXPORT)] = "export",
+  [_IOC_NR(IOCTL_IMPORT)] = "import",
+  [_IOC_NR(IOCTL_RMTREE)] = "rmtree",
+  [_IOC_NR(IOCTL_WALK)] = "walk",
+  [_IOC_NR(IOCTL_RENAME)] = "rename",
+  [_IOC_NR(IOCTL_COPY_RANGE)] = "copy_range",
+  [_IOC_NR(IOCTL_SNAPSHOT)] = "snapshot",
+  [_IOC_NR(IOCTL_DEDUP)] = "dedup",
+  [_IOC_NR(IOCTL_COMPRESS)] = "compress",
+  [_IOC_NR(IOCTL_READV)] = "readv",
+  [_IOC_NR(IOCTL_WRITEV)] = "writev",
+  [_IOC_NR(IOCTL_APPEND)] = "append",
+  [_IOC_NR(IOCTL_RANGE_LOCK)] = "range_lock",
+};
+
+
+void ramdisk_stats_record(int command, u64 start, int result, int byte_count)
+{
+  u64 latency = ramdisk_stats_clock() - start;
+  int bucket = 0;
+  ramdisk_command_stats_t *command_stats = NULL;
+
+  bucket = min(fls64(latency), RAMDISK_STATS_BUCKET_COUNT - 1);
+  command_stats = &per_cpu_ptr(ramdisk_stats, get_cpu())->command[command];
+  command_stats->count++;
+  command_stats->total_ns += latency;
+  command_stats->latency[bucket]++;
+  if (result < 0)
+  {
+    command_stats->error_count++;
+  }
+  command_stats->byte_count += byte_count;
+  put_cpu();
+}
+
+// records made on other CPUs while this runs may survive the reset
+void ramdisk_stats_reset(void)
+{
+  int cpu = 0;
+  for_each_possible_cpu(cpu)
+  {
+    memset(per_cpu_ptr(ramdisk_stats, cpu), 0, sizeof(ramdisk_stats_t));
+  }
+}
+
+// upper bound in ns of the bucket holding the given fraction of the samples
+static u64 ramdisk_stats_percentile(ramdisk_command_stats_t *command_stats, int per_mille)
+{
+  u64 target = command_stats->count * per_mille;
+  u64 seen = 0;
+  int bucket = 0;
+  for (bucket = 0; bucket < RAMDISK_STATS_BUCKET_COUNT; bucket++)
+  {
+    seen += command_stats->latency[bucket] * 1000;
+    if (seen > target)
+    {
+      return 1ULL << bucket;
+    }
+  }
+  return 1ULL << (RAMDISK_STATS_BUCKET_COUNT - 1);
+}
+
+static int ramdisk_stats_show(struct seq_file *m, void *v)
+{
+  ramdisk_command_stats_t total;
+  ramdisk_command_stats_t *command_stats = NULL;
+  int command = 0;
+  int bucket = 0;
+  int cpu = 0;
+
+  seq_printf(m, "%-14s %12s %10s %14s %10s %10s %10s %10s\n",
+    "command", "count", "errors", "bytes", "avg_ns", "p50_ns", "p99_ns", "p999_ns");
+  for (command = 0; command < RAMDISK_STATS_COMMAND_COUNT; command++)
+  {
+    if (NULL == ramdisk_stats_command_name[command])
+    {
+      continue;
+    }
+    memset(&total, 0, sizeof(total));
+    for_each_possible_cpu(cpu)
+    {
+      command_stats = &per_cpu_ptr(ramdisk_stats, cpu)->command[command];
+      total.count += command_stats->count;
+      total.error_count += command_stats->error_count;
+      total.byte_count += command_stats->byte_count;
+      total.total_ns += command_stats->total_ns;
+      for (bucket = 0; bucket < RAMDISK_STATS_BUCKET_COUNT; bucket++)
+      {
+        total.latency[bucket] += command_stats->latency[bucket];
+      }
+    }
+    if (0 == total.count)
+    {
+      continue;
+    }
+    seq_printf(m, "%-14s %12llu %10llu %14llu %10llu %10llu %10llu %10llu\n",
+      ramdisk_stats_command_name[command], total.count, total.error_count, total.byte_count,
+      div64_u64(total.total_ns, total.count),
+      ramdisk_stats_percentile(&total, 500),
+      ramdisk_stats_percentile(&total, 990),
+      ramdisk_stats_percentile(&total, 999));
+    // histogram as "upper bound in ns:count" for the non-empty buckets
+    seq_printf(m, "  latency");
+    for (bucket = 0; bucket < RAMDISK_STATS_BUCKET_COUNT; bucket++)
+    {
+      if (0 != total.latency[bucket])
+      {
+        seq_printf(m, " %llu:%llu", 1ULL << bucket, total.latency[bucket]);
+      }
+    }
+    seq_printf(m, "\n");
+  }
+
+  return 0;
+}
+
+static int ramdisk_stats_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, ramdisk_stats_show, NULL);
+}
+
+static const struct file_operations ramdisk_stats_proc_operations =
+{
+  .owner = THIS_MODULE,
+  .open = ramdisk_stats_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release,
+};
+
+// part of total as a percentage with one decimal, printed as "%d.%d%%"
+#define RAMDISK_PERMILLE(part, total) ((total) > 0 ? (int)((1000LL * (part)) / (total)) : 0)
+
+// /proc/ramdisk_space: an on-demand walk of the bitmap and every index node
+static int ramdisk_space_show(struct seq_file *m, void *v)
+{
+  space_report_t *report = NULL;
+  int permille = 0;
+  int i = 0;
+
+  report = (space_report_t *)vmalloc(sizeof(space_report_t));
+  if (NULL == report)
+  {
+    return -ENOMEM;
+  }
+  // keep out unlinks and every other command that frees blocks; the
+  // report itself keeps out reads and writes
+  mutex_lock(&rd_namespace_lock);
+  i = ramdisk_space_analyze(report);
+  mutex_unlock(&rd_namespace_lock);
+  if (0 != i)
+  {
+    vfree(report);
+    return -ENOMEM;
+  }
+
+  seq_printf(m, "blocks:");
+  for (i = 0; i < block_class_count; i++)
+  {
+    seq_printf(m, " %s %d", ramdisk_space_block_class_name[i], report->block_class_count[i]);
+  }
+  seq_printf(m, " shared %d invalid %d\n", report->shared_block_count, report->invalid_pointer_count);
+  seq_printf(m, "memory: chunks %d of %d, %d KB, %d huge\n", report->backed_chunk_count, report->chunk_count,
+    report->backed_chunk_count * (report->chunk_size / 1024), report->huge_chunk_count);
+  seq_printf(m, "free runs: count %d largest %d\n", report->free_run_count, report->largest_free_run);
+  // lower bound of each bucket's run length and the number of runs in it
+  seq_printf(m, "free run lengths:");
+  for (i = 0; i < SPACE_RUN_BUCKET_COUNT; i++)
+  {
+    if (0 != report->free_run_histogram[i])
+    {
+      seq_printf(m, " %d:%d", 1 << i, report->free_run_histogram[i]);
+    }
+  }
+  seq_printf(m, "\n");
+  permille = RAMDISK_PERMILLE(report->flat_directory_tombstone_count, report->flat_directory_slot_count);
+  seq_printf(m, "flat directories: %d slots %d tombstones %d (%d.%d%%)\n",
+    report->flat_directory_count, report->flat_directory_slot_count, report->flat_directory_tombstone_count,
+    permille / 10, permille % 10);
+  permille = RAMDISK_PERMILLE(report->btree_leaf_entry_count, report->btree_leaf_slot_count);
+  seq_printf(m, "btree directories: %d leaf slots %d entries %d (%d.%d%% full)\n",
+    report->btree_directory_count, report->btree_leaf_slot_count, report->btree_leaf_entry_count,
+    permille / 10, permille % 10);
+  seq_printf(m, "files: %d extent-mapped %d packed tails %d fragmented %d\n",
+    report->file_count, report->extent_file_count, report->packed_tail_count, report->fragmented_file_count);
+  seq_printf(m, "%-10s %8s %8s %9s\n", "index_node", "blocks", "indirect", "fragments");
+  for (i = 0; i < report->file_count; i++)
+  {
+    seq_printf(m, "%-10d %8d %8d %9d\n", report->files[i].index_node_number,
+      report->files[i].block_count, report->files[i].indirect_block_count, report->files[i].fragment_count);
+  }
+  vfree(report);
+
+  return 0;
+}
+
+static int ramdisk_space_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, ramdisk_space_show, NULL);
+}
+
+static const struct file_operations ramdisk_space_proc_operations =
+{
+  .owner = THIS_MODULE,
+  .open = ramdisk_space_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release,
+};
+
+int ramdisk_stats_init(void)
+{
+  ramdisk_stats = alloc_percpu(ramdisk_stats_t);
+  if (NULL == ramdisk_stats)
+  {
+    return -1;
+  }
+  ramdisk_stats_proc_entry = create_proc_entry("ramdisk_stats", 0444, NULL);
+  if (NULL == ramdisk_stats_proc_entry)
+  {
+    free_percpu(ramdisk_stats);
+    ramdisk_stats = NULL;
+    return -1;
+  }
+  ramdisk_stats_proc_entry->proc_fops = &ramdisk_stats_proc_operations;
+  ramdisk_space_proc_entry = create_proc_entry("ramdisk_space", 0444, NULL);
+  if (NULL == ramdisk_space_proc_entry)
+  {
+    ramdisk_stats_uninit();
+    return -1;
+  }
+  ramdisk_space_proc_entry->proc_fops = &ramdisk_space_proc_operations;
+
+  return 0;
+}
+
+void ramdisk_stats_uninit(void)
+{
+  if (NULL != ramdisk_space_proc_entry)
+  {
+    remove_proc_entry("ramdisk_space", NULL);
+    ramdisk_space_proc_entry = NULL;
+  }
+  if (NULL != ramdisk_stats_proc_entry)
+  {
+    remove_proc_entry("ramdisk_stats", NULL);
+    ramdisk_stats_proc_entry = NULL;
+  }
+  if (NULL != ramdisk_stats)
+  {
+    free_percpu(ramdisk_stats);
+    ramdisk_stats = NULL;
+  }
+}
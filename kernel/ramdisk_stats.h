@@ -0,0 +1,26 @@
+#ifndef _RAMDISK_STATS_H
+#define _RAMDISK_STATS_H
+
+#include <linux/types.h>
+#include <linux/sched.h>
+#include <linux/mutex.h>
+
+// one slot per ioctl command, indexed by _IOC_NR of the command
+#define RAMDISK_STATS_COMMAND_COUNT  32
+// bucket b counts latencies in [2^(b-1), 2^b) ns, the last one everything longer
+#define RAMDISK_STATS_BUCKET_COUNT   40
+
+int ramdisk_stats_init(void);
+void ramdisk_stats_uninit(void);
+void ramdisk_stats_reset(void);
+void ramdisk_stats_record(int command, u64 start, int result, int byte_count);
+
+// held by every ioctl other than file I/O, see module.c
+extern struct mutex rd_namespace_lock;
+
+static inline u64 ramdisk_stats_clock(void)
+{
+  return sched_clock();
+}
+
+#endif
@@ -0,0 +1,115 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ramdisk
+
+#if !defined(_RAMDISK_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _RAMDISK_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// Tracepoints for the file system engine, under events/ramdisk in the
+// tracing directory. Disabled events cost one untaken branch. The events
+// that report latency_ns turn timing on through their reg/unreg hooks, so
+// no clock is read while all of them are off.
+
+void ramdisk_trace_timing_reg(void);
+void ramdisk_trace_timing_unreg(void);
+
+TRACE_EVENT_FN(ramdisk_create,
+  TP_PROTO(const char *pathname, const char *type, int index_node_number, int result, unsigned long long latency_ns),
+  TP_ARGS(pathname, type, index_node_number, result, latency_ns),
+  TP_STRUCT__entry(
+    __string(pathname, pathname)
+    __array(char, type, 4)
+    __field(int, index_node_number)
+    __field(int, result)
+    __field(unsigned long long, latency_ns)
+  ),
+  TP_fast_assign(
+    __assign_str(pathname, pathname);
+    strncpy(__entry->type, type, 4);
+    __entry->index_node_number = index_node_number;
+    __entry->result = result;
+    __entry->latency_ns = latency_ns;
+  ),
+  TP_printk("pathname=%s type=%.4s index_node=%d result=%d latency_ns=%llu",
+    __get_str(pathname), __entry->type, __entry->index_node_number, __entry->result, __entry->latency_ns),
+  ramdisk_trace_timing_reg, ramdisk_trace_timing_unreg
+);
+
+TRACE_EVENT_FN(ramdisk_open,
+  TP_PROTO(const char *pathname, int index_node_number, int result, unsigned long long latency_ns),
+  TP_ARGS(pathname, index_node_number, result, latency_ns),
+  TP_STRUCT__entry(
+    __string(pathname, pathname)
+    __field(int, index_node_number)
+    __field(int, result)
+    __field(unsigned long long, latency_ns)
+  ),
+  TP_fast_assign(
+    __assign_str(pathname, pathname);
+    __entry->index_node_number = index_node_number;
+    __entry->result = result;
+    __entry->latency_ns = latency_ns;
+  ),
+  TP_printk("pathname=%s index_node=%d result=%d latency_ns=%llu",
+    __get_str(pathname), __entry->index_node_number, __entry->result, __entry->latency_ns),
+  ramdisk_trace_timing_reg, ramdisk_trace_timing_unreg
+);
+
+TRACE_EVENT_FN(ramdisk_unlink,
+  TP_PROTO(const char *pathname, int index_node_number, int result, unsigned long long latency_ns),
+  TP_ARGS(pathname, index_node_number, result, latency_ns),
+  TP_STRUCT__entry(
+    __string(pathname, pathname)
+    __field(int, index_node_number)
+    __field(int, result)
+    __field(unsigned long long, latency_ns)
+  ),
+  TP_fast_assign(
+    __assign_str(pathname, pathname);
+    __entry->index_node_number = index_node_number;
+    __entry->result = result;
+    __entry->latency_ns = latency_ns;
+  ),
+  TP_printk("pathname=%s index_node=%d result=%d latency_ns=%llu",
+    __get_str(pathname), __entry->index_node_number, __entry->result, __entry->latency_ns),
+  ramdisk_trace_timing_reg, ramdisk_trace_timing_unreg
+);
+
+// order is 0 for single blocks and the buddy order for extents
+TRACE_EVENT(ramdisk_block_alloc,
+  TP_PROTO(int block_pointer, int order),
+  TP_ARGS(block_pointer, order),
+  TP_STRUCT__entry(
+    __field(int, block_pointer)
+    __field(int, order)
+  ),
+  TP_fast_assign(
+    __entry->block_pointer = block_pointer;
+    __entry->order = order;
+  ),
+  TP_printk("block=%d order=%d", __entry->block_pointer, __entry->order)
+);
+
+TRACE_EVENT(ramdisk_block_free,
+  TP_PROTO(int block_pointer, int order),
+  TP_ARGS(block_pointer, order),
+  TP_STRUCT__entry(
+    __field(int, block_pointer)
+    __field(int, order)
+  ),
+  TP_fast_assign(
+    __entry->block_pointer = block_pointer;
+    __entry->order = order;
+  ),
+  TP_printk("block=%d order=%d", __entry->block_pointer, __entry->order)
+);
+
+#endif
+
+// out-of-tree module: the build adds this directory to the include path
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ramdisk_trace
+#include <trace/define_trace.h>
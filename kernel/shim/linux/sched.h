@@ -0,0 +1 @@
+#include "ramdisk_shim.h"
@@ -0,0 +1,9 @@
+#include "ramdisk_shim.h"
+
+// tracepoints compile to empty inline functions in the userspace build
+#define TP_PROTO(args...) args
+#define TP_ARGS(args...) args
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print) \
+  static inline void trace_##name(proto) {}
+#define TRACE_EVENT_FN(name, proto, args, tstruct, assign, print, reg, unreg) \
+  static inline void trace_##name(proto) {}
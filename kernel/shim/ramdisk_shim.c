@@ -0,0 +1,239 @@
+#include "ramdisk_shim.h"
+
+__thread int ramdisk_shim_cpu;
+
+void ramdisk_shim_set_cpu(int cpu)
+{
+  ramdisk_shim_cpu = cpu % NR_CPUS;
+}
+
+// a control byte below 128 starts that many plus one literal bytes, any
+// other copies (control & 127) + SHIM_LZ_MIN_MATCH bytes from the two byte
+// distance that follows; wrkmem holds the last position of each hash of
+// the next SHIM_LZ_MIN_MATCH bytes
+#define SHIM_LZ_MIN_MATCH 4
+#define SHIM_LZ_MAX_MATCH (127 + SHIM_LZ_MIN_MATCH)
+#define SHIM_LZ_MAX_DISTANCE 65535
+#define SHIM_LZ_HASH_BITS 13
+
+static unsigned int ramdisk_shim_lz_hash(const unsigned char *p)
+{
+  unsigned int word = p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+
+  return (word * 2654435761U) >> (32 - SHIM_LZ_HASH_BITS);
+}
+
+int lzo1x_1_compress(const unsigned char *src, size_t src_len, unsigned char *dst, size_t *dst_len, void *wrkmem)
+{
+  int *last = (int *)wrkmem;
+  size_t i = 0;
+  size_t literal_start = 0;
+  size_t length = 0;
+  size_t match_length = 0;
+  size_t candidate = 0;
+  size_t count = 0;
+  unsigned int hash = 0;
+
+  for (i = 0; i < (1 << SHIM_LZ_HASH_BITS); i++)
+  {
+    last[i] = -1;
+  }
+  i = 0;
+  while (i < src_len)
+  {
+    match_length = 0;
+    if (i + SHIM_LZ_MIN_MATCH <= src_len)
+    {
+      hash = ramdisk_shim_lz_hash(src + i);
+      if ((last[hash] >= 0) && (i - last[hash] <= SHIM_LZ_MAX_DISTANCE))
+      {
+        candidate = last[hash];
+        while ((i + match_length < src_len) && (match_length < SHIM_LZ_MAX_MATCH)
+               && (src[candidate + match_length] == src[i + match_length]))
+        {
+          match_length++;
+        }
+      }
+      last[hash] = i;
+    }
+    if ((match_length < SHIM_LZ_MIN_MATCH) && (i + 1 < src_len) && (i + 1 - literal_start < 128))
+    {
+      i++;
+      continue;
+    }
+    if (match_length < SHIM_LZ_MIN_MATCH)
+    {
+      i++;
+    }
+    // flush the literals before the match, or the full literal run
+    count = i - literal_start;
+    if (count > 0)
+    {
+      dst[length++] = (unsigned char)(count - 1);
+      memcpy(dst + length, src + literal_start, count);
+      length = length + count;
+    }
+    if (match_length >= SHIM_LZ_MIN_MATCH)
+    {
+      dst[length++] = (unsigned char)(128 | (match_length - SHIM_LZ_MIN_MATCH));
+      dst[length++] = (unsigned char)((i - candidate) & 0xFF);
+      dst[length++] = (unsigned char)((i - candidate) >> 8);
+      i = i + match_length;
+    }
+    literal_start = i;
+  }
+  *dst_len = length;
+
+  return LZO_E_OK;
+}
+
+int lzo1x_decompress_safe(const unsigned char *src, size_t src_len, unsigned char *dst, size_t *dst_len)
+{
+  size_t i = 0;
+  size_t length = 0;
+  size_t count = 0;
+  size_t distance = 0;
+  unsigned char control = 0;
+
+  while (i < src_len)
+  {
+    control = src[i++];
+    if (control < 128)
+    {
+      count = control + 1;
+      if (i + count > src_len)
+      {
+        return LZO_E_INPUT_OVERRUN;
+      }
+      if (length + count > *dst_len)
+      {
+        return LZO_E_OUTPUT_OVERRUN;
+      }
+      memcpy(dst + length, src + i, count);
+      i = i + count;
+    }
+    else
+    {
+      count = (control & 127) + SHIM_LZ_MIN_MATCH;
+      if (i + 2 > src_len)
+      {
+        return LZO_E_INPUT_OVERRUN;
+      }
+      distance = src[i] | (src[i + 1] << 8);
+      i = i + 2;
+      if ((0 == distance) || (distance > length))
+      {
+        return LZO_E_LOOKBEHIND_OVERRUN;
+      }
+      if (length + count > *dst_len)
+      {
+        return LZO_E_OUTPUT_OVERRUN;
+      }
+      // byte by byte, a match may overlap the bytes it produces
+      for (; count > 0; count--, length++)
+      {
+        dst[length] = dst[length - distance];
+      }
+      continue;
+    }
+    length = length + count;
+  }
+  *dst_len = length;
+
+  return LZO_E_OK;
+}
+
+static pthread_mutex_t ramdisk_shim_work_lock = PTHREAD_MUTEX_INITIALIZER;
+// signalled when work is queued and when a work item finishes
+static pthread_cond_t ramdisk_shim_work_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ramdisk_shim_work_done = PTHREAD_COND_INITIALIZER;
+static struct work_struct *ramdisk_shim_work_head;
+static struct work_struct *ramdisk_shim_work_running;
+static pthread_once_t ramdisk_shim_worker_once = PTHREAD_ONCE_INIT;
+
+static void *ramdisk_shim_worker(void *arg)
+{
+  struct work_struct *work = NULL;
+
+  pthread_mutex_lock(&ramdisk_shim_work_lock);
+  for (;;)
+  {
+    while (NULL == ramdisk_shim_work_head)
+    {
+      pthread_cond_wait(&ramdisk_shim_work_queued, &ramdisk_shim_work_lock);
+    }
+    work = ramdisk_shim_work_head;
+    ramdisk_shim_work_head = work->next;
+    work->pending = 0;
+    ramdisk_shim_work_running = work;
+    pthread_mutex_unlock(&ramdisk_shim_work_lock);
+    work->func(work);
+    pthread_mutex_lock(&ramdisk_shim_work_lock);
+    ramdisk_shim_work_running = NULL;
+    pthread_cond_broadcast(&ramdisk_shim_work_done);
+  }
+
+  return NULL;
+}
+
+static void ramdisk_shim_worker_start(void)
+{
+  pthread_t thread;
+
+  pthread_create(&thread, NULL, ramdisk_shim_worker, NULL);
+  pthread_detach(thread);
+}
+
+int schedule_work(struct work_struct *work)
+{
+  struct work_struct **tail = NULL;
+
+  pthread_once(&ramdisk_shim_worker_once, ramdisk_shim_worker_start);
+  pthread_mutex_lock(&ramdisk_shim_work_lock);
+  if (work->pending)
+  {
+    pthread_mutex_unlock(&ramdisk_shim_work_lock);
+    return 0;
+  }
+  work->pending = 1;
+  work->next = NULL;
+  for (tail = &ramdisk_shim_work_head; NULL != *tail; tail = &(*tail)->next)
+  {
+  }
+  *tail = work;
+  pthread_cond_signal(&ramdisk_shim_work_queued);
+  pthread_mutex_unlock(&ramdisk_shim_work_lock);
+
+  return 1;
+}
+
+// wait until the work is neither queued nor running
+void flush_work(struct work_struct *work)
+{
+  pthread_mutex_lock(&ramdisk_shim_work_lock);
+  while (work->pending || (ramdisk_shim_work_running == work))
+  {
+    pthread_cond_wait(&ramdisk_shim_work_done, &ramdisk_shim_work_lock);
+  }
+  pthread_mutex_unlock(&ramdisk_shim_work_lock);
+}
+
+void cancel_work_sync(struct work_struct *work)
+{
+  struct work_struct **link = NULL;
+
+  pthread_mutex_lock(&ramdisk_shim_work_lock);
+  if (work->pending)
+  {
+    for (link = &ramdisk_shim_work_head; work != *link; link = &(*link)->next)
+    {
+    }
+    *link = work->next;
+    work->pending = 0;
+  }
+  while (ramdisk_shim_work_running == work)
+  {
+    pthread_cond_wait(&ramdisk_shim_work_done, &ramdisk_shim_work_lock);
+  }
+  pthread_mutex_unlock(&ramdisk_shim_work_lock);
+}
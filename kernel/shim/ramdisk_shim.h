@@ -0,0 +1,197 @@
+#ifndef _RAMDISK_SHIM_H
+#define _RAMDISK_SHIM_H
+
+// Userspace stand-ins for the kernel interfaces ramdisk_kernel.c uses, so
+// the file system engine can be built as a plain static library and driven
+// directly by a benchmark under perf or the sanitizers. Only included
+// through the headers in shim/linux, which shadow the real kernel headers.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#define KERN_INFO ""
+#define KERN_ERR ""
+#define printk(...) ((void)0)
+
+#define GFP_KERNEL 0
+#define __GFP_ZERO 0x1
+#define __GFP_NOWARN 0x2
+#define __GFP_NORETRY 0x4
+#define vmalloc(size) malloc(size)
+#define vzalloc(size) calloc(1, size)
+#define vfree(address) free(address)
+// every allocation is freed with free, so nothing needs telling apart
+#define is_vmalloc_addr(address) 0
+#define kmalloc(size, flags) malloc(size)
+#define kfree(address) free(address)
+
+#define PAGE_SIZE 4096
+#define get_zeroed_page(flags) ((unsigned long)calloc(1, PAGE_SIZE))
+#define free_page(address) free((void *)(address))
+
+static inline int get_order(unsigned long size)
+{
+  int order = 0;
+  while ((PAGE_SIZE << order) < size)
+  {
+    order++;
+  }
+  return order;
+}
+
+// aligned so transparent huge pages can back high orders the way the
+// kernel's direct map backs them with large pages
+static inline unsigned long __get_free_pages(int flags, int order)
+{
+  void *address = aligned_alloc(PAGE_SIZE << order, PAGE_SIZE << order);
+  if ((NULL != address) && (order > 0))
+  {
+    madvise(address, PAGE_SIZE << order, MADV_HUGEPAGE);
+  }
+  if ((NULL != address) && (flags & __GFP_ZERO))
+  {
+    memset(address, 0, PAGE_SIZE << order);
+  }
+  return (unsigned long)address;
+}
+#define free_pages(address, order) free((void *)(address))
+
+// the caller's buffer is already in our address space, so the copy never faults
+static inline unsigned long copy_to_user(void *to, const void *from, unsigned long n)
+{
+  memcpy(to, from, n);
+  return 0;
+}
+
+static inline unsigned long copy_from_user(void *to, const void *from, unsigned long n)
+{
+  memcpy(to, from, n);
+  return 0;
+}
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define sort(base, count, size, compare, swap_function) qsort((base), (count), (size), (compare))
+#define swap(a, b) do { __typeof__(a) __tmp = (a); (a) = (b); (b) = __tmp; } while (0)
+
+typedef unsigned int u32;
+
+// not the kernel's Jenkins hash, only as well mixed
+static inline u32 jhash2(const u32 *k, u32 length, u32 initval)
+{
+  u32 hash = initval ^ 0x9e3779b9;
+  u32 i = 0;
+
+  for (i = 0; i < length; i++)
+  {
+    hash = (hash ^ k[i]) * 0x01000193;
+    hash = hash ^ (hash >> 15);
+  }
+  return hash;
+}
+
+// the kernel's LZO1X entry points, backed by a plain LZ77 coder whose
+// output only ramdisk_shim.c's lzo1x_decompress_safe reads, not by the
+// real LZO1X format
+#define LZO_E_OK 0
+#define LZO_E_ERROR (-1)
+#define LZO_E_INPUT_OVERRUN (-4)
+#define LZO_E_OUTPUT_OVERRUN (-5)
+#define LZO_E_LOOKBEHIND_OVERRUN (-6)
+#define LZO1X_1_MEM_COMPRESS (8192 * sizeof(unsigned short *))
+#define lzo1x_worst_compress(x) ((x) + ((x) / 16) + 64 + 3)
+int lzo1x_1_compress(const unsigned char *src, size_t src_len, unsigned char *dst, size_t *dst_len, void *wrkmem);
+int lzo1x_decompress_safe(const unsigned char *src, size_t src_len, unsigned char *dst, size_t *dst_len);
+
+static inline unsigned long long sched_clock(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// spinlocks become mutexes; sleeping instead of spinning is fine outside the kernel
+typedef pthread_mutex_t spinlock_t;
+#define DEFINE_SPINLOCK(x) spinlock_t x = PTHREAD_MUTEX_INITIALIZER
+#define spin_lock_init(lock) pthread_mutex_init((lock), NULL)
+#define spin_lock(lock) pthread_mutex_lock(lock)
+#define spin_unlock(lock) pthread_mutex_unlock(lock)
+
+struct mutex
+{
+  pthread_mutex_t lock;
+};
+#define DEFINE_MUTEX(x) struct mutex x = { PTHREAD_MUTEX_INITIALIZER }
+#define mutex_lock(x) pthread_mutex_lock(&(x)->lock)
+#define mutex_unlock(x) pthread_mutex_unlock(&(x)->lock)
+
+struct rw_semaphore
+{
+  pthread_rwlock_t lock;
+};
+#define DECLARE_RWSEM(x) struct rw_semaphore x = { PTHREAD_RWLOCK_INITIALIZER }
+#define init_rwsem(sem) pthread_rwlock_init(&(sem)->lock, NULL)
+#define down_read(sem) pthread_rwlock_rdlock(&(sem)->lock)
+#define up_read(sem) pthread_rwlock_unlock(&(sem)->lock)
+#define down_write(sem) pthread_rwlock_wrlock(&(sem)->lock)
+#define up_write(sem) pthread_rwlock_unlock(&(sem)->lock)
+// there is no lock validator to tell nesting levels apart
+#define SINGLE_DEPTH_NESTING 1
+#define down_write_nested(sem, subclass) down_write(sem)
+
+// a wait queue is a condition variable; the condition is evaluated with its
+// mutex held, so a wake_up_all after the state changes is never missed
+typedef struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} wait_queue_head_t;
+#define init_waitqueue_head(queue) do { pthread_mutex_init(&(queue)->lock, NULL); pthread_cond_init(&(queue)->cond, NULL); } while (0)
+#define wait_event(queue, condition) do { \
+    pthread_mutex_lock(&(queue).lock); \
+    while (!(condition)) \
+    { \
+      pthread_cond_wait(&(queue).cond, &(queue).lock); \
+    } \
+    pthread_mutex_unlock(&(queue).lock); \
+  } while (0)
+// there are no signals to interrupt the wait
+#define wait_event_interruptible(queue, condition) ({ wait_event(queue, condition); 0; })
+#define wake_up_all(queue) do { \
+    pthread_mutex_lock(&(queue)->lock); \
+    pthread_cond_broadcast(&(queue)->cond); \
+    pthread_mutex_unlock(&(queue)->lock); \
+  } while (0)
+
+// per-CPU variables become arrays indexed by a thread-local CPU number that
+// a multi-threaded driver sets with ramdisk_shim_set_cpu
+#define NR_CPUS 64
+extern __thread int ramdisk_shim_cpu;
+#define DEFINE_PER_CPU(type, name) type name[NR_CPUS]
+#define per_cpu(var, cpu) ((var)[(cpu)])
+#define get_cpu_var(var) ((var)[ramdisk_shim_cpu])
+#define put_cpu_var(var) ((void)0)
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < NR_CPUS; (cpu)++)
+
+void ramdisk_shim_set_cpu(int cpu);
+
+// work items run one at a time on a worker thread started on first use
+struct work_struct
+{
+  void (*func)(struct work_struct *work);
+  struct work_struct *next;
+  int pending;
+};
+#define DECLARE_WORK(name, function) struct work_struct name = { (function), NULL, 0 }
+int schedule_work(struct work_struct *work);
+void flush_work(struct work_struct *work);
+void cancel_work_sync(struct work_struct *work);
+
+#endif
@@ -0,0 +1 @@
+// nothing to define for the empty userspace tracepoints
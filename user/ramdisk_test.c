@@ -3,6 +3,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <pthread.h>
 
 
 #include "ramdisk_test.h"
@@ -12,6 +13,8 @@ typedef struct _ramdisk_file_descriptor
   int fd;
   int file_position;
   int index_node_number;
+  // the entry the last rd_readdir returned, where the next one continues
+  char dir_entry[16];
   struct _ramdisk_file_descriptor *next;
   struct _ramdisk_file_descriptor *prev;
 } ramdisk_file_descriptor_t;
@@ -27,6 +30,8 @@ ramdisk_file_descriptor_t *find_file_descriptor(int fd);
 int ramdisk_current_fd = 1;
 ramdisk_file_descriptor_t *ramdisk_file_descriptor_list_head = NULL;
 ramdisk_file_descriptor_t *ramdisk_file_descriptor_list_tail = NULL;
+// protects the descriptor list and ramdisk_current_fd so threads can share the library
+pthread_mutex_t ramdisk_file_descriptor_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
 int rd_creat(char *pathname)
@@ -51,9 +56,11 @@ int rd_open(char *pathname)
   }
   file_descriptor = (ramdisk_file_descriptor_t *)malloc(sizeof(ramdisk_file_descriptor_t));
   file_descriptor->index_node_number = index_node_number;
-  file_descriptor->fd = ramdisk_current_fd++;
   file_descriptor->file_position = 0;
+  pthread_mutex_lock(&ramdisk_file_descriptor_lock);
+  file_descriptor->fd = ramdisk_current_fd++;
   append_file_descriptor_to_list(file_descriptor);
+  pthread_mutex_unlock(&ramdisk_file_descriptor_lock);
 
   return file_descriptor->fd;
 }
@@ -72,7 +79,9 @@ int rd_close(int fd)
   {
     return -1;
   }
+  pthread_mutex_lock(&ramdisk_file_descriptor_lock);
   remove_file_descriptor_from_list(file_descriptor);
+  pthread_mutex_unlock(&ramdisk_file_descriptor_lock);
   free(file_descriptor);
 
   return 0;
@@ -122,6 +131,93 @@ int rd_write(int fd, char *address, int num_bytes)
   return data_length_write;
 }
 
+/* Lock bytes start to start + length of the file, to its end for length 0,
+   for reading or writing, or unlock them with RAMDISK_RANGE_UNLOCK. The
+   locks are advisory and held by the process until it unlocks the range
+   or closes the file. With is_wait the call waits for locks of other
+   processes that conflict, otherwise it fails. */
+int rd_range_lock(int fd, int start, int length, int type, int is_wait)
+{
+  ramdisk_file_descriptor_t *file_descriptor = NULL;
+
+  file_descriptor = find_file_descriptor(fd);
+  if (NULL == file_descriptor)
+  {
+    return -1;
+  }
+
+  return ramdisk_range_lock(file_descriptor->index_node_number, start, length, type, is_wait);
+}
+
+/* Write at the end of the file as the kernel finds it, so appends from
+   several processes never overwrite each other. Data that does not fit
+   is not written at all. The position moves to the end of the data
+   written. */
+int rd_append(int fd, char *address, int num_bytes)
+{
+  int data_length_write = 0;
+  int file_position = 0;
+  ramdisk_file_descriptor_t *file_descriptor = NULL;
+
+  file_descriptor = find_file_descriptor(fd);
+  if (NULL == file_descriptor)
+  {
+    return -1;
+  }
+  data_length_write = ramdisk_append(file_descriptor->index_node_number,address,num_bytes,&file_position);
+  if (data_length_write < 0)
+  {
+    return -1;
+  }
+  file_descriptor->file_position = file_position + data_length_write;
+
+  return data_length_write;
+}
+
+/* Read into each buffer of iov in turn, as one read of their total length
+   from the current position. */
+int rd_readv(int fd, const struct iovec *iov, int iov_count)
+{
+  int data_length_read = 0;
+  ramdisk_file_descriptor_t *file_descriptor = NULL;
+
+  file_descriptor = find_file_descriptor(fd);
+  if (NULL == file_descriptor)
+  {
+    return -1;
+  }
+  data_length_read = ramdisk_readv(file_descriptor->index_node_number,file_descriptor->file_position,iov,iov_count);
+  if (data_length_read < 0)
+  {
+    return -1;
+  }
+  file_descriptor->file_position = file_descriptor->file_position + data_length_read;
+
+  return data_length_read;
+}
+
+/* Write each buffer of iov in turn, as one write of their total length at
+   the current position. */
+int rd_writev(int fd, const struct iovec *iov, int iov_count)
+{
+  int data_length_write = 0;
+  ramdisk_file_descriptor_t *file_descriptor = NULL;
+
+  file_descriptor = find_file_descriptor(fd);
+  if (NULL == file_descriptor)
+  {
+    return -1;
+  }
+  data_length_write = ramdisk_writev(file_descriptor->index_node_number,file_descriptor->file_position,iov,iov_count);
+  if (data_length_write < 0)
+  {
+    return -1;
+  }
+  file_descriptor->file_position = file_descriptor->file_position + data_length_write;
+
+  return data_length_write;
+}
+
 int rd_lseek(int fd, int offset)
 {
   int seek_result_offset = -1;
@@ -166,17 +262,132 @@ int rd_readdir(int fd, char *address)
 
   next_file_position = file_descriptor->file_position;
   read_result = ramdisk_readdir(file_descriptor->index_node_number,
-    address,
+    file_descriptor->dir_entry,
     &next_file_position);
   /* Update the file position value. */
   if (read_result >= 0)
   {
     file_descriptor->file_position = next_file_position;
   }
+  if (read_result > 0)
+  {
+    memcpy(address, file_descriptor->dir_entry, sizeof(file_descriptor->dir_entry));
+  }
 
   return read_result;
 }
 
+/* List up to max_entry_count entries named after "after", before "before"
+   and starting with "prefix", in name order. Pass the last returned name
+   as "after" to continue the listing. */
+int rd_readdir_range(int fd, char *after, char *before, char *prefix, char *address, int max_entry_count)
+{
+  ramdisk_file_descriptor_t *file_descriptor = NULL;
+
+  if (NULL == address)
+  {
+    return -1;
+  }
+  file_descriptor = find_file_descriptor(fd);
+  if (NULL == file_descriptor)
+  {
+    return -1;
+  }
+
+  return ramdisk_readdir_range(file_descriptor->index_node_number,
+    after,
+    before,
+    prefix,
+    address,
+    max_entry_count);
+}
+
+/* Remove a directory and everything below it, returns the number of files
+   and directories removed. Nothing is removed while a file in it is open. */
+int rd_rmtree(char *pathname)
+{
+  return ramdisk_rmtree(pathname);
+}
+
+/* List everything below a directory, parents before their children, with
+   paths relative to it. Pass the number of records already returned as
+   start_index to continue once a call fills the buffer. */
+int rd_walk(char *pathname, int start_index, walk_record_t *records, int max_record_count)
+{
+  if (NULL == records)
+  {
+    return -1;
+  }
+
+  return ramdisk_walk(pathname, start_index, records, max_record_count);
+}
+
+/* Move a file or directory to a new path without copying its data. A file
+   or empty directory of the same type at the new path is replaced, and the
+   new path keeps resolving to one of the two files throughout. */
+int rd_rename(char *old_pathname, char *new_pathname)
+{
+  return ramdisk_rename(old_pathname, new_pathname);
+}
+
+/* Copy num_bytes from src_fd's position to dst_fd's inside the ramdisk and
+   advance both, like a read followed by a write. With COPY_RANGE_REFLINK
+   the files share whole blocks until one of them writes to a block. */
+int rd_copy_range(int src_fd, int dst_fd, int num_bytes, int flags)
+{
+  int data_length_copied = 0;
+  ramdisk_file_descriptor_t *src_file_descriptor = NULL;
+  ramdisk_file_descriptor_t *dst_file_descriptor = NULL;
+
+  src_file_descriptor = find_file_descriptor(src_fd);
+  dst_file_descriptor = find_file_descriptor(dst_fd);
+  if ((NULL == src_file_descriptor) || (NULL == dst_file_descriptor))
+  {
+    return -1;
+  }
+
+  data_length_copied = ramdisk_copy_range(src_file_descriptor->index_node_number,
+    src_file_descriptor->file_position,
+    dst_file_descriptor->index_node_number,
+    dst_file_descriptor->file_position,
+    num_bytes,
+    flags);
+  if (data_length_copied < 0)
+  {
+    return -1;
+  }
+  src_file_descriptor->file_position = src_file_descriptor->file_position + data_length_copied;
+  dst_file_descriptor->file_position = dst_file_descriptor->file_position + data_length_copied;
+
+  return data_length_copied;
+}
+
+/* Freeze the whole tree as /.snapshot/name. The snapshot's files share
+   their blocks with the live files until either side writes to them, so
+   it costs little space and no writer has to stop for a backup to read
+   it. Files in a snapshot can be read but not written, created, renamed
+   or unlinked. Returns the number of files and directories in the
+   snapshot. */
+int rd_snapshot(char *name)
+{
+  return ramdisk_snapshot(name);
+}
+
+/* Remove a snapshot; blocks only it still holds are freed in the background. */
+int rd_snapshot_drop(char *name)
+{
+  char pathname[64];
+
+  if ((NULL == name) || (0 == strlen(name)) || (strlen(name) + sizeof(SNAPSHOT_DIRECTORY_NAME) + 2 > sizeof(pathname)))
+  {
+    return -1;
+  }
+  strcpy(pathname, "/" SNAPSHOT_DIRECTORY_NAME "/");
+  strcat(pathname, name);
+
+  return (ramdisk_rmtree(pathname) > 0) ? 0 : -1;
+}
+
 void append_file_descriptor_to_list(ramdisk_file_descriptor_t *file_descriptor)
 {
   ramdisk_file_descriptor_t *head = NULL;
@@ -240,17 +451,19 @@ ramdisk_file_descriptor_t *find_file_descriptor(int fd)
 {
   ramdisk_file_descriptor_t *curr = NULL;
 
+  pthread_mutex_lock(&ramdisk_file_descriptor_lock);
   curr = ramdisk_file_descriptor_list_head;
   while (NULL != curr)
   {
     if (fd == curr->fd)
     {
-      return curr;
+      break;
     }
     curr = curr->next;
   }
+  pthread_mutex_unlock(&ramdisk_file_descriptor_lock);
 
-  return NULL;
+  return curr;
 }
 
 int ramdisk_creat(char *pathname)
@@ -486,6 +699,9 @@ int ramdisk_mkdir(char *pathname)
   return 0;
 }
 
+/* Read the directory entry at file_position into address. Unless
+   file_position is 0, address has to hold the entry the previous call
+   returned, which large directories continue after in name order. */
 int ramdisk_readdir(int index_node_number, char *address, int *file_position)
 {
   int ret = 0;
@@ -500,6 +716,7 @@ int ramdisk_readdir(int index_node_number, char *address, int *file_position)
   readdir_param.return_value = -1;
   readdir_param.index_node_number = index_node_number;
   readdir_param.file_position = *file_position;
+  memcpy(readdir_param.address, address, sizeof(readdir_param.address));
   ret = ioctl(fd, IOCTL_READDIR, &readdir_param);
   close(fd);
   if (ret != 0)
@@ -519,4 +736,414 @@ int ramdisk_readdir(int index_node_number, char *address, int *file_position)
   return readdir_param.return_value;
 }
 
+int ramdisk_readdir_range(int index_node_number, char *after, char *before, char *prefix, char *address, int max_entry_count)
+{
+  int ret = 0;
+  int fd = 0;
+  readdir_range_param_t range_param;
+
+  fd = open("/proc/ramdisk", O_RDONLY);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  memset(&range_param, 0, sizeof(range_param));
+  range_param.return_value = -1;
+  range_param.index_node_number = index_node_number;
+  strncpy(range_param.after, (NULL == after) ? "" : after, sizeof(range_param.after) - 1);
+  strncpy(range_param.before, (NULL == before) ? "" : before, sizeof(range_param.before) - 1);
+  strncpy(range_param.prefix, (NULL == prefix) ? "" : prefix, sizeof(range_param.prefix) - 1);
+  range_param.max_entry_count = max_entry_count;
+  range_param.address = address;
+  ret = ioctl(fd, IOCTL_READDIR_RANGE, &range_param);
+  close(fd);
+  if (ret != 0)
+  {
+    return -1;
+  }
+
+  return range_param.return_value;
+}
+
+int ramdisk_stats_reset(void)
+{
+  int ret = 0;
+  int fd = 0;
+
+  fd = open("/proc/ramdisk", O_RDONLY);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  ret = ioctl(fd, IOCTL_STATS_RESET);
+  close(fd);
+  if (ret != 0)
+  {
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Move the blocks of a file, or of every file when index_node_number is
+   -1, into contiguous runs. defrag_param receives the bytes moved and the
+   fragment counts before and after. */
+int ramdisk_defrag(int index_node_number, defrag_param_t *defrag_param)
+{
+  int ret = 0;
+  int fd = 0;
+
+  fd = open("/proc/ramdisk", O_RDONLY);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  memset(defrag_param, 0, sizeof(defrag_param_t));
+  defrag_param->return_value = -1;
+  defrag_param->index_node_number = index_node_number;
+  ret = ioctl(fd, IOCTL_DEFRAG, defrag_param);
+  close(fd);
+  if (ret != 0)
+  {
+    return -1;
+  }
+
+  return defrag_param->return_value;
+}
+
+/* Make the blocks of every file that hold the same bytes share one block,
+   until a write to one of them. dedup_param receives the blocks looked at,
+   the duplicates found and the blocks that became free. */
+int ramdisk_dedup(dedup_param_t *dedup_param)
+{
+  int ret = 0;
+  int fd = 0;
+
+  fd = open("/proc/ramdisk", O_RDONLY);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  memset(dedup_param, 0, sizeof(dedup_param_t));
+  dedup_param->return_value = -1;
+  ret = ioctl(fd, IOCTL_DEDUP, dedup_param);
+  close(fd);
+  if (ret != 0)
+  {
+    return -1;
+  }
+
+  return dedup_param->return_value;
+}
 
+int ramdisk_range_lock(int index_node_number, int start, int length, int type, int is_wait)
+{
+  int ret = 0;
+  int fd = 0;
+  range_lock_param_t range_lock_param;
+
+  fd = open("/proc/ramdisk", O_RDONLY);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  range_lock_param.return_value = -1;
+  range_lock_param.index_node_number = index_node_number;
+  range_lock_param.start = start;
+  range_lock_param.length = length;
+  range_lock_param.type = type;
+  range_lock_param.is_wait = is_wait;
+  ret = ioctl(fd, IOCTL_RANGE_LOCK, &range_lock_param);
+  close(fd);
+  if (ret != 0)
+  {
+    return -1;
+  }
+
+  return range_lock_param.return_value;
+}
+
+/* Write at the end of the file in one call. file_position receives the
+   offset the data went to. Fails rather than writing part of the data when
+   it would take the file past its maximum size. */
+int ramdisk_append(int index_node_number, char *address, int num_bytes, int *file_position)
+{
+  int ret = 0;
+  int fd = 0;
+  read_write_param_t append_param;
+
+  fd = open("/proc/ramdisk", O_RDONLY);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  append_param.return_value = -1;
+  append_param.index_node_number = index_node_number;
+  append_param.file_position = 0;
+  append_param.address = address;
+  append_param.num_bytes = num_bytes;
+  ret = ioctl(fd, IOCTL_APPEND, &append_param);
+  close(fd);
+  if (ret != 0)
+  {
+    return -1;
+  }
+  if ((append_param.return_value >= 0) && (NULL != file_position))
+  {
+    *file_position = append_param.file_position;
+  }
+
+  return append_param.return_value;
+}
+
+/* Read or write a list of buffers with one call, so the file is locked and
+   its blocks are walked once for all of them. */
+static int ramdisk_readv_writev(unsigned int cmd, int index_node_number, int file_position, const struct iovec *iov, int iov_count)
+{
+  int ret = 0;
+  int fd = 0;
+  readv_writev_param_t readv_writev_param;
+
+  fd = open("/proc/ramdisk", O_RDONLY);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  readv_writev_param.return_value = -1;
+  readv_writev_param.index_node_number = index_node_number;
+  readv_writev_param.file_position = file_position;
+  readv_writev_param.iov = (struct iovec *)iov;
+  readv_writev_param.iov_count = iov_count;
+  ret = ioctl(fd, cmd, &readv_writev_param);
+  close(fd);
+  if (ret != 0)
+  {
+    return -1;
+  }
+
+  return readv_writev_param.return_value;
+}
+
+int ramdisk_readv(int index_node_number, int file_position, const struct iovec *iov, int iov_count)
+{
+  return ramdisk_readv_writev(IOCTL_READV, index_node_number, file_position, iov, iov_count);
+}
+
+int ramdisk_writev(int index_node_number, int file_position, const struct iovec *iov, int iov_count)
+{
+  return ramdisk_readv_writev(IOCTL_WRITEV, index_node_number, file_position, iov, iov_count);
+}
+
+/* Compress a file, or every file nobody has read or written for
+   idle_seconds when index_node_number is -1. Reads decompress what they
+   need and the first write stores the file plainly again. compress_param
+   receives the size of the files compressed and what they take now. */
+int ramdisk_compress(int index_node_number, int idle_seconds, compress_param_t *compress_param)
+{
+  int ret = 0;
+  int fd = 0;
+
+  fd = open("/proc/ramdisk", O_RDONLY);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  memset(compress_param, 0, sizeof(compress_param_t));
+  compress_param->return_value = -1;
+  compress_param->index_node_number = index_node_number;
+  compress_param->idle_seconds = idle_seconds;
+  ret = ioctl(fd, IOCTL_COMPRESS, compress_param);
+  close(fd);
+  if (ret != 0)
+  {
+    return -1;
+  }
+
+  return compress_param->return_value;
+}
+
+/* Copy an image of the whole ramdisk into address. image_size receives the
+   bytes the image needs, so a call with a short buffer can be retried. */
+int ramdisk_export(char *address, int length, int *image_size)
+{
+  int ret = 0;
+  int fd = 0;
+  image_param_t export_param;
+
+  fd = open("/proc/ramdisk", O_RDONLY);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  export_param.return_value = -1;
+  export_param.image_size = 0;
+  export_param.address = address;
+  export_param.length = length;
+  ret = ioctl(fd, IOCTL_EXPORT, &export_param);
+  close(fd);
+  *image_size = export_param.image_size;
+  if (ret != 0)
+  {
+    return -1;
+  }
+
+  return export_param.return_value;
+}
+
+/* Replace the ramdisk contents with an image from ramdisk_export. Fails,
+   leaving the ramdisk as it was, when the image is malformed or a file is
+   open. */
+int ramdisk_import(char *address, int length)
+{
+  int ret = 0;
+  int fd = 0;
+  image_param_t import_param;
+
+  fd = open("/proc/ramdisk", O_RDONLY);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  import_param.return_value = -1;
+  import_param.image_size = length;
+  import_param.address = address;
+  import_param.length = length;
+  ret = ioctl(fd, IOCTL_IMPORT, &import_param);
+  close(fd);
+  if (ret != 0)
+  {
+    return -1;
+  }
+
+  return import_param.return_value;
+}
+
+int ramdisk_rmtree(char *pathname)
+{
+  int ret = 0;
+  int fd = 0;
+  creat_param_t rmtree_param;
+
+  fd = open("/proc/ramdisk", O_RDONLY);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  rmtree_param.return_value = -1;
+  rmtree_param.pathname.pathname = (const char *)pathname;
+  rmtree_param.pathname.pathname_length = (int)strlen(pathname);
+  ret = ioctl(fd, IOCTL_RMTREE, &rmtree_param);
+  close(fd);
+  if (ret != 0)
+  {
+    return -1;
+  }
+
+  return rmtree_param.return_value;
+}
+
+int ramdisk_walk(char *pathname, int start_index, walk_record_t *records, int max_record_count)
+{
+  int ret = 0;
+  int fd = 0;
+  walk_param_t walk_param;
+
+  fd = open("/proc/ramdisk", O_RDONLY);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  memset(&walk_param, 0, sizeof(walk_param));
+  walk_param.return_value = -1;
+  walk_param.pathname.pathname = (const char *)pathname;
+  walk_param.pathname.pathname_length = (int)strlen(pathname);
+  walk_param.start_index = start_index;
+  walk_param.max_record_count = max_record_count;
+  walk_param.address = (char *)records;
+  ret = ioctl(fd, IOCTL_WALK, &walk_param);
+  close(fd);
+  if (ret != 0)
+  {
+    return -1;
+  }
+
+  return walk_param.return_value;
+}
+
+int ramdisk_rename(char *old_pathname, char *new_pathname)
+{
+  int ret = 0;
+  int fd = 0;
+  rename_param_t rename_param;
+
+  fd = open("/proc/ramdisk", O_RDONLY);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  rename_param.return_value = -1;
+  rename_param.old_pathname.pathname = (const char *)old_pathname;
+  rename_param.old_pathname.pathname_length = (int)strlen(old_pathname);
+  rename_param.new_pathname.pathname = (const char *)new_pathname;
+  rename_param.new_pathname.pathname_length = (int)strlen(new_pathname);
+  ret = ioctl(fd, IOCTL_RENAME, &rename_param);
+  close(fd);
+  if (ret != 0)
+  {
+    return -1;
+  }
+
+  return rename_param.return_value;
+}
+
+int ramdisk_copy_range(int src_index_node_number, int src_file_position, int dst_index_node_number, int dst_file_position, int num_bytes, int flags)
+{
+  int ret = 0;
+  int fd = 0;
+  copy_range_param_t copy_range_param;
+
+  fd = open("/proc/ramdisk", O_RDONLY);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  copy_range_param.return_value = -1;
+  copy_range_param.src_index_node_number = src_index_node_number;
+  copy_range_param.src_file_position = src_file_position;
+  copy_range_param.dst_index_node_number = dst_index_node_number;
+  copy_range_param.dst_file_position = dst_file_position;
+  copy_range_param.num_bytes = num_bytes;
+  copy_range_param.flags = flags;
+  ret = ioctl(fd, IOCTL_COPY_RANGE, &copy_range_param);
+  close(fd);
+  if (ret != 0)
+  {
+    return -1;
+  }
+
+  return copy_range_param.return_value;
+}
+
+int ramdisk_snapshot(char *name)
+{
+  int ret = 0;
+  int fd = 0;
+  creat_param_t snapshot_param;
+
+  fd = open("/proc/ramdisk", O_RDONLY);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  snapshot_param.return_value = -1;
+  snapshot_param.pathname.pathname = (const char *)name;
+  snapshot_param.pathname.pathname_length = (int)strlen(name);
+  ret = ioctl(fd, IOCTL_SNAPSHOT, &snapshot_param);
+  close(fd);
+  if (ret != 0)
+  {
+    return -1;
+  }
+
+  return snapshot_param.return_value;
+}
@@ -1,3 +1,5 @@
+#include <sys/uio.h>
+
 
 typedef struct _pathname
 {
@@ -40,6 +42,19 @@ typedef struct _read_write_param
 
 } read_write_param_t;
 
+// most buffers one IOCTL_READV or IOCTL_WRITEV takes
+#define RAMDISK_IOV_MAX 1024
+
+typedef struct _readv_writev_param
+{
+  int return_value;
+  int index_node_number;
+  int file_position;
+  struct iovec *iov;
+  int iov_count;
+
+} readv_writev_param_t;
+
 typedef struct _lseek_param
 {
   int return_value;
@@ -58,6 +73,120 @@ typedef struct _readdir_param
 
 } readdir_param_t;
 
+typedef struct _readdir_range_param
+{
+  int return_value;
+  int index_node_number;
+  char after[14];
+  char before[14];
+  char prefix[14];
+  int max_entry_count;
+  char *address;
+
+} readdir_range_param_t;
+
+typedef struct _defrag_param
+{
+  int return_value;
+  int index_node_number;
+  int file_count;
+  int bytes_moved;
+  int fragment_count_before;
+  int fragment_count_after;
+
+} defrag_param_t;
+
+typedef struct _dedup_param
+{
+  int return_value;
+  int file_count;
+  int block_count;
+  int duplicate_block_count;
+  int blocks_freed;
+
+} dedup_param_t;
+
+typedef struct _compress_param
+{
+  int return_value;
+  int index_node_number;
+  int idle_seconds;
+  int file_count;
+  int bytes_before;
+  int bytes_after;
+
+} compress_param_t;
+
+#define RAMDISK_RANGE_UNLOCK 0
+#define RAMDISK_RANGE_READ 1
+#define RAMDISK_RANGE_WRITE 2
+
+typedef struct _range_lock_param
+{
+  int return_value;
+  int index_node_number;
+  // length 0 covers everything from start on
+  int start;
+  int length;
+  int type;
+  int is_wait;
+
+} range_lock_param_t;
+
+typedef struct _image_param
+{
+  int return_value;
+  int image_size;
+  char *address;
+  int length;
+
+} image_param_t;
+
+#define WALK_PATH_LENGTH  256
+
+typedef struct _walk_record
+{
+  char path[WALK_PATH_LENGTH];
+  int index_node_number;
+  char type[4];
+  int size;
+
+} walk_record_t;
+
+typedef struct _walk_param
+{
+  int return_value;
+  pathname_t pathname;
+  int start_index;
+  int max_record_count;
+  char *address;
+
+} walk_param_t;
+
+typedef struct _rename_param
+{
+  int return_value;
+  pathname_t old_pathname;
+  pathname_t new_pathname;
+
+} rename_param_t;
+
+#define COPY_RANGE_REFLINK  0x1
+
+typedef struct _copy_range_param
+{
+  int return_value;
+  int src_index_node_number;
+  int src_file_position;
+  int dst_index_node_number;
+  int dst_file_position;
+  int num_bytes;
+  int flags;
+
+} copy_range_param_t;
+
+#define SNAPSHOT_DIRECTORY_NAME  ".snapshot"
+
 
 #define IOCTL_CREAT _IOWR(0, 1, creat_param_t)
 #define IOCTL_UNLINK _IOWR(0, 2, creat_param_t)
@@ -68,6 +197,23 @@ typedef struct _readdir_param
 #define IOCTL_LSEEK _IOWR(0, 7, lseek_param_t)
 #define IOCTL_MKDIR _IOWR(0, 8, creat_param_t)
 #define IOCTL_READDIR _IOWR(0, 9, readdir_param_t)
+#define IOCTL_READDIR_RANGE _IOWR(0, 10, readdir_range_param_t)
+// clears the counters and histograms shown in /proc/ramdisk_stats
+#define IOCTL_STATS_RESET _IO(0, 11)
+#define IOCTL_DEFRAG _IOWR(0, 12, defrag_param_t)
+#define IOCTL_EXPORT _IOWR(0, 13, image_param_t)
+#define IOCTL_IMPORT _IOWR(0, 14, image_param_t)
+#define IOCTL_RMTREE _IOWR(0, 15, creat_param_t)
+#define IOCTL_WALK _IOWR(0, 16, walk_param_t)
+#define IOCTL_RENAME _IOWR(0, 17, rename_param_t)
+#define IOCTL_COPY_RANGE _IOWR(0, 18, copy_range_param_t)
+#define IOCTL_SNAPSHOT _IOWR(0, 19, creat_param_t)
+#define IOCTL_DEDUP _IOWR(0, 20, dedup_param_t)
+#define IOCTL_COMPRESS _IOWR(0, 21, compress_param_t)
+#define IOCTL_READV _IOWR(0, 22, readv_writev_param_t)
+#define IOCTL_WRITEV _IOWR(0, 23, readv_writev_param_t)
+#define IOCTL_APPEND _IOWR(0, 24, read_write_param_t)
+#define IOCTL_RANGE_LOCK _IOWR(0, 25, range_lock_param_t)
 
 int ramdisk_creat(char *pathname);
 
@@ -81,12 +227,44 @@ int ramdisk_read(int index_node_number, int file_position, char *address, int nu
 
 int ramdisk_write(int index_node_number, int file_position, char *address, int num_bytes);
 
+int ramdisk_range_lock(int index_node_number, int start, int length, int type, int is_wait);
+
+int ramdisk_append(int index_node_number, char *address, int num_bytes, int *file_position);
+
+int ramdisk_readv(int index_node_number, int file_position, const struct iovec *iov, int iov_count);
+
+int ramdisk_writev(int index_node_number, int file_position, const struct iovec *iov, int iov_count);
+
 int ramdisk_lseek(int index_node_number, int seek_offset, int *seek_result_offset);
 
 int ramdisk_mkdir(char *pathname);
 
 int ramdisk_readdir(int index_node_number, char *address, int *file_position);
 
+int ramdisk_readdir_range(int index_node_number, char *after, char *before, char *prefix, char *address, int max_entry_count);
+
+int ramdisk_stats_reset(void);
+
+int ramdisk_defrag(int index_node_number, defrag_param_t *defrag_param);
+
+int ramdisk_dedup(dedup_param_t *dedup_param);
+
+int ramdisk_compress(int index_node_number, int idle_seconds, compress_param_t *compress_param);
+
+int ramdisk_export(char *address, int length, int *image_size);
+
+int ramdisk_import(char *address, int length);
+
+int ramdisk_rmtree(char *pathname);
+
+int ramdisk_walk(char *pathname, int start_index, walk_record_t *records, int max_record_count);
+
+int ramdisk_rename(char *old_pathname, char *new_pathname);
+
+int ramdisk_copy_range(int src_index_node_number, int src_file_position, int dst_index_node_number, int dst_file_position, int num_bytes, int flags);
+
+int ramdisk_snapshot(char *name);
+
 int rd_creat(char *pathname);
 
 int rd_unlink(char *pathname);
@@ -99,11 +277,33 @@ int rd_read(int fd, char *address, int num_bytes);
 
 int rd_write(int fd, char *address, int num_bytes);
 
+int rd_range_lock(int fd, int start, int length, int type, int is_wait);
+
+int rd_append(int fd, char *address, int num_bytes);
+
+int rd_readv(int fd, const struct iovec *iov, int iov_count);
+
+int rd_writev(int fd, const struct iovec *iov, int iov_count);
+
 int rd_lseek(int fd, int offset);
 
 int rd_mkdir(char *pathname);
 
 int rd_readdir(int fd, char *address);
 
+int rd_readdir_range(int fd, char *after, char *before, char *prefix, char *address, int max_entry_count);
+
+int rd_rmtree(char *pathname);
+
+int rd_walk(char *pathname, int start_index, walk_record_t *records, int max_record_count);
+
+int rd_rename(char *old_pathname, char *new_pathname);
+
+int rd_copy_range(int src_fd, int dst_fd, int num_bytes, int flags);
+
+int rd_snapshot(char *name);
+
+int rd_snapshot_drop(char *name);
+
 
 
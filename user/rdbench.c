@@ -0,0 +1,676 @@
+/*
+   rdbench -- throughput and latency benchmark for the RAMDISK file system.
+
+   Runs one workload at a time from a number of worker processes or threads
+   for a fixed duration, timing every call, and reports ops/s together with
+   p50/p99/p999 latency. Built with USE_RAMDISK it goes through the user
+   library in ramdisk_test.c; built without it the same workloads run
+   against ordinary POSIX calls, e.g. on tmpfs, for comparison.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include "ramdisk_test.h"
+
+#ifdef USE_RAMDISK
+#define CREAT   rd_creat
+#define OPEN    rd_open
+#define WRITE   rd_write
+#define READ    rd_read
+#define UNLINK  rd_unlink
+#define RMDIR   rd_unlink
+#define MKDIR   rd_mkdir
+#define CLOSE   rd_close
+#define LSEEK   rd_lseek
+#define DEFAULT_ROOT ""
+
+#else
+#define CREAT(file)   creat(file, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+#define OPEN(file)    open(file, O_RDWR)
+#define WRITE   write
+#define READ    read
+#define UNLINK  unlink
+#define RMDIR   rmdir
+#define MKDIR(path)   mkdir(path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH)
+#define CLOSE   close
+#define LSEEK(fd, offset)   (lseek(fd, offset, SEEK_SET) < 0 ? -1 : 0)
+#define DEFAULT_ROOT "/dev/shm/rdbench"
+
+#endif
+
+#define BLK_SZ 256
+#define MAX_WORKERS 64
+#define MAX_PATH_LENGTH 256
+#define MAX_DEPTH 16
+
+// latency histogram: 16 linear sub-buckets per power of two nanoseconds,
+// so each bucket is within about 6% of the values it holds
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKET_COUNT (64 * HISTOGRAM_SUB_COUNT)
+
+typedef struct _histogram
+{
+  long count[HISTOGRAM_BUCKET_COUNT];
+  long op_count;
+  long byte_count;
+  long error_count;
+} histogram_t;
+
+typedef struct _bench_config
+{
+  const char *workload;
+  const char *root;
+  int worker_count;
+  int use_threads;
+  int duration;
+  int io_size;
+  int file_size;
+  int file_count;
+  int depth;
+} bench_config_t;
+
+typedef struct _worker
+{
+  int id;
+  char root[MAX_PATH_LENGTH];
+  bench_config_t *config;
+  histogram_t *histogram;
+  char *buffer;
+  unsigned int seed;
+} worker_t;
+
+typedef struct _workload
+{
+  const char *name;
+  int (*setup)(worker_t *worker);
+  // time operations until the deadline; returns -1 if the workload could not run
+  int (*run)(worker_t *worker, double deadline);
+  void (*teardown)(worker_t *worker);
+} workload_t;
+
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int histogram_bucket(long value)
+{
+  int shift = 0;
+  if (value < HISTOGRAM_SUB_COUNT)
+  {
+    return (int)value;
+  }
+  shift = 63 - __builtin_clzl(value) - HISTOGRAM_SUB_BITS;
+  return (shift + 1) * HISTOGRAM_SUB_COUNT + (int)((value >> shift) - HISTOGRAM_SUB_COUNT);
+}
+
+static long histogram_bucket_value(int bucket)
+{
+  int shift = bucket / HISTOGRAM_SUB_COUNT - 1;
+  if (shift < 0)
+  {
+    return bucket;
+  }
+  // middle of the bucket
+  return ((long)(bucket % HISTOGRAM_SUB_COUNT + HISTOGRAM_SUB_COUNT) << shift) + ((1L << shift) >> 1);
+}
+
+static void histogram_record(histogram_t *histogram, long start, int result, int byte_count)
+{
+  histogram->count[histogram_bucket(now_ns() - start)]++;
+  histogram->op_count++;
+  if (result < 0)
+  {
+    histogram->error_count++;
+  }
+  else
+  {
+    histogram->byte_count += byte_count;
+  }
+}
+
+static long histogram_percentile(histogram_t *histogram, double percentile)
+{
+  long target = (long)(histogram->op_count * percentile);
+  long seen = 0;
+  int i = 0;
+  for (i = 0; i < HISTOGRAM_BUCKET_COUNT; i++)
+  {
+    seen += histogram->count[i];
+    if (seen > target)
+    {
+      return histogram_bucket_value(i);
+    }
+  }
+  return 0;
+}
+
+static void histogram_merge(histogram_t *to, histogram_t *from)
+{
+  int i = 0;
+  for (i = 0; i < HISTOGRAM_BUCKET_COUNT; i++)
+  {
+    to->count[i] += from->count[i];
+  }
+  to->op_count += from->op_count;
+  to->byte_count += from->byte_count;
+  to->error_count += from->error_count;
+}
+
+
+// CREAT that leaves no descriptor open; creat(2) returns one, rd_creat does not
+static int create_file(char *path)
+{
+  int result = CREAT(path);
+#ifndef USE_RAMDISK
+  if (result >= 0)
+  {
+    close(result);
+  }
+#endif
+  return result < 0 ? -1 : 0;
+}
+
+static void worker_path(worker_t *worker, char *path, const char *format, int i)
+{
+  int length = snprintf(path, MAX_PATH_LENGTH, "%s/", worker->root);
+  snprintf(path + length, MAX_PATH_LENGTH - length, format, i);
+}
+
+// fill the worker's data file so read workloads have something to read
+static int setup_data_file(worker_t *worker)
+{
+  char path[MAX_PATH_LENGTH];
+  int fd = 0;
+  int pos = 0;
+  int length = 0;
+  worker_path(worker, path, "data", 0);
+  if (create_file(path) < 0)
+  {
+    return -1;
+  }
+  fd = OPEN(path);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  for (pos = 0; pos < worker->config->file_size; pos += length)
+  {
+    length = worker->config->file_size - pos < worker->config->io_size ? worker->config->file_size - pos : worker->config->io_size;
+    if (WRITE(fd, worker->buffer, length) != length)
+    {
+      CLOSE(fd);
+      return -1;
+    }
+  }
+  CLOSE(fd);
+  return 0;
+}
+
+static void teardown_data_file(worker_t *worker)
+{
+  char path[MAX_PATH_LENGTH];
+  worker_path(worker, path, "data", 0);
+  UNLINK(path);
+}
+
+// create/unlink storm: create file_count files, then unlink them all
+static int run_create(worker_t *worker, double deadline)
+{
+  char path[MAX_PATH_LENGTH];
+  long start = 0;
+  int result = 0;
+  int i = 0;
+  for (i = 0; i < worker->config->file_count; i++)
+  {
+    worker_path(worker, path, "f%d", i);
+    start = now_ns();
+    result = create_file(path);
+    histogram_record(worker->histogram, start, result, 0);
+  }
+  for (i = 0; i < worker->config->file_count; i++)
+  {
+    worker_path(worker, path, "f%d", i);
+    start = now_ns();
+    result = UNLINK(path);
+    histogram_record(worker->histogram, start, result, 0);
+  }
+  return 0;
+}
+
+// sequential or random transfers of io_size bytes on the data file
+static int run_transfer(worker_t *worker, double deadline, int is_write, int is_random)
+{
+  char path[MAX_PATH_LENGTH];
+  int block_count = (worker->config->file_size - worker->config->io_size) / BLK_SZ + 1;
+  int fd = 0;
+  int pos = 0;
+  int result = 0;
+  long start = 0;
+  worker_path(worker, path, "data", 0);
+  fd = OPEN(path);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  while (now() < deadline)
+  {
+    start = now_ns();
+    if (is_random)
+    {
+      worker->seed = worker->seed * 1103515245 + 12345;
+      pos = (worker->seed >> 8) % block_count * BLK_SZ;
+      result = LSEEK(fd, pos);
+    }
+    else if (pos + worker->config->io_size > worker->config->file_size)
+    {
+      pos = 0;
+      result = LSEEK(fd, 0);
+    }
+    if (result >= 0)
+    {
+      result = is_write ? WRITE(fd, worker->buffer, worker->config->io_size)
+                        : READ(fd, worker->buffer, worker->config->io_size);
+    }
+    histogram_record(worker->histogram, start, result, worker->config->io_size);
+    pos += worker->config->io_size;
+  }
+  CLOSE(fd);
+  return 0;
+}
+
+static int run_seqread(worker_t *worker, double deadline) { return run_transfer(worker, deadline, 0, 0); }
+static int run_seqwrite(worker_t *worker, double deadline) { return run_transfer(worker, deadline, 1, 0); }
+static int run_randread(worker_t *worker, double deadline) { return run_transfer(worker, deadline, 0, 1); }
+static int run_randwrite(worker_t *worker, double deadline) { return run_transfer(worker, deadline, 1, 1); }
+
+static void deep_path(worker_t *worker, char *path, int depth)
+{
+  int length = sprintf(path, "%s", worker->root);
+  int i = 0;
+  for (i = 0; i < depth; i++)
+  {
+    length += sprintf(path + length, "/d%d", i);
+  }
+}
+
+// a chain of depth directories with a file at the bottom
+static int setup_deep(worker_t *worker)
+{
+  char path[MAX_PATH_LENGTH];
+  int i = 0;
+  for (i = 1; i <= worker->config->depth; i++)
+  {
+    deep_path(worker, path, i);
+    if (MKDIR(path) < 0)
+    {
+      return -1;
+    }
+  }
+  strcat(path, "/leaf");
+  return create_file(path);
+}
+
+static void teardown_deep(worker_t *worker)
+{
+  char path[MAX_PATH_LENGTH];
+  int i = 0;
+  deep_path(worker, path, worker->config->depth);
+  strcat(path, "/leaf");
+  UNLINK(path);
+  for (i = worker->config->depth; i > 0; i--)
+  {
+    deep_path(worker, path, i);
+    RMDIR(path);
+  }
+}
+
+// open and close the file at the bottom of the directory chain
+static int run_open(worker_t *worker, double deadline)
+{
+  char path[MAX_PATH_LENGTH];
+  long start = 0;
+  int fd = 0;
+  deep_path(worker, path, worker->config->depth);
+  strcat(path, "/leaf");
+  while (now() < deadline)
+  {
+    start = now_ns();
+    fd = OPEN(path);
+    if (fd >= 0)
+    {
+      CLOSE(fd);
+    }
+    histogram_record(worker->histogram, start, fd, 0);
+  }
+  return 0;
+}
+
+// a directory holding file_count empty files
+static int setup_readdir(worker_t *worker)
+{
+  char path[MAX_PATH_LENGTH];
+  int i = 0;
+  worker_path(worker, path, "dir", 0);
+  if (MKDIR(path) < 0)
+  {
+    return -1;
+  }
+  for (i = 0; i < worker->config->file_count; i++)
+  {
+    worker_path(worker, path, "dir/f%d", i);
+    if (create_file(path) < 0)
+    {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void teardown_readdir(worker_t *worker)
+{
+  char path[MAX_PATH_LENGTH];
+  int i = 0;
+  for (i = 0; i < worker->config->file_count; i++)
+  {
+    worker_path(worker, path, "dir/f%d", i);
+    UNLINK(path);
+  }
+  worker_path(worker, path, "dir", 0);
+  RMDIR(path);
+}
+
+// list the whole directory; one op is one full listing
+static int run_readdir(worker_t *worker, double deadline)
+{
+  char path[MAX_PATH_LENGTH];
+  long start = 0;
+  int entry_count = 0;
+  int result = 0;
+#ifdef USE_RAMDISK
+  char entry[16];
+  int fd = 0;
+#else
+  DIR *dir = NULL;
+#endif
+  worker_path(worker, path, "dir", 0);
+  while (now() < deadline)
+  {
+    start = now_ns();
+    entry_count = 0;
+#ifdef USE_RAMDISK
+    fd = OPEN(path);
+    result = fd;
+    while (fd >= 0 && (result = rd_readdir(fd, entry)) > 0)
+    {
+      entry_count++;
+    }
+    if (fd >= 0)
+    {
+      CLOSE(fd);
+    }
+#else
+    dir = opendir(path);
+    result = NULL == dir ? -1 : 0;
+    while (NULL != dir && NULL != readdir(dir))
+    {
+      entry_count++;
+    }
+    if (NULL != dir)
+    {
+      closedir(dir);
+    }
+#endif
+    histogram_record(worker->histogram, start, result, 0);
+  }
+  return entry_count > 0 ? 0 : -1;
+}
+
+// create runs in whole batches; keep going until the deadline
+static int run_create_until(worker_t *worker, double deadline)
+{
+  while (now() < deadline)
+  {
+    run_create(worker, deadline);
+  }
+  return 0;
+}
+
+static workload_t workloads[] =
+{
+  {"create", NULL, run_create_until, NULL},
+  {"seqwrite", setup_data_file, run_seqwrite, teardown_data_file},
+  {"seqread", setup_data_file, run_seqread, teardown_data_file},
+  {"randwrite", setup_data_file, run_randwrite, teardown_data_file},
+  {"randread", setup_data_file, run_randread, teardown_data_file},
+  {"open", setup_deep, run_open, teardown_deep},
+  {"readdir", setup_readdir, run_readdir, teardown_readdir},
+};
+
+#define WORKLOAD_COUNT ((int)(sizeof(workloads) / sizeof(workloads[0])))
+
+static workload_t *current_workload;
+static pthread_barrier_t current_barrier;
+
+// set up, run to the deadline, and clean up one worker's share of the workload
+static int worker_run(worker_t *worker)
+{
+  int result = 0;
+  worker->buffer = malloc(worker->config->file_size);
+  memset(worker->buffer, 'a' + worker->id % 26, worker->config->file_size);
+  worker->seed = 12345 + worker->id;
+  if (NULL != current_workload->setup && 0 != current_workload->setup(worker))
+  {
+    fprintf(stderr, "worker %d: %s setup failed\n", worker->id, current_workload->name);
+    result = -1;
+  }
+  if (worker->config->use_threads)
+  {
+    pthread_barrier_wait(&current_barrier);
+  }
+  if (0 == result)
+  {
+    result = current_workload->run(worker, now() + worker->config->duration);
+  }
+  if (NULL != current_workload->teardown)
+  {
+    current_workload->teardown(worker);
+  }
+  free(worker->buffer);
+  return result;
+}
+
+static void *worker_thread(void *arg)
+{
+  return (void *)(long)worker_run((worker_t *)arg);
+}
+
+static void usage(const char *program)
+{
+  int i = 0;
+  fprintf(stderr,
+    "usage: %s [-w workload] [-j workers] [-T] [-d seconds] [-b io size]\n"
+    "          [-s file size] [-n files] [-D depth] [-r root]\n"
+    "  -w  workload, or \"all\" (default); one of:", program);
+  for (i = 0; i < WORKLOAD_COUNT; i++)
+  {
+    fprintf(stderr, " %s", workloads[i].name);
+  }
+  fprintf(stderr,
+    "\n  -j  worker count (default 1)\n"
+    "  -T  run workers as threads instead of processes\n"
+    "  -d  duration of each workload in seconds (default 5)\n"
+    "  -b  bytes per read or write (default %d)\n"
+    "  -s  data file size per worker (default 65536)\n"
+    "  -n  files per worker for create and readdir (default 100)\n"
+    "  -D  directory depth for open (default 8)\n"
+    "  -r  directory the workers run under (default \"%s\")\n",
+    BLK_SZ, DEFAULT_ROOT);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+  bench_config_t config;
+  worker_t workers[MAX_WORKERS];
+  pthread_t threads[MAX_WORKERS];
+  histogram_t *histograms = NULL;
+  histogram_t total;
+  pid_t pid = 0;
+  double elapsed = 0;
+  void *thread_result = NULL;
+  int status = 0;
+  int failed = 0;
+  int option = 0;
+  int i = 0;
+  int j = 0;
+
+  config.workload = "all";
+  config.root = DEFAULT_ROOT;
+  config.worker_count = 1;
+  config.use_threads = 0;
+  config.duration = 5;
+  config.io_size = BLK_SZ;
+  config.file_size = 65536;
+  config.file_count = 100;
+  config.depth = 8;
+  while (-1 != (option = getopt(argc, argv, "w:j:Td:b:s:n:D:r:h")))
+  {
+    switch (option)
+    {
+    case 'w': config.workload = optarg; break;
+    case 'j': config.worker_count = atoi(optarg); break;
+    case 'T': config.use_threads = 1; break;
+    case 'd': config.duration = atoi(optarg); break;
+    case 'b': config.io_size = atoi(optarg); break;
+    case 's': config.file_size = atoi(optarg); break;
+    case 'n': config.file_count = atoi(optarg); break;
+    case 'D': config.depth = atoi(optarg); break;
+    case 'r': config.root = optarg; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (config.worker_count <= 0 || config.worker_count > MAX_WORKERS || config.duration <= 0
+      || config.io_size <= 0 || config.io_size > config.file_size || config.file_count <= 0
+      || config.depth <= 0 || config.depth > MAX_DEPTH)
+  {
+    usage(argv[0]);
+  }
+#ifndef USE_RAMDISK
+  MKDIR(config.root);
+#endif
+
+  // shared with worker processes so the parent can merge their histograms
+  histograms = mmap(NULL, sizeof(histogram_t) * config.worker_count, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == histograms)
+  {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+
+  printf("%-10s %7s %10s %12s %9s %9s %9s %9s %6s\n",
+         "workload", "workers", "ops", "ops/s", "MB/s", "p50(us)", "p99(us)", "p999(us)", "errors");
+  // worker processes must not inherit buffered output
+  fflush(stdout);
+  for (i = 0; i < WORKLOAD_COUNT; i++)
+  {
+    if (0 != strcmp(config.workload, "all") && 0 != strcmp(config.workload, workloads[i].name))
+    {
+      continue;
+    }
+    current_workload = &workloads[i];
+    memset(histograms, 0, sizeof(histogram_t) * config.worker_count);
+    for (j = 0; j < config.worker_count; j++)
+    {
+      workers[j].id = j;
+      workers[j].config = &config;
+      workers[j].histogram = &histograms[j];
+      sprintf(workers[j].root, "%s/w%d", config.root, j);
+      if (MKDIR(workers[j].root) < 0 && EEXIST != errno)
+      {
+        fprintf(stderr, "mkdir %s failed\n", workers[j].root);
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    // setup is not timed; each worker runs for the duration once its own setup is done
+    if (config.use_threads)
+    {
+      pthread_barrier_init(&current_barrier, NULL, config.worker_count + 1);
+      for (j = 0; j < config.worker_count; j++)
+      {
+        pthread_create(&threads[j], NULL, worker_thread, &workers[j]);
+      }
+      pthread_barrier_wait(&current_barrier);
+      for (j = 0; j < config.worker_count; j++)
+      {
+        pthread_join(threads[j], &thread_result);
+        failed |= (0 != (long)thread_result);
+      }
+      pthread_barrier_destroy(&current_barrier);
+    }
+    else
+    {
+      for (j = 0; j < config.worker_count; j++)
+      {
+        pid = fork();
+        if (0 == pid)
+        {
+          exit(0 == worker_run(&workers[j]) ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        if (pid < 0)
+        {
+          perror("fork");
+          exit(EXIT_FAILURE);
+        }
+      }
+      for (j = 0; j < config.worker_count; j++)
+      {
+        wait(&status);
+        failed |= !(WIFEXITED(status) && EXIT_SUCCESS == WEXITSTATUS(status));
+      }
+    }
+    elapsed = config.duration;
+
+    memset(&total, 0, sizeof(total));
+    for (j = 0; j < config.worker_count; j++)
+    {
+      histogram_merge(&total, &histograms[j]);
+      RMDIR(workers[j].root);
+    }
+    printf("%-10s %7d %10ld %12.0f %9.2f %9.2f %9.2f %9.2f %6ld%s\n",
+           workloads[i].name, config.worker_count, total.op_count, total.op_count / elapsed,
+           total.byte_count / elapsed / (1024 * 1024),
+           histogram_percentile(&total, 0.50) / 1000.0,
+           histogram_percentile(&total, 0.99) / 1000.0,
+           histogram_percentile(&total, 0.999) / 1000.0,
+           total.error_count, failed ? " (failed)" : "");
+    fflush(stdout);
+  }
+  munmap(histograms, sizeof(histogram_t) * config.worker_count);
+
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,150 @@
+/*
+   rdimage -- save the RAMDISK to a file and load it back.
+
+   "rdimage export FILE" writes an image of the whole ramdisk to FILE and
+   "rdimage import FILE" replaces the ramdisk contents with it. Run the
+   import right after loading the module to start warm from a saved image;
+   the module does not read files itself. An import is refused while any
+   ramdisk file is open.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <limits.h>
+#include "ramdisk_test.h"
+
+static int image_export(const char *filename)
+{
+  char *image = NULL;
+  int image_size = 0;
+  int length = 0;
+  int written = 0;
+  int ret = 0;
+  int fd = 0;
+
+  // ask for the size first, and again if files grew in between
+  ret = ramdisk_export(image, length, &image_size);
+  while ((0 != ret) && (image_size > length))
+  {
+    free(image);
+    // leave room for some growth, and touch every page up front so the
+    // kernel copy does not fault them in
+    length = image_size + image_size / 8;
+    image = malloc(length);
+    if (NULL == image)
+    {
+      return -1;
+    }
+    memset(image, 0, length);
+    ret = ramdisk_export(image, length, &image_size);
+  }
+  if (0 != ret)
+  {
+    fprintf(stderr, "rdimage: export failed\n");
+    free(image);
+    return -1;
+  }
+
+  fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fd < 0)
+  {
+    perror(filename);
+    free(image);
+    return -1;
+  }
+  while (written < image_size)
+  {
+    ret = write(fd, image + written, image_size - written);
+    if (ret <= 0)
+    {
+      perror(filename);
+      close(fd);
+      free(image);
+      return -1;
+    }
+    written = written + ret;
+  }
+  close(fd);
+  free(image);
+  printf("exported %d bytes to %s\n", image_size, filename);
+
+  return 0;
+}
+
+static int image_import(const char *filename)
+{
+  char *image = NULL;
+  int image_size = 0;
+  int length = 0;
+  int ret = 0;
+  int fd = 0;
+  struct stat file_stat;
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0)
+  {
+    perror(filename);
+    return -1;
+  }
+  if ((0 != fstat(fd, &file_stat)) || (file_stat.st_size > INT_MAX))
+  {
+    fprintf(stderr, "rdimage: %s is not a ramdisk image\n", filename);
+    close(fd);
+    return -1;
+  }
+  length = file_stat.st_size;
+  image = malloc(length > 0 ? length : 1);
+  if (NULL == image)
+  {
+    close(fd);
+    return -1;
+  }
+  while (image_size < length)
+  {
+    ret = read(fd, image + image_size, length - image_size);
+    if (ret < 0)
+    {
+      perror(filename);
+      close(fd);
+      free(image);
+      return -1;
+    }
+    if (0 == ret)
+    {
+      break;
+    }
+    image_size = image_size + ret;
+  }
+  close(fd);
+
+  if (0 != ramdisk_import(image, image_size))
+  {
+    fprintf(stderr, "rdimage: %s was rejected, it is not a valid image or a file is open\n", filename);
+    free(image);
+    return -1;
+  }
+  free(image);
+  printf("imported %d bytes from %s\n", image_size, filename);
+
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  if ((3 == argc) && (0 == strcmp("export", argv[1])))
+  {
+    return (0 == image_export(argv[2])) ? 0 : 1;
+  }
+  if ((3 == argc) && (0 == strcmp("import", argv[1])))
+  {
+    return (0 == image_import(argv[2])) ? 0 : 1;
+  }
+  fprintf(stderr, "usage: %s export|import FILE\n", argv[0]);
+
+  return 1;
+}
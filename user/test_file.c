@@ -39,6 +39,21 @@
 #define TEST3
 #define TEST4
 #define TEST5
+// ramdisk-only behavior, run before TEST5 since its child runs to the end
+// of main
+#define TEST6
+#define TEST7
+#define TEST8
+#define TEST9
+#define TEST10
+#define TEST11
+#define TEST12
+#define TEST13
+#define TEST14
+#define TEST15
+#define TEST16
+#define TEST17
+#define TEST18
 
 // Insert a string for the pathname prefix here. For the ramdisk, it should be
 // NULL
@@ -95,17 +110,55 @@ static char data1[DIRECT*BLK_SZ]; /* Largest data directly accessible */
 static char data2[PTRS_PB*BLK_SZ];     /* Single indirect data size */
 static char data3[PTRS_PB*PTRS_PB*BLK_SZ]; /* Double indirect data size */
 static char addr[PTRS_PB*PTRS_PB*BLK_SZ+1]; /* Scratchpad memory */
+static char addr2[PTRS_PB*BLK_SZ];     /* Second scratchpad for comparisons */
+static char pattern[PTRS_PB*BLK_SZ];   /* Data that differs from block to block */
+
+/* Stop with message unless condition holds */
+static void check (int condition, const char *message) {
+  if (!condition) {
+    fprintf (stderr, "%s\n", message);
+    exit(EXIT_FAILURE);
+  }
+}
+
+#ifdef USE_RAMDISK
+/* Read the first length bytes of pathname into buffer, returns the bytes read */
+static int read_file (char *pathname, char *buffer, int length) {
+  int fd, retval;
+
+  fd = rd_open (pathname);
+  if (fd < 0)
+    return -1;
+  retval = rd_read (fd, buffer, length);
+  rd_close (fd);
+  return retval;
+}
+
+/* Create pathname holding length bytes of data */
+static void write_file (char *pathname, char *data, int length) {
+  int fd;
+
+  check (0 == rd_creat (pathname), "creat: File creation error!");
+  fd = rd_open (pathname);
+  check (fd >= 0, "open: File open error!");
+  check (length == rd_write (fd, data, length), "write: File write error!");
+  rd_close (fd);
+}
+#endif // USE_RAMDISK
 
 int main () {
     
   int retval, i;
   int fd;
+  int status;
   int index_node_number;
 
   /* Some arbitrary data for our files */
   memset (data1, '1', sizeof (data1));
   memset (data2, '2', sizeof (data2));
   memset (data3, '3', sizeof (data3));
+  for (i = 0; i < sizeof (pattern); i++)
+    pattern[i] = (char) (i % 251);
 
 
 #ifdef TEST1
@@ -348,9 +401,380 @@ int main () {
     index_node_number = ((short *)(&addr[14]))[0];
     printf ("Contents at addr: [%s,%d]\n", addr, index_node_number);
   }
+  /* Import is refused while anything is open */
+  CLOSE (fd);
 #endif // USE_RAMDISK
 #endif // TEST4
 
+#ifdef USE_RAMDISK
+#ifdef TEST6
+
+  /* ****TEST 6: Large directory read in name order while it shrinks**** */
+  check (0 == MKDIR (PATH_PREFIX "/big"), "mkdir: /big creation error!");
+  for (i = 0; i < 300; i++) {
+    sprintf (pathname, PATH_PREFIX "/big/f%03d", (i * 7) % 300);
+    check (0 == CREAT (pathname), "creat: Large directory file creation error!");
+  }
+  fd = OPEN (PATH_PREFIX "/big");
+  check (fd >= 0, "open: /big open error!");
+  memset (addr2, 0, 16);
+  i = 0;
+  while ((retval = READDIR (fd, addr)) > 0) {
+    check (strcmp (addr2, addr) < 0, "readdir: Entries out of name order!");
+    strcpy (addr2, addr);
+    /* Unlinking what was just read must not make the next one skip */
+    if (i % 2) {
+      sprintf (pathname, PATH_PREFIX "/big/%.13s", addr);
+      check (0 == UNLINK (pathname), "unlink: Large directory file deletion error!");
+    }
+    i++;
+  }
+  check (0 == retval && 300 == i, "readdir: Large directory read error!");
+  CLOSE (fd);
+  check (151 == rd_rmtree (PATH_PREFIX "/big"), "rmtree: /big deletion error!");
+
+#endif // TEST6
+
+#ifdef TEST7
+
+  /* ****TEST 7: Packed tails across close, reopen, read and write**** */
+  /* The partial last blocks are packed into a shared block on last close */
+  write_file (PATH_PREFIX "/tail", pattern, 2 * BLK_SZ + 100);
+  write_file (PATH_PREFIX "/small", pattern + 1000, 60);
+  check (2 * BLK_SZ + 100 == read_file (PATH_PREFIX "/tail", addr, sizeof(pattern))
+	 && 0 == memcmp (addr, pattern, 2 * BLK_SZ + 100),
+	 "tail: Packed tail reads back wrong!");
+  check (60 == read_file (PATH_PREFIX "/small", addr, sizeof(pattern))
+	 && 0 == memcmp (addr, pattern + 1000, 60),
+	 "tail: Packed small file reads back wrong!");
+  /* A write through the packed tail and past it */
+  fd = rd_open (PATH_PREFIX "/tail");
+  check (fd >= 0, "open: /tail open error!");
+  rd_lseek (fd, 2 * BLK_SZ + 50);
+  check (200 == rd_write (fd, pattern + 5000, 200), "write: Packed tail write error!");
+  rd_close (fd);
+  memcpy (addr2, pattern, 2 * BLK_SZ + 50);
+  memcpy (addr2 + 2 * BLK_SZ + 50, pattern + 5000, 200);
+  check (2 * BLK_SZ + 250 == read_file (PATH_PREFIX "/tail", addr, sizeof(pattern))
+	 && 0 == memcmp (addr, addr2, 2 * BLK_SZ + 250),
+	 "tail: Write over a packed tail reads back wrong!");
+  check (60 == read_file (PATH_PREFIX "/small", addr, sizeof(pattern))
+	 && 0 == memcmp (addr, pattern + 1000, 60),
+	 "tail: Write to another file changed a packed small file!");
+  check (0 == UNLINK (PATH_PREFIX "/tail") && 0 == UNLINK (PATH_PREFIX "/small"),
+	 "unlink: Packed file deletion error!");
+
+#endif // TEST7
+
+#ifdef TEST8
+
+  /* ****TEST 8: Defragment a file, then read it back**** */
+  {
+    defrag_param_t defrag_param;
+    int gap_fd;
+
+    /* Blocks of /frag and /gap alternate, so /frag is left in pieces */
+    check (0 == rd_creat (PATH_PREFIX "/frag") && 0 == rd_creat (PATH_PREFIX "/gap"),
+	   "creat: Fragmented file creation error!");
+    fd = rd_open (PATH_PREFIX "/frag");
+    gap_fd = rd_open (PATH_PREFIX "/gap");
+    check (fd >= 0 && gap_fd >= 0, "open: Fragmented file open error!");
+    for (i = 0; i < 32; i++) {
+      check (BLK_SZ == rd_write (fd, pattern + i * BLK_SZ, BLK_SZ), "write: /frag write error!");
+      check (BLK_SZ == rd_write (gap_fd, data1, BLK_SZ), "write: /gap write error!");
+    }
+    rd_close (gap_fd);
+    check (0 == UNLINK (PATH_PREFIX "/gap"), "unlink: /gap deletion error!");
+    check (0 == ramdisk_defrag (-1, &defrag_param)
+	   && defrag_param.fragment_count_after <= defrag_param.fragment_count_before,
+	   "defrag: Defragmentation error!");
+    rd_lseek (fd, 0);
+    check (32 * BLK_SZ == rd_read (fd, addr, sizeof(pattern))
+	   && 0 == memcmp (addr, pattern, 32 * BLK_SZ),
+	   "defrag: Defragmented file reads back wrong!");
+    rd_close (fd);
+    check (0 == UNLINK (PATH_PREFIX "/frag"), "unlink: /frag deletion error!");
+  }
+
+#endif // TEST8
+
+#ifdef TEST9
+
+  /* ****TEST 9: Export, change, import, then read back**** */
+  {
+    char *image;
+    int image_size;
+
+    write_file (PATH_PREFIX "/saved", pattern, sizeof(pattern));
+    /* A short buffer reports the size the image needs */
+    image_size = 0;
+    ramdisk_export (addr, 0, &image_size);
+    check (image_size > 0, "export: Image size error!");
+    image = malloc (image_size);
+    check (NULL != image && 0 == ramdisk_export (image, image_size, &image_size),
+	   "export: Export error!");
+    fd = rd_open (PATH_PREFIX "/saved");
+    check (fd >= 0 && BLK_SZ == rd_write (fd, data2, BLK_SZ), "write: /saved write error!");
+    rd_close (fd);
+    write_file (PATH_PREFIX "/later", data1, BLK_SZ);
+    check (0 == ramdisk_import (image, image_size), "import: Import error!");
+    free (image);
+    check (sizeof(pattern) == read_file (PATH_PREFIX "/saved", addr, sizeof(pattern))
+	   && 0 == memcmp (addr, pattern, sizeof(pattern)),
+	   "import: Imported file does not hold the exported data!");
+    check (rd_open (PATH_PREFIX "/later") < 0, "import: File created after the export survived!");
+    check (0 == UNLINK (PATH_PREFIX "/saved"), "unlink: /saved deletion error!");
+  }
+
+#endif // TEST9
+
+#ifdef TEST10
+
+  /* ****TEST 10: Reuse blocks freed in the background**** */
+  {
+    int round;
+
+    /* Each round's file takes the blocks of the one unlinked before it,
+       which may still be being reclaimed, and must read back its own data */
+    for (round = 0; round < 6; round++) {
+      check (0 == rd_creat (PATH_PREFIX "/reclaim"), "creat: /reclaim creation error!");
+      fd = rd_open (PATH_PREFIX "/reclaim");
+      check (fd >= 0, "open: /reclaim open error!");
+      for (i = 0; i < 64; i++)
+	check (8 * BLK_SZ == rd_write (fd, pattern + ((round * 5 + i) % 56) * BLK_SZ, 8 * BLK_SZ),
+	       "write: /reclaim write error!");
+      rd_lseek (fd, 0);
+      for (i = 0; i < 64; i++)
+	check (8 * BLK_SZ == rd_read (fd, addr, 8 * BLK_SZ)
+	       && 0 == memcmp (addr, pattern + ((round * 5 + i) % 56) * BLK_SZ, 8 * BLK_SZ),
+	       "reclaim: File on reclaimed blocks reads back wrong!");
+      rd_close (fd);
+      check (0 == UNLINK (PATH_PREFIX "/reclaim"), "unlink: /reclaim deletion error!");
+    }
+  }
+
+#endif // TEST10
+
+#ifdef TEST11
+
+  /* ****TEST 11: Rename over an existing file**** */
+  write_file (PATH_PREFIX "/old", data1, sizeof(data1));
+  write_file (PATH_PREFIX "/new", data2, sizeof(data1));
+  check (0 == rd_rename (PATH_PREFIX "/old", PATH_PREFIX "/new"),
+	 "rename: Replacing rename error!");
+  check (sizeof(data1) == read_file (PATH_PREFIX "/new", addr, sizeof(data1))
+	 && 0 == memcmp (addr, data1, sizeof(data1)),
+	 "rename: Replaced file does not hold the renamed data!");
+  check (rd_open (PATH_PREFIX "/old") < 0, "rename: Old name still opens!");
+  check (0 == UNLINK (PATH_PREFIX "/new"), "unlink: /new deletion error!");
+
+#endif // TEST11
+
+#ifdef TEST12
+
+  /* ****TEST 12: Reflink copy, write to one side, release both**** */
+  write_file (PATH_PREFIX "/orig", data2, sizeof(data2));
+  check (0 == rd_creat (PATH_PREFIX "/clone"), "creat: /clone creation error!");
+  fd = rd_open (PATH_PREFIX "/orig");
+  retval = rd_open (PATH_PREFIX "/clone");
+  check (fd >= 0 && retval >= 0, "open: Reflink file open error!");
+  check (sizeof(data2) == rd_copy_range (fd, retval, sizeof(data2), COPY_RANGE_REFLINK),
+	 "copy_range: Reflink error!");
+  rd_lseek (retval, BLK_SZ);
+  check (BLK_SZ == rd_write (retval, data1, BLK_SZ), "write: Clone write error!");
+  rd_close (fd);
+  rd_close (retval);
+  check (sizeof(data2) == read_file (PATH_PREFIX "/orig", addr, sizeof(data2))
+	 && 0 == memcmp (addr, data2, sizeof(data2)),
+	 "copy_range: Write to the clone changed the original!");
+  memcpy (addr2, data2, sizeof(data2));
+  memcpy (addr2 + BLK_SZ, data1, BLK_SZ);
+  check (sizeof(data2) == read_file (PATH_PREFIX "/clone", addr, sizeof(data2))
+	 && 0 == memcmp (addr, addr2, sizeof(data2)),
+	 "copy_range: Clone does not hold its own write!");
+  /* The clone keeps the shared blocks after the original goes */
+  check (0 == UNLINK (PATH_PREFIX "/orig"), "unlink: /orig deletion error!");
+  check (sizeof(data2) == read_file (PATH_PREFIX "/clone", addr, sizeof(data2))
+	 && 0 == memcmp (addr, addr2, sizeof(data2)),
+	 "copy_range: Clone changed when the original was deleted!");
+  check (0 == UNLINK (PATH_PREFIX "/clone"), "unlink: /clone deletion error!");
+
+#endif // TEST12
+
+#ifdef TEST13
+
+  /* ****TEST 13: Snapshot keeps its data and refuses changes**** */
+  check (0 == MKDIR (PATH_PREFIX "/snapdir"), "mkdir: /snapdir creation error!");
+  write_file (PATH_PREFIX "/snapdir/f", data1, sizeof(data1));
+  check (rd_snapshot ("s1") >= 2, "snapshot: Snapshot error!");
+  fd = rd_open (PATH_PREFIX "/snapdir/f");
+  check (fd >= 0 && sizeof(data1) == rd_write (fd, data2, sizeof(data1)),
+	 "write: Live file write error!");
+  rd_close (fd);
+  check (sizeof(data1) == read_file (PATH_PREFIX "/.snapshot/s1/snapdir/f", addr, sizeof(data1))
+	 && 0 == memcmp (addr, data1, sizeof(data1)),
+	 "snapshot: Snapshot file changed with the live file!");
+  fd = rd_open (PATH_PREFIX "/.snapshot/s1/snapdir/f");
+  check (fd >= 0 && rd_write (fd, data2, BLK_SZ) < 0, "snapshot: Snapshot file was written!");
+  rd_close (fd);
+  check (rd_creat (PATH_PREFIX "/.snapshot/s1/snapdir/g") < 0, "snapshot: File created in a snapshot!");
+  check (UNLINK (PATH_PREFIX "/.snapshot/s1/snapdir/f") < 0, "snapshot: Snapshot file was unlinked!");
+  check (0 == rd_snapshot_drop ("s1"), "snapshot: Snapshot drop error!");
+  check (1 == rd_rmtree (PATH_PREFIX "/" SNAPSHOT_DIRECTORY_NAME), "rmtree: Snapshot directory deletion error!");
+  check (2 == rd_rmtree (PATH_PREFIX "/snapdir"), "rmtree: /snapdir deletion error!");
+
+#endif // TEST13
+
+#ifdef TEST14
+
+  /* ****TEST 14: Write to a deduplicated file**** */
+  {
+    dedup_param_t dedup_param;
+
+    write_file (PATH_PREFIX "/dup1", data1, sizeof(data1));
+    write_file (PATH_PREFIX "/dup2", data1, sizeof(data1));
+    check (0 == ramdisk_dedup (&dedup_param) && dedup_param.duplicate_block_count > 0,
+	   "dedup: Deduplication error!");
+    fd = rd_open (PATH_PREFIX "/dup1");
+    check (fd >= 0 && BLK_SZ == rd_write (fd, data2, BLK_SZ), "write: Deduplicated file write error!");
+    rd_close (fd);
+    check (sizeof(data1) == read_file (PATH_PREFIX "/dup2", addr, sizeof(data1))
+	   && 0 == memcmp (addr, data1, sizeof(data1)),
+	   "dedup: Write to one copy changed the other!");
+    check (sizeof(data1) == read_file (PATH_PREFIX "/dup1", addr, sizeof(data1))
+	   && 0 == memcmp (addr, data2, BLK_SZ) && 0 == memcmp (addr + BLK_SZ, data1, sizeof(data1) - BLK_SZ),
+	   "dedup: Deduplicated file lost its write!");
+    check (0 == UNLINK (PATH_PREFIX "/dup1") && 0 == UNLINK (PATH_PREFIX "/dup2"),
+	   "unlink: Deduplicated file deletion error!");
+  }
+
+#endif // TEST14
+
+#ifdef TEST15
+
+  /* ****TEST 15: Compress, read, then write**** */
+  {
+    compress_param_t compress_param;
+
+    write_file (PATH_PREFIX "/packed", data2, sizeof(data2));
+    check (0 == ramdisk_open (PATH_PREFIX "/packed", &index_node_number), "open: /packed open error!");
+    check (0 == ramdisk_compress (index_node_number, 0, &compress_param) && 1 == compress_param.file_count
+	   && compress_param.bytes_after < compress_param.bytes_before,
+	   "compress: Compression error!");
+    ramdisk_close (index_node_number);
+    check (sizeof(data2) == read_file (PATH_PREFIX "/packed", addr, sizeof(data2))
+	   && 0 == memcmp (addr, data2, sizeof(data2)),
+	   "compress: Compressed file reads back wrong!");
+    fd = rd_open (PATH_PREFIX "/packed");
+    rd_lseek (fd, 3 * BLK_SZ + 7);
+    check (fd >= 0 && 100 == rd_write (fd, data1, 100), "write: Compressed file write error!");
+    rd_close (fd);
+    memcpy (addr2, data2, sizeof(data2));
+    memcpy (addr2 + 3 * BLK_SZ + 7, data1, 100);
+    check (sizeof(data2) == read_file (PATH_PREFIX "/packed", addr, sizeof(data2))
+	   && 0 == memcmp (addr, addr2, sizeof(data2)),
+	   "compress: Write to a compressed file reads back wrong!");
+    check (0 == UNLINK (PATH_PREFIX "/packed"), "unlink: /packed deletion error!");
+  }
+
+#endif // TEST15
+
+#ifdef TEST16
+
+  /* ****TEST 16: Vector write and read**** */
+  {
+    struct iovec iov[3];
+
+    check (0 == rd_creat (PATH_PREFIX "/vector"), "creat: /vector creation error!");
+    fd = rd_open (PATH_PREFIX "/vector");
+    check (fd >= 0, "open: /vector open error!");
+    iov[0].iov_base = data1;
+    iov[0].iov_len = 100;
+    iov[1].iov_base = data2;
+    iov[1].iov_len = BLK_SZ;
+    iov[2].iov_base = data3;
+    iov[2].iov_len = 3 * BLK_SZ + 1;
+    check (100 + 4 * BLK_SZ + 1 == rd_writev (fd, iov, 3), "writev: Vector write error!");
+    rd_lseek (fd, 0);
+    memset (addr, 0, 4 * BLK_SZ);
+    memset (addr2, 0, 4 * BLK_SZ);
+    iov[0].iov_base = addr;
+    iov[0].iov_len = 2 * BLK_SZ;
+    iov[1].iov_base = addr2;
+    iov[1].iov_len = 3 * BLK_SZ;
+    check (100 + 4 * BLK_SZ + 1 == rd_readv (fd, iov, 2), "readv: Vector read error!");
+    rd_close (fd);
+    check (0 == memcmp (addr, data1, 100) && 0 == memcmp (addr + 100, data2, BLK_SZ)
+	   && 0 == memcmp (addr + 100 + BLK_SZ, data3, BLK_SZ - 100)
+	   && 0 == memcmp (addr2, data3 + BLK_SZ - 100, 2 * BLK_SZ + 101),
+	   "readv: Vector read does not match the vector write!");
+    check (0 == UNLINK (PATH_PREFIX "/vector"), "unlink: /vector deletion error!");
+  }
+
+#endif // TEST16
+
+#ifdef TEST17
+
+  /* ****TEST 17: Appends from two processes**** */
+  check (0 == rd_creat (PATH_PREFIX "/log"), "creat: /log creation error!");
+  fd = rd_open (PATH_PREFIX "/log");
+  check (fd >= 0, "open: /log open error!");
+  check (10 == rd_append (fd, data1, 10), "append: Append error!");
+  fflush (stdout);
+  if ((retval = fork()) == 0) {
+    for (i = 0; i < 50; i++)
+      check (10 == rd_append (fd, data2, 10), "append: (Child) append error!");
+    exit(EXIT_SUCCESS);
+  }
+  check (retval > 0, "Failed to fork");
+  for (i = 0; i < 50; i++)
+    check (10 == rd_append (fd, data3, 10), "append: (Parent) append error!");
+  waitpid (retval, &status, 0);
+  check (WIFEXITED(status) && EXIT_SUCCESS == WEXITSTATUS(status), "append: Child appends failed!");
+  rd_close (fd);
+  /* Every append lands whole after the ones before it */
+  check (1010 == read_file (PATH_PREFIX "/log", addr, sizeof(data2)), "append: Log has the wrong length!");
+  check (0 == memcmp (addr, data1, 10), "append: First append was overwritten!");
+  for (i = 10; i < 1010; i += 10)
+    check (0 == memcmp (addr + i, data2, 10) || 0 == memcmp (addr + i, data3, 10),
+	   "append: Appends were interleaved!");
+  check (0 == UNLINK (PATH_PREFIX "/log"), "unlink: /log deletion error!");
+
+#endif // TEST17
+
+#ifdef TEST18
+
+  /* ****TEST 18: Conflicting range locks of two processes**** */
+  write_file (PATH_PREFIX "/locked", data1, sizeof(data1));
+  fd = rd_open (PATH_PREFIX "/locked");
+  check (fd >= 0, "open: /locked open error!");
+  check (0 == rd_range_lock (fd, 0, BLK_SZ, RAMDISK_RANGE_WRITE, 0), "range_lock: Write lock error!");
+  fflush (stdout);
+  if ((retval = fork()) == 0) {
+    /* Overlapping ranges conflict, disjoint ones and read locks on them
+       do not, and a waiting lock is granted once the parent unlocks */
+    status = EXIT_SUCCESS;
+    if (rd_range_lock (fd, BLK_SZ - 1, 2, RAMDISK_RANGE_READ, 0) >= 0
+	|| 0 != rd_range_lock (fd, BLK_SZ, BLK_SZ, RAMDISK_RANGE_WRITE, 0)
+	|| 0 != rd_range_lock (fd, 2 * BLK_SZ, BLK_SZ, RAMDISK_RANGE_READ, 0)
+	|| 0 != rd_range_lock (fd, 0, 1, RAMDISK_RANGE_WRITE, 1))
+      status = EXIT_FAILURE;
+    rd_range_lock (fd, 0, 0, RAMDISK_RANGE_UNLOCK, 0);
+    exit(status);
+  }
+  check (retval > 0, "Failed to fork");
+  check (0 == rd_range_lock (fd, 2 * BLK_SZ, BLK_SZ, RAMDISK_RANGE_READ, 0),
+	 "range_lock: Shared read lock error!");
+  sleep (1);
+  check (0 == rd_range_lock (fd, 0, BLK_SZ, RAMDISK_RANGE_UNLOCK, 0), "range_lock: Unlock error!");
+  waitpid (retval, &status, 0);
+  check (WIFEXITED(status) && EXIT_SUCCESS == WEXITSTATUS(status), "range_lock: Child saw the wrong conflicts!");
+  rd_close (fd);
+  check (0 == UNLINK (PATH_PREFIX "/locked"), "unlink: /locked deletion error!");
+
+#endif // TEST18
+#endif // USE_RAMDISK
+
 #ifdef TEST5
 
   /* ****TEST 5: 2 process test**** */
@@ -377,8 +801,6 @@ int main () {
       memset (pathname, 0, 80);
     } 
 
-    int status;
-
     waitpid(retval, &status, 0);
     
   }